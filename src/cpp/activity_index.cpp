@@ -0,0 +1,379 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "activity_index.h"
+#include "globals.h"
+#include "scanner.h"
+#include "sources.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+struct activity_index_config activity_index_config = { "", 512, 10, 168 };
+
+#define ACTIVITY_MAGIC "GWSACT1"
+#define HEADER_SIZE 4096
+
+struct activity_header {
+	char magic[8];
+	uint32_t bins;
+	uint32_t interval_s;
+	uint64_t capacity;
+	uint32_t record_size;
+	uint32_t reserved;
+	// Records ever written, the newest is at (next - 1) % capacity
+	atomic<uint64_t> next;
+};
+
+/* Followed by the levels of the bins in hundredths of a dB, int16_t each */
+struct activity_record {
+	// Unix time of the start
+	int64_t time;
+	int64_t center;
+	int32_t sample_rate;
+	uint32_t spectra;
+	int16_t floor_cdb;
+};
+
+struct source_index {
+	char *map;
+	size_t map_len;
+	struct activity_header *hdr;
+	// The record being accumulated, used by the scanner's thread only
+	vector<double> sum;
+	// Spectrum bins summed into each bin of the record
+	vector<int> per_bin;
+	int fft_size;
+	double floor_sum;
+	uint32_t spectra;
+	int64_t start;
+	int64_t center;
+	int sample_rate;
+};
+
+static vector<struct source_index> indexes;
+static atomic<uint64_t> count_records{0};
+
+static struct activity_record *record_at(struct source_index &s,
+		uint64_t n)
+{
+	return (struct activity_record *) (s.map + HEADER_SIZE
+			+ n % s.hdr->capacity * s.hdr->record_size);
+}
+
+static int16_t *record_levels(struct activity_record *r)
+{
+	return (int16_t *) (r + 1);
+}
+
+static int16_t to_cdb(double db)
+{
+	return (int16_t) max(-32768.0, min(32767.0, round(db * 100.0)));
+}
+
+/*
+ * Map the file of the source, keeping its records if it was written with
+ * the same settings.
+ */
+static int open_index(size_t ix, struct source_index &s)
+{
+	const struct activity_index_config &c = activity_index_config;
+	string path = c.directory + "/source" + to_string(ix) + ".activity";
+	uint64_t capacity = max(1, c.retention_h * 3600 / c.interval_s);
+	uint32_t record_size = (sizeof(struct activity_record)
+			+ c.bins * sizeof(int16_t) + 7) / 8 * 8;
+	struct activity_header old = {};
+	struct stat st;
+	bool reuse;
+	int fd;
+
+	s.map_len = HEADER_SIZE + capacity * record_size;
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path.c_str());
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	reuse = (size_t) st.st_size == s.map_len
+		&& pread(fd, &old, sizeof(old), 0) == sizeof(old)
+		&& !memcmp(old.magic, ACTIVITY_MAGIC, sizeof(old.magic))
+		&& old.bins == (uint32_t) c.bins
+		&& old.interval_s == (uint32_t) c.interval_s
+		&& old.capacity == capacity && old.record_size == record_size;
+	if (!reuse && (ftruncate(fd, 0) || ftruncate(fd, s.map_len))) {
+		perror(path.c_str());
+		close(fd);
+		return -1;
+	}
+	s.map = (char *) mmap(nullptr, s.map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (s.map == MAP_FAILED) {
+		perror("mmap");
+		s.map = nullptr;
+		return -1;
+	}
+	s.hdr = (struct activity_header *) s.map;
+	if (!reuse) {
+		memcpy(s.hdr->magic, ACTIVITY_MAGIC, sizeof(s.hdr->magic));
+		s.hdr->bins = c.bins;
+		s.hdr->interval_s = c.interval_s;
+		s.hdr->capacity = capacity;
+		s.hdr->record_size = record_size;
+		s.hdr->next.store(0);
+		msync(s.map, HEADER_SIZE, MS_SYNC);
+	}
+	s.spectra = 0;
+	s.fft_size = 0;
+	cout << "Activity index of source " << ix << " in " << path << ", "
+		<< s.hdr->next.load() << " records so far." << endl;
+	return 0;
+}
+
+static void write_record(struct source_index &s)
+{
+	uint64_t next = s.hdr->next.load(memory_order_relaxed);
+	struct activity_record *r = record_at(s, next);
+	int16_t *levels = record_levels(r);
+
+	r->time = s.start;
+	r->center = s.center;
+	r->sample_rate = s.sample_rate;
+	r->spectra = s.spectra;
+	r->floor_cdb = to_cdb(s.floor_sum / s.spectra);
+	for (size_t i = 0; i < s.sum.size(); ++i) {
+		levels[i] = to_cdb(10.0 * log10(s.sum[i]
+					/ ((double) s.spectra * s.per_bin[i])
+					+ 1e-20));
+	}
+	s.hdr->next.store(next + 1, memory_order_release);
+	s.spectra = 0;
+	count_records.fetch_add(1, memory_order_relaxed);
+}
+
+/*
+ * Called by the scanner. The pages of a new record are touched once per
+ * interval, so page faults on the mapping don't hold up the flowgraph.
+ */
+static void add_spectrum(size_t ix, const float *power, int fft_size,
+		float floor_db, int64_t center, int sample_rate)
+{
+	struct source_index &s = indexes[ix];
+	int bins = activity_index_config.bins;
+	int64_t now = time(nullptr);
+	int64_t start = now - now % activity_index_config.interval_s;
+
+	if (s.hdr == nullptr)
+		return;
+	if (s.spectra && (start != s.start || center != s.center
+				|| sample_rate != s.sample_rate))
+		write_record(s);
+	if (fft_size != s.fft_size) {
+		s.fft_size = fft_size;
+		s.per_bin.assign(bins, 0);
+		for (int i = 0; i < fft_size; ++i)
+			s.per_bin[(int64_t) i * bins / fft_size]++;
+	}
+	if (!s.spectra) {
+		s.start = start;
+		s.center = center;
+		s.sample_rate = sample_rate;
+		s.sum.assign(bins, 0.0);
+		s.floor_sum = 0.0;
+	}
+	for (int i = 0; i < fft_size; ++i)
+		s.sum[(int64_t) i * bins / fft_size] += power[i];
+	s.floor_sum += floor_db;
+	s.spectra++;
+}
+
+int activity_index_start()
+{
+	struct activity_index_config &c = activity_index_config;
+
+	if (c.directory.empty())
+		return 0;
+	if (sources_remote()) {
+		cerr << "The activity index needs the sources in this process."
+			<< endl;
+		return 0;
+	}
+	// Each bin of a record must get at least one bin of the spectrum
+	if (c.bins > scanner_config.fft_size) {
+		c.bins = scanner_config.fft_size;
+		cerr << "Activity index bins reduced to the scanner's FFT size."
+			<< endl;
+	}
+	indexes.resize(sources_info.size());
+	for (size_t i = 0; i < indexes.size(); ++i) {
+		indexes[i].hdr = nullptr;
+		if (open_index(i, indexes[i]))
+			return -1;
+	}
+	scanner_set_spectrum_hook(add_spectrum);
+	lock_guard<mutex> lock(flowgraph_mutex);
+	for (size_t i = 0; i < indexes.size(); ++i) {
+		if (scanner_subscribe(i))
+			return -1;
+	}
+	return 0;
+}
+
+/* First record in [lo, hi) whose end is after t, or that starts after t */
+static uint64_t find_record(struct source_index &s, uint64_t lo,
+		uint64_t hi, int64_t t, bool by_end)
+{
+	int64_t len = by_end ? s.hdr->interval_s : 0;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (record_at(s, mid)->time + len > t)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/* The levels of a record in a column, the highest of the bins it covers */
+static bool column_level(struct activity_record *r, int bins, double col_lo,
+		double col_hi, double *db)
+{
+	double edge = r->center - r->sample_rate / 2.0;
+	double bins_per_hz = (double) bins / r->sample_rate;
+	int first = (int) floor((col_lo - edge) * bins_per_hz);
+	int last = (int) ceil((col_hi - edge) * bins_per_hz) - 1;
+	const int16_t *levels = record_levels(r);
+
+	if (last < 0 || first >= bins)
+		return false;
+	first = max(first, 0);
+	last = max(first, min(last, bins - 1));
+	for (int i = first; i <= last; ++i)
+		*db = max(*db, levels[i] / 100.0);
+	return true;
+}
+
+bool activity_index_query(struct json_writer *w, size_t source_ix,
+		const struct activity_query &q)
+{
+	struct source_index *s;
+	uint64_t next, first, a, b, per_row;
+	int64_t to = q.to ? q.to : time(nullptr);
+	int64_t lo = q.lo, hi = q.hi;
+	int bins;
+
+	if (source_ix >= indexes.size() || indexes[source_ix].hdr == nullptr)
+		return false;
+	s = &indexes[source_ix];
+	bins = s->hdr->bins;
+	next = s->hdr->next.load(memory_order_acquire);
+	// The oldest record may be being overwritten
+	first = next > s->hdr->capacity ? next - s->hdr->capacity + 1 : 0;
+	a = find_record(*s, first, next, q.from, true);
+	b = find_record(*s, a, next, to, false);
+	// Default to all the frequencies the source was tuned to meanwhile
+	for (uint64_t i = a; i < b && (!q.lo || !q.hi); ++i) {
+		struct activity_record *r = record_at(*s, i);
+		int64_t r_lo = r->center - r->sample_rate / 2;
+		int64_t r_hi = r->center + r->sample_rate / 2;
+
+		if (!q.lo)
+			lo = i == a ? r_lo : min(lo, r_lo);
+		if (!q.hi)
+			hi = i == a ? r_hi : max(hi, r_hi);
+	}
+	per_row = b > a ? (b - a + ACTIVITY_QUERY_ROWS - 1)
+		/ ACTIVITY_QUERY_ROWS : 1;
+
+	jw_begin_object(w);
+	jw_key(w, "source_ix");
+	jw_int(w, source_ix);
+	jw_key(w, "from");
+	jw_int(w, q.from);
+	jw_key(w, "to");
+	jw_int(w, to);
+	jw_key(w, "lo");
+	jw_int(w, lo);
+	jw_key(w, "hi");
+	jw_int(w, hi);
+	jw_key(w, "interval_s");
+	jw_int(w, s->hdr->interval_s * per_row);
+	jw_key(w, "rows");
+	jw_begin_array(w);
+	for (uint64_t i = a; hi > lo && i < b; i += per_row) {
+		double level[ACTIVITY_QUERY_COLS];
+		bool covered[ACTIVITY_QUERY_COLS] = {};
+		double col_hz = (double) (hi - lo) / ACTIVITY_QUERY_COLS;
+		double floor_db = 0.0;
+		uint64_t end = min(i + per_row, b);
+
+		for (int c = 0; c < ACTIVITY_QUERY_COLS; ++c)
+			level[c] = -HUGE_VAL;
+		for (uint64_t j = i; j < end; ++j) {
+			struct activity_record *r = record_at(*s, j);
+
+			floor_db += r->floor_cdb / 100.0 / (end - i);
+			for (int c = 0; c < ACTIVITY_QUERY_COLS; ++c) {
+				covered[c] |= column_level(r, bins,
+						lo + c * col_hz,
+						lo + (c + 1) * col_hz,
+						&level[c]);
+			}
+		}
+		jw_begin_object(w);
+		jw_key(w, "t");
+		jw_int(w, record_at(*s, i)->time);
+		jw_key(w, "floor");
+		jw_int(w, lround(floor_db));
+		jw_key(w, "db");
+		jw_begin_array(w);
+		for (int c = 0; c < ACTIVITY_QUERY_COLS; ++c) {
+			if (covered[c])
+				jw_int(w, lround(level[c]));
+			else
+				jw_null(w);
+		}
+		jw_end_array(w);
+		jw_end_object(w);
+	}
+	jw_end_array(w);
+	jw_end_object(w);
+	return true;
+}
+
+uint64_t activity_index_records()
+{
+	return count_records.load(memory_order_relaxed);
+}
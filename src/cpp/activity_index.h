@@ -0,0 +1,83 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ACTIVITY_INDEX_H
+#define ACTIVITY_INDEX_H
+
+#include <config.h>
+#include "json_writer.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Long term record of the band activity of the sources, without recording
+ * IQ. The spectra of the scanner (see scanner.h) are averaged over
+ * interval_s into a record of `bins` power levels across the tuner
+ * bandwidth, together with the center frequency, the rate and the noise
+ * floor. A record is also ended early when the source is retuned.
+ *
+ * Each source has a file <directory>/source<n>.activity, a header page
+ * followed by a ring of retention_h worth of fixed size records. It is
+ * mapped into memory and kept across restarts as long as the settings
+ * don't change. Queries binary search the ring by time and read only the
+ * records in the window, the history is never loaded as a whole.
+ */
+
+struct activity_index_config {
+	// Where the files go, empty disables the index
+	std::string directory;
+	int bins;
+	int interval_s;
+	int retention_h;
+};
+
+extern struct activity_index_config activity_index_config;
+
+// Size of the answer of a query at most, coarser records are merged
+#define ACTIVITY_QUERY_ROWS 120
+#define ACTIVITY_QUERY_COLS 64
+
+struct activity_query {
+	// Unix time, to = 0 means now
+	int64_t from;
+	int64_t to;
+	// Absolute frequencies in Hz, 0 means the edges of the records
+	int64_t lo;
+	int64_t hi;
+};
+
+/**
+ * Open the files and start scanning the sources in this process. Call
+ * after scanner_init().
+ */
+int activity_index_start();
+/**
+ * Write the window of the source's index as a JSON object. Each row has
+ * the time of its first record, the noise floor and the level of each
+ * column in dB, the highest of the merged cells, or null where the source
+ * wasn't tuned. Returns false if the source has no index.
+ */
+bool activity_index_query(struct json_writer *w, size_t source_ix,
+		const struct activity_query &q);
+/** Records written since the start. Thread safe. */
+uint64_t activity_index_records();
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+#include <config.h>
+#include "admission.h"
+#include "event_loop.h"
+#include "globals.h"
+#include "metrics.h"
+#include "monitor.h"
+#include "quality.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+struct admission_config admission_config = { 0.0, 0.0, 0.0, 0.1 };
+
+typedef pair<size_t, string> chain_key;
+
+struct reservation {
+	chain_key chain;
+};
+
+struct cpu_sample {
+	chain_key chain;
+	bool full_quality;
+	uint64_t cpu_ns;
+	uint64_t wall_ns;
+};
+
+static map<chain_key, double> costs;
+static map<receiver *, struct reservation> reservations;
+static mutex admission_mutex;
+static atomic<uint64_t> rejected{0};
+static atomic<double> measured_load{0.0};
+static int timer_fd = -1;
+// Only touched by the calibration timer
+static map<string, struct cpu_sample> samples;
+
+/*
+ * Must be called with admission_mutex held. A monitor chain that isn't
+ * calibrated yet costs as much as its channels would on their own.
+ */
+static double chain_cost(const chain_key &chain)
+{
+	auto it = costs.find(chain);
+
+	if (it != costs.end())
+		return it->second;
+	return admission_config.default_cost
+		* max((size_t) 1, monitor_chain_channels(chain.second));
+}
+
+bool admission_admit(receiver::sptr rec, size_t source_ix,
+		const string &demod)
+{
+	lock_guard<mutex> lock(admission_mutex);
+	chain_key chain(source_ix, demod);
+	double cost = chain_cost(chain);
+	double total = cost, on_source = cost;
+	double budget = admission_config.cpu_budget;
+
+	for (auto &pair : reservations) {
+		double c;
+
+		if (pair.first == rec.get())
+			continue;
+		c = chain_cost(pair.second.chain);
+		total += c;
+		if (pair.second.chain.first == source_ix)
+			on_source += c;
+	}
+	if (!rec->get_privileged())
+		budget -= admission_config.privileged_reserve;
+	if ((admission_config.cpu_budget > 0 && total > budget)
+			|| (admission_config.source_budget > 0
+			&& on_source > admission_config.source_budget)) {
+		++rejected;
+		return false;
+	}
+	reservations[rec.get()].chain = chain;
+	return true;
+}
+
+bool admission_release(receiver::sptr rec)
+{
+	lock_guard<mutex> lock(admission_mutex);
+
+	return reservations.erase(rec.get()) > 0;
+}
+
+double admission_committed()
+{
+	lock_guard<mutex> lock(admission_mutex);
+	double ret = 0.0;
+
+	for (auto &pair : reservations)
+		ret += chain_cost(pair.second.chain);
+	return ret;
+}
+
+double admission_measured_load()
+{
+	return measured_load.load();
+}
+
+uint64_t admission_rejected()
+{
+	return rejected.load();
+}
+
+vector<struct demod_cost> admission_costs()
+{
+	lock_guard<mutex> lock(admission_mutex);
+	vector<struct demod_cost> ret;
+
+	for (auto &pair : costs)
+		ret.push_back({ pair.first.first, pair.first.second, pair.second });
+	return ret;
+}
+
+/*
+ * Measure the CPU time of the running receivers' chains since the last
+ * tick and fold it into the cost estimates.
+ */
+static void calibrate()
+{
+	uint64_t expirations, now;
+	map<string, struct cpu_sample> new_samples;
+	map<chain_key, pair<double, int>> measured;
+	double load = 0.0;
+
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	now = monotonic_ns();
+	{
+		// The receivers' blocks may be replaced by other threads
+		lock_guard<mutex> lock(flowgraph_mutex);
+
+		for (auto pair : receiver_map.snapshot()) {
+			receiver::sptr rec = pair.second;
+			struct cpu_sample s;
+
+			if (!rec->is_running())
+				continue;
+			s.chain = chain_key(rec->get_source_ix(),
+					rec->get_chain_name());
+			s.full_quality =
+				rec->get_quality_tier() == QUALITY_FULL;
+			s.cpu_ns = rec->dsp_cpu_ns()
+				+ rec->get_stats()->encoder_ns.load();
+			s.wall_ns = now;
+			new_samples[pair.first] = s;
+		}
+	}
+	for (auto &pair : new_samples) {
+		auto it = samples.find(pair.first);
+		const struct cpu_sample &s = pair.second;
+		double cores;
+
+		// Skip receivers that just started or changed their chain
+		if (it == samples.end() || it->second.chain != s.chain
+				|| s.wall_ns <= it->second.wall_ns
+				|| s.cpu_ns < it->second.cpu_ns)
+			continue;
+		cores = (double) (s.cpu_ns - it->second.cpu_ns)
+			/ (s.wall_ns - it->second.wall_ns);
+		load += cores;
+		// The estimates are for the full quality chains
+		if (!s.full_quality || !it->second.full_quality)
+			continue;
+		auto &m = measured[s.chain];
+		m.first += cores;
+		++m.second;
+	}
+	samples.swap(new_samples);
+	measured_load.store(load);
+
+	lock_guard<mutex> lock(admission_mutex);
+	for (auto &pair : measured) {
+		double cores = pair.second.first / pair.second.second;
+		auto it = costs.find(pair.first);
+
+		if (it == costs.end())
+			costs[pair.first] = cores;
+		else
+			it->second += ADMISSION_COST_ALPHA * (cores - it->second);
+	}
+}
+
+int admission_init()
+{
+	struct itimerspec its = {};
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+	its.it_value.tv_sec = ADMISSION_SAMPLE_MS / 1000;
+	its.it_value.tv_nsec = ADMISSION_SAMPLE_MS % 1000 * 1000000;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(timer_fd, 0, &its, nullptr)) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	return event_loop_add_fd(timer_fd, calibrate);
+}
@@ -0,0 +1,76 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <config.h>
+#include "receiver.h"
+#include <string>
+#include <vector>
+
+/*
+ * Admission control. Every receiver with a source holds a reservation of
+ * the estimated CPU cost of its chain, in cores. The estimates are kept
+ * per source and chain (see receiver::get_chain_name()) and calibrated
+ * from the measured CPU time of the running receivers. A receiver is only
+ * given a source if the reservations stay within the budgets.
+ */
+
+#define ADMISSION_SAMPLE_MS 1000
+// Weight of a new measurement in the moving average of the cost
+#define ADMISSION_COST_ALPHA 0.2
+
+struct admission_config {
+	// Budgets in cores, 0 means unlimited
+	double cpu_budget;
+	double source_budget;
+	// Part of cpu_budget only privileged users may use
+	double privileged_reserve;
+	// Cost of a chain that hasn't been measured yet
+	double default_cost;
+};
+
+extern struct admission_config admission_config;
+
+struct demod_cost {
+	size_t source_ix;
+	std::string demod;
+	double cores;
+};
+
+/** Start the calibration timer. Before event_loop_run(). */
+int admission_init();
+/**
+ * Reserve the cost of running the chain demod on the source for rec,
+ * replacing its current reservation. Returns false and keeps the current
+ * reservation if the budget doesn't allow it.
+ */
+bool admission_admit(receiver::sptr rec, size_t source_ix,
+		const std::string &demod);
+/** Returns true if rec held a reservation */
+bool admission_release(receiver::sptr rec);
+/** Sum of all reservations in cores */
+double admission_committed();
+/** CPU time used by all running receivers in the last interval, in cores */
+double admission_measured_load();
+uint64_t admission_rejected();
+std::vector<struct demod_cost> admission_costs();
+
+#endif
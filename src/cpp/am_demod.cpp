@@ -46,3 +46,8 @@ am_demod::~am_demod()
 {
 	disconnect_all();
 }
+
+std::vector<block_sptr> am_demod::get_blocks()
+{
+	return { agc, mag };
+}
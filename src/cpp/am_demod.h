@@ -26,12 +26,14 @@
 #include <gnuradio/hier_block2.h>
 #include <gnuradio/analog/agc_cc.h>
 #include <gnuradio/blocks/complex_to_mag.h>
+#include <vector>
 
 class am_demod : public gr::hier_block2 {
 public:
 	typedef boost::shared_ptr<am_demod> sptr;
 	static sptr make();
 	~am_demod();
+	std::vector<gr::block_sptr> get_blocks();
 private:
 	am_demod();
 
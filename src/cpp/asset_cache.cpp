@@ -0,0 +1,300 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+#include <config.h>
+#include "asset_cache.h"
+#include "event_loop.h"
+#include <boost/make_shared.hpp>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_LIBBROTLIENC
+#include <brotli/encode.h>
+#endif
+
+using namespace std;
+
+typedef map<string, asset_sptr> asset_map;
+
+static boost::shared_ptr<const asset_map> assets;
+static mutex assets_mutex;
+static string asset_dir;
+static int inotify_fd = -1;
+
+static const char *content_type(const string &name)
+{
+	static const struct {
+		const char *ext;
+		const char *type;
+	} types[] = {
+		{ ".html", "text/html; charset=utf-8" },
+		{ ".js", "application/javascript; charset=utf-8" },
+		{ ".css", "text/css; charset=utf-8" },
+		{ ".json", "application/json" },
+		{ ".svg", "image/svg+xml" },
+		{ ".png", "image/png" },
+		{ ".ico", "image/x-icon" },
+	};
+	size_t len;
+
+	for (auto &t : types) {
+		len = strlen(t.ext);
+		if (name.size() >= len
+				&& !name.compare(name.size() - len, len, t.ext))
+			return t.type;
+	}
+	return "application/octet-stream";
+}
+
+/* 64 bit FNV-1a of the content */
+static string content_hash(const string &data)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	char buf[17];
+
+	for (unsigned char c : data) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) hash);
+	return buf;
+}
+
+static int read_file(const string &path, string &out)
+{
+	char buf[4096];
+	ssize_t n;
+	int fd;
+
+	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	out.clear();
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		out.append(buf, n);
+	if (n < 0)
+		perror("read");
+	close(fd);
+	return n < 0 ? -1 : 0;
+}
+
+/* Returns an empty string on failure */
+static string compress_gzip(const char *in, size_t len)
+{
+	z_stream zs;
+	string out;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	// 16 + 15: gzip wrapper with the largest window
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + 15, 9,
+				Z_DEFAULT_STRATEGY) != Z_OK) {
+		cerr << "deflateInit2() failed." << endl;
+		return "";
+	}
+	out.resize(deflateBound(&zs, len));
+	zs.next_in = (Bytef *) in;
+	zs.avail_in = len;
+	zs.next_out = (Bytef *) &out[0];
+	zs.avail_out = out.size();
+	ret = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END) {
+		cerr << "deflate() failed." << endl;
+		return "";
+	}
+	out.resize(zs.total_out);
+	return out;
+}
+
+static string compress_brotli(const char *in, size_t len)
+{
+#ifdef HAVE_LIBBROTLIENC
+	string out;
+	size_t out_len = BrotliEncoderMaxCompressedSize(len);
+
+	if (!out_len)
+		return "";
+	out.resize(out_len);
+	if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+				BROTLI_MODE_TEXT, len, (const uint8_t *) in,
+				&out_len, (uint8_t *) &out[0])) {
+		cerr << "BrotliEncoderCompress() failed." << endl;
+		return "";
+	}
+	out.resize(out_len);
+	return out;
+#else
+	(void) in;
+	(void) len;
+	return "";
+#endif
+}
+
+static asset_sptr load_asset(const string &name)
+{
+	boost::shared_ptr<struct asset> a;
+	string *body;
+	size_t len;
+
+	a = boost::make_shared<struct asset>();
+	body = a->body;
+	if (read_file(asset_dir + "/" + name, body[ASSET_IDENTITY]))
+		return nullptr;
+	len = body[ASSET_IDENTITY].size();
+	a->content_type = content_type(name);
+	a->cache_control = "no-cache";
+	a->etag = content_hash(body[ASSET_IDENTITY]);
+	body[ASSET_GZIP] = compress_gzip(body[ASSET_IDENTITY].data(), len);
+	body[ASSET_BROTLI] = compress_brotli(body[ASSET_IDENTITY].data(),
+			len);
+	// Images and tiny files don't get any smaller
+	for (int enc = ASSET_GZIP; enc < ASSET_ENCODINGS; ++enc) {
+		if (body[enc].size() >= body[ASSET_IDENTITY].size())
+			body[enc].clear();
+	}
+	return a;
+}
+
+static bool is_regular_file(const string &name)
+{
+	struct stat st;
+
+	if (name.empty() || name[0] == '.')
+		return false;
+	if (stat((asset_dir + "/" + name).c_str(), &st))
+		return false;
+	return S_ISREG(st.st_mode);
+}
+
+/* Replace (or remove, if it's gone) a single file of the cache */
+static void reload_asset(const string &name)
+{
+	boost::shared_ptr<asset_map> m;
+	asset_sptr a;
+
+	if (is_regular_file(name))
+		a = load_asset(name);
+	lock_guard<mutex> lock(assets_mutex);
+	m = boost::make_shared<asset_map>(*assets);
+	if (a == nullptr)
+		m->erase("/" + name);
+	else
+		(*m)["/" + name] = a;
+	assets = m;
+}
+
+static void handle_inotify()
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+
+	while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n;
+				p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			if (ev->len)
+				reload_asset(ev->name);
+		}
+	}
+	if (n < 0 && errno != EAGAIN)
+		perror("read");
+}
+
+int asset_cache_init(const char *resource_path)
+{
+	boost::shared_ptr<asset_map> m;
+	struct dirent *ent;
+	asset_sptr a;
+	DIR *dir;
+
+	asset_dir = resource_path;
+	dir = opendir(resource_path);
+	if (!dir) {
+		perror("opendir");
+		return -1;
+	}
+	m = boost::make_shared<asset_map>();
+	while ((ent = readdir(dir))) {
+		if (!is_regular_file(ent->d_name))
+			continue;
+		a = load_asset(ent->d_name);
+		if (a != nullptr)
+			(*m)[string("/") + ent->d_name] = a;
+	}
+	closedir(dir);
+	assets = m;
+
+	// The cache still works without reloading, just complain
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		perror("inotify_init1");
+		return 0;
+	}
+	// Editors usually write a new file and rename it over the old one
+	if (inotify_add_watch(inotify_fd, resource_path, IN_CLOSE_WRITE
+				| IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+		perror("inotify_add_watch");
+		close(inotify_fd);
+		inotify_fd = -1;
+		return 0;
+	}
+	if (event_loop_add_fd(inotify_fd, handle_inotify)) {
+		close(inotify_fd);
+		inotify_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+asset_sptr asset_find(const char *url)
+{
+	lock_guard<mutex> lock(assets_mutex);
+	asset_map::const_iterator it;
+
+	if (assets == nullptr)
+		return nullptr;
+	it = assets->find(strcmp(url, "/") ? url : "/index.html");
+	if (it == assets->end())
+		return nullptr;
+	return it->second;
+}
+
+size_t asset_body_len(const struct asset &a, enum asset_encoding enc)
+{
+	return a.body[enc].size();
+}
+
+const char *asset_body(const struct asset &a, enum asset_encoding enc)
+{
+	return a.body[enc].data();
+}
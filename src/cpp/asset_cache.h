@@ -0,0 +1,64 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ASSET_CACHE_H
+#define ASSET_CACHE_H
+
+#include <config.h>
+#include <boost/shared_ptr.hpp>
+#include <libwebsockets.h>
+#include <string>
+
+/*
+ * The static web files, kept in memory together with their compressed
+ * variants, so serving a page load never touches the filesystem. The
+ * files are reloaded when they change on disk.
+ */
+
+enum asset_encoding {
+	ASSET_IDENTITY,
+	ASSET_GZIP,
+	ASSET_BROTLI,
+	ASSET_ENCODINGS
+};
+
+struct asset {
+	std::string content_type;
+	// Strong validator of the file content, without the quotes
+	std::string etag;
+	// Static files are revalidated on every load
+	std::string cache_control;
+	/*
+	 * The bodies in each encoding, empty if the encoding doesn't make
+	 * the file smaller. Shared by all connections, each copies its
+	 * chunks into its own buffer with room for lws_write().
+	 */
+	std::string body[ASSET_ENCODINGS];
+};
+
+typedef boost::shared_ptr<const struct asset> asset_sptr;
+
+/** Load all files of the resource directory and watch it for changes */
+int asset_cache_init(const char *resource_path);
+/** Returns nullptr if there's no such file. "/" is index.html. Thread safe. */
+asset_sptr asset_find(const char *url);
+size_t asset_body_len(const struct asset &a, enum asset_encoding enc);
+const char *asset_body(const struct asset &a, enum asset_encoding enc);
+
+#endif
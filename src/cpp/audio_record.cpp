@@ -0,0 +1,324 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "audio_record.h"
+#include "metrics.h"
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+struct audio_record_config audio_record_config = { "", 1024, 64, 60 };
+
+struct queued_page {
+	string data;
+	bool header;
+};
+
+struct audio_writer {
+	string name;
+	int fd;
+	mutex lock;
+	condition_variable cond;
+	deque<struct queued_page> queued;
+	size_t queued_bytes;
+	bool done;
+	// Under lock, for audio_record_get_info()
+	string file;
+	unsigned files;
+	atomic<uint64_t> bytes_written;
+	atomic<uint64_t> pages_dropped;
+	// The writer thread's own
+	bool failed;
+	// The header pages of the current stream, for the next file
+	string headers;
+	bool in_headers;
+	uint64_t file_bytes;
+	uint64_t file_start_ns;
+};
+
+static mutex writers_mutex;
+static condition_variable writers_cond;
+// Until their thread has written everything
+static set<boost::shared_ptr<struct audio_writer>> writers;
+// Of the finished recordings
+static atomic<uint64_t> bytes_done{0};
+static atomic<uint64_t> dropped_done{0};
+
+static string utc_time()
+{
+	time_t now = time(nullptr);
+	struct tm tm;
+	char buf[32];
+
+	gmtime_r(&now, &tm);
+	strftime(buf, sizeof(buf), "%Y%m%dT%H%M%SZ", &tm);
+	return buf;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void close_file(struct audio_writer *w)
+{
+	if (w->fd < 0)
+		return;
+	if (fdatasync(w->fd))
+		perror("Audio recording");
+	close(w->fd);
+	w->fd = -1;
+}
+
+/*
+ * Start the next file of the recording with the headers of the current
+ * stream. Fails if a file of that name exists already, which only happens
+ * when rotating more often than once a second.
+ */
+static int open_file(struct audio_writer *w)
+{
+	string path = audio_record_config.directory + "/" + w->name + "-"
+		+ utc_time();
+	int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+	int fd;
+
+	fd = open((path + ".ogg").c_str(), flags, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		path += "-" + to_string(w->files);
+		fd = open((path + ".ogg").c_str(), flags, 0644);
+	}
+	if (fd < 0) {
+		perror(path.c_str());
+		return -1;
+	}
+	close_file(w);
+	w->fd = fd;
+	w->file_bytes = 0;
+	w->file_start_ns = monotonic_ns();
+	{
+		lock_guard<mutex> lock(w->lock);
+		w->file = path + ".ogg";
+		w->files++;
+	}
+	if (write_all(w->fd, w->headers.data(), w->headers.size())) {
+		perror(path.c_str());
+		return -1;
+	}
+	w->file_bytes += w->headers.size();
+	w->bytes_written.fetch_add(w->headers.size(), memory_order_relaxed);
+	return 0;
+}
+
+static bool rotation_due(struct audio_writer *w)
+{
+	uint64_t max_bytes = (uint64_t) audio_record_config.rotate_mb << 20;
+	uint64_t max_ns = audio_record_config.rotate_minutes * 60000000000ULL;
+
+	if (w->file_bytes <= w->headers.size())
+		return false;
+	if (max_bytes && w->file_bytes >= max_bytes)
+		return true;
+	return max_ns && monotonic_ns() - w->file_start_ns >= max_ns;
+}
+
+static void write_page(struct audio_writer *w, const struct queued_page &p)
+{
+	if (p.header) {
+		// The first header page of a stream chained after the last one
+		if (!w->in_headers)
+			w->headers.clear();
+		w->headers += p.data;
+		w->in_headers = true;
+	} else {
+		w->in_headers = false;
+		if (!w->failed && rotation_due(w) && open_file(w))
+			w->failed = true;
+	}
+	if (w->failed)
+		return;
+	if (write_all(w->fd, p.data.data(), p.data.size())) {
+		perror("Audio recording");
+		w->failed = true;
+		return;
+	}
+	w->file_bytes += p.data.size();
+	w->bytes_written.fetch_add(p.data.size(), memory_order_relaxed);
+}
+
+static void write_loop(boost::shared_ptr<struct audio_writer> w)
+{
+	unique_lock<mutex> lock(w->lock);
+	struct queued_page p;
+
+	while (1) {
+		w->cond.wait(lock, [&w] { return !w->queued.empty() || w->done; });
+		if (w->queued.empty())
+			break;
+		p = move(w->queued.front());
+		w->queued.pop_front();
+		w->queued_bytes -= p.data.size();
+		lock.unlock();
+		write_page(w.get(), p);
+		lock.lock();
+	}
+	lock.unlock();
+	close_file(w.get());
+	cout << "Recorded " << (w->bytes_written.load() >> 10) << " KiB of "
+		<< w->name << " in " << w->files << " file(s), "
+		<< w->pages_dropped.load() << " pages dropped." << endl;
+	{
+		lock_guard<mutex> lock(writers_mutex);
+
+		bytes_done.fetch_add(w->bytes_written.load());
+		dropped_done.fetch_add(w->pages_dropped.load());
+		writers.erase(w);
+	}
+	writers_cond.notify_all();
+}
+
+boost::shared_ptr<struct audio_writer> audio_record_open(const string &name)
+{
+	boost::shared_ptr<struct audio_writer> w;
+
+	if (audio_record_config.directory.empty())
+		return nullptr;
+	w.reset(new struct audio_writer);
+	w->name = name;
+	w->fd = -1;
+	w->queued_bytes = 0;
+	w->done = false;
+	w->files = 0;
+	w->bytes_written = 0;
+	w->pages_dropped = 0;
+	w->failed = false;
+	w->in_headers = false;
+	if (open_file(w.get())) {
+		close_file(w.get());
+		return nullptr;
+	}
+	{
+		lock_guard<mutex> lock(writers_mutex);
+		writers.insert(w);
+	}
+	thread(write_loop, w).detach();
+	cout << "Recording " << name << "." << endl;
+	return w;
+}
+
+void audio_record_page(struct audio_writer *w, const char *head,
+		size_t head_len, const char *body, size_t body_len,
+		bool header)
+{
+	lock_guard<mutex> lock(w->lock);
+	size_t len = head_len + body_len;
+
+	if (w->done)
+		return;
+	// The headers are small, and without them nothing after plays
+	if (!header && w->queued_bytes + len
+			> (size_t) audio_record_config.buffer_kb * 1024) {
+		w->pages_dropped.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+	w->queued.push_back({ string(head, head_len), header });
+	w->queued.back().data.append(body, body_len);
+	w->queued_bytes += len;
+	w->cond.notify_one();
+}
+
+void audio_record_close(boost::shared_ptr<struct audio_writer> w)
+{
+	{
+		lock_guard<mutex> lock(w->lock);
+		w->done = true;
+	}
+	w->cond.notify_one();
+}
+
+void audio_record_stop_all()
+{
+	unique_lock<mutex> lock(writers_mutex);
+
+	for (const boost::shared_ptr<struct audio_writer> &w : writers)
+		audio_record_close(w);
+	writers_cond.wait(lock, [] { return writers.empty(); });
+}
+
+struct audio_record_info audio_record_get_info(struct audio_writer *w)
+{
+	lock_guard<mutex> lock(w->lock);
+	struct audio_record_info info;
+
+	info.file = w->file;
+	info.files = w->files;
+	info.bytes_written = w->bytes_written.load();
+	info.pages_dropped = w->pages_dropped.load();
+	return info;
+}
+
+size_t audio_recordings()
+{
+	lock_guard<mutex> lock(writers_mutex);
+
+	return writers.size();
+}
+
+uint64_t audio_record_bytes_total()
+{
+	lock_guard<mutex> lock(writers_mutex);
+	uint64_t ret = bytes_done.load();
+
+	for (const boost::shared_ptr<struct audio_writer> &w : writers)
+		ret += w->bytes_written.load();
+	return ret;
+}
+
+uint64_t audio_record_dropped_total()
+{
+	lock_guard<mutex> lock(writers_mutex);
+	uint64_t ret = dropped_done.load();
+
+	for (const boost::shared_ptr<struct audio_writer> &w : writers)
+		ret += w->pages_dropped.load();
+	return ret;
+}
@@ -0,0 +1,93 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIO_RECORD_H
+#define AUDIO_RECORD_H
+
+#include <config.h>
+#include <boost/shared_ptr.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Recording of what a listener hears. The receiver's ogg_sink passes every
+ * Ogg page it produces to an audio_writer as well, so a recording costs no
+ * DSP or encoding. The pages are copied into a queue of at most buffer_kb
+ * and written by a thread of the writer, the encoder never waits for the
+ * disk: if the queue is full, the page is dropped and counted. Header pages
+ * are always queued.
+ *
+ * The files are <directory>/<name>-<UTC time>.ogg. A new file is started
+ * once the current one has rotate_mb or is rotate_minutes old, at a page
+ * boundary, and starts with the headers of the current stream, so each file
+ * plays on its own.
+ */
+
+struct audio_record_config {
+	// Where the recordings go, empty disables recording
+	std::string directory;
+	// Memory for the queued pages of each recording
+	int buffer_kb;
+	// 0 disables the rotation by size or time
+	int rotate_mb;
+	int rotate_minutes;
+};
+
+extern struct audio_record_config audio_record_config;
+
+struct audio_writer;
+
+struct audio_record_info {
+	// The file being written
+	std::string file;
+	unsigned files;
+	uint64_t bytes_written;
+	uint64_t pages_dropped;
+};
+
+/**
+ * Start a recording. Returns nullptr if recording is disabled or the file
+ * can't be created.
+ */
+boost::shared_ptr<struct audio_writer> audio_record_open(
+		const std::string &name);
+/**
+ * Queue a page given as its header and body, or the headers of a stream if
+ * header is set. Never blocks on the disk. Called by the ogg_sink only.
+ */
+void audio_record_page(struct audio_writer *w, const char *head,
+		size_t head_len, const char *body, size_t body_len,
+		bool header);
+/**
+ * Stop queueing pages. The writer thread writes the rest and closes the
+ * file in the background. Any thread.
+ */
+void audio_record_close(boost::shared_ptr<struct audio_writer> w);
+/** Close all the recordings and wait until they are on disk */
+void audio_record_stop_all();
+struct audio_record_info audio_record_get_info(struct audio_writer *w);
+/** Number of recordings being written. Thread safe. */
+size_t audio_recordings();
+uint64_t audio_record_bytes_total();
+uint64_t audio_record_dropped_total();
+
+#endif
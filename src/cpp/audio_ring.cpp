@@ -0,0 +1,98 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "audio_ring.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+#define RING_MASK (AUDIO_RING_SIZE - 1)
+
+void audio_ring_reset(struct audio_ring *ring)
+{
+	ring->head.store(0);
+	ring->tail.store(0);
+}
+
+static void copy_in(struct audio_ring *ring, uint32_t pos, const void *src,
+		size_t len)
+{
+	size_t first = min(len, (size_t) AUDIO_RING_SIZE - (pos & RING_MASK));
+
+	memcpy(ring->data + (pos & RING_MASK), src, first);
+	memcpy(ring->data, (const char *) src + first, len - first);
+}
+
+static void copy_out(const struct audio_ring *ring, uint32_t pos, void *dst,
+		size_t len)
+{
+	size_t first = min(len, (size_t) AUDIO_RING_SIZE - (pos & RING_MASK));
+
+	memcpy(dst, ring->data + (pos & RING_MASK), first);
+	memcpy((char *) dst + first, ring->data, len - first);
+}
+
+bool audio_ring_put(struct audio_ring *ring, const void *a, size_t a_len,
+		const void *b, size_t b_len)
+{
+	uint32_t head = ring->head.load(memory_order_relaxed);
+	uint32_t tail = ring->tail.load(memory_order_acquire);
+	uint32_t len = a_len + b_len;
+
+	if (sizeof(len) + len > AUDIO_RING_SIZE - (head - tail))
+		return false;
+	copy_in(ring, head, &len, sizeof(len));
+	copy_in(ring, head + sizeof(len), a, a_len);
+	copy_in(ring, head + sizeof(len) + a_len, b, b_len);
+	ring->head.store(head + sizeof(len) + len, memory_order_release);
+	return true;
+}
+
+size_t audio_ring_used(const struct audio_ring *ring)
+{
+	return ring->head.load(memory_order_acquire)
+		- ring->tail.load(memory_order_relaxed);
+}
+
+size_t audio_ring_read(struct audio_ring_reader *r, char *buf, size_t max)
+{
+	struct audio_ring *ring = r->ring;
+	uint32_t tail = ring->tail.load(memory_order_relaxed);
+	uint32_t head = ring->head.load(memory_order_acquire);
+	size_t n = 0, chunk;
+
+	while (n < max) {
+		if (!r->left) {
+			if (tail == head)
+				break;
+			copy_out(ring, tail, &r->left, sizeof(r->left));
+			tail += sizeof(r->left);
+		}
+		chunk = min((size_t) r->left, max - n);
+		copy_out(ring, tail, buf + n, chunk);
+		tail += chunk;
+		r->left -= chunk;
+		n += chunk;
+	}
+	ring->tail.store(tail, memory_order_release);
+	return n;
+}
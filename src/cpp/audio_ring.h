@@ -0,0 +1,68 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#include <config.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Single producer, single consumer ring of Ogg pages in memory shared by
+ * a worker process (the producer) and the front-end (the consumer), see
+ * worker.h. The pages are stored as records prefixed with their length
+ * and only published once complete, so a reader can stop between any two
+ * pages, e.g. when its receiver moves to another worker.
+ */
+
+// Must be a power of two and hold the largest Ogg page (about 64 KiB)
+#define AUDIO_RING_SIZE (1 << 18)
+
+struct audio_ring {
+	// Only ever grow, wrapping around. Written by the producer.
+	std::atomic<uint32_t> head;
+	// Written by the consumer
+	std::atomic<uint32_t> tail;
+	char data[AUDIO_RING_SIZE];
+};
+
+/* The consumer's position inside the current record */
+struct audio_ring_reader {
+	struct audio_ring *ring;
+	// Bytes of the current record not read yet, 0 between records
+	uint32_t left;
+};
+
+/** Empty the ring. Only while nobody produces or consumes. */
+void audio_ring_reset(struct audio_ring *ring);
+/**
+ * Append a record made of the two buffers. Returns false if it doesn't fit
+ * and the consumer has to catch up first.
+ */
+bool audio_ring_put(struct audio_ring *ring, const void *a, size_t a_len,
+		const void *b, size_t b_len);
+/** Bytes waiting to be read, including the record headers */
+size_t audio_ring_used(const struct audio_ring *ring);
+/** Copy up to max bytes of the page stream, returns the number copied */
+size_t audio_ring_read(struct audio_ring_reader *r, char *buf, size_t max);
+
+#endif
@@ -21,6 +21,7 @@
 #include <config.h>
 #include "auth.h"
 #include <iostream>
+#include <mutex>
 #include <sqlite3.h>
 
 using namespace std;
@@ -29,6 +30,8 @@ static string username;
 static string password;
 static sqlite3 *db;
 static sqlite3_stmt *stmt;
+// The statement is shared by the service threads
+static mutex stmt_mutex;
 
 void set_admin_username(std::string user)
 {
@@ -72,6 +75,8 @@ bool authenticate(string user, string pass)
 		return user == username && pass == password;
 	} else {
 		bool ret = false;
+		lock_guard<mutex> lock(stmt_mutex);
+
 		if (sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC)
 				!= SQLITE_OK) {
 			cerr << "Failed to bind user to SQL statement." << endl;
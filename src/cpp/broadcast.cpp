@@ -0,0 +1,168 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "broadcast.h"
+#include "event_loop.h"
+#include "globals.h"
+#include "scanner.h"
+#include "source_state.h"
+#include <boost/make_shared.hpp>
+#include <cstdio>
+#include <libwebsockets.h>
+#include <mutex>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+struct source_broadcast {
+	unsigned pending;
+	broadcast_msg_sptr msg;
+};
+
+static vector<struct source_broadcast> sources;
+static mutex broadcast_mutex;
+static int timer_fd = -1;
+static bool timer_armed;
+// Clients without a source only get the number of clients, with a reply
+static bool sourceless_pending;
+
+/* The members come pre-serialized with the source state */
+static string serialize(unsigned fields, size_t source_ix)
+{
+	source_state_sptr state = get_source_state(source_ix);
+	string ret = "{";
+
+	if (fields & BROADCAST_HW_FREQ)
+		ret += state->hw_freq_json + ",";
+	if (fields & BROADCAST_GAIN)
+		ret += state->gain_json + ",";
+	if (fields & BROADCAST_NUM_CLIENTS)
+		ret += "\"num_clients\":" + to_string(receiver_map.size()) + ",";
+	if (fields & BROADCAST_OVERRUNS) {
+		ret += "\"overruns\":"
+			+ to_string(sources_info[source_ix].stats->overruns.load())
+			+ ",";
+	}
+	if (fields & BROADCAST_ACTIVITY)
+		ret += "\"activity\":" + scanner_activity_json(source_ix) + ",";
+	if (ret.size() > 1)
+		ret.pop_back();
+	return ret + "}";
+}
+
+static vector<string> framed(const string &json)
+{
+	string buf = string(LWS_PRE, '\0') + json;
+
+	return vector<string>(service_threads, buf);
+}
+
+static void broadcast_tick()
+{
+	uint64_t expirations;
+	boost::shared_ptr<struct broadcast_msg> msg;
+	vector<size_t> sent;
+
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	lock_guard<mutex> lock(broadcast_mutex);
+	timer_armed = false;
+	for (size_t i = 0; i < sources.size(); ++i) {
+		struct source_broadcast &s = sources[i];
+
+		if (!s.pending)
+			continue;
+		msg = boost::make_shared<struct broadcast_msg>();
+		msg->version = s.msg == nullptr ? 1 : s.msg->version + 1;
+		msg->delta = framed(serialize(s.pending, i));
+		msg->full = framed(serialize(BROADCAST_ALL, i));
+		s.msg = msg;
+		s.pending = 0;
+		sent.push_back(i);
+	}
+	for (size_t source_ix : sent)
+		notify_source_clients(source_ix);
+	if (sourceless_pending) {
+		sourceless_pending = false;
+		notify_sourceless_clients();
+	}
+}
+
+/* Must be called with broadcast_mutex held */
+static void arm_timer()
+{
+	struct itimerspec its = {};
+
+	if (timer_armed)
+		return;
+	its.it_value.tv_sec = BROADCAST_INTERVAL_MS / 1000;
+	its.it_value.tv_nsec = BROADCAST_INTERVAL_MS % 1000 * 1000000;
+	if (timerfd_settime(timer_fd, 0, &its, nullptr)) {
+		perror("timerfd_settime");
+		return;
+	}
+	timer_armed = true;
+}
+
+int broadcast_init()
+{
+	sources.resize(sources_info.size());
+	for (struct source_broadcast &s : sources)
+		s.pending = 0;
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+	return event_loop_add_fd(timer_fd, broadcast_tick);
+}
+
+void broadcast_changed(unsigned fields, size_t source_ix)
+{
+	lock_guard<mutex> lock(broadcast_mutex);
+
+	if (source_ix >= sources.size())
+		return;
+	sources[source_ix].pending |= fields;
+	arm_timer();
+}
+
+void broadcast_changed_all(unsigned fields)
+{
+	lock_guard<mutex> lock(broadcast_mutex);
+
+	for (struct source_broadcast &s : sources)
+		s.pending |= fields;
+	if (fields & BROADCAST_NUM_CLIENTS)
+		sourceless_pending = true;
+	arm_timer();
+}
+
+broadcast_msg_sptr broadcast_get(size_t source_ix)
+{
+	lock_guard<mutex> lock(broadcast_mutex);
+
+	if (source_ix >= sources.size())
+		return nullptr;
+	return sources[source_ix].msg;
+}
@@ -0,0 +1,77 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <config.h>
+#include <boost/shared_ptr.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * State shared by many clients (hardware frequency and gain of a source,
+ * number of clients) is broadcast by a scheduler instead of every change
+ * making every client build its own update. Changes are collected for
+ * BROADCAST_INTERVAL_MS, then one message per source is serialized, only
+ * the clients of the source are woken up and they all send the same message.
+ */
+
+#define BROADCAST_INTERVAL_MS 100
+
+enum broadcast_field {
+	BROADCAST_HW_FREQ = 1 << 0,
+	// auto_gain and gain, the UI expects them together
+	BROADCAST_GAIN = 1 << 1,
+	BROADCAST_NUM_CLIENTS = 1 << 2,
+	// Number of overruns of the source
+	BROADCAST_OVERRUNS = 1 << 3,
+	// Active channels found by the scanner, see scanner.h
+	BROADCAST_ACTIVITY = 1 << 4,
+	BROADCAST_ALL = (1 << 5) - 1
+};
+
+struct broadcast_msg {
+	// Starts at 1 for each source, 0 means no message was sent yet
+	uint64_t version;
+	/*
+	 * One copy per service thread with LWS_PRE bytes of room in front,
+	 * lws_write() puts the frame header there
+	 */
+	// Fields that changed since the previous version
+	std::vector<std::string> delta;
+	// All fields, for clients that missed a version
+	std::vector<std::string> full;
+};
+
+typedef boost::shared_ptr<const struct broadcast_msg> broadcast_msg_sptr;
+
+/** Call after the sources are set up and the event loop is initialized */
+int broadcast_init();
+/** Schedule a broadcast of fields. Any thread. */
+void broadcast_changed(unsigned fields, size_t source_ix);
+/** Schedule a broadcast of fields to the clients of all sources */
+void broadcast_changed_all(unsigned fields);
+/** Latest message of the source, nullptr if there was none yet */
+broadcast_msg_sptr broadcast_get(size_t source_ix);
+
+#endif
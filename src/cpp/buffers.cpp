@@ -0,0 +1,116 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "buffers.h"
+#include <algorithm>
+#include <boost/math/common_factor_rt.hpp>
+#include <gnuradio/block_detail.h>
+#include <unistd.h>
+
+// The default buffer size used by GNU Radio, see flat_flowgraph.cc
+#define GR_DEFAULT_BUFFER_BYTES (2 * 32 * 1024)
+
+struct buffer_policy buffer_policy = {
+	{ 0, 10, 40 },
+	512
+};
+
+const char *buffer_stage_names[BUFFER_STAGES] = {
+	"source", "channel", "audio"
+};
+
+static long default_items(size_t item_size)
+{
+	return GR_DEFAULT_BUFFER_BYTES / item_size;
+}
+
+void apply_buffer_policy(gr::block_sptr block, enum buffer_stage stage,
+		double rate)
+{
+	size_t item_size;
+	long items;
+
+	if (buffer_policy.latency_ms[stage] <= 0)
+		return;
+	item_size = block->output_signature()->sizeof_stream_item(0);
+	items = rate * buffer_policy.latency_ms[stage] / 1000;
+	if (items < buffer_policy.min_items)
+		items = buffer_policy.min_items;
+	// GNU Radio still enlarges the buffer if a downstream block needs
+	// more items (decimation, history), so this can't deadlock.
+	if (items < default_items(item_size))
+		block->set_max_output_buffer(items);
+	else
+		block->set_min_output_buffer(items);
+}
+
+/*
+ * The buffers are mapped twice, but only backed by memory once. Their size
+ * is rounded up to a multiple of both the page size and the item size.
+ */
+static size_t buffer_bytes(long items, size_t item_size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t granularity = boost::math::lcm(page, item_size);
+	size_t bytes = items * item_size;
+
+	return (bytes + granularity - 1) / granularity * granularity;
+}
+
+/*
+ * The outputs connected when the flowgraph was last flattened, or the
+ * fewest the block has before that
+ */
+static int output_streams(gr::block_sptr block)
+{
+	if (block->detail() != nullptr)
+		return block->detail()->noutputs();
+	return std::max(0, block->output_signature()->min_streams());
+}
+
+size_t default_buffer_memory(gr::block_sptr block)
+{
+	size_t ret = 0, item_size;
+
+	for (int i = 0; i < output_streams(block); ++i) {
+		item_size = block->output_signature()->sizeof_stream_item(i);
+		ret += buffer_bytes(default_items(item_size), item_size);
+	}
+	return ret;
+}
+
+size_t buffer_memory(gr::block_sptr block)
+{
+	size_t ret = 0, item_size;
+	long items;
+
+	for (int i = 0; i < output_streams(block); ++i) {
+		item_size = block->output_signature()->sizeof_stream_item(i);
+		items = default_items(item_size);
+		if (block->max_output_buffer(i) > 0
+				&& block->max_output_buffer(i) < items)
+			items = block->max_output_buffer(i);
+		if (block->min_output_buffer(i) > items)
+			items = block->min_output_buffer(i);
+		ret += buffer_bytes(items, item_size);
+	}
+	return ret;
+}
@@ -0,0 +1,63 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUFFERS_H
+#define BUFFERS_H
+
+#include <config.h>
+#include <cstddef>
+#include <gnuradio/block.h>
+
+/*
+ * Output buffer sizing. GNU Radio gives every edge a 64 KiB buffer no
+ * matter the sample rate, which holds seconds of samples once the rate is
+ * decimated to audio. Each stage of the chain instead gets buffers holding
+ * a configurable amount of time at the stage's sample rate.
+ */
+
+enum buffer_stage {
+	// Source rate IQ, fed to the receivers
+	BUFFER_STAGE_SOURCE,
+	// Channel filter and demodulator, at the decimated rate
+	BUFFER_STAGE_CHANNEL,
+	// Audio filtering and resampling, feeding the encoder
+	BUFFER_STAGE_AUDIO,
+	BUFFER_STAGES
+};
+
+struct buffer_policy {
+	// Buffer length per stage in ms, 0 keeps the GNU Radio default
+	int latency_ms[BUFFER_STAGES];
+	// Lower limit in items, GNU Radio enforces further minimums itself
+	int min_items;
+};
+
+extern struct buffer_policy buffer_policy;
+extern const char *buffer_stage_names[BUFFER_STAGES];
+
+/** Size the output buffers of the block according to the policy */
+void apply_buffer_policy(gr::block_sptr block, enum buffer_stage stage,
+		double rate);
+/** Estimated memory used by the output buffers of the block, in bytes */
+size_t buffer_memory(gr::block_sptr block);
+/** Memory the output buffers of the block would use by default */
+size_t default_buffer_memory(gr::block_sptr block);
+
+#endif
@@ -20,15 +20,142 @@
 
 #include <config.h>
 #include "config_load.h"
+#include "admission.h"
+#include "buffers.h"
+#include "edge.h"
+#include "event_loop.h"
 #include "globals.h"
+#include "headless.h"
+#include "activity_index.h"
+#include "audio_record.h"
+#include "iq_record.h"
+#include "monitor.h"
+#include "overrun.h"
+#include "scanner.h"
+#include "placement.h"
+#include "quality.h"
+#include "receiver_pool.h"
+#include "relay.h"
+#include "segmented.h"
+#include "sources.h"
+#include "timeshift.h"
+#include "worker.h"
 #include <json-c/json_object.h>
 #include <json-c/json_util.h>
 #include <json-c/linkhash.h>
+#include <boost/make_shared.hpp>
+#include <algorithm>
 #include <string>
+#include <cstdlib>
 #include <cstring>
+#include <unistd.h>
 
 using namespace std;
 
+/* An array of CPU numbers */
+static bool parse_cores(struct json_object *obj, vector<int> &cores)
+{
+	struct json_object *tmp;
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+	int i, len, c;
+
+	if (json_object_get_type(obj) != json_type_array)
+		goto bad_format;
+	cores.clear();
+	len = json_object_array_length(obj);
+	for (i = 0; i < len; ++i) {
+		tmp = json_object_array_get_idx(obj, i);
+		if (json_object_get_type(tmp) != json_type_int)
+			goto bad_format;
+		c = json_object_get_int(tmp);
+		if (c < 0 || c >= CPU_SETSIZE || c >= cpus) {
+			cerr << "CPU " << c << " doesn't exist." << endl;
+			return false;
+		}
+		cores.push_back(c);
+	}
+	sort(cores.begin(), cores.end());
+	cores.erase(unique(cores.begin(), cores.end()), cores.end());
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+/* An array of receivers of a source, see headless.h */
+static bool parse_receivers(struct json_object *obj,
+		vector<struct headless_config> &configs)
+{
+	struct json_object *rec;
+	int i, len;
+
+	if (json_object_get_type(obj) != json_type_array)
+		goto bad_format;
+	len = json_object_array_length(obj);
+	for (i = 0; i < len; ++i) {
+		struct headless_config c = { 0, 0, "", "", "", "", "" };
+
+		rec = json_object_array_get_idx(obj, i);
+		if (json_object_get_type(rec) != json_type_object)
+			goto bad_format;
+		json_object_object_foreach(rec, key, tmp) {
+			if (!strcmp(key, "offset")) {
+				if (json_object_get_type(tmp) != json_type_int)
+					goto bad_format;
+				c.offset = json_object_get_int(tmp);
+			} else if (!strcmp(key, "demod")) {
+				if (json_object_get_type(tmp)
+						!= json_type_string)
+					goto bad_format;
+				c.demod = json_object_get_string(tmp);
+			} else if (!strcmp(key, "pcm_socket")) {
+				if (json_object_get_type(tmp)
+						!= json_type_string)
+					goto bad_format;
+				c.pcm_socket = json_object_get_string(tmp);
+			} else if (!strcmp(key, "pcm_fifo")) {
+				if (json_object_get_type(tmp)
+						!= json_type_string)
+					goto bad_format;
+				c.pcm_fifo = json_object_get_string(tmp);
+			} else if (!strcmp(key, "record")) {
+				if (json_object_get_type(tmp)
+						!= json_type_string)
+					goto bad_format;
+				c.record = json_object_get_string(tmp);
+			} else if (!strcmp(key, "broadcast")) {
+				if (json_object_get_type(tmp)
+						!= json_type_string)
+					goto bad_format;
+				c.broadcast = json_object_get_string(tmp);
+			} else {
+				cerr << "Unknown receiver parameter in config "
+					"file: " << key << endl;
+				return false;
+			}
+		}
+		if (find(receiver::supported_demods.begin(),
+					receiver::supported_demods.end(),
+					c.demod)
+				== receiver::supported_demods.end()) {
+			cerr << "Unsupported demodulation of a receiver: "
+				<< c.demod << endl;
+			return false;
+		}
+		if (c.pcm_socket.empty() && c.pcm_fifo.empty()
+				&& c.record.empty() && c.broadcast.empty()) {
+			cerr << "A receiver in the config file has no output."
+				<< endl;
+			return false;
+		}
+		configs.push_back(c);
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
 bool add_source(struct json_object *obj)
 {
 	string osmosdr_arg{""};
@@ -41,7 +168,8 @@ bool add_source(struct json_object *obj)
 	bool auto_gain = true;
 	double gain = 1.0;
 	bool got_gain = false;
-	osmosdr::source::sptr source;
+	int timeshift_s = 0;
+	vector<struct headless_config> receivers;
 	source_info_t info;
 
 	json_object_object_foreach(obj, key, tmp) {
@@ -96,6 +224,18 @@ bool add_source(struct json_object *obj)
 			}
 			auto_gain = false;
 			got_gain = true;
+		} else if (!strcmp(key, "cores")) {
+			if (!parse_cores(tmp, info.cores))
+				return false;
+		} else if (!strcmp(key, "timeshift_s")) {
+			if (json_object_get_type(tmp) != json_type_int)
+				goto bad_format;
+			timeshift_s = json_object_get_int(tmp);
+			if (timeshift_s < 0)
+				goto bad_format;
+		} else if (!strcmp(key, "receivers")) {
+			if (!parse_receivers(tmp, receivers))
+				return false;
 		} else {
 			cerr << "Unknown source parameter in config file: "
 					<< key << endl;
@@ -104,21 +244,624 @@ bool add_source(struct json_object *obj)
 	}
 	if (label == "")
 		label = osmosdr_arg;
-	source = osmosdr::source::make(osmosdr_arg);
-	source->set_freq_corr(freq_corr);
-	source->set_sample_rate(sample_rate);
-	source->set_center_freq(initial_hw_freq);
-	if (auto_gain) {
-		source->set_gain_mode(true);
-	} else {
-		source->set_gain_mode(false);
-		source->set_gain(gain);
-	}
-	osmosdr_sources.push_back(source);
 	info.label = label;
 	info.description = description;
 	info.freq_converter_offset = freq_converter_offset;
+	info.timeshift_s = timeshift_s;
+	info.stats = boost::make_shared<source_stats>();
+	info.params.osmosdr_arg = osmosdr_arg;
+	info.params.freq_corr = freq_corr;
+	info.params.initial_hw_freq = initial_hw_freq;
+	info.params.sample_rate = sample_rate;
+	info.params.auto_gain = auto_gain;
+	info.params.gain = gain;
+	for (struct headless_config &c : receivers) {
+		if (2 * abs(c.offset) > sample_rate) {
+			cerr << "Receiver offset " << c.offset
+				<< " is outside of the source." << endl;
+			return false;
+		}
+		c.source_ix = sources_info.size();
+		headless_configs.push_back(c);
+	}
 	sources_info.push_back(info);
+	// Each worker process opens its own source
+	if (!sources_remote())
+		osmosdr_sources.push_back(open_source(sources_info.size() - 1));
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_buffer_policy(struct json_object *obj)
+{
+	bool found;
+
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		found = false;
+		for (int i = 0; i < BUFFER_STAGES; ++i) {
+			if (string(key) != string(buffer_stage_names[i]) + "_ms")
+				continue;
+			// 0 keeps the GNU Radio default
+			if (json_object_get_type(tmp) != json_type_int
+					|| json_object_get_int(tmp) < 0)
+				goto bad_format;
+			buffer_policy.latency_ms[i] = json_object_get_int(tmp);
+			found = true;
+		}
+		if (found)
+			continue;
+		if (!strcmp(key, "min_items")) {
+			if (json_object_get_type(tmp) != json_type_int
+					|| json_object_get_int(tmp) <= 0)
+				goto bad_format;
+			buffer_policy.min_items = json_object_get_int(tmp);
+		} else {
+			cerr << "Unknown buffer parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_receiver_pool(struct json_object *obj)
+{
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (json_object_get_type(tmp) != json_type_int) {
+			cerr << "Bad format of config file." << endl;
+			return false;
+		}
+		if (!strcmp(key, "size")) {
+			receiver_pool_config.size = json_object_get_int(tmp);
+		} else if (!strcmp(key, "low_water")) {
+			receiver_pool_config.low_water = json_object_get_int(tmp);
+		} else {
+			cerr << "Unknown receiver pool parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	if (receiver_pool_config.low_water > receiver_pool_config.size) {
+		cerr << "Receiver pool low_water can't exceed its size." << endl;
+		return false;
+	}
+	return true;
+}
+
+bool set_admission(struct json_object *obj)
+{
+	double val;
+
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (json_object_get_type(tmp) != json_type_double
+				&& json_object_get_type(tmp) != json_type_int) {
+			cerr << "Bad format of config file." << endl;
+			return false;
+		}
+		val = json_object_get_double(tmp);
+		if (val < 0) {
+			cerr << "Admission parameters can't be negative." << endl;
+			return false;
+		}
+		if (!strcmp(key, "cpu_budget")) {
+			admission_config.cpu_budget = val;
+		} else if (!strcmp(key, "source_budget")) {
+			admission_config.source_budget = val;
+		} else if (!strcmp(key, "privileged_reserve")) {
+			admission_config.privileged_reserve = val;
+		} else if (!strcmp(key, "default_cost")) {
+			admission_config.default_cost = val;
+		} else {
+			cerr << "Unknown admission parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool set_quality(struct json_object *obj)
+{
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "enabled")) {
+			if (json_object_get_type(tmp) != json_type_boolean)
+				goto bad_format;
+			quality_config.enabled = json_object_get_boolean(tmp);
+			continue;
+		}
+		if (json_object_get_type(tmp) != json_type_double
+				&& json_object_get_type(tmp) != json_type_int)
+			goto bad_format;
+		if (!strcmp(key, "high_load")) {
+			quality_config.high_load = json_object_get_double(tmp);
+		} else if (!strcmp(key, "low_load")) {
+			quality_config.low_load = json_object_get_double(tmp);
+		} else {
+			cerr << "Unknown quality parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	if (quality_config.low_load > quality_config.high_load) {
+		cerr << "Quality low_load can't exceed high_load." << endl;
+		return false;
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_placement(struct json_object *obj)
+{
+	int val;
+
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "service_cores")) {
+			if (!parse_cores(tmp, placement_config.service_cores))
+				return false;
+			continue;
+		} else if (!strcmp(key, "receiver_cores")) {
+			if (!parse_cores(tmp, placement_config.receiver_cores))
+				return false;
+			continue;
+		} else if (!strcmp(key, "realtime")) {
+			if (json_object_get_type(tmp) != json_type_boolean)
+				goto bad_format;
+			placement_config.realtime = json_object_get_boolean(tmp);
+			continue;
+		}
+		if (json_object_get_type(tmp) != json_type_int)
+			goto bad_format;
+		val = json_object_get_int(tmp);
+		if (val < 1 || val > 99) {
+			cerr << "SCHED_FIFO priorities are between 1 and 99."
+					<< endl;
+			return false;
+		}
+		if (!strcmp(key, "source_priority")) {
+			placement_config.source_priority = val;
+		} else if (!strcmp(key, "service_priority")) {
+			placement_config.service_priority = val;
+		} else if (!strcmp(key, "receiver_priority")) {
+			placement_config.receiver_priority = val;
+		} else {
+			cerr << "Unknown placement parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_workers(struct json_object *obj)
+{
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "enabled")) {
+			if (json_object_get_type(tmp) != json_type_boolean)
+				goto bad_format;
+			worker_config.enabled = json_object_get_boolean(tmp);
+		} else if (!strcmp(key, "slots")) {
+			if (json_object_get_type(tmp) != json_type_int)
+				goto bad_format;
+			worker_config.slots = json_object_get_int(tmp);
+			if (worker_config.slots < 1) {
+				cerr << "A worker needs at least one slot."
+						<< endl;
+				return false;
+			}
+		} else {
+			cerr << "Unknown workers parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_relay(struct json_object *obj)
+{
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "address")) {
+			if (json_object_get_type(tmp) != json_type_string)
+				goto bad_format;
+			relay_config.address = json_object_get_string(tmp);
+		} else if (!strcmp(key, "port")) {
+			if (json_object_get_type(tmp) != json_type_int)
+				goto bad_format;
+			relay_config.port = json_object_get_int(tmp);
+			if (relay_config.port < 0 || relay_config.port > 65535)
+				goto bad_format;
+		} else {
+			cerr << "Unknown relay parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_audio_recording(struct json_object *obj)
+{
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "directory")) {
+			if (json_object_get_type(tmp) != json_type_string)
+				goto bad_format;
+			audio_record_config.directory =
+				json_object_get_string(tmp);
+			continue;
+		}
+		if (json_object_get_type(tmp) != json_type_int)
+			goto bad_format;
+		if (!strcmp(key, "buffer_kb")) {
+			audio_record_config.buffer_kb = json_object_get_int(tmp);
+			if (audio_record_config.buffer_kb < 64)
+				goto bad_format;
+		} else if (!strcmp(key, "rotate_mb")) {
+			audio_record_config.rotate_mb = json_object_get_int(tmp);
+			if (audio_record_config.rotate_mb < 0)
+				goto bad_format;
+		} else if (!strcmp(key, "rotate_minutes")) {
+			audio_record_config.rotate_minutes =
+				json_object_get_int(tmp);
+			if (audio_record_config.rotate_minutes < 0)
+				goto bad_format;
+		} else {
+			cerr << "Unknown audio_recording parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_iq_recording(struct json_object *obj)
+{
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "directory")) {
+			if (json_object_get_type(tmp) != json_type_string)
+				goto bad_format;
+			iq_record_config.directory = json_object_get_string(tmp);
+		} else if (!strcmp(key, "buffer_mb")) {
+			if (json_object_get_type(tmp) != json_type_int)
+				goto bad_format;
+			iq_record_config.buffer_mb = json_object_get_int(tmp);
+			if (iq_record_config.buffer_mb < 1)
+				goto bad_format;
+		} else if (!strcmp(key, "direct_io")) {
+			if (json_object_get_type(tmp) != json_type_boolean)
+				goto bad_format;
+			iq_record_config.direct_io =
+				json_object_get_boolean(tmp);
+		} else {
+			cerr << "Unknown iq_recording parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_activity_index(struct json_object *obj)
+{
+	struct activity_index_config &c = activity_index_config;
+
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "directory")) {
+			if (json_object_get_type(tmp) != json_type_string)
+				goto bad_format;
+			c.directory = json_object_get_string(tmp);
+			continue;
+		}
+		if (json_object_get_type(tmp) != json_type_int)
+			goto bad_format;
+		if (!strcmp(key, "bins")) {
+			c.bins = json_object_get_int(tmp);
+			if (c.bins < 1)
+				goto bad_format;
+		} else if (!strcmp(key, "interval_s")) {
+			c.interval_s = json_object_get_int(tmp);
+			if (c.interval_s < 1)
+				goto bad_format;
+		} else if (!strcmp(key, "retention_h")) {
+			c.retention_h = json_object_get_int(tmp);
+			if (c.retention_h < 1)
+				goto bad_format;
+		} else {
+			cerr << "Unknown activity_index parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_scanner(struct json_object *obj)
+{
+	struct scanner_config &c = scanner_config;
+
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "threshold_db")
+				|| !strcmp(key, "hysteresis_db")) {
+			if (json_object_get_type(tmp) != json_type_double
+					&& json_object_get_type(tmp)
+					!= json_type_int)
+				goto bad_format;
+			if (json_object_get_double(tmp) < 0.0)
+				goto bad_format;
+			if (!strcmp(key, "threshold_db"))
+				c.threshold_db = json_object_get_double(tmp);
+			else
+				c.hysteresis_db = json_object_get_double(tmp);
+			continue;
+		}
+		if (json_object_get_type(tmp) != json_type_int)
+			goto bad_format;
+		if (!strcmp(key, "fft_size")) {
+			c.fft_size = json_object_get_int(tmp);
+			if (c.fft_size < 64)
+				goto bad_format;
+		} else if (!strcmp(key, "rate")) {
+			c.rate = json_object_get_int(tmp);
+			if (c.rate < 1)
+				goto bad_format;
+		} else if (!strcmp(key, "averages")) {
+			c.averages = json_object_get_int(tmp);
+			if (c.averages < 1)
+				goto bad_format;
+		} else if (!strcmp(key, "channel_hz")) {
+			c.channel_hz = json_object_get_int(tmp);
+			if (c.channel_hz < 1)
+				goto bad_format;
+		} else if (!strcmp(key, "dwell_ms")) {
+			c.dwell_ms = json_object_get_int(tmp);
+			if (c.dwell_ms < 0)
+				goto bad_format;
+		} else if (!strcmp(key, "hang_ms")) {
+			c.hang_ms = json_object_get_int(tmp);
+			if (c.hang_ms < 0)
+				goto bad_format;
+		} else {
+			cerr << "Unknown scanner parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_monitor(struct json_object *obj)
+{
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "max_channels")) {
+			if (json_object_get_type(tmp) != json_type_int)
+				goto bad_format;
+			monitor_config.max_channels = json_object_get_int(tmp);
+			if (monitor_config.max_channels < 0
+					|| monitor_config.max_channels
+					> MONITOR_MAX_CHANNELS)
+				goto bad_format;
+		} else if (!strcmp(key, "squelch_db")) {
+			if (json_object_get_type(tmp) != json_type_double
+					&& json_object_get_type(tmp)
+					!= json_type_int)
+				goto bad_format;
+			monitor_config.squelch_db = json_object_get_double(tmp);
+			if (monitor_config.squelch_db < 0.0)
+				goto bad_format;
+		} else {
+			cerr << "Unknown monitor parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_overruns(struct json_object *obj)
+{
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "driver_marks")) {
+			if (json_object_get_type(tmp) != json_type_boolean)
+				goto bad_format;
+			overrun_config.driver_marks =
+				json_object_get_boolean(tmp);
+		} else {
+			cerr << "Unknown overruns parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_timeshift(struct json_object *obj)
+{
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "hugepages")) {
+			if (json_object_get_type(tmp) != json_type_boolean)
+				goto bad_format;
+			timeshift_config.hugepages =
+				json_object_get_boolean(tmp);
+		} else if (!strcmp(key, "prime_ms")) {
+			if (json_object_get_type(tmp) != json_type_int)
+				goto bad_format;
+			timeshift_config.prime_ms = json_object_get_int(tmp);
+			if (timeshift_config.prime_ms < 0)
+				goto bad_format;
+		} else if (!strcmp(key, "catchup_speed")) {
+			if (json_object_get_type(tmp) != json_type_double
+					&& json_object_get_type(tmp)
+					!= json_type_int)
+				goto bad_format;
+			timeshift_config.catchup_speed =
+				json_object_get_double(tmp);
+			if (timeshift_config.catchup_speed <= 1.0)
+				goto bad_format;
+		} else {
+			cerr << "Unknown timeshift parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_segments(struct json_object *obj)
+{
+	int val;
+
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (json_object_get_type(tmp) != json_type_int)
+			goto bad_format;
+		val = json_object_get_int(tmp);
+		if (!strcmp(key, "duration_ms")) {
+			if (val < 100)
+				goto bad_format;
+			segments_config.duration_ms = val;
+		} else if (!strcmp(key, "window")) {
+			if (val < 1)
+				goto bad_format;
+			segments_config.window = val;
+		} else if (!strcmp(key, "max_channels")) {
+			if (val < 0)
+				goto bad_format;
+			segments_config.max_channels = val;
+		} else {
+			cerr << "Unknown segments parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	return true;
+bad_format:
+	cerr << "Bad format of config file." << endl;
+	return false;
+}
+
+bool set_edge(struct json_object *obj)
+{
+	if (json_object_get_type(obj) != json_type_object) {
+		cerr << "Bad format of config file." << endl;
+		return false;
+	}
+	json_object_object_foreach(obj, key, tmp) {
+		if (!strcmp(key, "backend")) {
+			if (json_object_get_type(tmp) != json_type_string)
+				goto bad_format;
+			edge_config.backend = json_object_get_string(tmp);
+		} else if (!strcmp(key, "port")) {
+			if (json_object_get_type(tmp) != json_type_int)
+				goto bad_format;
+			edge_config.port = json_object_get_int(tmp);
+		} else {
+			cerr << "Unknown edge parameter in config file: "
+					<< key << endl;
+			return false;
+		}
+	}
+	if (edge_config.backend == "" || edge_config.port <= 0
+			|| edge_config.port > 65535) {
+		cerr << "The edge needs the backend's address and port."
+				<< endl;
+		return false;
+	}
+	edge_config.enabled = true;
 	return true;
 bad_format:
 	cerr << "Bad format of config file." << endl;
@@ -127,7 +870,7 @@ bad_format:
 
 bool process_config(const char *path)
 {
-	struct json_object *obj, *sources, *source;
+	struct json_object *obj, *sources, *source, *tmp;
 	int i, len;
 	bool ret = true;
 
@@ -143,6 +886,31 @@ bool process_config(const char *path)
 		ret = false;
 		goto out;
 	}
+	// The sources are placed as they are created
+	if (json_object_object_get_ex(obj, "placement", &tmp)) {
+		if (!set_placement(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	// With worker processes or as an edge the devices aren't opened here
+	if (json_object_object_get_ex(obj, "workers", &tmp)) {
+		if (!set_workers(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "edge", &tmp)) {
+		if (!set_edge(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (edge_config.enabled && worker_config.enabled) {
+		cerr << "An edge has no sources to run workers for." << endl;
+		ret = false;
+		goto out;
+	}
 	len = json_object_array_length(sources);
 	for (i = 0; i < len; ++i) {
 		source = json_object_array_get_idx(sources, i);
@@ -151,6 +919,93 @@ bool process_config(const char *path)
 			goto out;
 		}
 	}
+	if (json_object_object_get_ex(obj, "buffers", &tmp)) {
+		if (!set_buffer_policy(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "service_threads", &tmp)) {
+		if (json_object_get_type(tmp) != json_type_int
+				|| json_object_get_int(tmp) < 1) {
+			cerr << "Bad format of config file." << endl;
+			ret = false;
+			goto out;
+		}
+		service_threads = json_object_get_int(tmp);
+	}
+	if (json_object_object_get_ex(obj, "receiver_pool", &tmp)) {
+		if (!set_receiver_pool(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "admission", &tmp)) {
+		if (!set_admission(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "relay", &tmp)) {
+		if (!set_relay(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "quality", &tmp)) {
+		if (!set_quality(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "audio_recording", &tmp)) {
+		if (!set_audio_recording(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "iq_recording", &tmp)) {
+		if (!set_iq_recording(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "activity_index", &tmp)) {
+		if (!set_activity_index(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "scanner", &tmp)) {
+		if (!set_scanner(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "monitor", &tmp)) {
+		if (!set_monitor(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "overruns", &tmp)) {
+		if (!set_overruns(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "timeshift", &tmp)) {
+		if (!set_timeshift(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
+	if (json_object_object_get_ex(obj, "segments", &tmp)) {
+		if (!set_segments(tmp)) {
+			ret = false;
+			goto out;
+		}
+	}
 out:
 	json_object_put(obj);
 	if (ret)
@@ -0,0 +1,668 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "control_msg.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#define MAX_DEPTH 16
+#define MAX_NUMBER_LEN 40
+
+enum value_type {
+	VALUE_NULL,
+	VALUE_BOOL,
+	VALUE_INT,
+	VALUE_DOUBLE,
+	VALUE_STRING,
+	// Objects and arrays, their contents are skipped
+	VALUE_OTHER
+};
+
+struct value {
+	enum value_type type;
+	bool b;
+	int64_t i;
+	double d;
+	// Strings that don't fit are treated as VALUE_OTHER
+	char str[CONTROL_STR_LEN + 1];
+};
+
+struct parser {
+	const char *p;
+	const char *end;
+};
+
+static bool parse_value(struct parser *ps, struct value *v, int depth);
+
+static void skip_ws(struct parser *ps)
+{
+	while (ps->p < ps->end && (*ps->p == ' ' || *ps->p == '\t'
+				|| *ps->p == '\n' || *ps->p == '\r'))
+		++ps->p;
+}
+
+static bool expect(struct parser *ps, char c)
+{
+	skip_ws(ps);
+	if (ps->p >= ps->end || *ps->p != c)
+		return false;
+	++ps->p;
+	return true;
+}
+
+static bool parse_literal(struct parser *ps, const char *lit)
+{
+	size_t n = strlen(lit);
+
+	if ((size_t) (ps->end - ps->p) < n || memcmp(ps->p, lit, n))
+		return false;
+	ps->p += n;
+	return true;
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static bool parse_hex4(struct parser *ps, unsigned *out)
+{
+	int d;
+
+	*out = 0;
+	if (ps->end - ps->p < 4)
+		return false;
+	for (int i = 0; i < 4; ++i) {
+		d = hex_digit(*ps->p++);
+		if (d < 0)
+			return false;
+		*out = *out << 4 | d;
+	}
+	return true;
+}
+
+/*
+ * Decode a string into out. Sets *fits to false if it's longer than
+ * CONTROL_STR_LEN, the rest is still consumed.
+ */
+static bool parse_string(struct parser *ps, char *out, bool *fits)
+{
+	size_t len = 0;
+	char utf8[4];
+	size_t n;
+	unsigned cp, lo;
+
+	*fits = true;
+	if (!expect(ps, '"'))
+		return false;
+	while (ps->p < ps->end && *ps->p != '"') {
+		if ((unsigned char) *ps->p < 0x20)
+			return false;
+		if (*ps->p != '\\') {
+			utf8[0] = *ps->p++;
+			n = 1;
+		} else {
+			if (++ps->p >= ps->end)
+				return false;
+			n = 1;
+			switch (*ps->p++) {
+			case '"': utf8[0] = '"'; break;
+			case '\\': utf8[0] = '\\'; break;
+			case '/': utf8[0] = '/'; break;
+			case 'b': utf8[0] = '\b'; break;
+			case 'f': utf8[0] = '\f'; break;
+			case 'n': utf8[0] = '\n'; break;
+			case 'r': utf8[0] = '\r'; break;
+			case 't': utf8[0] = '\t'; break;
+			case 'u':
+				if (!parse_hex4(ps, &cp))
+					return false;
+				// Surrogate pair
+				if (cp >= 0xd800 && cp < 0xdc00) {
+					if (!parse_literal(ps, "\\u")
+							|| !parse_hex4(ps, &lo)
+							|| lo < 0xdc00 || lo >= 0xe000)
+						return false;
+					cp = 0x10000 + ((cp - 0xd800) << 10)
+						+ (lo - 0xdc00);
+				}
+				if (cp < 0x80) {
+					utf8[0] = cp;
+				} else if (cp < 0x800) {
+					utf8[0] = 0xc0 | cp >> 6;
+					utf8[1] = 0x80 | (cp & 0x3f);
+					n = 2;
+				} else if (cp < 0x10000) {
+					utf8[0] = 0xe0 | cp >> 12;
+					utf8[1] = 0x80 | (cp >> 6 & 0x3f);
+					utf8[2] = 0x80 | (cp & 0x3f);
+					n = 3;
+				} else {
+					utf8[0] = 0xf0 | cp >> 18;
+					utf8[1] = 0x80 | (cp >> 12 & 0x3f);
+					utf8[2] = 0x80 | (cp >> 6 & 0x3f);
+					utf8[3] = 0x80 | (cp & 0x3f);
+					n = 4;
+				}
+				break;
+			default:
+				return false;
+			}
+		}
+		if (len + n > CONTROL_STR_LEN) {
+			*fits = false;
+			continue;
+		}
+		memcpy(out + len, utf8, n);
+		len += n;
+	}
+	if (ps->p >= ps->end)
+		return false;
+	++ps->p;
+	out[len] = '\0';
+	return true;
+}
+
+static const char *skip_digits(const char *p)
+{
+	while (*p >= '0' && *p <= '9')
+		++p;
+	return p;
+}
+
+/*
+ * Whether the token is a JSON number,
+ * -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+ */
+static bool valid_number(const char *num)
+{
+	const char *p = num;
+	const char *digits;
+
+	if (*p == '-')
+		++p;
+	if (*p == '0')
+		++p;
+	else if (*p >= '1' && *p <= '9')
+		p = skip_digits(p);
+	else
+		return false;
+	if (*p == '.') {
+		digits = ++p;
+		p = skip_digits(p);
+		if (p == digits)
+			return false;
+	}
+	if (*p == 'e' || *p == 'E') {
+		++p;
+		if (*p == '+' || *p == '-')
+			++p;
+		digits = p;
+		p = skip_digits(p);
+		if (p == digits)
+			return false;
+	}
+	return *p == '\0';
+}
+
+/* strchr() would find the terminating NUL too */
+static bool number_char(char c)
+{
+	return c != '\0' && strchr("+-0123456789.eE", c);
+}
+
+/* Integers beyond the range of int64_t are refused */
+static bool parse_number(struct parser *ps, struct value *v)
+{
+	char num[MAX_NUMBER_LEN + 1];
+	size_t len = 0;
+	bool is_int = true;
+	long long ll;
+	char *end;
+
+	while (ps->p < ps->end && len < MAX_NUMBER_LEN
+			&& number_char(*ps->p)) {
+		if (strchr(".eE", *ps->p))
+			is_int = false;
+		num[len++] = *ps->p++;
+	}
+	num[len] = '\0';
+	if (!len || (ps->p < ps->end && number_char(*ps->p))
+			|| !valid_number(num))
+		return false;
+	if (is_int) {
+		errno = 0;
+		ll = strtoll(num, &end, 10);
+		if (*end || errno == ERANGE)
+			return false;
+		v->type = VALUE_INT;
+		v->i = ll;
+	} else {
+		v->type = VALUE_DOUBLE;
+		v->d = strtod(num, &end);
+		if (*end)
+			return false;
+	}
+	return true;
+}
+
+/* For the int fields, clamped like json-c does */
+static int int_value(const struct value &v)
+{
+	return std::max((int64_t) INT_MIN, std::min((int64_t) INT_MAX, v.i));
+}
+
+/* Skip the members or elements of an object or array */
+static bool skip_container(struct parser *ps, char close, int depth)
+{
+	struct value v;
+	bool fits;
+
+	if (depth >= MAX_DEPTH)
+		return false;
+	skip_ws(ps);
+	if (ps->p < ps->end && *ps->p == close) {
+		++ps->p;
+		return true;
+	}
+	for (;;) {
+		if (close == '}') {
+			if (!parse_string(ps, v.str, &fits) || !expect(ps, ':'))
+				return false;
+		}
+		if (!parse_value(ps, &v, depth + 1))
+			return false;
+		skip_ws(ps);
+		if (ps->p >= ps->end)
+			return false;
+		if (*ps->p == close) {
+			++ps->p;
+			return true;
+		}
+		if (*ps->p++ != ',')
+			return false;
+	}
+}
+
+static bool parse_value(struct parser *ps, struct value *v, int depth)
+{
+	bool fits;
+
+	skip_ws(ps);
+	if (ps->p >= ps->end)
+		return false;
+	switch (*ps->p) {
+	case '"':
+		if (!parse_string(ps, v->str, &fits))
+			return false;
+		v->type = fits ? VALUE_STRING : VALUE_OTHER;
+		return true;
+	case '{':
+	case '[':
+		v->type = VALUE_OTHER;
+		++ps->p;
+		return skip_container(ps, ps->p[-1] == '{' ? '}' : ']', depth);
+	case 't':
+		v->type = VALUE_BOOL;
+		v->b = true;
+		return parse_literal(ps, "true");
+	case 'f':
+		v->type = VALUE_BOOL;
+		v->b = false;
+		return parse_literal(ps, "false");
+	case 'n':
+		v->type = VALUE_NULL;
+		return parse_literal(ps, "null");
+	default:
+		return parse_number(ps, v);
+	}
+}
+
+/* The members of "login", other members are skipped */
+static bool parse_login(struct parser *ps, struct control_msg *msg)
+{
+	char key[CONTROL_STR_LEN + 1];
+	struct value v;
+	bool fits;
+
+	if (!expect(ps, '{'))
+		return false;
+	skip_ws(ps);
+	if (ps->p < ps->end && *ps->p == '}') {
+		++ps->p;
+		return true;
+	}
+	for (;;) {
+		if (!parse_string(ps, key, &fits) || !expect(ps, ':'))
+			return false;
+		if (!parse_value(ps, &v, 2))
+			return false;
+		if (fits && v.type == VALUE_STRING) {
+			if (!strcmp(key, "user")) {
+				strcpy(msg->user, v.str);
+				msg->fields |= CONTROL_USER;
+			} else if (!strcmp(key, "pass")) {
+				strcpy(msg->pass, v.str);
+				msg->fields |= CONTROL_PASS;
+			}
+		}
+		skip_ws(ps);
+		if (ps->p >= ps->end)
+			return false;
+		if (*ps->p == '}') {
+			++ps->p;
+			return true;
+		}
+		if (*ps->p++ != ',')
+			return false;
+	}
+}
+
+/* The members of "activity_query", numbers of any type */
+static bool parse_activity_query(struct parser *ps, struct control_msg *msg)
+{
+	char key[CONTROL_STR_LEN + 1];
+	struct value v;
+	int64_t val;
+	bool fits;
+
+	msg->activity_from = 0;
+	msg->activity_to = 0;
+	msg->activity_lo = 0;
+	msg->activity_hi = 0;
+	if (!expect(ps, '{'))
+		return false;
+	skip_ws(ps);
+	if (ps->p < ps->end && *ps->p == '}') {
+		++ps->p;
+		return true;
+	}
+	for (;;) {
+		if (!parse_string(ps, key, &fits) || !expect(ps, ':'))
+			return false;
+		if (!parse_value(ps, &v, 2))
+			return false;
+		// Doubles beyond int64_t are ignored
+		if (fits && (v.type == VALUE_INT || (v.type == VALUE_DOUBLE
+					&& fabs(v.d) < 9e18))) {
+			val = v.type == VALUE_INT ? v.i : (int64_t) v.d;
+			if (!strcmp(key, "from"))
+				msg->activity_from = val;
+			else if (!strcmp(key, "to"))
+				msg->activity_to = val;
+			else if (!strcmp(key, "lo"))
+				msg->activity_lo = val;
+			else if (!strcmp(key, "hi"))
+				msg->activity_hi = val;
+		}
+		skip_ws(ps);
+		if (ps->p >= ps->end)
+			return false;
+		if (*ps->p == '}') {
+			++ps->p;
+			return true;
+		}
+		if (*ps->p++ != ',')
+			return false;
+	}
+}
+
+/* One channel of "monitor", the squelch is on unless turned off */
+static bool parse_monitor_channel(struct parser *ps,
+		struct control_monitor_channel *c)
+{
+	char key[CONTROL_STR_LEN + 1];
+	struct value v;
+	bool fits;
+
+	c->offset = 0;
+	c->demod[0] = '\0';
+	c->pan = 0.0;
+	c->squelch = true;
+	if (!expect(ps, '{'))
+		return false;
+	skip_ws(ps);
+	if (ps->p < ps->end && *ps->p == '}') {
+		++ps->p;
+		return true;
+	}
+	for (;;) {
+		if (!parse_string(ps, key, &fits) || !expect(ps, ':'))
+			return false;
+		if (!parse_value(ps, &v, 3))
+			return false;
+		if (fits && !strcmp(key, "offset") && v.type == VALUE_INT)
+			c->offset = int_value(v);
+		else if (fits && !strcmp(key, "demod")
+				&& v.type == VALUE_STRING)
+			strcpy(c->demod, v.str);
+		else if (fits && !strcmp(key, "pan") && v.type == VALUE_INT)
+			c->pan = v.i;
+		else if (fits && !strcmp(key, "pan") && v.type == VALUE_DOUBLE)
+			c->pan = v.d;
+		else if (fits && !strcmp(key, "squelch")
+				&& v.type == VALUE_BOOL)
+			c->squelch = v.b;
+		skip_ws(ps);
+		if (ps->p >= ps->end)
+			return false;
+		if (*ps->p == '}') {
+			++ps->p;
+			return true;
+		}
+		if (*ps->p++ != ',')
+			return false;
+	}
+}
+
+/* The elements of "monitor", the ones that aren't objects are skipped */
+static bool parse_monitor(struct parser *ps, struct control_msg *msg)
+{
+	struct control_monitor_channel c;
+	struct value v;
+
+	msg->n_monitor = 0;
+	if (!expect(ps, '['))
+		return false;
+	skip_ws(ps);
+	if (ps->p < ps->end && *ps->p == ']') {
+		++ps->p;
+		return true;
+	}
+	for (;;) {
+		skip_ws(ps);
+		if (ps->p < ps->end && *ps->p == '{') {
+			if (!parse_monitor_channel(ps, &c))
+				return false;
+			if (msg->n_monitor < CONTROL_MONITOR_MAX)
+				msg->monitor[msg->n_monitor] = c;
+			++msg->n_monitor;
+		} else if (!parse_value(ps, &v, 2)) {
+			return false;
+		}
+		skip_ws(ps);
+		if (ps->p >= ps->end)
+			return false;
+		if (*ps->p == ']') {
+			++ps->p;
+			return true;
+		}
+		if (*ps->p++ != ',')
+			return false;
+	}
+}
+
+static void set_field(struct control_msg *msg, const char *key,
+		const struct value &v)
+{
+	if (!strcmp(key, "freq_offset") && v.type == VALUE_INT) {
+		msg->freq_offset = int_value(v);
+		msg->fields |= CONTROL_FREQ_OFFSET;
+	} else if (!strcmp(key, "hw_freq") && v.type == VALUE_INT) {
+		msg->hw_freq = int_value(v);
+		msg->fields |= CONTROL_HW_FREQ;
+	} else if (!strcmp(key, "auto_gain") && v.type == VALUE_BOOL) {
+		msg->auto_gain = v.b;
+		msg->fields |= CONTROL_AUTO_GAIN;
+	} else if (!strcmp(key, "gain") && v.type == VALUE_DOUBLE) {
+		msg->gain = v.d;
+		msg->fields |= CONTROL_GAIN;
+	} else if (!strcmp(key, "demod") && v.type == VALUE_STRING) {
+		strcpy(msg->demod, v.str);
+		msg->fields |= CONTROL_DEMOD;
+	} else if (!strcmp(key, "source") && v.type == VALUE_INT) {
+		msg->source = int_value(v);
+		msg->fields |= CONTROL_SOURCE;
+	} else if (!strcmp(key, "logout")) {
+		msg->fields |= CONTROL_LOGOUT;
+	} else if (!strcmp(key, "get_latency") && v.type == VALUE_BOOL && v.b) {
+		msg->fields |= CONTROL_GET_LATENCY;
+	} else if (!strcmp(key, "get_block_stats") && v.type == VALUE_BOOL
+			&& v.b) {
+		msg->fields |= CONTROL_GET_BLOCK_STATS;
+	} else if (!strcmp(key, "get_overruns") && v.type == VALUE_BOOL
+			&& v.b) {
+		msg->fields |= CONTROL_GET_OVERRUNS;
+	} else if (!strcmp(key, "create_channel")) {
+		if (v.type == VALUE_STRING)
+			strcpy(msg->label, v.str);
+		else
+			msg->label[0] = '\0';
+		msg->fields |= CONTROL_CREATE_CHANNEL;
+	} else if (!strcmp(key, "delete_channel") && v.type == VALUE_INT) {
+		msg->channel = int_value(v);
+		msg->fields |= CONTROL_DELETE_CHANNEL;
+	} else if (!strcmp(key, "replay") && v.type == VALUE_INT) {
+		msg->replay = v.i;
+		msg->fields |= CONTROL_REPLAY;
+	} else if (!strcmp(key, "replay") && v.type == VALUE_DOUBLE) {
+		msg->replay = v.d;
+		msg->fields |= CONTROL_REPLAY;
+	} else if (!strcmp(key, "record_iq")) {
+		if (v.type == VALUE_STRING)
+			strcpy(msg->iq_format, v.str);
+		else
+			msg->iq_format[0] = '\0';
+		msg->fields |= CONTROL_RECORD_IQ;
+	} else if (!strcmp(key, "record_audio") && v.type == VALUE_BOOL) {
+		msg->record_audio = v.b;
+		msg->fields |= CONTROL_RECORD_AUDIO;
+	} else if (!strcmp(key, "scan") && v.type == VALUE_BOOL) {
+		msg->scan = v.b;
+		msg->fields |= CONTROL_SCAN;
+	} else if (!strcmp(key, "scan_auto_tune") && v.type == VALUE_BOOL) {
+		msg->scan_auto_tune = v.b;
+		msg->fields |= CONTROL_SCAN_AUTO_TUNE;
+	}
+}
+
+bool parse_control_json(const char *in, size_t len, struct control_msg *msg)
+{
+	struct parser ps = { in, in + len };
+	char key[CONTROL_STR_LEN + 1];
+	struct value v;
+	bool fits;
+
+	msg->fields = 0;
+	if (!expect(&ps, '{'))
+		return false;
+	skip_ws(&ps);
+	if (ps.p < ps.end && *ps.p == '}') {
+		++ps.p;
+		goto done;
+	}
+	for (;;) {
+		if (!parse_string(&ps, key, &fits) || !expect(&ps, ':'))
+			return false;
+		skip_ws(&ps);
+		if (fits && !strcmp(key, "login")) {
+			msg->fields |= CONTROL_LOGIN;
+			msg->fields &= ~(CONTROL_USER | CONTROL_PASS);
+			if (ps.p < ps.end && *ps.p == '{') {
+				if (!parse_login(&ps, msg))
+					return false;
+			} else if (!parse_value(&ps, &v, 1)) {
+				return false;
+			}
+		} else if (fits && !strcmp(key, "activity_query")) {
+			if (ps.p >= ps.end || *ps.p != '{')
+				return false;
+			if (!parse_activity_query(&ps, msg))
+				return false;
+			msg->fields |= CONTROL_ACTIVITY_QUERY;
+		} else if (fits && !strcmp(key, "monitor")) {
+			if (ps.p >= ps.end || *ps.p != '[')
+				return false;
+			if (!parse_monitor(&ps, msg))
+				return false;
+			msg->fields |= CONTROL_MONITOR;
+		} else {
+			if (!parse_value(&ps, &v, 1))
+				return false;
+			if (fits)
+				set_field(msg, key, v);
+		}
+		skip_ws(&ps);
+		if (ps.p >= ps.end)
+			return false;
+		if (*ps.p == '}') {
+			++ps.p;
+			break;
+		}
+		if (*ps.p++ != ',')
+			return false;
+	}
+done:
+	skip_ws(&ps);
+	return ps.p == ps.end;
+}
+
+bool parse_control_binary(const unsigned char *in, size_t len,
+		struct control_msg *msg)
+{
+	uint32_t val;
+
+	msg->fields = 0;
+	if (len < 1)
+		return false;
+	switch (in[0]) {
+	case CONTROL_OP_FREQ_OFFSET:
+		if (len != 5)
+			return false;
+		val = in[1] | in[2] << 8 | in[3] << 16 | (uint32_t) in[4] << 24;
+		msg->freq_offset = (int32_t) val;
+		msg->fields |= CONTROL_FREQ_OFFSET;
+		return true;
+	default:
+		return false;
+	}
+}
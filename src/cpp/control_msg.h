@@ -0,0 +1,129 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTROL_MSG_H
+#define CONTROL_MSG_H
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Messages sent by the clients over the WebSocket. They are parsed in a
+ * single pass into a fixed structure, without allocating. Members with
+ * unknown keys or of the wrong type are ignored.
+ */
+
+#define CONTROL_STR_LEN 63
+// Channels of "monitor" kept, see monitor.h
+#define CONTROL_MONITOR_MAX 8
+
+enum control_field {
+	CONTROL_FREQ_OFFSET = 1 << 0,
+	CONTROL_HW_FREQ = 1 << 1,
+	CONTROL_AUTO_GAIN = 1 << 2,
+	CONTROL_GAIN = 1 << 3,
+	CONTROL_DEMOD = 1 << 4,
+	CONTROL_SOURCE = 1 << 5,
+	// "login" of any type, user and pass if it had them as strings
+	CONTROL_LOGIN = 1 << 6,
+	CONTROL_USER = 1 << 7,
+	CONTROL_PASS = 1 << 8,
+	CONTROL_LOGOUT = 1 << 9,
+	CONTROL_GET_LATENCY = 1 << 10,
+	CONTROL_GET_BLOCK_STATS = 1 << 11,
+	CONTROL_GET_OVERRUNS = 1 << 12,
+	// Broadcast channels, see segmented.h. "create_channel" may be the
+	// label.
+	CONTROL_CREATE_CHANNEL = 1 << 13,
+	CONTROL_DELETE_CHANNEL = 1 << 14,
+	// Seconds to go back, see timeshift.h
+	CONTROL_REPLAY = 1 << 15,
+	// A SigMF datatype starts recording the source, anything else stops
+	// it, see iq_record.h
+	CONTROL_RECORD_IQ = 1 << 16,
+	// Record the receiver's audio, see audio_record.h
+	CONTROL_RECORD_AUDIO = 1 << 17,
+	// Subscribe to the active channels of the source, see scanner.h
+	CONTROL_SCAN = 1 << 18,
+	// Keep the receiver on the strongest active channel
+	CONTROL_SCAN_AUTO_TUNE = 1 << 19,
+	// "activity_query", an object with any of from, to, lo and hi, see
+	// activity_index.h
+	CONTROL_ACTIVITY_QUERY = 1 << 20,
+	// "monitor", an array of channel objects with offset, demod, pan and
+	// squelch, see monitor.h. Empty to leave monitor mode.
+	CONTROL_MONITOR = 1 << 21
+};
+
+/*
+ * Compact binary messages, for high rate updates like dragging the
+ * frequency offset. An opcode byte is followed by the arguments in little
+ * endian. Clients may use them if the server advertises "binary_protocol".
+ */
+#define CONTROL_BINARY_VERSION 1
+enum control_opcode {
+	// int32 offset
+	CONTROL_OP_FREQ_OFFSET = 1
+};
+
+struct control_monitor_channel {
+	int offset;
+	char demod[CONTROL_STR_LEN + 1];
+	double pan;
+	bool squelch;
+};
+
+struct control_msg {
+	// Bitmask of the control_field members present
+	unsigned fields;
+	int freq_offset;
+	int hw_freq;
+	bool auto_gain;
+	double gain;
+	int source;
+	char demod[CONTROL_STR_LEN + 1];
+	char user[CONTROL_STR_LEN + 1];
+	char pass[CONTROL_STR_LEN + 1];
+	char label[CONTROL_STR_LEN + 1];
+	int channel;
+	double replay;
+	// Empty to stop
+	char iq_format[CONTROL_STR_LEN + 1];
+	bool record_audio;
+	bool scan;
+	bool scan_auto_tune;
+	// 0 where not given
+	int64_t activity_from;
+	int64_t activity_to;
+	int64_t activity_lo;
+	int64_t activity_hi;
+	// May be above CONTROL_MONITOR_MAX, only that many are kept
+	int n_monitor;
+	struct control_monitor_channel monitor[CONTROL_MONITOR_MAX];
+};
+
+/** Returns false if the message isn't a valid JSON object */
+bool parse_control_json(const char *in, size_t len, struct control_msg *msg);
+/** Returns false for an unknown opcode or a truncated message */
+bool parse_control_binary(const unsigned char *in, size_t len,
+		struct control_msg *msg);
+
+#endif
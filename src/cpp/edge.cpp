@@ -0,0 +1,625 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "edge.h"
+#include "broadcast.h"
+#include "event_loop.h"
+#include "fanout.h"
+#include "globals.h"
+#include "metrics.h"
+#include "relay_proto.h"
+#include "remote.h"
+#include "source_state.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// Give up on a connection attempt after this long
+#define EDGE_CONNECT_TIMEOUT_MS 5000
+
+#define EDGE_TICK 0
+#define EDGE_CONN 1
+
+struct edge_config edge_config = { false, "", 0 };
+
+struct edge_slot {
+	bool used;
+	bool closing;
+	bool released;
+	// The receiver's eventfd
+	int notify_fd;
+	struct remote_slot_settings settings;
+	boost::shared_ptr<receiver_stats> stats;
+	unique_ptr<struct audio_ring> ring;
+	struct fanout_sub sub;
+	// 0 if it doesn't listen to any
+	uint32_t channel;
+};
+
+struct edge_channel {
+	size_t source_ix;
+	string demod;
+	int freq_offset;
+	int quality_tier;
+	struct fanout_channel fan;
+};
+
+enum edge_state {
+	EDGE_DOWN,
+	EDGE_CONNECTING,
+	EDGE_UP,
+};
+
+// Protects everything below but the atomics
+static mutex edge_mutex;
+static vector<vector<unique_ptr<struct edge_slot>>> slots;
+static map<uint32_t, unique_ptr<struct edge_channel>> channels;
+static uint32_t next_channel = 1;
+static struct relay_conn conn = { -1, "", 0, "", 0 };
+static enum edge_state state = EDGE_DOWN;
+static uint64_t connect_started_ns;
+static bool want_write;
+static int epoll_fd = -1;
+static int tick_fd = -1;
+static atomic<uint64_t> connects{0};
+static atomic<uint64_t> bytes_received{0};
+
+static void update_events()
+{
+	struct epoll_event ev = {};
+	bool write = state == EDGE_CONNECTING || relay_conn_pending(&conn);
+
+	if (write == want_write)
+		return;
+	ev.events = EPOLLIN;
+	if (write)
+		ev.events |= EPOLLOUT;
+	ev.data.u64 = EDGE_CONN;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev))
+		perror("epoll_ctl");
+	want_write = write;
+}
+
+static void disconnect()
+{
+	if (state == EDGE_DOWN)
+		return;
+	if (state == EDGE_UP)
+		cerr << "Lost the connection to the backend." << endl;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+	relay_conn_close(&conn);
+	state = EDGE_DOWN;
+	// The backend starts the streams over when we're back
+	for (auto &pair : channels)
+		fanout_reset(&pair.second->fan);
+}
+
+static void send_frame(uint32_t type, uint32_t channel, const string &payload)
+{
+	if (state != EDGE_UP)
+		return;
+	relay_send(&conn, type, channel, payload.data(), payload.size());
+	if (relay_conn_flush(&conn)) {
+		disconnect();
+		return;
+	}
+	update_events();
+}
+
+static void send_open(uint32_t id, const struct edge_channel &ch)
+{
+	string payload;
+	char demod[RELAY_DEMOD_LEN] = {};
+
+	relay_put_u32(payload, ch.source_ix);
+	relay_put_u32(payload, ch.freq_offset);
+	relay_put_u32(payload, ch.quality_tier);
+	strncpy(demod, ch.demod.c_str(), RELAY_DEMOD_LEN - 1);
+	payload.append(demod, RELAY_DEMOD_LEN);
+	send_frame(RELAY_OPEN, id, payload);
+}
+
+static void leave_channel(struct edge_slot &s)
+{
+	auto it = channels.find(s.channel);
+
+	s.channel = 0;
+	if (it == channels.end())
+		return;
+	fanout_leave(&it->second->fan, &s.sub);
+	if (!it->second->fan.subs.empty())
+		return;
+	send_frame(RELAY_CLOSE, it->first, "");
+	channels.erase(it);
+}
+
+/* Move the slot to the channel matching its settings, if it's playing */
+static void resubscribe(size_t ix, struct edge_slot &s)
+{
+	const struct remote_slot_settings &set = s.settings;
+	bool wanted = s.used && !s.closing && set.running && set.demod != "";
+	unique_ptr<struct edge_channel> ch;
+	uint32_t id = 0;
+
+	for (auto &pair : channels) {
+		const struct edge_channel &c = *pair.second;
+
+		if (c.source_ix == ix && c.demod == set.demod
+				&& c.freq_offset == set.freq_offset
+				&& c.quality_tier == set.quality_tier) {
+			id = pair.first;
+			break;
+		}
+	}
+	if (wanted && id && id == s.channel)
+		return;
+	if (s.channel)
+		leave_channel(s);
+	if (!wanted)
+		return;
+	if (!id) {
+		ch.reset(new struct edge_channel);
+		ch->source_ix = ix;
+		ch->demod = set.demod;
+		ch->freq_offset = set.freq_offset;
+		ch->quality_tier = set.quality_tier;
+		fanout_reset(&ch->fan);
+		id = next_channel++;
+		send_open(id, *ch);
+		channels[id] = move(ch);
+	}
+	fanout_join(&channels[id]->fan, &s.sub);
+	s.channel = id;
+}
+
+static void maybe_free(struct edge_slot &s)
+{
+	if (!s.closing || !s.released)
+		return;
+	close(s.notify_fd);
+	s.notify_fd = -1;
+	s.stats = nullptr;
+	s.used = false;
+}
+
+static int start_connect()
+{
+	struct addrinfo hints = {}, *res;
+	struct epoll_event ev = {};
+	string port = to_string(edge_config.port);
+	int fd, one = 1, ret;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(edge_config.backend.c_str(), port.c_str(), &hints,
+			&res);
+	if (ret) {
+		cerr << "Can't resolve " << edge_config.backend << ": "
+			<< gai_strerror(ret) << endl;
+		return -1;
+	}
+	fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	if (fd < 0) {
+		perror("socket");
+		freeaddrinfo(res);
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	ret = connect(fd, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	if (ret && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.u64 = EDGE_CONN;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl");
+		close(fd);
+		return -1;
+	}
+	relay_conn_init(&conn, fd);
+	want_write = true;
+	state = EDGE_CONNECTING;
+	connect_started_ns = monotonic_ns();
+	return 0;
+}
+
+/* Say hello and open all the channels the listeners want */
+static void connected()
+{
+	string hello;
+
+	state = EDGE_UP;
+	connects.fetch_add(1);
+	cout << "Connected to the backend " << edge_config.backend << ":"
+		<< edge_config.port << endl;
+	relay_put_u32(hello, RELAY_VERSION);
+	send_frame(RELAY_HELLO, 0, hello);
+	for (auto &pair : channels)
+		send_open(pair.first, *pair.second);
+}
+
+/*
+ * The backend couldn't open the channel, e.g. it ran out of receivers.
+ * Its listeners are left without one, tick() tries again.
+ */
+static void refused(uint32_t id)
+{
+	auto it = channels.find(id);
+
+	if (it == channels.end())
+		return;
+	cerr << "The backend refused channel " << id << "." << endl;
+	for (auto &v : slots) {
+		for (auto &s : v) {
+			if (s->channel == id)
+				s->channel = 0;
+		}
+	}
+	channels.erase(it);
+}
+
+/* Give the listeners without a channel another try */
+static void retry_refused()
+{
+	for (size_t ix = 0; ix < slots.size(); ++ix) {
+		for (auto &s : slots[ix]) {
+			if (s->used && !s->channel)
+				resubscribe(ix, *s);
+		}
+	}
+}
+
+static void handle_frame(const struct relay_header &h, const string &payload)
+{
+	const char *p = payload.data();
+
+	switch (h.type) {
+	case RELAY_HELLO:
+		if (payload.size() < 8 || relay_get_u32(p) != RELAY_VERSION
+				|| relay_get_u32(p + 4)
+				!= sources_info.size()) {
+			cerr << "The backend runs another protocol version "
+				"or has other sources." << endl;
+			disconnect();
+		}
+		break;
+	case RELAY_STATE:
+		if (h.channel >= sources_info.size() || payload.size() < 16)
+			break;
+		set_source_state(h.channel, (int32_t) relay_get_u32(p),
+				relay_get_u32(p + 4),
+				(int32_t) relay_get_u32(p + 8) / 1000.0,
+				(int32_t) relay_get_u32(p + 12));
+		broadcast_changed(BROADCAST_HW_FREQ | BROADCAST_GAIN,
+				h.channel);
+		break;
+	case RELAY_AUDIO: {
+		auto it = channels.find(h.channel);
+
+		bytes_received.fetch_add(payload.size(),
+				memory_order_relaxed);
+		// Late data of a closed channel
+		if (it == channels.end())
+			break;
+		fanout_feed(&it->second->fan, p, payload.size());
+		break;
+	}
+	case RELAY_CLOSE:
+		refused(h.channel);
+		break;
+	default:
+		cerr << "Unknown frame from the backend." << endl;
+		break;
+	}
+}
+
+static void service_conn(uint32_t events)
+{
+	struct relay_header h;
+	string payload;
+	int err = 0, ret;
+	socklen_t len = sizeof(err);
+
+	if (state == EDGE_CONNECTING) {
+		if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			return;
+		getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err) {
+			disconnect();
+			return;
+		}
+		connected();
+	}
+	if (state == EDGE_UP && (events & EPOLLOUT)
+			&& relay_conn_flush(&conn)) {
+		disconnect();
+		return;
+	}
+	if (state == EDGE_UP && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+		ret = relay_conn_fill(&conn);
+		while (state == EDGE_UP) {
+			int n = relay_next_frame(&conn, &h, payload);
+
+			if (n < 0) {
+				cerr << "Bad frame from the backend." << endl;
+				disconnect();
+			}
+			if (n <= 0)
+				break;
+			handle_frame(h, payload);
+		}
+		if (ret)
+			disconnect();
+	}
+	if (state != EDGE_DOWN)
+		update_events();
+}
+
+/* Once a second, retry connecting */
+static void tick()
+{
+	uint64_t expirations;
+
+	if (read(tick_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	if (state == EDGE_CONNECTING && monotonic_ns() - connect_started_ns
+			> EDGE_CONNECT_TIMEOUT_MS * 1000000ULL)
+		disconnect();
+	if (state == EDGE_DOWN)
+		start_connect();
+	else if (state == EDGE_UP)
+		retry_refused();
+}
+
+static void service_edge()
+{
+	struct epoll_event events[4];
+	int n;
+	lock_guard<mutex> lock(edge_mutex);
+
+	n = epoll_wait(epoll_fd, events, 4, 0);
+	for (int i = 0; i < n; ++i) {
+		if (events[i].data.u64 == EDGE_TICK)
+			tick();
+		else if (state != EDGE_DOWN)
+			service_conn(events[i].events);
+	}
+}
+
+static int edge_open(size_t source_ix, int notify_fd,
+		const struct remote_slot_settings &settings,
+		boost::shared_ptr<receiver_stats> stats)
+{
+	lock_guard<mutex> lock(edge_mutex);
+	vector<unique_ptr<struct edge_slot>> &v = slots[source_ix];
+	size_t i;
+
+	for (i = 0; i < v.size() && v[i]->used; ++i)
+		;
+	if (i == v.size()) {
+		v.emplace_back(new struct edge_slot);
+		v[i]->used = false;
+		v[i]->ring.reset(new struct audio_ring);
+		v[i]->channel = 0;
+	}
+	struct edge_slot &s = *v[i];
+	s.notify_fd = dup(notify_fd);
+	if (s.notify_fd < 0) {
+		perror("dup");
+		return -1;
+	}
+	s.used = true;
+	s.closing = false;
+	s.released = false;
+	s.settings = settings;
+	s.stats = stats;
+	// Nothing reads or writes the ring of a free slot
+	audio_ring_reset(s.ring.get());
+	s.sub.ring = s.ring.get();
+	s.sub.notify_fd = s.notify_fd;
+	s.sub.stats = stats.get();
+	resubscribe(source_ix, s);
+	return i;
+}
+
+static void edge_close(size_t source_ix, int slot)
+{
+	lock_guard<mutex> lock(edge_mutex);
+	struct edge_slot &s = *slots[source_ix][slot];
+
+	s.closing = true;
+	if (s.channel)
+		leave_channel(s);
+	maybe_free(s);
+}
+
+static struct audio_ring *edge_ring(size_t source_ix, int slot)
+{
+	lock_guard<mutex> lock(edge_mutex);
+
+	return slots[source_ix][slot]->ring.get();
+}
+
+static void edge_release_ring(size_t source_ix, int slot)
+{
+	lock_guard<mutex> lock(edge_mutex);
+	struct edge_slot &s = *slots[source_ix][slot];
+
+	s.released = true;
+	maybe_free(s);
+}
+
+static void edge_set_demod(size_t source_ix, int slot, const string &demod)
+{
+	lock_guard<mutex> lock(edge_mutex);
+	struct edge_slot &s = *slots[source_ix][slot];
+
+	s.settings.demod = demod;
+	resubscribe(source_ix, s);
+}
+
+static void edge_set_freq_offset(size_t source_ix, int slot, int offset)
+{
+	lock_guard<mutex> lock(edge_mutex);
+	struct edge_slot &s = *slots[source_ix][slot];
+
+	s.settings.freq_offset = offset;
+	resubscribe(source_ix, s);
+}
+
+static void edge_set_quality(size_t source_ix, int slot, int tier)
+{
+	lock_guard<mutex> lock(edge_mutex);
+	struct edge_slot &s = *slots[source_ix][slot];
+
+	s.settings.quality_tier = tier;
+	resubscribe(source_ix, s);
+}
+
+static void edge_set_running(size_t source_ix, int slot, bool running)
+{
+	lock_guard<mutex> lock(edge_mutex);
+	struct edge_slot &s = *slots[source_ix][slot];
+
+	s.settings.running = running;
+	resubscribe(source_ix, s);
+}
+
+static void send_source_value(uint32_t type, size_t source_ix, int32_t val)
+{
+	lock_guard<mutex> lock(edge_mutex);
+	string payload;
+
+	relay_put_u32(payload, val);
+	send_frame(type, source_ix, payload);
+}
+
+static void edge_set_hw_freq(size_t source_ix, int freq)
+{
+	send_source_value(RELAY_HW_FREQ, source_ix, freq);
+}
+
+static void edge_set_gain_mode(size_t source_ix, bool automatic)
+{
+	send_source_value(RELAY_AUTO_GAIN, source_ix, automatic);
+}
+
+static void edge_set_gain(size_t source_ix, double gain)
+{
+	send_source_value(RELAY_GAIN, source_ix, gain * 1000);
+}
+
+static const struct remote_ops edge_ops = {
+	edge_open,
+	edge_close,
+	edge_ring,
+	edge_release_ring,
+	edge_set_demod,
+	edge_set_freq_offset,
+	edge_set_quality,
+	edge_set_running,
+	edge_set_hw_freq,
+	edge_set_gain_mode,
+	edge_set_gain,
+};
+
+int edge_init()
+{
+	struct itimerspec its = {};
+	struct epoll_event ev = {};
+
+	if (!edge_config.enabled)
+		return 0;
+	slots.resize(sources_info.size());
+	// The clients get the configured settings until the backend reports
+	for (size_t i = 0; i < sources_info.size(); ++i) {
+		const struct source_params &p = sources_info[i].params;
+
+		set_source_state(i, p.initial_hw_freq, p.auto_gain, p.gain,
+				p.sample_rate);
+	}
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tick_fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+	its.it_interval.tv_sec = 1;
+	its.it_value.tv_nsec = 1;
+	if (timerfd_settime(tick_fd, 0, &its, nullptr)) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u64 = EDGE_TICK;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tick_fd, &ev)) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	remote_ops = &edge_ops;
+	return event_loop_add_fd(epoll_fd, service_edge);
+}
+
+bool edge_connected()
+{
+	lock_guard<mutex> lock(edge_mutex);
+
+	return state == EDGE_UP;
+}
+
+uint64_t edge_connects()
+{
+	return connects.load();
+}
+
+size_t edge_channels()
+{
+	lock_guard<mutex> lock(edge_mutex);
+
+	return channels.size();
+}
+
+uint64_t edge_bytes_received()
+{
+	return bytes_received.load();
+}
@@ -0,0 +1,56 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EDGE_H
+#define EDGE_H
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Edge mode. An edge node has no devices, it serves the web UI and the
+ * streams of its listeners from a relay backend (see relay.h). Its
+ * receivers are stand-ins (see remote.h). Listeners with the same source,
+ * demodulation, offset and quality tier share one channel of the backend,
+ * whose pages are fanned out to them (see fanout.h). The sources in the
+ * config file must match the backend's, only their labels and
+ * descriptions are used.
+ */
+
+struct edge_config {
+	bool enabled;
+	std::string backend;
+	int port;
+};
+
+extern struct edge_config edge_config;
+
+/** Connect to the backend. Before event_loop_run(). */
+int edge_init();
+bool edge_connected();
+/** Number of successful connections to the backend */
+uint64_t edge_connects();
+/** Channels currently open on the backend */
+size_t edge_channels();
+uint64_t edge_bytes_received();
+
+#endif
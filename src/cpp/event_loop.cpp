@@ -0,0 +1,458 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "event_loop.h"
+#include "globals.h"
+#include "metrics.h"
+#include "placement.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+#define MAX_EVENTS 256
+
+/*
+ * The epoll data of the main set holds the fd, the poll() events lws asked
+ * for (lws_service_fd() looks at them) and what kind of fd it is.
+ */
+#define EV_FD_MASK 0xffffffffULL
+#define EV_EVENTS_SHIFT 32
+#define EV_KIND_SHIFT 48
+
+enum ev_kind {
+	EV_LWS,
+	EV_STREAMS,
+	EV_TIMER,
+	EV_WAKE,
+	EV_CALLBACK,
+	EV_STDIN
+};
+
+struct service_loop {
+	int tsi;
+	int epoll_fd = -1;
+	int stream_epoll_fd = -1;
+	int timer_fd = -1;
+	// Written by other threads to wake the loop up
+	int wake_fd = -1;
+	atomic<bool> notify_pending{false};
+	// Clients without a source are to be woken up
+	atomic<bool> notify_sourceless{false};
+	// Sources whose clients are to be woken up
+	mutex notify_mutex;
+	vector<size_t> notify_sources;
+	// Only touched by the loop's own thread
+	unordered_set<struct lws *> clients;
+	unordered_map<struct lws *, int> client_source;
+	unordered_map<int, unordered_set<struct lws *>> source_clients;
+	thread service_thread;
+};
+
+int service_threads = 1;
+
+static vector<unique_ptr<struct service_loop>> loops;
+static vector<void (*)()> callbacks;
+static atomic<bool> quitting{false};
+
+static uint64_t ev_data(int fd, short events, enum ev_kind kind)
+{
+	return (uint64_t) (unsigned) fd
+		| (uint64_t) (unsigned short) events << EV_EVENTS_SHIFT
+		| (uint64_t) kind << EV_KIND_SHIFT;
+}
+
+static uint32_t poll2epoll(short events)
+{
+	uint32_t ret = 0;
+
+	if (events & POLLIN)
+		ret |= EPOLLIN;
+	if (events & POLLOUT)
+		ret |= EPOLLOUT;
+	return ret;
+}
+
+static short epoll2poll(uint32_t events)
+{
+	short ret = 0;
+
+	if (events & EPOLLIN)
+		ret |= POLLIN;
+	if (events & EPOLLOUT)
+		ret |= POLLOUT;
+	if (events & EPOLLERR)
+		ret |= POLLERR;
+	if (events & EPOLLHUP)
+		ret |= POLLHUP;
+	return ret;
+}
+
+static int epoll_add(int epfd, int fd, uint32_t events, uint64_t data)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.u64 = data;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+static struct service_loop *loop_of(struct lws *wsi)
+{
+	size_t tsi = lws_get_tsi(wsi);
+
+	if (tsi >= loops.size())
+		tsi = 0;
+	return loops[tsi].get();
+}
+
+int add_pollfd(struct lws *wsi, int fd, short events)
+{
+	if (epoll_add(loop_of(wsi)->epoll_fd, fd, poll2epoll(events),
+				ev_data(fd, events, EV_LWS)))
+		return 1;
+	++count_pollfds;
+	return 0;
+}
+
+void change_pollfd(struct lws *wsi, int fd, short events)
+{
+	struct epoll_event ev;
+
+	ev.events = poll2epoll(events);
+	ev.data.u64 = ev_data(fd, events, EV_LWS);
+	if (epoll_ctl(loop_of(wsi)->epoll_fd, EPOLL_CTL_MOD, fd, &ev))
+		perror("epoll_ctl");
+}
+
+void delete_pollfd(struct lws *wsi, int fd)
+{
+	// lws may have closed the fd already, which removes it from the set
+	if (epoll_ctl(loop_of(wsi)->epoll_fd, EPOLL_CTL_DEL, fd, nullptr)
+			&& errno != EBADF && errno != ENOENT) {
+		perror("epoll_ctl");
+	}
+	--count_pollfds;
+}
+
+int add_stream_fd(int fd, struct lws *wsi)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = wsi;
+	if (epoll_ctl(loop_of(wsi)->stream_epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	++count_pollfds;
+	return 0;
+}
+
+void delete_stream_fd(int fd, struct lws *wsi)
+{
+	if (epoll_ctl(loop_of(wsi)->stream_epoll_fd, EPOLL_CTL_DEL, fd, nullptr))
+		perror("epoll_ctl");
+	--count_pollfds;
+}
+
+void add_client(struct lws *wsi)
+{
+	loop_of(wsi)->clients.insert(wsi);
+}
+
+void delete_client(struct lws *wsi)
+{
+	set_client_source(wsi, -1);
+	loop_of(wsi)->clients.erase(wsi);
+}
+
+void set_client_source(struct lws *wsi, int source_ix)
+{
+	struct service_loop *loop = loop_of(wsi);
+	auto it = loop->client_source.find(wsi);
+
+	if (it != loop->client_source.end()) {
+		if (it->second == source_ix)
+			return;
+		loop->source_clients[it->second].erase(wsi);
+		loop->client_source.erase(it);
+	}
+	if (source_ix < 0)
+		return;
+	loop->client_source[wsi] = source_ix;
+	loop->source_clients[source_ix].insert(wsi);
+}
+
+int event_loop_add_fd(int fd, void (*cb)())
+{
+	// The index of the callback takes the place of the events
+	if (epoll_add(loops[0]->epoll_fd, fd, EPOLLIN,
+				ev_data(fd, (short) callbacks.size(), EV_CALLBACK)))
+		return -1;
+	callbacks.push_back(cb);
+	return 0;
+}
+
+static void wake(struct service_loop *loop)
+{
+	uint64_t one = 1;
+
+	if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("write");
+}
+
+void notify_all_clients()
+{
+	for (auto &loop : loops) {
+		// One pending wakeup is enough, no matter how many requests
+		if (!loop->notify_pending.exchange(true))
+			wake(loop.get());
+	}
+}
+
+void notify_source_clients(size_t source_ix)
+{
+	bool was_empty;
+
+	for (auto &loop : loops) {
+		{
+			lock_guard<mutex> lock(loop->notify_mutex);
+
+			was_empty = loop->notify_sources.empty();
+			loop->notify_sources.push_back(source_ix);
+		}
+		if (was_empty)
+			wake(loop.get());
+	}
+}
+
+void notify_sourceless_clients()
+{
+	for (auto &loop : loops) {
+		if (!loop->notify_sourceless.exchange(true))
+			wake(loop.get());
+	}
+}
+
+static int init_loop(struct service_loop *loop)
+{
+	struct itimerspec its;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	loop->stream_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	loop->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+			TFD_NONBLOCK | TFD_CLOEXEC);
+	loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->epoll_fd < 0 || loop->stream_epoll_fd < 0
+			|| loop->timer_fd < 0 || loop->wake_fd < 0) {
+		perror("event_loop_init");
+		return -1;
+	}
+	// lws wants to be serviced at least once a second to handle timeouts
+	its.it_value.tv_sec = 1;
+	its.it_value.tv_nsec = 0;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(loop->timer_fd, 0, &its, nullptr)) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	if (epoll_add(loop->epoll_fd, loop->stream_epoll_fd, EPOLLIN,
+				ev_data(loop->stream_epoll_fd, POLLIN, EV_STREAMS))
+			|| epoll_add(loop->epoll_fd, loop->timer_fd, EPOLLIN,
+				ev_data(loop->timer_fd, POLLIN, EV_TIMER))
+			|| epoll_add(loop->epoll_fd, loop->wake_fd, EPOLLIN,
+				ev_data(loop->wake_fd, POLLIN, EV_WAKE))) {
+		return -1;
+	}
+	return 0;
+}
+
+int event_loop_init(int threads)
+{
+	struct epoll_event ev;
+
+	for (int i = 0; i < threads; ++i) {
+		loops.emplace_back(new service_loop);
+		loops.back()->tsi = i;
+		if (init_loop(loops.back().get()))
+			return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u64 = ev_data(STDIN_FILENO, POLLIN, EV_STDIN);
+	// epoll refuses regular files, e.g. stdin redirected from /dev/null.
+	// There's no way to quit with enter then, but the server still works.
+	if (epoll_ctl(loops[0]->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev)
+			&& errno != EPERM) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+void event_loop_destroy()
+{
+	for (auto &loop : loops) {
+		close(loop->wake_fd);
+		close(loop->timer_fd);
+		close(loop->stream_epoll_fd);
+		close(loop->epoll_fd);
+	}
+	loops.clear();
+}
+
+static void service_streams(struct service_loop *loop)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int n;
+
+	n = epoll_wait(loop->stream_epoll_fd, events, MAX_EVENTS, 0);
+	for (int i = 0; i < n; ++i)
+		lws_callback_on_writable((struct lws *) events[i].data.ptr);
+}
+
+static void service_timer(struct service_loop *loop)
+{
+	uint64_t expirations;
+
+	if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	lws_service_fd_tsi(ws_context, nullptr, loop->tsi);
+}
+
+static void service_wake(struct service_loop *loop)
+{
+	uint64_t val;
+	vector<size_t> sources;
+
+	if (read(loop->wake_fd, &val, sizeof(val)) < 0)
+		return;
+	if (loop->notify_pending.exchange(false)) {
+		// Everyone is woken up anyway
+		lock_guard<mutex> lock(loop->notify_mutex);
+
+		loop->notify_sources.clear();
+		loop->notify_sourceless.store(false);
+		for (struct lws *wsi : loop->clients)
+			lws_callback_on_writable(wsi);
+		return;
+	}
+	if (loop->notify_sourceless.exchange(false)) {
+		for (struct lws *wsi : loop->clients) {
+			if (!loop->client_source.count(wsi))
+				lws_callback_on_writable(wsi);
+		}
+	}
+	{
+		lock_guard<mutex> lock(loop->notify_mutex);
+
+		sources.swap(loop->notify_sources);
+	}
+	for (size_t source_ix : sources) {
+		auto it = loop->source_clients.find((int) source_ix);
+
+		if (it == loop->source_clients.end())
+			continue;
+		for (struct lws *wsi : it->second)
+			lws_callback_on_writable(wsi);
+	}
+}
+
+static void run_loop(struct service_loop *loop)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct lws_pollfd pfd;
+	uint64_t start, elapsed, data;
+	int n;
+
+	placement_pin_service_thread(loop->tsi);
+	while (!quitting) {
+		n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+		start = monotonic_ns();
+		for (int i = 0; i < n; ++i) {
+			data = events[i].data.u64;
+			switch (data >> EV_KIND_SHIFT) {
+			case EV_STDIN:
+				quitting = true;
+				break;
+			case EV_TIMER:
+				service_timer(loop);
+				break;
+			case EV_WAKE:
+				service_wake(loop);
+				break;
+			case EV_STREAMS:
+				service_streams(loop);
+				break;
+			case EV_CALLBACK:
+				callbacks[(data >> EV_EVENTS_SHIFT) & 0xffff]();
+				break;
+			default:
+				pfd.fd = data & EV_FD_MASK;
+				pfd.events = (data >> EV_EVENTS_SHIFT) & 0xffff;
+				pfd.revents = epoll2poll(events[i].events);
+				lws_service_fd_tsi(ws_context, &pfd, loop->tsi);
+				break;
+			}
+		}
+		elapsed = monotonic_ns() - start;
+		event_loop_stats.iterations.fetch_add(1);
+		event_loop_stats.busy_ns.fetch_add(elapsed);
+		event_loop_stats.last_iteration_ns.store(elapsed);
+	}
+}
+
+void event_loop_run()
+{
+	quitting = false;
+	for (size_t i = 1; i < loops.size(); ++i) {
+		loops[i]->service_thread = thread(run_loop, loops[i].get());
+	}
+	run_loop(loops[0].get());
+	quitting = true;
+	for (size_t i = 1; i < loops.size(); ++i) {
+		wake(loops[i].get());
+		loops[i]->service_thread.join();
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <config.h>
+#include <libwebsockets.h>
+
+/*
+ * epoll based event loops, one per lws service thread. The sockets of
+ * libwebsockets are registered through its external poll callbacks and are
+ * level-triggered, because lws expects poll() semantics. The audio pipes of
+ * the HTTP streams live in a second, edge-triggered epoll set, nested in the
+ * main one, so a wakeup only touches the fds that are actually ready.
+ *
+ * lws assigns every connection to one service thread and all callbacks of
+ * the connection run on that thread. Everything below that takes a wsi must
+ * be called from the thread servicing it.
+ */
+
+// Number of service threads, lws may support fewer
+extern int service_threads;
+
+/** Creates the loops, call before lws_create_context() */
+int event_loop_init(int threads);
+void event_loop_destroy();
+/**
+ * Services events until enter is pressed on stdin. The calling thread
+ * services thread 0, the others get their own threads.
+ */
+void event_loop_run();
+
+/** Watch a libwebsockets fd. events are poll() flags. */
+int add_pollfd(struct lws *wsi, int fd, short events);
+void change_pollfd(struct lws *wsi, int fd, short events);
+void delete_pollfd(struct lws *wsi, int fd);
+/** Request a writable callback for wsi whenever fd becomes readable */
+int add_stream_fd(int fd, struct lws *wsi);
+void delete_stream_fd(int fd, struct lws *wsi);
+
+/** WebSocket clients that get a writable callback on notify_all_clients() */
+void add_client(struct lws *wsi);
+void delete_client(struct lws *wsi);
+/** Source the client listens to, -1 if none. Service thread of wsi. */
+void set_client_source(struct lws *wsi, int source_ix);
+/** Ask every WebSocket client to send an update. Any thread. */
+void notify_all_clients();
+/** Ask the WebSocket clients of a source to send an update. Any thread. */
+void notify_source_clients(size_t source_ix);
+/** Ask the WebSocket clients without a source to send an update */
+void notify_sourceless_clients();
+/**
+ * Call cb on service thread 0 whenever fd becomes readable. cb must
+ * consume the event. Only before event_loop_run().
+ */
+int event_loop_add_fd(int fd, void (*cb)());
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "fanout.h"
+#include "ogg_page.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <unistd.h>
+
+using namespace std;
+
+static void notify(struct fanout_sub *sub)
+{
+	uint64_t one = 1;
+
+	if (sub->notify_fd < 0)
+		return;
+	// A full eventfd already wakes the reader up
+	if (write(sub->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("write");
+}
+
+static void deliver(struct fanout_sub *sub, const char *page, size_t len)
+{
+	if (audio_ring_put(sub->ring, page, len, nullptr, 0)) {
+		if (sub->stats)
+			sub->stats->pages_written.fetch_add(1,
+					memory_order_relaxed);
+	} else if (sub->stats) {
+		sub->stats->pages_dropped.fetch_add(1, memory_order_relaxed);
+	}
+}
+
+static void handle_page(struct fanout_channel *c, const char *page,
+		size_t len)
+{
+	// A new link of a chained stream brings new headers
+	if (ogg_bos(page)) {
+		c->headers.clear();
+		c->header_packets = 0;
+	}
+	// The pages up to the end of the last Vorbis header packet
+	if (c->header_packets < VORBIS_HEADER_PACKETS) {
+		c->headers.push_back(string(page, len));
+		c->header_packets += ogg_packets_ended(page);
+	}
+	for (struct fanout_sub *sub : c->subs)
+		deliver(sub, page, len);
+}
+
+void fanout_reset(struct fanout_channel *c)
+{
+	c->partial.clear();
+	c->headers.clear();
+	c->header_packets = 0;
+}
+
+void fanout_join(struct fanout_channel *c, struct fanout_sub *sub)
+{
+	for (const string &page : c->headers)
+		deliver(sub, page.data(), page.size());
+	c->subs.push_back(sub);
+	if (!c->headers.empty())
+		notify(sub);
+}
+
+void fanout_leave(struct fanout_channel *c, struct fanout_sub *sub)
+{
+	c->subs.erase(remove(c->subs.begin(), c->subs.end(), sub),
+			c->subs.end());
+}
+
+size_t fanout_feed(struct fanout_channel *c, const char *data, size_t len)
+{
+	const char *buf = data;
+	size_t avail = len, n, skip, pages = 0;
+
+	// Most of the time whole pages arrive and are passed on in place
+	if (!c->partial.empty()) {
+		c->partial.append(data, len);
+		buf = c->partial.data();
+		avail = c->partial.size();
+	}
+	while (1) {
+		n = ogg_page_len(buf, avail, &skip);
+		if (skip) {
+			buf += skip;
+			avail -= skip;
+			continue;
+		}
+		if (!n)
+			break;
+		handle_page(c, buf, n);
+		buf += n;
+		avail -= n;
+		++pages;
+	}
+	if (c->partial.empty())
+		c->partial.assign(buf, avail);
+	else
+		c->partial.erase(0, c->partial.size() - avail);
+	if (pages) {
+		for (struct fanout_sub *sub : c->subs)
+			notify(sub);
+	}
+	return pages;
+}
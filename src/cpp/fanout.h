@@ -0,0 +1,68 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <config.h>
+#include "audio_ring.h"
+#include "metrics.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * Fan-out of one Ogg stream to many listeners, used by the edge nodes (see
+ * edge.h). The stream arrives cut anywhere and is split into pages. Each
+ * subscriber has its own ring and gets the stream's header pages first, so
+ * it can join at any page boundary. Subscribers that don't keep up lose
+ * whole pages, like the listeners of a local receiver.
+ */
+
+struct fanout_sub {
+	struct audio_ring *ring;
+	// Signalled when pages were added, -1 for none
+	int notify_fd;
+	// May be nullptr
+	struct receiver_stats *stats;
+};
+
+struct fanout_channel {
+	// An incomplete page
+	std::string partial;
+	// The header pages of the current stream
+	std::vector<std::string> headers;
+	// Header packets in them
+	int header_packets;
+	std::vector<struct fanout_sub *> subs;
+};
+
+/** Forget the stream, e.g. when the connection to the backend was lost */
+void fanout_reset(struct fanout_channel *c);
+/** Add the subscriber and give it the header pages seen so far */
+void fanout_join(struct fanout_channel *c, struct fanout_sub *sub);
+void fanout_leave(struct fanout_channel *c, struct fanout_sub *sub);
+/**
+ * Split the data into pages and pass the complete ones to the subscribers.
+ * Returns the number of pages.
+ */
+size_t fanout_feed(struct fanout_channel *c, const char *data, size_t len);
+
+#endif
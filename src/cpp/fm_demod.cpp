@@ -50,3 +50,8 @@ fm_demod::~fm_demod()
 {
 	disconnect_all();
 }
+
+vector<block_sptr> fm_demod::get_blocks()
+{
+	return { demod };
+}
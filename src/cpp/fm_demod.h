@@ -27,12 +27,14 @@
 #include <gnuradio/hier_block2.h>
 #include <gnuradio/analog/quadrature_demod_cf.h>
 #include <gnuradio/filter/firdes.h>
+#include <vector>
 
 class fm_demod : public gr::hier_block2 {
 public:
 	typedef boost::shared_ptr<fm_demod> sptr;
 	static sptr make(int in_rate, int max_deviation);
 	~fm_demod();
+	std::vector<gr::block_sptr> get_blocks();
 private:
 	fm_demod(int in_rate, int max_deviation);
 	gr::analog::quadrature_demod_cf::sptr demod;
@@ -22,30 +22,52 @@
 #define GLOBALS_H
 
 #include <config.h>
+#include "iq_ring.h"
+#include "metrics.h"
 #include "receiver.h"
-#include <unordered_map>
+#include "receiver_map.h"
+#include "timestamp_tagger.h"
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <libwebsockets.h>
 #include <vector>
 
 #define STREAM_NAME_LEN 8
 
+/* Device settings from the config file */
+struct source_params {
+	std::string osmosdr_arg;
+	double freq_corr;
+	int initial_hw_freq;
+	int sample_rate;
+	bool auto_gain;
+	double gain;
+};
+
 typedef struct {
 	std::string label;
 	std::string description;
 	int freq_converter_offset;
+	boost::shared_ptr<source_stats> stats;
+	timestamp_tagger::sptr tagger;
+	// CPUs of the driver threads and the tagger, empty if not configured
+	std::vector<int> cores;
+	struct source_params params;
+	// Seconds of IQ kept for time-shift, see timeshift.h. The ring is
+	// nullptr if there's none in this process.
+	int timeshift_s;
+	boost::shared_ptr<struct iq_ring> iq_ring;
 } source_info_t;
 
-extern std::unordered_map<std::string, receiver::sptr> receiver_map;
+extern sharded_receiver_map receiver_map;
 extern std::vector<osmosdr::source::sptr> osmosdr_sources;
 extern std::vector<source_info_t> sources_info;
 extern gr::top_block_sptr topbl;
 extern struct lws_context *ws_context;
 extern const struct lws_protocols protocols[];
-extern struct lws_pollfd *pollfds;
-extern int *fd_lookup;
-extern int count_pollfds;
-extern int max_fds;
-extern struct lws **fd2wsi;
+extern std::atomic<int> count_pollfds;
+// Held while starting, stopping or reconfiguring the flowgraph
+extern std::mutex flowgraph_mutex;
 
 #endif
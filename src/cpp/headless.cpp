@@ -0,0 +1,409 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "headless.h"
+#include "event_loop.h"
+#include "globals.h"
+#include "receiver.h"
+#include "remote.h"
+#include "segmented.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <gnuradio/io_signature.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+vector<struct headless_config> headless_configs;
+
+/*
+ * Writes the audio as 16 bit PCM to the clients of a socket and to a
+ * FIFO. A write that only went through partly leaves the rest of its chunk
+ * pending, the following chunks are dropped until it's out, so a reader
+ * never gets half a sample.
+ */
+class pcm_sink : virtual public gr::sync_block {
+public:
+	typedef boost::shared_ptr<pcm_sink> sptr;
+	static sptr make();
+	~pcm_sink();
+	int work(int noutput_items, gr_vector_const_void_star &input_items,
+			gr_vector_void_star &output_items);
+	/** Any thread. The FIFO is never closed by the sink. */
+	void add_output(int fd, bool fifo);
+	size_t clients();
+private:
+	struct output {
+		int fd;
+		bool fifo;
+		string pending;
+	};
+	mutex outputs_mutex;
+	vector<struct output> outputs;
+	vector<int16_t> buf;
+	pcm_sink();
+	bool write_output(struct output &o, const char *data, size_t len);
+};
+
+struct headless_receiver {
+	struct headless_config config;
+	receiver::sptr rec;
+	// In receiver_map, empty if broadcast
+	string name;
+	int broadcast_id;
+	int listen_fd;
+	int fifo_fd;
+	pcm_sink::sptr pcm;
+};
+
+static vector<unique_ptr<struct headless_receiver>> receivers;
+static int epoll_fd = -1;
+static atomic<size_t> count_receivers{0};
+static atomic<uint64_t> pcm_bytes{0};
+static atomic<uint64_t> pcm_dropped{0};
+
+pcm_sink::sptr pcm_sink::make()
+{
+	return boost::shared_ptr<pcm_sink>(new pcm_sink());
+}
+
+pcm_sink::pcm_sink()
+	: gr::sync_block("pcm_sink",
+		gr::io_signature::make(1, 1, sizeof(float)),
+		gr::io_signature::make(0, 0, 0))
+{
+}
+
+pcm_sink::~pcm_sink()
+{
+	for (struct output &o : outputs) {
+		if (!o.fifo)
+			close(o.fd);
+	}
+}
+
+void pcm_sink::add_output(int fd, bool fifo)
+{
+	lock_guard<mutex> lock(outputs_mutex);
+
+	outputs.push_back({ fd, fifo, "" });
+}
+
+size_t pcm_sink::clients()
+{
+	lock_guard<mutex> lock(outputs_mutex);
+	size_t ret = 0;
+
+	for (const struct output &o : outputs)
+		ret += !o.fifo;
+	return ret;
+}
+
+/* Returns false if the reader of a socket is gone */
+bool pcm_sink::write_output(struct output &o, const char *data, size_t len)
+{
+	ssize_t n;
+
+	if (!o.pending.empty()) {
+		n = o.fifo ? write(o.fd, o.pending.data(), o.pending.size())
+			: send(o.fd, o.pending.data(), o.pending.size(),
+					MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno != EAGAIN)
+			return o.fifo;
+		if (n > 0)
+			o.pending.erase(0, n);
+		if (!o.pending.empty()) {
+			pcm_dropped.fetch_add(len, memory_order_relaxed);
+			return true;
+		}
+	}
+	n = o.fifo ? write(o.fd, data, len)
+		: send(o.fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0 && errno != EAGAIN)
+		return o.fifo;
+	if (n < 0)
+		n = 0;
+	if (n > 0 && (size_t) n < len)
+		o.pending.assign(data + n, len - n);
+	else if (n == 0)
+		pcm_dropped.fetch_add(len, memory_order_relaxed);
+	pcm_bytes.fetch_add(n, memory_order_relaxed);
+	return true;
+}
+
+int pcm_sink::work(int noutput_items, gr_vector_const_void_star &input_items,
+		gr_vector_void_star &output_items)
+{
+	const float *in = (const float *) input_items[0];
+	int n = min(noutput_items,
+			(int) (HEADLESS_PCM_CHUNK / sizeof(int16_t)));
+
+	(void) output_items;
+	buf.resize(n);
+	for (int i = 0; i < n; ++i)
+		buf[i] = max(-1.0f, min(1.0f, in[i])) * 32767.0f;
+
+	lock_guard<mutex> lock(outputs_mutex);
+	for (auto it = outputs.begin(); it != outputs.end();) {
+		if (write_output(*it, (const char *) buf.data(),
+					n * sizeof(int16_t))) {
+			++it;
+			continue;
+		}
+		close(it->fd);
+		it = outputs.erase(it);
+	}
+	return n;
+}
+
+/* Accept the clients of the PCM sockets */
+static void service_headless()
+{
+	struct epoll_event events[16];
+	struct headless_receiver *h;
+	int n, fd;
+
+	n = epoll_wait(epoll_fd, events, 16, 0);
+	for (int i = 0; i < n; ++i) {
+		h = receivers[events[i].data.u32].get();
+		while ((fd = accept4(h->listen_fd, nullptr, nullptr,
+						SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+			h->pcm->add_output(fd, false);
+		if (errno != EAGAIN)
+			perror("accept4");
+	}
+}
+
+static int listen_unix(const string &path)
+{
+	struct sockaddr_un addr = {};
+	int fd;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		cerr << "Socket path too long: " << path << endl;
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	// Left behind by a previous run
+	unlink(path.c_str());
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))
+			|| listen(fd, 16)) {
+		perror(path.c_str());
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Opened for reading too, so that opening doesn't wait for a reader and
+ * writing without one doesn't fail. The audio then waits in the pipe
+ * until it's full.
+ */
+static int open_fifo(const string &path)
+{
+	int fd;
+
+	if (mkfifo(path.c_str(), 0644) && errno != EEXIST) {
+		perror(path.c_str());
+		return -1;
+	}
+	fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		perror(path.c_str());
+	return fd;
+}
+
+/*
+ * Broadcast receivers come from segmented.h, which reads their stream.
+ * The others have none.
+ */
+static receiver::sptr create_receiver(struct headless_receiver &h, size_t n)
+{
+	const struct headless_config &c = h.config;
+	receiver::sptr rec;
+
+	if (!c.broadcast.empty()) {
+		h.broadcast_id = segmented_create(c.source_ix, c.demod,
+				c.offset, c.broadcast, true);
+		if (h.broadcast_id < 0) {
+			cerr << "Couldn't create the broadcast channel "
+				<< c.broadcast << endl;
+			return nullptr;
+		}
+		return segmented_receiver(h.broadcast_id);
+	}
+	rec = receiver::make_headless(topbl);
+	// Keeps the full quality under load, see quality.h
+	rec->set_privileged(true);
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+
+		topbl->lock();
+		rec->set_source(c.source_ix);
+		rec->change_demod(c.demod);
+		topbl->unlock();
+	}
+	rec->set_freq_offset(c.offset);
+	h.name = "headless-" + to_string(n);
+	receiver_map.insert(h.name, rec);
+	return rec;
+}
+
+static int setup_outputs(struct headless_receiver &h, size_t n)
+{
+	const struct headless_config &c = h.config;
+	struct epoll_event ev = {};
+
+	if (!c.pcm_socket.empty() || !c.pcm_fifo.empty()) {
+		h.pcm = pcm_sink::make();
+		lock_guard<mutex> lock(flowgraph_mutex);
+
+		topbl->lock();
+		h.rec->set_audio_tap(h.pcm);
+		topbl->unlock();
+	}
+	if (!c.pcm_fifo.empty()) {
+		h.fifo_fd = open_fifo(c.pcm_fifo);
+		if (h.fifo_fd < 0)
+			return -1;
+		h.pcm->add_output(h.fifo_fd, true);
+	}
+	if (!c.pcm_socket.empty()) {
+		h.listen_fd = listen_unix(c.pcm_socket);
+		if (h.listen_fd < 0)
+			return -1;
+		ev.events = EPOLLIN;
+		ev.data.u32 = n;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, h.listen_fd, &ev)) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+	if (!c.record.empty() && !h.rec->start_recording(c.record)) {
+		cerr << "Couldn't record " << c.record << endl;
+		return -1;
+	}
+	return 0;
+}
+
+int headless_start()
+{
+	if (headless_configs.empty())
+		return 0;
+	if (remote_ops != nullptr) {
+		cerr << "Headless receivers need the sources in this process."
+			<< endl;
+		return -1;
+	}
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	for (size_t i = 0; i < headless_configs.size(); ++i) {
+		unique_ptr<struct headless_receiver> h(
+				new struct headless_receiver);
+
+		h->config = headless_configs[i];
+		h->broadcast_id = -1;
+		h->listen_fd = -1;
+		h->fifo_fd = -1;
+		h->rec = create_receiver(*h, i);
+		if (h->rec == nullptr)
+			return -1;
+		receivers.push_back(move(h));
+		if (setup_outputs(*receivers.back(), i))
+			return -1;
+		// Broadcast channels are running already
+		if (receivers.back()->broadcast_id < 0) {
+			lock_guard<mutex> lock(flowgraph_mutex);
+			start_receiver(receivers.back()->rec);
+		}
+		count_receivers.fetch_add(1);
+	}
+	cout << receivers.size() << " headless receivers started." << endl;
+	return event_loop_add_fd(epoll_fd, service_headless);
+}
+
+void headless_stop()
+{
+	for (auto &h : receivers) {
+		if (h->broadcast_id < 0) {
+			lock_guard<mutex> lock(flowgraph_mutex);
+			stop_receiver(h->rec);
+		}
+		h->rec->stop_recording();
+		if (!h->name.empty())
+			receiver_map.erase(h->name);
+		if (h->listen_fd >= 0) {
+			close(h->listen_fd);
+			unlink(h->config.pcm_socket.c_str());
+		}
+		if (h->fifo_fd >= 0)
+			close(h->fifo_fd);
+	}
+	count_receivers.store(0);
+}
+
+size_t headless_receivers()
+{
+	return count_receivers.load();
+}
+
+size_t headless_pcm_clients()
+{
+	size_t ret = 0;
+
+	for (size_t i = 0; i < count_receivers.load(); ++i) {
+		if (receivers[i]->pcm != nullptr)
+			ret += receivers[i]->pcm->clients();
+	}
+	return ret;
+}
+
+uint64_t headless_pcm_bytes()
+{
+	return pcm_bytes.load();
+}
+
+uint64_t headless_pcm_dropped()
+{
+	return pcm_dropped.load();
+}
@@ -0,0 +1,78 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Receivers defined in the config file, in the "receivers" array of their
+ * source. They run from start-up to shutdown whether anybody listens or
+ * not, e.g. for an APRS decoder or a beacon skimmer, in the same chain as
+ * the receivers of the browsers. Each has one or more outputs:
+ *
+ * - pcm_socket: a Unix stream socket the server listens on. Every client
+ *   connected to it gets the audio as raw signed 16 bit little endian mono
+ *   PCM at the full quality audio rate, see quality.h.
+ * - pcm_fifo: the same PCM written into a named pipe, created if missing.
+ * - record: the Ogg stream recorded under this name, see audio_record.h.
+ * - broadcast: the Ogg stream published as a broadcast channel with this
+ *   label, see segmented.h. The browsers listening to it share the
+ *   receiver. The channel can't be deleted over the WebSocket.
+ *
+ * A PCM reader that doesn't keep up loses audio in whole samples, the
+ * flowgraph never waits for it. The receiver is only encoded to Ogg if it
+ * is recorded or broadcast.
+ */
+
+// Most PCM written at once in bytes, a client that can't take a whole
+// chunk besides what its socket buffers loses it
+#define HEADLESS_PCM_CHUNK 16384
+
+struct headless_config {
+	size_t source_ix;
+	int offset;
+	std::string demod;
+	std::string pcm_socket;
+	std::string pcm_fifo;
+	std::string record;
+	std::string broadcast;
+};
+
+extern std::vector<struct headless_config> headless_configs;
+
+/**
+ * Start the receivers of headless_configs. Before event_loop_run(), after
+ * segmented_init(). Returns -1 if one couldn't be set up.
+ */
+int headless_start();
+/** Stop the receivers and remove the sockets */
+void headless_stop();
+size_t headless_receivers();
+size_t headless_pcm_clients();
+uint64_t headless_pcm_bytes();
+uint64_t headless_pcm_dropped();
+
+#endif
@@ -20,11 +20,19 @@
 
 #include <config.h>
 #include "http.h"
+#include "auth.h"
+#include "event_loop.h"
 #include "globals.h"
+#include "metrics.h"
+#include "quality.h"
+#include "segmented.h"
 #include "utils.h"
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <strings.h>
 
 using namespace std;
 
@@ -50,28 +58,6 @@ const char *stream_name(const char *url)
 		return nullptr;
 }
 
-int add_pollfd(int fd, short events)
-{
-	if (count_pollfds >= max_fds) {
-		cerr << "Too many fds." << endl;
-		return 1;
-	}
-	fd_lookup[fd] = count_pollfds;
-	pollfds[count_pollfds].fd = fd;
-	pollfds[count_pollfds].events = events;
-	pollfds[count_pollfds].revents = 0;
-	++count_pollfds;
-	return 0;
-}
-
-void delete_pollfd(int fd)
-{
-	if (--count_pollfds) {
-		pollfds[fd_lookup[fd]] = pollfds[count_pollfds];
-		fd_lookup[pollfds[count_pollfds].fd] = fd_lookup[fd];
-	}
-}
-
 int handle_new_stream(struct lws *wsi, const char *stream,
 		struct http_user_data *data)
 {
@@ -82,25 +68,23 @@ int handle_new_stream(struct lws *wsi, const char *stream,
 	int n;
 	receiver::sptr rec;
 
-	auto iter = receiver_map.find(stream);
-	if (iter == receiver_map.end()) {
+	rec = receiver_map.find(stream);
+	if (rec == nullptr) {
 		lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, nullptr);
 		return -1;
 	}
-	rec = iter->second;
-	if (!rec->is_ready() || rec->is_running()) {
-		lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, nullptr);
-		return -1;
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+		if (!rec->is_ready() || rec->is_running()) {
+			lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND,
+					nullptr);
+			return -1;
+		}
+		data->fd = rec->get_fd()[0];
+		add_stream_fd(data->fd, wsi);
+
+		start_receiver(rec);
 	}
-	data->fd = rec->get_fd()[0];
-	add_pollfd(data->fd, POLLIN);
-	fd2wsi[data->fd] = wsi;
-
-	topbl->lock();
-	rec->start();
-	topbl->unlock();
-	if (count_receivers_running() == 1)
-		topbl->start();
 	if (lws_add_http_header_status(wsi, 200, &buf_pos, buf_end))
 		return 1;
 	header = "audio/ogg";
@@ -145,10 +129,328 @@ int handle_new_stream(struct lws *wsi, const char *stream,
 	return 0;
 }
 
+/*
+ * The metrics name the streams, so they take the credentials of the
+ * privileged users, sent with HTTP Basic authentication.
+ */
+static bool metrics_authorized(struct lws *wsi)
+{
+	char header[256];
+	char decoded[256];
+	const char *colon;
+	int len;
+
+	if (lws_hdr_copy(wsi, header, sizeof(header),
+				WSI_TOKEN_HTTP_AUTHORIZATION) <= 0
+			|| strncmp(header, "Basic ", 6))
+		return false;
+	len = lws_b64_decode_string(header + 6, decoded,
+			sizeof(decoded) - 1);
+	if (len < 0)
+		return false;
+	decoded[len] = '\0';
+	colon = strchr(decoded, ':');
+	if (colon == nullptr)
+		return false;
+	return authenticate(string(decoded, colon - decoded),
+			string(colon + 1));
+}
+
+static int metrics_unauthorized(struct lws *wsi, struct http_user_data *data)
+{
+	unsigned char *buffer = (unsigned char *) data->buf;
+	unsigned char *buf_pos = (unsigned char *) data->buf + LWS_PRE;
+	unsigned char *buf_end = (unsigned char *) data->buf + sizeof(data->buf);
+	const char *header;
+	int n;
+
+	if (lws_add_http_header_status(wsi, HTTP_STATUS_UNAUTHORIZED,
+				&buf_pos, buf_end))
+		return 1;
+	header = "Basic realm=\"GrWebSDR\"";
+	if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_WWW_AUTHENTICATE,
+				(unsigned char *) header,
+				strlen(header),
+				&buf_pos, buf_end))
+		return 1;
+	if (lws_add_http_header_content_length(wsi, 0, &buf_pos, buf_end))
+		return 1;
+	if (lws_finalize_http_header(wsi, &buf_pos, buf_end))
+		return 1;
+	n = lws_write(wsi, buffer + LWS_PRE,
+			buf_pos - (buffer + LWS_PRE),
+			LWS_WRITE_HTTP_HEADERS);
+	if (n < 0)
+		return -1;
+	return lws_http_transaction_completed(wsi) ? -1 : 0;
+}
+
+int handle_metrics(struct lws *wsi, struct http_user_data *data)
+{
+	unsigned char *buffer = (unsigned char *) data->buf;
+	unsigned char *buf_pos = (unsigned char *) data->buf + LWS_PRE;
+	unsigned char *buf_end = (unsigned char *) data->buf + sizeof(data->buf);
+	const char *header;
+	string text;
+	char *body;
+	int n;
+
+	if (!metrics_authorized(wsi))
+		return metrics_unauthorized(wsi, data);
+	text = metrics_text();
+	body = (char *) malloc(text.size());
+	if (!body) {
+		cerr << "malloc() failed" << endl;
+		return -1;
+	}
+	memcpy(body, text.data(), text.size());
+	data->body = body;
+	data->body_len = text.size();
+	data->body_pos = 0;
+
+	if (lws_add_http_header_status(wsi, 200, &buf_pos, buf_end))
+		return 1;
+	header = "text/plain; version=0.0.4";
+	if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_CONTENT_TYPE,
+				(unsigned char *) header,
+				strlen(header),
+				&buf_pos, buf_end))
+		return 1;
+	header = "no-cache";
+	if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_CACHE_CONTROL,
+				(unsigned char *) header,
+				strlen(header),
+				&buf_pos, buf_end))
+		return 1;
+	if (lws_add_http_header_content_length(wsi, data->body_len,
+				&buf_pos, buf_end))
+		return 1;
+	if (lws_finalize_http_header(wsi, &buf_pos, buf_end))
+		return 1;
+	n = lws_write(wsi, buffer + LWS_PRE,
+			buf_pos - (buffer + LWS_PRE),
+			LWS_WRITE_HTTP_HEADERS);
+	if (n < 0)
+		return -1;
+	lws_callback_on_writable(wsi);
+	return 0;
+}
+
+void free_body(struct http_user_data *data)
+{
+	if (data->asset) {
+		delete data->asset;
+		data->asset = nullptr;
+	} else {
+		free((void *) data->body);
+	}
+	data->body = nullptr;
+	data->body_len = 0;
+	data->body_pos = 0;
+}
+
+int send_body(struct lws *wsi, struct http_user_data *data)
+{
+	size_t n;
+	unsigned char *buffer = (unsigned char *) data->buf;
+
+	n = min((size_t) HTTP_MAX_PAYLOAD, data->body_len - data->body_pos);
+	// lws_write() may write in front of the data, cached bodies are shared
+	memcpy(data->buf + LWS_PRE, data->body + data->body_pos, n);
+	if (lws_write(wsi, buffer + LWS_PRE, n, LWS_WRITE_HTTP) < 0) {
+		cerr << "lws_write() failed." << endl;
+		return -1;
+	}
+	data->body_pos += n;
+	if (data->body_pos < data->body_len)
+		lws_callback_on_writable(wsi);
+	else
+		free_body(data);
+	return 0;
+}
+
+/*
+ * Whether the client accepts the content coding, i.e. lists it in
+ * Accept-Encoding without q=0.
+ */
+static bool accepts_encoding(const char *header, const char *coding)
+{
+	size_t len = strlen(coding);
+	const char *p = header;
+	const char *q;
+
+	while (*p) {
+		p += strspn(p, " \t,");
+		if (!strncasecmp(p, coding, len) && strchr(" \t;,", p[len])) {
+			q = p + len + strspn(p + len, " \t");
+			if (*q != ';')
+				return true;
+			q += 1 + strspn(q + 1, " \t");
+			// Only q=0 refuses the coding
+			return strncmp(q, "q=", 2) || strtod(q + 2, nullptr) > 0;
+		}
+		p += strcspn(p, ",");
+	}
+	return false;
+}
+
+static enum asset_encoding choose_encoding(struct lws *wsi,
+		const struct asset &a)
+{
+	char header[128];
+
+	if (lws_hdr_copy(wsi, header, sizeof(header),
+				WSI_TOKEN_HTTP_ACCEPT_ENCODING) <= 0)
+		return ASSET_IDENTITY;
+	if (asset_body_len(a, ASSET_BROTLI) && accepts_encoding(header, "br"))
+		return ASSET_BROTLI;
+	if (asset_body_len(a, ASSET_GZIP) && accepts_encoding(header, "gzip"))
+		return ASSET_GZIP;
+	return ASSET_IDENTITY;
+}
+
+// Of the ETags of the encodings, which share the content hash
+static const char *etag_suffixes[] = { "", "-gz", "-br" };
+
+/* Whether an opaque tag, without the quotes, is one of the asset's */
+static bool etag_is(const struct asset &a, const char *tag, size_t len)
+{
+	size_t hash_len = a.etag.size();
+
+	if (len < hash_len || memcmp(tag, a.etag.data(), hash_len))
+		return false;
+	for (const char *suffix : etag_suffixes) {
+		if (len - hash_len == strlen(suffix)
+				&& !memcmp(tag + hash_len, suffix,
+					len - hash_len))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Whether If-None-Match lists an ETag of the asset, in any encoding, or
+ * is "*". Weak tags match too, as RFC 7232 wants for this header.
+ */
+static bool etag_matches(struct lws *wsi, const struct asset &a)
+{
+	char header[256];
+	const char *p = header;
+	const char *end;
+
+	if (lws_hdr_copy(wsi, header, sizeof(header),
+				WSI_TOKEN_HTTP_IF_NONE_MATCH) <= 0)
+		return false;
+	while (*p) {
+		p += strspn(p, " \t,");
+		if (*p == '*')
+			return true;
+		if (!strncmp(p, "W/", 2))
+			p += 2;
+		if (*p == '"') {
+			end = strchr(p + 1, '"');
+			if (end == nullptr)
+				return false;
+			if (etag_is(a, p + 1, end - p - 1))
+				return true;
+			p = end + 1;
+		}
+		p += strcspn(p, ",");
+	}
+	return false;
+}
+
+/*
+ * Serve a cached static file or a segment of a broadcast channel. A static
+ * file is revalidated on every load, which costs a 304 without a body as
+ * long as the file doesn't change.
+ */
+int handle_asset(struct lws *wsi, asset_sptr a, struct http_user_data *data)
+{
+	unsigned char *buffer = (unsigned char *) data->buf;
+	unsigned char *buf_pos = (unsigned char *) data->buf + LWS_PRE;
+	unsigned char *buf_end = (unsigned char *) data->buf + sizeof(data->buf);
+	static const char *codings[] = { nullptr, "gzip", "br" };
+	enum asset_encoding enc;
+	bool not_modified;
+	string etag;
+	const char *header;
+	int n;
+
+	enc = choose_encoding(wsi, *a);
+	not_modified = etag_matches(wsi, *a);
+	etag = "\"" + a->etag + etag_suffixes[enc] + "\"";
+
+	if (lws_add_http_header_status(wsi, not_modified
+				? HTTP_STATUS_NOT_MODIFIED : HTTP_STATUS_OK,
+				&buf_pos, buf_end))
+		return 1;
+	header = a->content_type.c_str();
+	if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_CONTENT_TYPE,
+				(unsigned char *) header,
+				strlen(header),
+				&buf_pos, buf_end))
+		return 1;
+	if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_ETAG,
+				(unsigned char *) etag.c_str(),
+				etag.size(),
+				&buf_pos, buf_end))
+		return 1;
+	header = a->cache_control.c_str();
+	if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_CACHE_CONTROL,
+				(unsigned char *) header,
+				strlen(header),
+				&buf_pos, buf_end))
+		return 1;
+	header = "Accept-Encoding";
+	if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_VARY,
+				(unsigned char *) header,
+				strlen(header),
+				&buf_pos, buf_end))
+		return 1;
+	if (codings[enc] && lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_CONTENT_ENCODING,
+				(unsigned char *) codings[enc],
+				strlen(codings[enc]),
+				&buf_pos, buf_end))
+		return 1;
+	if (!not_modified) {
+		data->asset = new asset_sptr(a);
+		data->body = asset_body(*a, enc);
+		data->body_len = asset_body_len(*a, enc);
+		data->body_pos = 0;
+	}
+	if (lws_add_http_header_content_length(wsi,
+				not_modified ? 0 : data->body_len,
+				&buf_pos, buf_end))
+		return 1;
+	if (lws_finalize_http_header(wsi, &buf_pos, buf_end))
+		return 1;
+	n = lws_write(wsi, buffer + LWS_PRE,
+			buf_pos - (buffer + LWS_PRE),
+			LWS_WRITE_HTTP_HEADERS);
+	if (n < 0)
+		return -1;
+	if (!data->body_len) {
+		free_body(data);
+		return lws_http_transaction_completed(wsi) ? -1 : 0;
+	}
+	lws_callback_on_writable(wsi);
+	return 0;
+}
+
 int init_http_session(struct lws *wsi, void *user, void *in, size_t len)
 {
 	struct http_user_data *data = (struct http_user_data *) user;
 	const char *stream;
+	asset_sptr a;
 
 	(void) user;
 	(void) len;
@@ -162,43 +464,45 @@ int init_http_session(struct lws *wsi, void *user, void *in, size_t len)
 	}
 
 	data->fd = -1;
+	data->body = nullptr;
+	data->body_len = 0;
+	data->asset = nullptr;
 	strncpy(data->url, (char *) in, len);
 	data->url[len] = '\0';
 	stream = stream_name((char *) in);
 	if (stream) {
 		return handle_new_stream(wsi, stream, data);
+	} else if (!strcmp(data->url, "/metrics")) {
+		return handle_metrics(wsi, data);
+	} else if ((a = segmented_find(data->url)) != nullptr
+			|| (a = asset_find(data->url)) != nullptr) {
+		return handle_asset(wsi, a, data);
 	} else {
 		lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, nullptr);
 		return -1;
 	}
 }
 
-void end_http_session(struct http_user_data *data)
+void end_http_session(struct lws *wsi, struct http_user_data *data)
 {
 	const char *stream;
 	receiver::sptr rec;
 
 	if (!data)
 		return;
+	free_body(data);
 	stream = stream_name(data->url);
 	if (!stream)
 		return;
 	cout << "Closing stream " << stream << endl;
 	if (data->fd >= 0) {
-		delete_pollfd(data->fd);
-		fd2wsi[data->fd] = nullptr;
+		delete_stream_fd(data->fd, wsi);
 	}
-	auto iter = receiver_map.find(stream);
-	if (iter == receiver_map.end())
+	rec = receiver_map.find(stream);
+	if (rec == nullptr)
 		return;
-	if (count_receivers_running() == 1) {
-		topbl->stop();
-		topbl->wait();
-	}
-	rec = iter->second;
-	topbl->lock();
-	rec->stop();
-	topbl->unlock();
+	lock_guard<mutex> lock(flowgraph_mutex);
+	stop_receiver(rec);
 }
 
 int send_audio(struct lws *wsi, struct http_user_data *data)
@@ -206,8 +510,17 @@ int send_audio(struct lws *wsi, struct http_user_data *data)
 	size_t max = sizeof(data->buf) - LWS_PRE;
 	ssize_t res;
 	unsigned char *buffer = (unsigned char *) data->buf;
+	receiver::sptr rec;
 
-	res = read(data->fd, data->buf + LWS_PRE, max);
+	rec = receiver_map.find(stream_name(data->url));
+	if (rec != nullptr && rec->is_remote()) {
+		// The pages come from a worker's ring, the fd only wakes us up
+		res = rec->read_audio(data->buf + LWS_PRE, max);
+		if (res == 0)
+			return 0;
+	} else {
+		res = read(data->fd, data->buf + LWS_PRE, max);
+	}
 	if (res <= 0) {
 		if (errno == EAGAIN) {
 			return 0;
@@ -221,7 +534,18 @@ int send_audio(struct lws *wsi, struct http_user_data *data)
 		cerr << "lws_write() failed." << endl;
 		return -1;
 	}
-	lws_set_timeout(wsi, PENDING_TIMEOUT_HTTP_CONTENT, 5);
+	if (rec != nullptr)
+		account_bytes_sent(rec->get_stats().get(), res);
+	// A squelch gated stream pauses while there's nothing to hear
+	if (rec != nullptr
+			&& quality_tier_params(rec->get_quality_tier()).squelch)
+		lws_set_timeout(wsi, NO_PENDING_TIMEOUT, 0);
+	else
+		lws_set_timeout(wsi, PENDING_TIMEOUT_HTTP_CONTENT, 5);
+	// The pipe is edge-triggered, there may be more data we won't be
+	// woken up for
+	if ((size_t) res == max)
+		lws_callback_on_writable(wsi);
 	return 0;
 }
 
@@ -235,21 +559,28 @@ int http_cb(struct lws *wsi, enum lws_callback_reasons reason,
 	case LWS_CALLBACK_HTTP:
 		return init_http_session(wsi, user, in, len);
 	case LWS_CALLBACK_CLOSED_HTTP:
-		end_http_session(data);
+		end_http_session(wsi, data);
 		break;
 	case LWS_CALLBACK_HTTP_FILE_COMPLETION:
 		goto try_to_reuse;
 	case LWS_CALLBACK_HTTP_WRITEABLE:
+		if (data->body) {
+			if (send_body(wsi, data))
+				return -1;
+			if (data->body)
+				break;
+			goto try_to_reuse;
+		}
 		if (data->fd < 0)
 			goto try_to_reuse;
 		return send_audio(wsi, data);
 	case LWS_CALLBACK_ADD_POLL_FD:
-		return add_pollfd(pollargs->fd, pollargs->events);
+		return add_pollfd(wsi, pollargs->fd, pollargs->events);
 	case LWS_CALLBACK_DEL_POLL_FD:
-		delete_pollfd(pollargs->fd);
+		delete_pollfd(wsi, pollargs->fd);
 		break;
 	case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
-		pollfds[fd_lookup[pollargs->fd]].events = pollargs->events;
+		change_pollfd(wsi, pollargs->fd, pollargs->events);
 		break;
 	default:
 		break;
@@ -22,6 +22,7 @@
 #define HTTP_H
 
 #include <config.h>
+#include "asset_cache.h"
 #include <libwebsockets.h>
 #include <string>
 
@@ -31,11 +32,17 @@
 struct http_user_data {
 	int fd;
 	char url[MAX_URL_LEN + 1];
+	// Response body, either generated for the request (e.g. /metrics)
+	// and owned by the session, or a cached static file
+	const char *body;
+	size_t body_len;
+	size_t body_pos;
+	// Keeps the cached file alive while it's being sent
+	asset_sptr *asset;
 	char buf[LWS_PRE + HTTP_MAX_PAYLOAD];
 };
 
 int http_cb(struct lws *wsi, enum lws_callback_reasons reason,
 		void *user, void *in, size_t len);
-int add_pollfd(int fd, short events);
 
 #endif
@@ -0,0 +1,689 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "iq_record.h"
+#include "globals.h"
+#include "json_writer.h"
+#include "remote.h"
+#include "source_state.h"
+#include "utils.h"
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <gnuradio/io_signature.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+// A multiple of the sizes of all sample formats and of IQ_ALIGN
+#define IQ_BUF_SIZE (4 * 1024 * 1024)
+// Alignment of the buffers and writes for O_DIRECT
+#define IQ_ALIGN 4096
+
+struct iq_record_config iq_record_config = { "", 64, true };
+
+static const char *format_names[IQ_FORMATS] = { "cf32_le", "ci16_le", "cu8" };
+static const size_t format_sizes[IQ_FORMATS] = { 8, 4, 2 };
+
+struct iq_buffer {
+	char *data;
+	size_t len;
+	uint64_t first_sample;
+	// Wall clock time of the first sample
+	uint64_t time_ns;
+};
+
+/*
+ * Shared by the recorder block, the writer thread and the service thread,
+ * which hands over the meta file to write.
+ */
+struct iq_writer {
+	size_t source_ix;
+	// Path without the extension
+	string path;
+	int fd;
+	int index_fd;
+	bool direct;
+	mutex lock;
+	condition_variable cond;
+	deque<struct iq_buffer> queued;
+	vector<char *> free_bufs;
+	vector<char *> all_bufs;
+	// The latest content of the meta file, if it's not written yet
+	string meta;
+	bool meta_pending;
+	bool done;
+	bool failed;
+	atomic<uint64_t> bytes_written{0};
+	atomic<uint64_t> dropped{0};
+	// Samples seen by the block, including the dropped ones
+	atomic<uint64_t> samples{0};
+};
+
+class iq_recorder : virtual public gr::sync_block {
+public:
+	typedef boost::shared_ptr<iq_recorder> sptr;
+	static sptr make(boost::shared_ptr<struct iq_writer> w,
+			enum iq_format format);
+	int work(int noutput_items, gr_vector_const_void_star &input_items,
+			gr_vector_void_star &output_items);
+	/** Queue the partly filled buffer. Once the block doesn't run. */
+	void flush();
+private:
+	iq_recorder(boost::shared_ptr<struct iq_writer> w,
+			enum iq_format format);
+	boost::shared_ptr<struct iq_writer> w;
+	enum iq_format format;
+	size_t sample_size;
+	// data is nullptr while there's no buffer
+	struct iq_buffer cur;
+	uint64_t samples;
+	bool take_buffer();
+	void queue_buffer();
+	void convert(const gr_complex *in, char *out, size_t n);
+};
+
+struct capture {
+	uint64_t sample_start;
+	int64_t frequency;
+	bool auto_gain;
+	double gain;
+	string datetime;
+};
+
+struct recording {
+	struct iq_record_info info;
+	double rate;
+	iq_recorder::sptr block;
+	boost::shared_ptr<struct iq_writer> w;
+	vector<struct capture> captures;
+};
+
+static mutex records_mutex;
+static map<size_t, unique_ptr<struct recording>> recordings;
+static atomic<size_t> count_recordings{0};
+// Of the finished recordings
+static atomic<uint64_t> bytes_done{0};
+static atomic<uint64_t> dropped_done{0};
+// Writer threads still writing out stopped recordings
+static mutex finishing_mutex;
+static condition_variable finishing_cond;
+static int finishing;
+
+static uint64_t realtime_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static string utc_time(const char *format)
+{
+	time_t now = time(nullptr);
+	struct tm tm;
+	char buf[64];
+
+	gmtime_r(&now, &tm);
+	strftime(buf, sizeof(buf), format, &tm);
+	return buf;
+}
+
+bool iq_format_parse(const char *str, enum iq_format *format)
+{
+	for (int i = 0; i < IQ_FORMATS; ++i) {
+		if (!strcmp(str, format_names[i])) {
+			*format = (enum iq_format) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *iq_format_name(enum iq_format format)
+{
+	return format_names[format];
+}
+
+iq_recorder::sptr iq_recorder::make(boost::shared_ptr<struct iq_writer> w,
+		enum iq_format format)
+{
+	return boost::shared_ptr<iq_recorder>(new iq_recorder(w, format));
+}
+
+iq_recorder::iq_recorder(boost::shared_ptr<struct iq_writer> w,
+		enum iq_format format)
+	: gr::sync_block("iq_recorder",
+		gr::io_signature::make(1, 1, sizeof(gr_complex)),
+		gr::io_signature::make(0, 0, 0)),
+	w(w), format(format), sample_size(format_sizes[format]),
+	samples(0)
+{
+	cur.data = nullptr;
+}
+
+/* Never waits for the writer, which only holds the lock briefly */
+bool iq_recorder::take_buffer()
+{
+	lock_guard<mutex> lock(w->lock);
+
+	if (w->free_bufs.empty())
+		return false;
+	cur.data = w->free_bufs.back();
+	w->free_bufs.pop_back();
+	cur.len = 0;
+	cur.first_sample = samples;
+	cur.time_ns = realtime_ns();
+	return true;
+}
+
+void iq_recorder::queue_buffer()
+{
+	{
+		lock_guard<mutex> lock(w->lock);
+		w->queued.push_back(cur);
+	}
+	w->cond.notify_one();
+	cur.data = nullptr;
+}
+
+void iq_recorder::convert(const gr_complex *in, char *out, size_t n)
+{
+	int16_t *s16 = (int16_t *) out;
+	uint8_t *u8 = (uint8_t *) out;
+	float v;
+
+	switch (format) {
+	case IQ_CF32:
+		memcpy(out, in, n * sizeof(gr_complex));
+		break;
+	case IQ_CI16:
+		for (size_t i = 0; i < n; ++i) {
+			v = max(-1.0f, min(1.0f, in[i].real()));
+			s16[2 * i] = v * 32767;
+			v = max(-1.0f, min(1.0f, in[i].imag()));
+			s16[2 * i + 1] = v * 32767;
+		}
+		break;
+	default:
+		for (size_t i = 0; i < n; ++i) {
+			v = max(-1.0f, min(1.0f, in[i].real()));
+			u8[2 * i] = v * 127.5f + 127.5f;
+			v = max(-1.0f, min(1.0f, in[i].imag()));
+			u8[2 * i + 1] = v * 127.5f + 127.5f;
+		}
+		break;
+	}
+}
+
+int iq_recorder::work(int noutput_items,
+		gr_vector_const_void_star &input_items,
+		gr_vector_void_star &output_items)
+{
+	const gr_complex *in = (const gr_complex *) input_items[0];
+	size_t done = 0, n;
+
+	(void) output_items;
+
+	while (done < (size_t) noutput_items) {
+		if (!cur.data && !take_buffer()) {
+			// The disk doesn't keep up
+			n = noutput_items - done;
+			w->dropped.fetch_add(n, memory_order_relaxed);
+			samples += n;
+			break;
+		}
+		n = min(noutput_items - done,
+				(IQ_BUF_SIZE - cur.len) / sample_size);
+		convert(in + done, cur.data + cur.len, n);
+		cur.len += n * sample_size;
+		done += n;
+		samples += n;
+		if (cur.len == IQ_BUF_SIZE)
+			queue_buffer();
+	}
+	w->samples.store(samples, memory_order_relaxed);
+	return noutput_items;
+}
+
+void iq_recorder::flush()
+{
+	if (!cur.data)
+		return;
+	if (cur.len) {
+		queue_buffer();
+	} else {
+		lock_guard<mutex> lock(w->lock);
+		w->free_bufs.push_back(cur.data);
+		cur.data = nullptr;
+	}
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void free_writer(struct iq_writer *w)
+{
+	for (char *buf : w->all_bufs)
+		free(buf);
+	if (w->fd >= 0)
+		close(w->fd);
+	if (w->index_fd >= 0)
+		close(w->index_fd);
+	delete w;
+}
+
+static boost::shared_ptr<struct iq_writer> make_writer(size_t source_ix,
+		const string &path)
+{
+	boost::shared_ptr<struct iq_writer> w(new struct iq_writer, free_writer);
+	int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+	size_t count;
+	void *buf;
+
+	w->source_ix = source_ix;
+	w->path = path;
+	w->index_fd = -1;
+	w->meta_pending = false;
+	w->direct = iq_record_config.direct_io;
+	w->done = false;
+	w->failed = false;
+	w->fd = open((path + ".sigmf-data").c_str(),
+			flags | (w->direct ? O_DIRECT : 0), 0644);
+	// Not every filesystem supports O_DIRECT
+	if (w->fd < 0 && w->direct && errno == EINVAL) {
+		w->direct = false;
+		w->fd = open((path + ".sigmf-data").c_str(), flags, 0644);
+	}
+	if (w->fd < 0) {
+		perror(path.c_str());
+		return nullptr;
+	}
+	w->index_fd = open((path + ".idx").c_str(), flags | O_APPEND, 0644);
+	if (w->index_fd < 0) {
+		perror(path.c_str());
+		goto remove_files;
+	}
+	count = max(2, iq_record_config.buffer_mb / (IQ_BUF_SIZE >> 20));
+	for (size_t i = 0; i < count; ++i) {
+		if (posix_memalign(&buf, IQ_ALIGN, IQ_BUF_SIZE)) {
+			cerr << "posix_memalign() failed" << endl;
+			goto remove_files;
+		}
+		w->all_bufs.push_back((char *) buf);
+		w->free_bufs.push_back((char *) buf);
+	}
+	return w;
+remove_files:
+	// They're opened with O_EXCL, a retry within the second would fail
+	unlink((path + ".sigmf-data").c_str());
+	if (w->index_fd >= 0)
+		unlink((path + ".idx").c_str());
+	return nullptr;
+}
+
+static void write_buffer(struct iq_writer *w, const struct iq_buffer &b)
+{
+	char line[64];
+	int flags, n;
+
+	if (w->failed)
+		return;
+	// Only the last buffer may be shorter, O_DIRECT needs whole blocks
+	if (w->direct && b.len % IQ_ALIGN) {
+		flags = fcntl(w->fd, F_GETFL);
+		fcntl(w->fd, F_SETFL, flags & ~O_DIRECT);
+		w->direct = false;
+	}
+	if (write_all(w->fd, b.data, b.len) || fdatasync(w->fd)) {
+		perror("IQ recording");
+		w->failed = true;
+		return;
+	}
+	w->bytes_written.fetch_add(b.len, memory_order_relaxed);
+	n = snprintf(line, sizeof(line), "%llu %llu\n",
+			(unsigned long long) b.first_sample,
+			(unsigned long long) b.time_ns);
+	if (write_all(w->index_fd, line, n))
+		perror("IQ recording index");
+}
+
+static struct capture current_capture(size_t ix, uint64_t sample_start)
+{
+	source_state_sptr state = get_source_state(ix);
+	struct capture c;
+
+	c.sample_start = sample_start;
+	c.frequency = (int64_t) state->hw_freq
+		- sources_info[ix].freq_converter_offset;
+	c.auto_gain = state->auto_gain;
+	c.gain = state->gain;
+	c.datetime = utc_time("%Y-%m-%dT%H:%M:%SZ");
+	return c;
+}
+
+static void meta_json(struct json_writer *jw, const struct recording &r)
+{
+	const source_info_t &info = sources_info[r.info.source_ix];
+
+	jw_begin_object(jw);
+	jw_key(jw, "global");
+	jw_begin_object(jw);
+	jw_key(jw, "core:datatype");
+	jw_string(jw, iq_format_name(r.info.format));
+	jw_key(jw, "core:sample_rate");
+	jw_double(jw, r.rate);
+	jw_key(jw, "core:version");
+	jw_string(jw, "1.0.0");
+	jw_key(jw, "core:recorder");
+	jw_string(jw, PACKAGE_STRING);
+	jw_key(jw, "core:description");
+	jw_string(jw, info.label.c_str());
+	jw_key(jw, "grwebsdr:osmosdr_arg");
+	jw_string(jw, info.params.osmosdr_arg.c_str());
+	jw_end_object(jw);
+	jw_key(jw, "captures");
+	jw_begin_array(jw);
+	for (const struct capture &c : r.captures) {
+		jw_begin_object(jw);
+		jw_key(jw, "core:sample_start");
+		jw_int(jw, c.sample_start);
+		jw_key(jw, "core:frequency");
+		jw_int(jw, c.frequency);
+		jw_key(jw, "core:datetime");
+		jw_string(jw, c.datetime.c_str());
+		jw_key(jw, "grwebsdr:auto_gain");
+		jw_bool(jw, c.auto_gain);
+		jw_key(jw, "grwebsdr:gain");
+		jw_double(jw, c.gain);
+		jw_end_object(jw);
+	}
+	jw_end_array(jw);
+	jw_key(jw, "annotations");
+	jw_begin_array(jw);
+	jw_end_array(jw);
+	jw_end_object(jw);
+}
+
+/* Give the writer thread the current meta file, it may replace one */
+static void post_meta(const struct recording &r)
+{
+	struct json_writer jw;
+	vector<char> buf(4096);
+
+	jw_init(&jw, buf.data(), buf.size());
+	meta_json(&jw, r);
+	if (jw_overflow(&jw)) {
+		buf.resize(jw.len);
+		jw_init(&jw, buf.data(), buf.size());
+		meta_json(&jw, r);
+	}
+	{
+		lock_guard<mutex> lock(r.w->lock);
+
+		r.w->meta.assign(buf.data(), jw.len);
+		r.w->meta_pending = true;
+	}
+	r.w->cond.notify_one();
+}
+
+/* Replace the meta file, so it's complete even after a crash */
+static void write_meta(const string &path, const string &meta)
+{
+	string tmp = path + ".sigmf-meta.tmp";
+	int fd;
+
+	fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0644);
+	if (fd < 0) {
+		perror(tmp.c_str());
+		return;
+	}
+	if (write_all(fd, meta.data(), meta.size()) || fsync(fd)) {
+		perror(tmp.c_str());
+		close(fd);
+		return;
+	}
+	close(fd);
+	if (rename(tmp.c_str(), (path + ".sigmf-meta").c_str()))
+		perror(tmp.c_str());
+}
+
+/*
+ * Writes the queued buffers and the meta file until the recording is
+ * stopped, then finishes it. Holds on to the writer until then.
+ */
+static void write_loop(boost::shared_ptr<struct iq_writer> w)
+{
+	unique_lock<mutex> lock(w->lock);
+	struct iq_buffer b;
+	string meta;
+
+	while (1) {
+		w->cond.wait(lock, [&w] { return !w->queued.empty()
+				|| w->meta_pending || w->done; });
+		if (w->meta_pending) {
+			meta.swap(w->meta);
+			w->meta_pending = false;
+			lock.unlock();
+			write_meta(w->path, meta);
+			lock.lock();
+			continue;
+		}
+		if (w->queued.empty())
+			break;
+		b = w->queued.front();
+		w->queued.pop_front();
+		lock.unlock();
+		write_buffer(w.get(), b);
+		lock.lock();
+		w->free_bufs.push_back(b.data);
+	}
+	lock.unlock();
+	bytes_done.fetch_add(w->bytes_written.load());
+	dropped_done.fetch_add(w->dropped.load());
+	cout << "Recorded " << (w->bytes_written.load() >> 20)
+		<< " MiB of source " << w->source_ix << ", "
+		<< w->dropped.load() << " samples dropped." << endl;
+	{
+		lock_guard<mutex> guard(finishing_mutex);
+		--finishing;
+	}
+	finishing_cond.notify_all();
+}
+
+int iq_record_start(size_t source_ix, enum iq_format format)
+{
+	unique_ptr<struct recording> r;
+	timestamp_tagger::sptr tagger;
+	string path;
+
+	if (iq_record_config.directory.empty() || remote_ops != nullptr
+			|| source_ix >= osmosdr_sources.size())
+		return -1;
+	if (iq_record_active(source_ix))
+		return -1;
+	r.reset(new struct recording);
+	r->info.source_ix = source_ix;
+	r->info.name = "source" + to_string(source_ix) + "-"
+		+ utc_time("%Y%m%dT%H%M%SZ");
+	r->info.format = format;
+	r->info.bytes_written = 0;
+	r->info.dropped = 0;
+	path = iq_record_config.directory + "/" + r->info.name;
+	r->rate = osmosdr_sources[source_ix]->get_sample_rate();
+	r->w = make_writer(source_ix, path);
+	if (r->w == nullptr)
+		return -1;
+	{
+		lock_guard<mutex> lock(finishing_mutex);
+		++finishing;
+	}
+	thread(write_loop, r->w).detach();
+	r->captures.push_back(current_capture(source_ix, 0));
+	post_meta(*r);
+	r->block = iq_recorder::make(r->w, format);
+
+	tagger = sources_info[source_ix].tagger;
+	topbl->lock();
+	if (!source_in_use(source_ix))
+		topbl->connect(osmosdr_sources[source_ix], 0, tagger, 0);
+	topbl->connect(tagger, 0, r->block, 0);
+	{
+		lock_guard<mutex> lock(records_mutex);
+		recordings[source_ix] = move(r);
+		count_recordings.fetch_add(1);
+	}
+	topbl->unlock();
+	if (flowgraph_users() == 1)
+		topbl->start();
+	cout << "Recording source " << source_ix << " as "
+		<< iq_format_name(format) << "." << endl;
+	return 0;
+}
+
+void iq_record_stop(size_t source_ix)
+{
+	unique_ptr<struct recording> r;
+	timestamp_tagger::sptr tagger = sources_info[source_ix].tagger;
+
+	if (!iq_record_active(source_ix))
+		return;
+	if (flowgraph_users() == 1) {
+		topbl->stop();
+		topbl->wait();
+	}
+	topbl->lock();
+	{
+		lock_guard<mutex> lock(records_mutex);
+		auto it = recordings.find(source_ix);
+
+		r = move(it->second);
+		recordings.erase(it);
+		count_recordings.fetch_sub(1);
+	}
+	topbl->disconnect(tagger, 0, r->block, 0);
+	if (!source_in_use(source_ix))
+		topbl->disconnect(osmosdr_sources[source_ix], 0, tagger, 0);
+	topbl->unlock();
+
+	// The writer thread finishes the files on its own
+	r->block->flush();
+	post_meta(*r);
+	{
+		lock_guard<mutex> lock(r->w->lock);
+		r->w->done = true;
+	}
+	r->w->cond.notify_one();
+}
+
+void iq_record_stop_all()
+{
+	unique_lock<mutex> lock(finishing_mutex, defer_lock);
+
+	for (size_t i = 0; i < sources_info.size(); ++i)
+		iq_record_stop(i);
+	lock.lock();
+	finishing_cond.wait(lock, [] { return finishing == 0; });
+}
+
+void iq_record_retuned(size_t source_ix)
+{
+	lock_guard<mutex> lock(records_mutex);
+	auto it = recordings.find(source_ix);
+
+	if (it == recordings.end())
+		return;
+	struct recording &r = *it->second;
+
+	r.captures.push_back(current_capture(source_ix,
+				r.w->samples.load()));
+	post_meta(r);
+}
+
+bool iq_record_active(size_t source_ix)
+{
+	lock_guard<mutex> lock(records_mutex);
+
+	return recordings.count(source_ix) > 0;
+}
+
+size_t iq_recordings()
+{
+	return count_recordings.load();
+}
+
+vector<struct iq_record_info> iq_record_list()
+{
+	lock_guard<mutex> lock(records_mutex);
+	vector<struct iq_record_info> ret;
+
+	for (auto &pair : recordings) {
+		struct iq_record_info info = pair.second->info;
+
+		info.bytes_written = pair.second->w->bytes_written.load();
+		info.dropped = pair.second->w->dropped.load();
+		ret.push_back(info);
+	}
+	return ret;
+}
+
+uint64_t iq_record_bytes_total()
+{
+	uint64_t ret = bytes_done.load();
+
+	for (const struct iq_record_info &info : iq_record_list())
+		ret += info.bytes_written;
+	return ret;
+}
+
+uint64_t iq_record_dropped_total()
+{
+	uint64_t ret = dropped_done.load();
+
+	for (const struct iq_record_info &info : iq_record_list())
+		ret += info.dropped;
+	return ret;
+}
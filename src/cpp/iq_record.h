@@ -0,0 +1,100 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IQ_RECORD_H
+#define IQ_RECORD_H
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Recording of the raw IQ of a source to disk. An iq_recorder block behind
+ * the source's timestamp tagger converts the samples into large aligned
+ * buffers, which a writer thread writes with O_DIRECT. The block never
+ * waits for the disk: if all buffers are queued, samples are dropped and
+ * counted.
+ *
+ * A recording is stored in SigMF format: <name>.sigmf-data holds the
+ * samples and <name>.sigmf-meta the rate, datatype and a capture per
+ * retuning with the center frequency, gain and time. The meta file is
+ * replaced atomically whenever it changes. <name>.idx gets a line
+ * "<first sample> <unix time in ns>" after each buffer is on disk, so after
+ * a crash the data up to its last line is known to be complete.
+ */
+
+enum iq_format {
+	IQ_CF32,
+	IQ_CI16,
+	IQ_CU8,
+	IQ_FORMATS
+};
+
+struct iq_record_config {
+	// Where the recordings go, empty disables recording
+	std::string directory;
+	// Memory for the queued buffers of each recording
+	int buffer_mb;
+	bool direct_io;
+};
+
+extern struct iq_record_config iq_record_config;
+
+struct iq_record_info {
+	size_t source_ix;
+	// Without the extension
+	std::string name;
+	enum iq_format format;
+	uint64_t bytes_written;
+	uint64_t dropped;
+};
+
+/** Parse a SigMF datatype name, returns false if unknown */
+bool iq_format_parse(const char *str, enum iq_format *format);
+const char *iq_format_name(enum iq_format format);
+/**
+ * Start recording the source. Returns -1 if recording is disabled, the
+ * source is already recorded or isn't in this process, or the files can't
+ * be created. With flowgraph_mutex held.
+ */
+int iq_record_start(size_t source_ix, enum iq_format format);
+/**
+ * Stop recording the source. The writer thread writes out the queued
+ * buffers and the meta file afterwards. With flowgraph_mutex held.
+ */
+void iq_record_stop(size_t source_ix);
+/** Stop all recordings and wait until their files are complete */
+void iq_record_stop_all();
+/**
+ * Add a capture to the meta file, after the source was retuned. The file
+ * is written by the writer thread.
+ */
+void iq_record_retuned(size_t source_ix);
+/** Whether the source is recorded. Thread safe. */
+bool iq_record_active(size_t source_ix);
+/** Number of sources being recorded. Thread safe. */
+size_t iq_recordings();
+std::vector<struct iq_record_info> iq_record_list();
+uint64_t iq_record_bytes_total();
+uint64_t iq_record_dropped_total();
+
+#endif
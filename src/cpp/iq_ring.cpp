@@ -0,0 +1,142 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "iq_ring.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+
+using namespace std;
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+int iq_ring_init(struct iq_ring *r, size_t samples, size_t guard,
+		bool hugepages)
+{
+	size_t len = (samples + guard) * sizeof(gr_complex);
+	void *mem = MAP_FAILED;
+
+	if (hugepages) {
+		len = (len + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+		mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE
+				| MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+				-1, 0);
+		if (mem == MAP_FAILED)
+			cerr << "No hugepages for the IQ ring, using normal "
+				"pages." << endl;
+	}
+	r->hugepages = mem != MAP_FAILED;
+	if (mem == MAP_FAILED) {
+		mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE
+				| MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (mem == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		// Transparent hugepages at least, if enabled
+		if (hugepages)
+			madvise(mem, len, MADV_HUGEPAGE);
+	}
+	r->buf = (gr_complex *) mem;
+	r->mapped_len = len;
+	r->capacity = len / sizeof(gr_complex);
+	r->guard = guard;
+	r->written = 0;
+	r->waiters = 0;
+	return 0;
+}
+
+void iq_ring_free(struct iq_ring *r)
+{
+	if (r->buf)
+		munmap(r->buf, r->mapped_len);
+	r->buf = nullptr;
+}
+
+void iq_ring_write(struct iq_ring *r, const gr_complex *in, size_t n)
+{
+	uint64_t pos = r->written.load(memory_order_relaxed);
+	size_t off, chunk;
+
+	// Only the newest samples of a huge write survive anyway
+	if (n > r->capacity) {
+		in += n - r->capacity;
+		pos += n - r->capacity;
+		n = r->capacity;
+	}
+	while (n) {
+		off = pos % r->capacity;
+		chunk = min(n, r->capacity - off);
+		memcpy(r->buf + off, in, chunk * sizeof(gr_complex));
+		in += chunk;
+		pos += chunk;
+		n -= chunk;
+	}
+	r->written.store(pos);
+	// A reader going to sleep has incremented waiters before it looks
+	// at written, so either it sees the samples or it's notified
+	if (r->waiters.load()) {
+		lock_guard<mutex> lock(r->mutex);
+		r->cond.notify_all();
+	}
+}
+
+uint64_t iq_ring_oldest(const struct iq_ring *r)
+{
+	uint64_t written = r->written.load();
+	size_t keep = r->capacity - r->guard;
+
+	return written > keep ? written - keep : 0;
+}
+
+bool iq_ring_read(const struct iq_ring *r, uint64_t pos, gr_complex *out,
+		size_t n)
+{
+	uint64_t start = pos;
+	size_t off, chunk;
+
+	while (n) {
+		off = pos % r->capacity;
+		chunk = min(n, r->capacity - off);
+		memcpy(out, r->buf + off, chunk * sizeof(gr_complex));
+		out += chunk;
+		pos += chunk;
+		n -= chunk;
+	}
+	// The copy happens before the producer's position is looked at again
+	atomic_thread_fence(memory_order_acquire);
+	return start >= iq_ring_oldest(r);
+}
+
+bool iq_ring_wait(struct iq_ring *r, uint64_t pos, int timeout_ms)
+{
+	unique_lock<mutex> lock(r->mutex);
+	bool ret;
+
+	r->waiters.fetch_add(1);
+	ret = r->cond.wait_for(lock, chrono::milliseconds(timeout_ms),
+			[r, pos] { return r->written.load() > pos; });
+	r->waiters.fetch_sub(1);
+	return ret;
+}
@@ -0,0 +1,81 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IQ_RING_H
+#define IQ_RING_H
+
+#include <config.h>
+#include <gnuradio/gr_complex.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/*
+ * Single producer, multiple reader ring of the recent IQ samples of a
+ * source, see timeshift.h. The producer never waits for the readers. A
+ * reader keeps its own position in the stream and only copies samples that
+ * are at least a guard interval away from being overwritten.
+ */
+
+struct iq_ring {
+	gr_complex *buf;
+	// Samples in buf
+	size_t capacity;
+	// Samples a reader stays away from the producer's next write
+	size_t guard;
+	size_t mapped_len;
+	bool hugepages;
+	// Samples written since the start, only grows
+	std::atomic<uint64_t> written;
+	// Readers sleeping in iq_ring_wait()
+	std::atomic<int> waiters;
+	std::mutex mutex;
+	std::condition_variable cond;
+};
+
+/**
+ * Allocate room for the given number of samples plus the guard. With
+ * hugepages, falls back to normal pages if none are reserved. The memory
+ * is faulted in up front so the producer never takes a page fault.
+ */
+int iq_ring_init(struct iq_ring *r, size_t samples, size_t guard,
+		bool hugepages);
+void iq_ring_free(struct iq_ring *r);
+/** Append the samples and wake up the waiting readers */
+void iq_ring_write(struct iq_ring *r, const gr_complex *in, size_t n);
+/** Position of the oldest sample a reader may still copy */
+uint64_t iq_ring_oldest(const struct iq_ring *r);
+/**
+ * Copy n samples from pos on, which must be at least iq_ring_oldest().
+ * Returns false if the producer got too close to them meanwhile, e.g. when
+ * the reader was preempted for longer than the guard interval, and the
+ * copy may be torn.
+ */
+bool iq_ring_read(const struct iq_ring *r, uint64_t pos, gr_complex *out,
+		size_t n);
+/**
+ * Wait until samples after pos are written or the timeout expires.
+ * Returns false on timeout.
+ */
+bool iq_ring_wait(struct iq_ring *r, uint64_t pos, int timeout_ms);
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "json_writer.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static void put(struct json_writer *w, const char *s, size_t n)
+{
+	if (w->len < w->size) {
+		size_t avail = w->size - w->len;
+		memcpy(w->buf + w->len, s, n < avail ? n : avail);
+	}
+	w->len += n;
+}
+
+static void put_char(struct json_writer *w, char c)
+{
+	if (w->len < w->size)
+		w->buf[w->len] = c;
+	++w->len;
+}
+
+/* Separate the new member or element from the previous one */
+static void begin_value(struct json_writer *w)
+{
+	uint32_t bit = 1U << w->depth;
+
+	if (w->after_key) {
+		w->after_key = false;
+		return;
+	}
+	if (w->nonempty & bit)
+		put_char(w, ',');
+	w->nonempty |= bit;
+}
+
+static void begin_container(struct json_writer *w, char c)
+{
+	begin_value(w);
+	put_char(w, c);
+	if (w->depth < JSON_WRITER_MAX_DEPTH - 1)
+		++w->depth;
+	w->nonempty &= ~(1U << w->depth);
+}
+
+static void end_container(struct json_writer *w, char c)
+{
+	if (w->depth > 0)
+		--w->depth;
+	put_char(w, c);
+}
+
+void jw_init(struct json_writer *w, char *buf, size_t size)
+{
+	w->buf = buf;
+	w->size = size;
+	w->len = 0;
+	w->depth = 0;
+	w->nonempty = 0;
+	w->after_key = false;
+}
+
+bool jw_overflow(const struct json_writer *w)
+{
+	return w->len > w->size;
+}
+
+void jw_begin_object(struct json_writer *w)
+{
+	begin_container(w, '{');
+}
+
+void jw_end_object(struct json_writer *w)
+{
+	end_container(w, '}');
+}
+
+void jw_begin_array(struct json_writer *w)
+{
+	begin_container(w, '[');
+}
+
+void jw_end_array(struct json_writer *w)
+{
+	end_container(w, ']');
+}
+
+static void put_string(struct json_writer *w, const char *s)
+{
+	char esc[8];
+
+	put_char(w, '"');
+	for (; *s; ++s) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\') {
+			put_char(w, '\\');
+			put_char(w, c);
+		} else if (c < 0x20) {
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			put(w, esc, 6);
+		} else {
+			put_char(w, c);
+		}
+	}
+	put_char(w, '"');
+}
+
+void jw_key(struct json_writer *w, const char *key)
+{
+	begin_value(w);
+	put_string(w, key);
+	put_char(w, ':');
+	w->after_key = true;
+}
+
+void jw_string(struct json_writer *w, const char *val)
+{
+	begin_value(w);
+	put_string(w, val);
+}
+
+void jw_int(struct json_writer *w, int64_t val)
+{
+	char num[24];
+	int n;
+
+	begin_value(w);
+	n = snprintf(num, sizeof(num), "%lld", (long long) val);
+	put(w, num, n);
+}
+
+void jw_double(struct json_writer *w, double val)
+{
+	char num[32];
+	int n;
+
+	begin_value(w);
+	// JSON has no NaN or infinity
+	if (!std::isfinite(val))
+		val = 0.0;
+	n = snprintf(num, sizeof(num), "%.17g", val);
+	// Keep it a floating point number for the other side
+	if (!strpbrk(num, ".eE"))
+		n += snprintf(num + n, sizeof(num) - n, ".0");
+	put(w, num, n);
+}
+
+void jw_bool(struct json_writer *w, bool val)
+{
+	begin_value(w);
+	if (val)
+		put(w, "true", 4);
+	else
+		put(w, "false", 5);
+}
+
+void jw_null(struct json_writer *w)
+{
+	begin_value(w);
+	put(w, "null", 4);
+}
+
+void jw_members(struct json_writer *w, const char *members, size_t len)
+{
+	if (!len)
+		return;
+	begin_value(w);
+	put(w, members, len);
+}
@@ -0,0 +1,63 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Minimal JSON writer working on a caller supplied buffer, used for the
+ * messages of the WebSocket protocol. It never allocates. Output that
+ * doesn't fit is cut off, but len keeps counting, so the caller can retry
+ * with a buffer of len bytes.
+ */
+
+#define JSON_WRITER_MAX_DEPTH 32
+
+struct json_writer {
+	char *buf;
+	size_t size;
+	size_t len;
+	int depth;
+	// Bit n is set if the container at depth n has members already
+	uint32_t nonempty;
+	bool after_key;
+};
+
+void jw_init(struct json_writer *w, char *buf, size_t size);
+/** true if the output didn't fit into the buffer */
+bool jw_overflow(const struct json_writer *w);
+void jw_begin_object(struct json_writer *w);
+void jw_end_object(struct json_writer *w);
+void jw_begin_array(struct json_writer *w);
+void jw_end_array(struct json_writer *w);
+void jw_key(struct json_writer *w, const char *key);
+void jw_string(struct json_writer *w, const char *val);
+void jw_int(struct json_writer *w, int64_t val);
+void jw_double(struct json_writer *w, double val);
+void jw_bool(struct json_writer *w, bool val);
+void jw_null(struct json_writer *w);
+/** Pre-serialized members of an object, e.g. "a":1,"b":2 */
+void jw_members(struct json_writer *w, const char *members, size_t len);
+
+#endif
@@ -19,11 +19,31 @@
  */
 
 #include <config.h>
+#include "admission.h"
+#include "asset_cache.h"
 #include "auth.h"
+#include "broadcast.h"
+#include "edge.h"
+#include "event_loop.h"
+#include "headless.h"
+#include "activity_index.h"
+#include "audio_record.h"
+#include "iq_record.h"
+#include "scanner.h"
 #include "receiver.h"
+#include "receiver_pool.h"
+#include "relay.h"
+#include "segmented.h"
+#include "source_state.h"
 #include "globals.h"
+#include "overrun.h"
+#include "placement.h"
+#include "quality.h"
+#include "sources.h"
+#include "timeshift.h"
 #include "utils.h"
 #include "websocket.h"
+#include "worker.h"
 #include "http.h"
 #include "config_load.h"
 #include <iostream>
@@ -31,6 +51,8 @@
 #include <unordered_map>
 #include <cstdlib>
 #include <osmosdr/device.h>
+#include <boost/make_shared.hpp>
+#include <gnuradio/prefs.h>
 #include <vector>
 #include <stdexcept>
 #include <termios.h>
@@ -40,16 +62,13 @@ using namespace std;
 
 vector<osmosdr::source::sptr> osmosdr_sources;
 vector<source_info_t> sources_info;
-unordered_map<string, receiver::sptr> receiver_map;
+sharded_receiver_map receiver_map;
 
 top_block_sptr topbl;
 
 struct lws_context *ws_context;
-struct lws_pollfd *pollfds;
-int *fd_lookup;
-int count_pollfds;
-int max_fds;
-struct lws **fd2wsi;
+atomic<int> count_pollfds;
+mutex flowgraph_mutex;
 
 void usage(const char *progname)
 {
@@ -62,6 +81,7 @@ void usage(const char *progname)
 	cout << "         -p <port_number>        Port number for HTTP and WebSocket server" << endl;
 	cout << "         -r <resource_path>      Path to WWW files (default is ../web)" << endl;
 	cout << "         -d <user_database>      Path to user DB file" << endl;
+	cout << "         -W <spec>               Run as a source worker (internal)" << endl;
 }
 
 string get_username()
@@ -156,35 +176,51 @@ const struct lws_protocols protocols[] = {
 };
 
 int run(const char *key_path, const char *cert_path, int port,
-		const char *resource_path)
+		const char *resource_path, const char *config_path)
 {
 	struct lws_context_creation_info info;
-	int n;
-	bool quitting = false;
-	struct lws_http_mount mount, stream_mount;
+	struct lws_http_mount mount, stream_mount, metrics_mount;
 
 	memset(&mount, 0, sizeof(mount));
 	memset(&stream_mount, 0, sizeof(mount));
+	memset(&metrics_mount, 0, sizeof(mount));
 	mount.mount_next = &stream_mount;
 	mount.mountpoint = "/";
 	mount.mountpoint_len = strlen("/");
-	mount.origin = resource_path;
-	mount.def = "index.html";
-	mount.origin_protocol = LWSMPRO_FILE;
+	// The static files are served from memory, see asset_cache.h
+	mount.origin = "http-only";
+	mount.origin_protocol = LWSMPRO_CALLBACK;
 	stream_mount.mountpoint = "/streams";
 	stream_mount.mountpoint_len = strlen("/streams");
 	stream_mount.origin = "http-only";
 	stream_mount.origin_protocol = LWSMPRO_CALLBACK;
-
-	max_fds = getdtablesize();
-	pollfds = (struct lws_pollfd *) malloc(sizeof(*pollfds) * max_fds);
-	fd_lookup = (int *) malloc(sizeof(*fd_lookup) * max_fds);
-	fd2wsi = (struct lws **) calloc(max_fds, sizeof(*fd2wsi));
-	if (!pollfds || !fd_lookup || !fd2wsi) {
-		cerr << "malloc() failed" << endl;
-		return -1;
+	stream_mount.mount_next = &metrics_mount;
+	metrics_mount.mountpoint = "/metrics";
+	metrics_mount.mountpoint_len = strlen("/metrics");
+	metrics_mount.origin = "http-only";
+	metrics_mount.origin_protocol = LWSMPRO_CALLBACK;
+
+#ifdef LWS_MAX_SMP
+	if (service_threads > LWS_MAX_SMP) {
+		cout << "libwebsockets supports only " << LWS_MAX_SMP
+			<< " service threads." << endl;
+		service_threads = LWS_MAX_SMP;
 	}
-	add_pollfd(STDIN_FILENO, POLLIN);
+#endif
+	if (service_threads < 1)
+		service_threads = 1;
+	if (event_loop_init(service_threads) || broadcast_init()
+			|| asset_cache_init(resource_path) || admission_init()
+			|| quality_init() || overrun_hook_stderr()
+			|| workers_init(config_path) || edge_init()
+			|| relay_init() || segmented_init())
+		return -1;
+	scanner_init();
+	// Scans the sources all the time
+	if (activity_index_start())
+		return -1;
+	if (headless_start())
+		return -1;
 
 	memset(&info, 0, sizeof(info));
 	info.port = port;
@@ -193,6 +229,7 @@ int run(const char *key_path, const char *cert_path, int port,
 	info.gid = -1;
 	info.uid = -1;
 	info.max_http_header_pool = 100;
+	info.count_threads = service_threads;
 	info.ssl_cert_filepath = cert_path;
 	info.ssl_private_key_filepath = key_path;
 	info.options |= LWS_SERVER_OPTION_REDIRECT_HTTP_TO_HTTPS;
@@ -205,28 +242,12 @@ int run(const char *key_path, const char *cert_path, int port,
 	}
 	cout << "Starting the server. Press enter to quit." << endl;
 
-	while (!quitting) {
-		n = poll(pollfds, count_pollfds, 50);
-		if (n <= 0)
-			continue;
-		for (n = 0; n < count_pollfds; ++n) {
-			if (!pollfds[n].revents)
-				continue;
-			if (pollfds[n].fd == STDIN_FILENO) {
-				quitting = true;
-				break;
-			}
-			lws_service_fd(ws_context, &pollfds[n]);
-			// If lws didn't service the fd, it might be
-			// a receiver fd
-			if (pollfds[n].revents && fd2wsi[pollfds[n].fd]) {
-				lws_callback_on_writable(fd2wsi[pollfds[n].fd]);
-			}
-		}
-	}
+	event_loop_run();
 
 	cout << "Stopping the server." << endl;
+	workers_stop();
 	lws_context_destroy(ws_context);
+	event_loop_destroy();
 	return 0;
 }
 
@@ -264,8 +285,16 @@ void add_sources_interactive()
 			source->set_sample_rate(sample_rate);
 			source->set_center_freq(freq);
 			osmosdr_sources.push_back(source);
+			info.params.osmosdr_arg = str;
+			info.params.freq_corr = 0.0;
+			info.params.initial_hw_freq = freq;
+			info.params.sample_rate = sample_rate;
+			info.params.auto_gain = true;
+			info.params.gain = 0.0;
 			info.freq_converter_offset = offset;
 			info.label = str;
+			info.timeshift_s = 0;
+			info.stats = boost::make_shared<source_stats>();
 			sources_info.push_back(info);
 		}
 	}
@@ -277,10 +306,11 @@ int main(int argc, char **argv)
 	const char *config_path = nullptr;
 	const char *resource_path = "../web";
 	const char *user_db = nullptr;
+	const char *worker_spec = nullptr;
 	int port = 8080;
 	int c;
 
-	while ((c = getopt(argc, argv, "hc:k:sf:p:r:d:")) != -1) {
+	while ((c = getopt(argc, argv, "hc:k:sf:p:r:d:W:")) != -1) {
 		switch (c) {
 		case 'h':
 			usage(argv[0]);
@@ -311,6 +341,9 @@ int main(int argc, char **argv)
 		case 'd':
 			user_db = optarg;
 			break;
+		case 'W':
+			worker_spec = optarg;
+			break;
 		default:
 			usage(argv[0]);
 			return 1;
@@ -324,11 +357,27 @@ int main(int argc, char **argv)
 			return 1;
 	}
 
-	if (osmosdr_sources.size() == 0) {
+	if (sources_info.size() == 0) {
 		cout << "No tuner selected. Quitting." << endl;
 		return 0;
 	}
 
+	// Needed for the DSP CPU time metrics. The thread clock makes the
+	// counters measure CPU time rather than wall time.
+	prefs::singleton()->set_bool("PerfCounters", "on", true);
+	prefs::singleton()->set_string("PerfCounters", "clock", "thread");
+	if (worker_spec != nullptr) {
+		if (config_path == nullptr) {
+			cerr << "A worker needs the configuration file." << endl;
+			return 1;
+		}
+		return worker_main(worker_spec);
+	}
+	if (sources_remote() && config_path == nullptr) {
+		cerr << "Worker processes need a configuration file." << endl;
+		return 1;
+	}
+
 	if (user_db == nullptr) {
 		set_admin_username(get_username());
 		set_admin_password(get_password());
@@ -339,18 +388,32 @@ int main(int argc, char **argv)
 
 	topbl = make_top_block("top_block");
 
-	for (osmosdr::source::sptr src : osmosdr_sources) {
-		src->set_dc_offset_mode(0);
-		src->set_iq_balance_mode(0);
-		src->set_bandwidth(0.0);
+	// The workers or the backend set up the devices
+	if (!sources_remote()) {
+		for (size_t i = 0; i < osmosdr_sources.size(); ++i)
+			setup_source(i);
 	}
-
-	if (run(key_path, cert_path, port, resource_path) != 0)
+	placement_init();
+	// The rings are filled while nobody listens
+	if (timeshift_active())
+		topbl->start();
+	receiver_pool_start();
+	if (run(key_path, cert_path, port, resource_path, config_path) != 0) {
+		receiver_pool_stop();
 		return 1;
+	}
+	receiver_pool_stop();
 
 	getchar();
+	headless_stop();
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+		iq_record_stop_all();
+	}
+	audio_record_stop_all();
 	topbl->stop();
 	topbl->wait();
+	overrun_unhook_stderr();
 
 	auth_finalize();
 
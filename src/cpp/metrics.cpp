@@ -0,0 +1,491 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "metrics.h"
+#include "admission.h"
+#include "edge.h"
+#include "headless.h"
+#include "activity_index.h"
+#include "audio_record.h"
+#include "iq_record.h"
+#include "scanner.h"
+#include "overrun.h"
+#include "relay.h"
+#include "segmented.h"
+#include "globals.h"
+#include "source_state.h"
+#include "worker.h"
+#include <ctime>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+
+struct loop_stats event_loop_stats;
+
+uint64_t thread_cpu_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static string escape_label(const string &val)
+{
+	string ret;
+
+	for (char c : val) {
+		if (c == '\\' || c == '"')
+			ret += '\\';
+		if (c == '\n') {
+			ret += "\\n";
+			continue;
+		}
+		ret += c;
+	}
+	return ret;
+}
+
+static void add_family(stringstream &s, const char *name, const char *type,
+		const char *help)
+{
+	s << "# HELP " << name << " " << help << "\n";
+	s << "# TYPE " << name << " " << type << "\n";
+}
+
+/*
+ * What the metrics need from a receiver. The blocks may be replaced by
+ * other threads, so it's read with flowgraph_mutex held, and the text is
+ * written without it.
+ */
+struct receiver_sample {
+	string stream;
+	string demod;
+	// -1 if none
+	int source_ix;
+	bool running;
+	uint64_t dsp_ns;
+	int queue_bytes;
+	size_t buffer_bytes;
+	size_t default_buffer_bytes;
+	boost::shared_ptr<receiver_stats> stats;
+};
+
+static vector<struct receiver_sample> sample_receivers()
+{
+	vector<struct receiver_sample> ret;
+	lock_guard<mutex> lock(flowgraph_mutex);
+
+	for (auto pair : receiver_map.snapshot()) {
+		receiver::sptr rec = pair.second;
+		struct receiver_sample r;
+
+		r.stream = pair.first;
+		r.demod = rec->get_current_demod();
+		r.source_ix = rec->has_source() ? (int) rec->get_source_ix() : -1;
+		r.running = rec->is_running();
+		r.dsp_ns = rec->dsp_cpu_ns();
+		r.queue_bytes = rec->queue_depth();
+		r.buffer_bytes = rec->get_buffer_memory();
+		r.default_buffer_bytes = rec->get_default_buffer_memory();
+		r.stats = rec->get_stats();
+		ret.push_back(r);
+	}
+	return ret;
+}
+
+static void append_source_metrics(stringstream &s,
+		const vector<struct receiver_sample> &receivers)
+{
+	vector<bool> idle(sources_info.size(), true);
+
+	for (const struct receiver_sample &r : receivers) {
+		if (r.running && r.source_ix >= 0)
+			idle[r.source_ix] = false;
+	}
+
+	add_family(s, "grwebsdr_source_sample_rate", "gauge",
+			"Sample rate of the source in samples per second.");
+	for (size_t i = 0; i < sources_info.size(); ++i) {
+		s << "grwebsdr_source_sample_rate{source=\"" << i
+			<< "\",label=\"" << escape_label(sources_info[i].label)
+			<< "\"} " << get_source_state(i)->sample_rate
+			<< "\n";
+	}
+	add_family(s, "grwebsdr_source_overruns_total", "counter",
+			"Number of sample overruns reported by the source.");
+	for (size_t i = 0; i < sources_info.size(); ++i) {
+		s << "grwebsdr_source_overruns_total{source=\"" << i << "\"} "
+			<< sources_info[i].stats->overruns.load() << "\n";
+	}
+	add_family(s, "grwebsdr_source_lost_samples_total", "counter",
+			"Samples lost in overruns of the source.");
+	for (size_t i = 0; i < sources_info.size(); ++i) {
+		s << "grwebsdr_source_lost_samples_total{source=\"" << i
+			<< "\"} " << sources_info[i].stats->lost_samples.load()
+			<< "\n";
+	}
+	add_family(s, "grwebsdr_source_last_overrun_seconds", "gauge",
+			"Monotonic clock time of the last overrun, 0 if none.");
+	for (size_t i = 0; i < sources_info.size(); ++i) {
+		s << "grwebsdr_source_last_overrun_seconds{source=\"" << i
+			<< "\"} "
+			<< sources_info[i].stats->last_overrun_ns.load() / 1e9
+			<< "\n";
+	}
+	// Nothing counts them unless stderr is hooked
+	if (overrun_config.driver_marks) {
+		add_family(s, "grwebsdr_driver_overrun_marks_total", "counter",
+				"Overrun marks ('O') printed to stderr by the "
+				"drivers.");
+		s << "grwebsdr_driver_overrun_marks_total "
+			<< driver_overrun_marks() << "\n";
+	}
+	add_family(s, "grwebsdr_source_idle", "gauge",
+			"1 if no running receiver uses the source.");
+	for (size_t i = 0; i < idle.size(); ++i) {
+		s << "grwebsdr_source_idle{source=\"" << i << "\"} "
+			<< (idle[i] ? 1 : 0) << "\n";
+	}
+}
+
+static void append_worker_metrics(stringstream &s)
+{
+	if (!worker_config.enabled)
+		return;
+	add_family(s, "grwebsdr_worker_up", "gauge",
+			"1 if the worker process of the source is running.");
+	for (size_t i = 0; i < sources_info.size(); ++i) {
+		s << "grwebsdr_worker_up{source=\"" << i << "\"} "
+			<< (worker_up(i) ? 1 : 0) << "\n";
+	}
+	add_family(s, "grwebsdr_worker_restarts_total", "counter",
+			"Number of times the worker process was restarted.");
+	for (size_t i = 0; i < sources_info.size(); ++i) {
+		s << "grwebsdr_worker_restarts_total{source=\"" << i << "\"} "
+			<< worker_restarts(i) << "\n";
+	}
+}
+
+static void append_relay_metrics(stringstream &s)
+{
+	if (relay_config.port) {
+		add_family(s, "grwebsdr_relay_edges", "gauge",
+				"Edge nodes connected to the relay.");
+		s << "grwebsdr_relay_edges " << relay_edges() << "\n";
+		add_family(s, "grwebsdr_relay_channels", "gauge",
+				"Channels open for the edge nodes.");
+		s << "grwebsdr_relay_channels " << relay_channels() << "\n";
+		add_family(s, "grwebsdr_relay_bytes_sent_total", "counter",
+				"Encoded audio bytes sent to the edge nodes.");
+		s << "grwebsdr_relay_bytes_sent_total " << relay_bytes_sent()
+			<< "\n";
+	}
+	if (edge_config.enabled) {
+		add_family(s, "grwebsdr_edge_connected", "gauge",
+				"1 if the edge is connected to its backend.");
+		s << "grwebsdr_edge_connected " << (edge_connected() ? 1 : 0)
+			<< "\n";
+		add_family(s, "grwebsdr_edge_connects_total", "counter",
+				"Connections made to the backend.");
+		s << "grwebsdr_edge_connects_total " << edge_connects() << "\n";
+		add_family(s, "grwebsdr_edge_channels", "gauge",
+				"Backend channels the listeners are fanned out from.");
+		s << "grwebsdr_edge_channels " << edge_channels() << "\n";
+		add_family(s, "grwebsdr_edge_bytes_received_total", "counter",
+				"Encoded audio bytes received from the backend.");
+		s << "grwebsdr_edge_bytes_received_total "
+			<< edge_bytes_received() << "\n";
+	}
+}
+
+static void append_audio_record_metrics(stringstream &s)
+{
+	if (audio_record_config.directory.empty())
+		return;
+	add_family(s, "grwebsdr_audio_recordings", "gauge",
+			"Receivers whose audio is being recorded.");
+	s << "grwebsdr_audio_recordings " << audio_recordings() << "\n";
+	add_family(s, "grwebsdr_audio_record_bytes_total", "counter",
+			"Encoded audio bytes written to disk.");
+	s << "grwebsdr_audio_record_bytes_total "
+		<< audio_record_bytes_total() << "\n";
+	add_family(s, "grwebsdr_audio_record_dropped_pages_total", "counter",
+			"Ogg pages not recorded because the disk didn't keep up.");
+	s << "grwebsdr_audio_record_dropped_pages_total "
+		<< audio_record_dropped_total() << "\n";
+}
+
+static void append_scanner_metrics(stringstream &s)
+{
+	add_family(s, "grwebsdr_scanners", "gauge",
+			"Sources scanned for active channels.");
+	s << "grwebsdr_scanners " << scanners_running() << "\n";
+	if (activity_index_config.directory.empty())
+		return;
+	add_family(s, "grwebsdr_activity_index_records_total", "counter",
+			"Records appended to the band activity index.");
+	s << "grwebsdr_activity_index_records_total "
+		<< activity_index_records() << "\n";
+}
+
+static void append_iq_record_metrics(stringstream &s)
+{
+	if (iq_record_config.directory.empty())
+		return;
+	add_family(s, "grwebsdr_iq_recordings", "gauge",
+			"Sources whose IQ is being recorded.");
+	s << "grwebsdr_iq_recordings " << iq_recordings() << "\n";
+	add_family(s, "grwebsdr_iq_record_bytes_total", "counter",
+			"IQ bytes written to disk.");
+	s << "grwebsdr_iq_record_bytes_total " << iq_record_bytes_total()
+		<< "\n";
+	add_family(s, "grwebsdr_iq_record_dropped_samples_total", "counter",
+			"IQ samples not recorded because the disk didn't keep up.");
+	s << "grwebsdr_iq_record_dropped_samples_total "
+		<< iq_record_dropped_total() << "\n";
+}
+
+static void append_headless_metrics(stringstream &s)
+{
+	if (headless_configs.empty())
+		return;
+	add_family(s, "grwebsdr_headless_receivers", "gauge",
+			"Receivers defined in the config file.");
+	s << "grwebsdr_headless_receivers " << headless_receivers() << "\n";
+	add_family(s, "grwebsdr_headless_pcm_clients", "gauge",
+			"Clients connected to the PCM sockets.");
+	s << "grwebsdr_headless_pcm_clients " << headless_pcm_clients()
+		<< "\n";
+	add_family(s, "grwebsdr_headless_pcm_bytes_total", "counter",
+			"PCM bytes written to the sockets and FIFOs.");
+	s << "grwebsdr_headless_pcm_bytes_total " << headless_pcm_bytes()
+		<< "\n";
+	add_family(s, "grwebsdr_headless_pcm_dropped_bytes_total", "counter",
+			"PCM bytes lost because a reader didn't keep up.");
+	s << "grwebsdr_headless_pcm_dropped_bytes_total "
+		<< headless_pcm_dropped() << "\n";
+}
+
+static void append_segment_metrics(stringstream &s)
+{
+	if (!segments_config.max_channels)
+		return;
+	add_family(s, "grwebsdr_segmented_channels", "gauge",
+			"Broadcast channels cut into segments.");
+	s << "grwebsdr_segmented_channels " << segmented_channels() << "\n";
+	add_family(s, "grwebsdr_segments_total", "counter",
+			"Segments cut from the broadcast channels.");
+	s << "grwebsdr_segments_total " << segmented_segments_cut() << "\n";
+	add_family(s, "grwebsdr_segment_requests_total", "counter",
+			"HTTP requests for the broadcast channels.");
+	s << "grwebsdr_segment_requests_total " << segmented_requests()
+		<< "\n";
+}
+
+static void append_receiver_metrics(stringstream &s,
+		const vector<struct receiver_sample> &receivers)
+{
+	add_family(s, "grwebsdr_receiver_info", "gauge",
+			"Demodulation and source of each receiver.");
+	for (const struct receiver_sample &r : receivers) {
+		s << "grwebsdr_receiver_info{stream=\"" << r.stream
+			<< "\",demod=\"" << r.demod << "\",source=\"";
+		if (r.source_ix >= 0)
+			s << r.source_ix;
+		s << "\",running=\"" << (r.running ? 1 : 0) << "\"} 1\n";
+	}
+	add_family(s, "grwebsdr_receiver_dsp_cpu_seconds_total", "counter",
+			"CPU time spent in the DSP blocks of the receiver.");
+	for (const struct receiver_sample &r : receivers) {
+		s << "grwebsdr_receiver_dsp_cpu_seconds_total{stream=\""
+			<< r.stream << "\"} " << r.dsp_ns / 1e9 << "\n";
+	}
+	add_family(s, "grwebsdr_receiver_encoder_cpu_seconds_total", "counter",
+			"CPU time spent encoding the audio of the receiver.");
+	for (const struct receiver_sample &r : receivers) {
+		s << "grwebsdr_receiver_encoder_cpu_seconds_total{stream=\""
+			<< r.stream << "\"} "
+			<< r.stats->encoder_ns.load() / 1e9 << "\n";
+	}
+	add_family(s, "grwebsdr_receiver_bytes_sent_total", "counter",
+			"Encoded audio bytes handed to the HTTP stream.");
+	for (const struct receiver_sample &r : receivers) {
+		s << "grwebsdr_receiver_bytes_sent_total{stream=\""
+			<< r.stream << "\"} "
+			<< r.stats->bytes_sent.load() << "\n";
+	}
+	add_family(s, "grwebsdr_receiver_queue_bytes", "gauge",
+			"Encoded audio bytes waiting to be sent.");
+	for (const struct receiver_sample &r : receivers) {
+		s << "grwebsdr_receiver_queue_bytes{stream=\""
+			<< r.stream << "\"} " << r.queue_bytes << "\n";
+	}
+	add_family(s, "grwebsdr_receiver_buffer_bytes", "gauge",
+			"Estimated memory used by the receiver's stream buffers.");
+	for (const struct receiver_sample &r : receivers) {
+		s << "grwebsdr_receiver_buffer_bytes{stream=\""
+			<< r.stream << "\"} " << r.buffer_bytes << "\n";
+	}
+	add_family(s, "grwebsdr_receiver_default_buffer_bytes", "gauge",
+			"Memory the buffers would use with the GNU Radio "
+			"defaults.");
+	for (const struct receiver_sample &r : receivers) {
+		s << "grwebsdr_receiver_default_buffer_bytes{stream=\""
+			<< r.stream << "\"} " << r.default_buffer_bytes
+			<< "\n";
+	}
+	add_family(s, "grwebsdr_receiver_pages_written_total", "counter",
+			"Ogg pages produced by the encoder.");
+	for (const struct receiver_sample &r : receivers) {
+		s << "grwebsdr_receiver_pages_written_total{stream=\""
+			<< r.stream << "\"} "
+			<< r.stats->pages_written.load() << "\n";
+	}
+	add_family(s, "grwebsdr_receiver_pages_dropped_total", "counter",
+			"Ogg pages dropped because the listener didn't keep up.");
+	for (const struct receiver_sample &r : receivers) {
+		s << "grwebsdr_receiver_pages_dropped_total{stream=\""
+			<< r.stream << "\"} "
+			<< r.stats->pages_dropped.load() << "\n";
+	}
+}
+
+static void append_global_metrics(stringstream &s)
+{
+	add_family(s, "grwebsdr_event_loop_iterations_total", "counter",
+			"Number of event loop wakeups.");
+	s << "grwebsdr_event_loop_iterations_total "
+		<< event_loop_stats.iterations.load() << "\n";
+	add_family(s, "grwebsdr_event_loop_busy_seconds_total", "counter",
+			"Time the event loop spent servicing file descriptors.");
+	s << "grwebsdr_event_loop_busy_seconds_total "
+		<< event_loop_stats.busy_ns.load() / 1e9 << "\n";
+	add_family(s, "grwebsdr_event_loop_last_iteration_seconds", "gauge",
+			"Duration of the last event loop iteration.");
+	s << "grwebsdr_event_loop_last_iteration_seconds "
+		<< event_loop_stats.last_iteration_ns.load() / 1e9 << "\n";
+	add_family(s, "grwebsdr_open_fds", "gauge",
+			"Number of file descriptors watched by the event loop.");
+	s << "grwebsdr_open_fds " << count_pollfds << "\n";
+	add_family(s, "grwebsdr_receivers", "gauge",
+			"Number of receivers (connected WebSocket clients).");
+	s << "grwebsdr_receivers " << receiver_map.size() << "\n";
+}
+
+static void append_admission_metrics(stringstream &s)
+{
+	add_family(s, "grwebsdr_admission_committed_cores", "gauge",
+			"Estimated CPU cost reserved by the admitted receivers.");
+	s << "grwebsdr_admission_committed_cores " << admission_committed()
+		<< "\n";
+	add_family(s, "grwebsdr_admission_rejected_total", "counter",
+			"Receivers turned away because of the CPU budget.");
+	s << "grwebsdr_admission_rejected_total " << admission_rejected()
+		<< "\n";
+	add_family(s, "grwebsdr_chain_cost_cores", "gauge",
+			"Measured CPU cost of a receiver chain.");
+	for (const struct demod_cost &c : admission_costs()) {
+		s << "grwebsdr_chain_cost_cores{source=\"" << c.source_ix
+			<< "\",demod=\"" << c.demod << "\"} " << c.cores
+			<< "\n";
+	}
+}
+
+void latency_record(struct latency_histogram *h, uint64_t ns)
+{
+	uint64_t ms = ns / 1000000;
+	int bucket = 0;
+
+	while (bucket < LATENCY_BUCKETS - 1 && ms >= (1ULL << bucket))
+		++bucket;
+	h->buckets[bucket].fetch_add(1, memory_order_relaxed);
+	h->count.fetch_add(1, memory_order_relaxed);
+	h->sum_ns.fetch_add(ns, memory_order_relaxed);
+}
+
+unsigned latency_bucket_bound_ms(int bucket)
+{
+	if (bucket >= LATENCY_BUCKETS - 1)
+		return 0;
+	return 1U << bucket;
+}
+
+void page_written(struct receiver_stats *stats,
+		const struct page_timestamp &ts)
+{
+	unsigned head = stats->page_ts_head.load(memory_order_relaxed);
+	unsigned tail = stats->page_ts_tail.load(memory_order_acquire);
+
+	// If the consumer isn't keeping up, skip the measurement
+	if (head - tail >= PAGE_TS_QUEUE_LEN)
+		return;
+	stats->page_ts[head % PAGE_TS_QUEUE_LEN] = ts;
+	stats->page_ts_head.store(head + 1, memory_order_release);
+}
+
+void account_bytes_sent(struct receiver_stats *stats, size_t n)
+{
+	uint64_t sent = stats->bytes_sent.fetch_add(n) + n;
+	unsigned tail = stats->page_ts_tail.load(memory_order_relaxed);
+	unsigned head = stats->page_ts_head.load(memory_order_acquire);
+	uint64_t now = 0;
+
+	for (; tail != head; ++tail) {
+		const struct page_timestamp &ts =
+			stats->page_ts[tail % PAGE_TS_QUEUE_LEN];
+		if (ts.end_offset > sent)
+			break;
+		if (!now)
+			now = monotonic_ns();
+		latency_record(&stats->transport_latency, now - ts.page_ns);
+		latency_record(&stats->total_latency, now - ts.source_ns);
+	}
+	stats->page_ts_tail.store(tail, memory_order_release);
+}
+
+string metrics_text()
+{
+	stringstream s;
+	vector<struct receiver_sample> receivers = sample_receivers();
+
+	append_global_metrics(s);
+	append_source_metrics(s, receivers);
+	append_worker_metrics(s);
+	append_relay_metrics(s);
+	append_segment_metrics(s);
+	append_headless_metrics(s);
+	append_scanner_metrics(s);
+	append_iq_record_metrics(s);
+	append_audio_record_metrics(s);
+	append_receiver_metrics(s, receivers);
+	append_admission_metrics(s);
+	return s.str();
+}
@@ -0,0 +1,110 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <config.h>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*
+ * Performance counters. The streaming threads only ever do relaxed atomic
+ * increments on these, so exporting them from the event loop never
+ * blocks audio.
+ */
+
+// Bucket i counts latencies below 2^i ms, the last bucket is unbounded
+#define LATENCY_BUCKETS 16
+// Must be a power of two
+#define PAGE_TS_QUEUE_LEN 64
+
+struct latency_histogram {
+	std::atomic<uint64_t> buckets[LATENCY_BUCKETS] = {};
+	std::atomic<uint64_t> count{0};
+	std::atomic<uint64_t> sum_ns{0};
+};
+
+/*
+ * Timestamps of an Ogg page on its way from the encoder to the socket.
+ * end_offset is the position of the end of the page in the encoded stream.
+ */
+struct page_timestamp {
+	uint64_t end_offset;
+	uint64_t source_ns;
+	uint64_t page_ns;
+};
+
+struct receiver_stats {
+	std::atomic<uint64_t> encoder_ns{0};
+	std::atomic<uint64_t> samples_encoded{0};
+	std::atomic<uint64_t> pages_written{0};
+	std::atomic<uint64_t> pages_dropped{0};
+	std::atomic<uint64_t> bytes_sent{0};
+	// DSP CPU time reported by a worker process, see worker.h
+	std::atomic<uint64_t> worker_dsp_ns{0};
+
+	// Source -> encoder input
+	struct latency_histogram dsp_latency;
+	// Encoder input -> Ogg page written to the pipe
+	struct latency_histogram encoder_latency;
+	// Ogg page written to the pipe -> lws_write()
+	struct latency_histogram transport_latency;
+	// Source -> lws_write()
+	struct latency_histogram total_latency;
+
+	// Single producer (ogg_sink), single consumer (HTTP stream) queue
+	struct page_timestamp page_ts[PAGE_TS_QUEUE_LEN];
+	std::atomic<unsigned> page_ts_head{0};
+	std::atomic<unsigned> page_ts_tail{0};
+};
+
+struct source_stats {
+	std::atomic<uint64_t> overruns{0};
+	std::atomic<uint64_t> lost_samples{0};
+	// Monotonic time of the last overrun, 0 if none
+	std::atomic<uint64_t> last_overrun_ns{0};
+};
+
+struct loop_stats {
+	std::atomic<uint64_t> iterations{0};
+	std::atomic<uint64_t> busy_ns{0};
+	std::atomic<uint64_t> last_iteration_ns{0};
+};
+
+extern struct loop_stats event_loop_stats;
+
+/** CPU time consumed by the calling thread, in nanoseconds */
+uint64_t thread_cpu_ns();
+/** Monotonic wall clock time in nanoseconds */
+uint64_t monotonic_ns();
+/** Render all counters in the Prometheus text exposition format */
+std::string metrics_text();
+void latency_record(struct latency_histogram *h, uint64_t ns);
+/** Upper bound of a latency histogram bucket in ms, 0 means unbounded */
+unsigned latency_bucket_bound_ms(int bucket);
+/** Called by the encoder after writing a page. Never blocks. */
+void page_written(struct receiver_stats *stats,
+		const struct page_timestamp &ts);
+/** Called after n bytes of the encoded stream were passed to lws_write() */
+void account_bytes_sent(struct receiver_stats *stats, size_t n);
+
+#endif
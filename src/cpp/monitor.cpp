@@ -0,0 +1,235 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "monitor.h"
+#include <algorithm>
+#include <boost/make_shared.hpp>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <gnuradio/io_signature.h>
+
+using namespace std;
+
+// Input samples filtered by all the channels before moving on, 32 KiB
+#define BANK_CHUNK 4096
+
+struct monitor_config monitor_config = { 4, 10.0 };
+
+string monitor_chain_name(size_t n)
+{
+	return "MONITOR" + to_string(n);
+}
+
+size_t monitor_chain_channels(const string &chain)
+{
+	if (chain.compare(0, 7, "MONITOR") || chain.size() == 7)
+		return 0;
+	return strtoul(chain.c_str() + 7, nullptr, 10);
+}
+
+channel_bank::sptr channel_bank::make(const vector<struct channel> &channels,
+		int sample_rate)
+{
+	return boost::shared_ptr<channel_bank>(new channel_bank(channels,
+				sample_rate));
+}
+
+/*
+ * The taps are shifted to the channel's offset and the decimated output
+ * is shifted back, like freq_xlating_fir_filter_ccc does it.
+ */
+channel_bank::channel_bank(const vector<struct channel> &channels,
+		int sample_rate)
+	: gr::block("channel_bank",
+		gr::io_signature::make(1, 1, sizeof(gr_complex)),
+		gr::io_signature::make(1, MONITOR_MAX_CHANNELS,
+			sizeof(gr_complex)))
+	, sample_rate(sample_rate), min_dec(0), max_ntaps(1)
+{
+	for (size_t i = 0; i < channels.size(); ++i) {
+		const struct channel &c = channels[i];
+		double fwT0 = 2 * M_PI * c.offset / sample_rate;
+		vector<gr_complex> taps(c.taps.size());
+		struct state s;
+
+		for (size_t k = 0; k < taps.size(); ++k)
+			taps[k] = c.taps[k] * exp(gr_complex(0, k * fwT0));
+		s.dec = c.dec;
+		s.level_len = max(1, sample_rate / c.dec * MONITOR_LEVEL_MS
+				/ 1000);
+		s.squelch = c.squelch && monitor_config.squelch_db > 0;
+		s.filter = boost::make_shared<
+			gr::filter::kernel::fir_filter_ccc>(1, taps);
+		s.rotator.set_phase_incr(exp(gr_complex(0, -fwT0 * c.dec)));
+		s.next = 0;
+		s.level_sum = 0.0;
+		s.level_n = 0;
+		s.floor_db = HUGE_VALF;
+		s.hang = 0;
+		this->channels.push_back(s);
+		open[i].store(!s.squelch);
+		if (!min_dec || c.dec < min_dec)
+			min_dec = c.dec;
+		max_ntaps = max(max_ntaps, (unsigned) taps.size());
+	}
+	set_history(max_ntaps);
+	set_relative_rate(1.0 / min_dec);
+}
+
+void channel_bank::forecast(int noutput_items,
+		gr_vector_int &ninput_items_required)
+{
+	ninput_items_required[0] = noutput_items * min_dec + max_ntaps - 1;
+}
+
+/*
+ * The input is taken in chunks small enough to stay in cache while every
+ * channel filters them. The newest input sample of an output of a channel
+ * with fewer taps than max_ntaps is still the same one, the filter just
+ * starts later in the history.
+ */
+int channel_bank::general_work(int noutput_items, gr_vector_int &ninput_items,
+		gr_vector_const_void_star &input_items,
+		gr_vector_void_star &output_items)
+{
+	const gr_complex *in = (const gr_complex *) input_items[0];
+	int n_in = min(ninput_items[0] - (int) max_ntaps + 1,
+			noutput_items * min_dec);
+	vector<int> produced(channels.size(), 0);
+	int start, end, n;
+
+	if (n_in <= 0)
+		return 0;
+	for (start = 0; start < n_in; start = end) {
+		end = min(n_in, start + BANK_CHUNK);
+		for (size_t i = 0; i < channels.size(); ++i) {
+			struct state &s = channels[i];
+			gr_complex *out = (gr_complex *) output_items[i]
+				+ produced[i];
+
+			if (s.next >= end)
+				continue;
+			n = (end - s.next + s.dec - 1) / s.dec;
+			s.filter->filterNdec(out, in + s.next + max_ntaps
+					- s.filter->ntaps(), n, s.dec);
+			s.rotator.rotateN(out, out, n);
+			update_squelch(i, out, n);
+			s.next += n * s.dec;
+			produced[i] += n;
+		}
+	}
+	for (size_t i = 0; i < channels.size(); ++i) {
+		channels[i].next -= n_in;
+		produce(i, produced[i]);
+	}
+	consume_each(n_in);
+	return WORK_CALLED_PRODUCE;
+}
+
+void channel_bank::update_squelch(int i, const gr_complex *out, int n)
+{
+	struct state &s = channels[i];
+	const float rise = MONITOR_FLOOR_RISE_DB_PER_S * MONITOR_LEVEL_MS
+		/ 1000.0;
+	float level_db;
+
+	if (!s.squelch)
+		return;
+	for (int k = 0; k < n; ++k) {
+		s.level_sum += norm(out[k]);
+		if (++s.level_n < s.level_len)
+			continue;
+		level_db = 10 * log10(s.level_sum / s.level_n + 1e-20);
+		s.level_sum = 0.0;
+		s.level_n = 0;
+		s.floor_db = min(level_db, s.floor_db + rise);
+		if (level_db > s.floor_db + monitor_config.squelch_db) {
+			s.hang = MONITOR_HANG_MS / MONITOR_LEVEL_MS;
+			open[i].store(true, memory_order_relaxed);
+		} else if (s.hang > 0) {
+			--s.hang;
+		} else {
+			open[i].store(false, memory_order_relaxed);
+		}
+	}
+}
+
+bool channel_bank::is_open(int i)
+{
+	return open[i].load(memory_order_relaxed);
+}
+
+audio_mixer::sptr audio_mixer::make(const vector<float> &pans, bool stereo,
+		channel_bank::sptr bank, int audio_rate)
+{
+	return boost::shared_ptr<audio_mixer>(new audio_mixer(pans, stereo,
+				bank, audio_rate));
+}
+
+/* Constant power panning, a centered channel is 3 dB down on each side */
+audio_mixer::audio_mixer(const vector<float> &pans, bool stereo,
+		channel_bank::sptr bank, int audio_rate)
+	: gr::sync_block("audio_mixer",
+		gr::io_signature::make(1, MONITOR_MAX_CHANNELS, sizeof(float)),
+		gr::io_signature::make(1, 2, sizeof(float)))
+	, n_outputs(stereo ? 2 : 1), bank(bank)
+{
+	for (float pan : pans) {
+		double angle = (max(-1.0f, min(1.0f, pan)) + 1) * M_PI / 4;
+
+		gains[0].push_back(stereo ? cos(angle) : 1.0f);
+		gains[1].push_back(stereo ? sin(angle) : 0.0f);
+	}
+	fade.assign(pans.size(), 0.0f);
+	fade_step = 1000.0f / ((float) audio_rate * MONITOR_FADE_MS);
+}
+
+int audio_mixer::work(int noutput_items,
+		gr_vector_const_void_star &input_items,
+		gr_vector_void_star &output_items)
+{
+	float *out[2] = { nullptr, nullptr };
+	float target, g;
+
+	for (int o = 0; o < n_outputs; ++o) {
+		out[o] = (float *) output_items[o];
+		memset(out[o], 0, noutput_items * sizeof(float));
+	}
+	for (size_t j = 0; j < input_items.size(); ++j) {
+		const float *in = (const float *) input_items[j];
+
+		target = bank->is_open(j) ? 1.0f : 0.0f;
+		if (fade[j] == 0.0f && target == 0.0f)
+			continue;
+		for (int i = 0; i < noutput_items; ++i) {
+			if (fade[j] < target)
+				fade[j] = min(target, fade[j] + fade_step);
+			else if (fade[j] > target)
+				fade[j] = max(target, fade[j] - fade_step);
+			g = in[i] * fade[j];
+			out[0][i] += gains[0][j] * g;
+			if (out[1])
+				out[1][i] += gains[1][j] * g;
+		}
+	}
+	return noutput_items;
+}
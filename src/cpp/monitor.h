@@ -0,0 +1,155 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <config.h>
+#include <boost/shared_ptr.hpp>
+#include <gnuradio/block.h>
+#include <gnuradio/blocks/rotator.h>
+#include <gnuradio/filter/fir_filter.h>
+#include <gnuradio/sync_block.h>
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * Monitor mode: a receiver listening to several channels of its source at
+ * once, like a scanner radio that doesn't have to scan. A channel_bank
+ * block takes the place of the receiver's frequency translating filter.
+ * It reads each chunk of the source's IQ once and runs the channel
+ * filters of all the channels over it while it's in cache. Each channel
+ * then has its own demodulator and resampler, and an audio_mixer mixes
+ * them, panned in stereo if any channel has a pan, into the receiver's
+ * single encoder.
+ *
+ * Each channel has a carrier squelch, so that the idle channels don't
+ * drown the active one in noise. A channel is open while the power in it
+ * is squelch_db above its noise floor, the lowest power seen. The floor
+ * slowly rises, so a station that never pauses is eventually taken for
+ * noise, such channels should have the squelch off.
+ */
+
+#define MONITOR_MAX_CHANNELS 8
+// Length of a squelch measurement
+#define MONITOR_LEVEL_MS 10
+// How long the squelch stays open after the carrier went away
+#define MONITOR_HANG_MS 500
+// How fast the noise floor estimate rises
+#define MONITOR_FLOOR_RISE_DB_PER_S 0.05
+// Fade in and out of a channel as its squelch opens and closes
+#define MONITOR_FADE_MS 20
+
+struct monitor_config {
+	// Channels a receiver may monitor, up to MONITOR_MAX_CHANNELS
+	int max_channels;
+	// 0 turns the squelch off
+	double squelch_db;
+};
+
+extern struct monitor_config monitor_config;
+
+struct monitor_channel {
+	int offset;
+	std::string demod;
+	// -1 is left, 1 is right
+	float pan;
+	bool squelch;
+};
+
+/** The chain of a receiver monitoring n channels, see admission.h */
+std::string monitor_chain_name(size_t n);
+/** The n of a monitor_chain_name(), 0 for other chains */
+size_t monitor_chain_channels(const std::string &chain);
+
+/*
+ * One input at the source rate, output i is channel i at the rate of its
+ * decimation. Equivalent to a freq_xlating_fir_filter_ccc per channel.
+ */
+class channel_bank : virtual public gr::block {
+public:
+	typedef boost::shared_ptr<channel_bank> sptr;
+	struct channel {
+		int offset;
+		int dec;
+		// Low pass prototype, see freq_xlating_fir_filter_ccc
+		std::vector<gr_complex> taps;
+		bool squelch;
+	};
+	static sptr make(const std::vector<struct channel> &channels,
+			int sample_rate);
+	int general_work(int noutput_items, gr_vector_int &ninput_items,
+			gr_vector_const_void_star &input_items,
+			gr_vector_void_star &output_items);
+	void forecast(int noutput_items, gr_vector_int &ninput_items_required);
+	/** Whether channel i's squelch is open. Any thread. */
+	bool is_open(int i);
+private:
+	struct state {
+		int dec;
+		// Output samples per squelch measurement
+		int level_len;
+		bool squelch;
+		boost::shared_ptr<gr::filter::kernel::fir_filter_ccc> filter;
+		gr::blocks::rotator rotator;
+		// Position of the next output's newest input sample, relative
+		// to the first input sample of the next work call
+		int next;
+		double level_sum;
+		int level_n;
+		float floor_db;
+		int hang;
+	};
+	std::vector<struct state> channels;
+	std::atomic<bool> open[MONITOR_MAX_CHANNELS];
+	int sample_rate;
+	int min_dec;
+	unsigned max_ntaps;
+	channel_bank(const std::vector<struct channel> &channels,
+			int sample_rate);
+	void update_squelch(int i, const gr_complex *out, int n);
+};
+
+/*
+ * Adds up one float input per channel into one output, or two with
+ * stereo. A channel is faded out while its squelch in bank is closed.
+ */
+class audio_mixer : virtual public gr::sync_block {
+public:
+	typedef boost::shared_ptr<audio_mixer> sptr;
+	/** pans has one entry per input */
+	static sptr make(const std::vector<float> &pans, bool stereo,
+			channel_bank::sptr bank, int audio_rate);
+	int work(int noutput_items, gr_vector_const_void_star &input_items,
+			gr_vector_void_star &output_items);
+private:
+	// Of each input on each output
+	std::vector<float> gains[2];
+	std::vector<float> fade;
+	float fade_step;
+	int n_outputs;
+	channel_bank::sptr bank;
+	audio_mixer(const std::vector<float> &pans, bool stereo,
+			channel_bank::sptr bank, int audio_rate);
+};
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "ogg_page.h"
+#include <cstring>
+
+// Packet type, "vorbis", version, channels, then the rate
+#define VORBIS_RATE_OFFSET 12
+
+size_t ogg_page_len(const char *buf, size_t len, size_t *skip)
+{
+	const unsigned char *p = (const unsigned char *) buf;
+	size_t i, total;
+	const char *sync;
+
+	*skip = 0;
+	if (len < 4)
+		return 0;
+	if (memcmp(buf, "OggS", 4)) {
+		sync = (const char *) memmem(buf + 1, len - 1, "OggS", 4);
+		*skip = sync ? sync - buf : len - 3;
+		return 0;
+	}
+	if (len < OGG_HEADER_LEN || len < OGG_HEADER_LEN + (size_t) p[26])
+		return 0;
+	total = OGG_HEADER_LEN + p[26];
+	for (i = 0; i < p[26]; ++i)
+		total += p[OGG_HEADER_LEN + i];
+	return len < total ? 0 : total;
+}
+
+int64_t ogg_granulepos(const char *page)
+{
+	const unsigned char *p = (const unsigned char *) page + 6;
+	uint64_t val = 0;
+
+	for (int i = 7; i >= 0; --i)
+		val = (val << 8) | p[i];
+	return (int64_t) val;
+}
+
+bool ogg_bos(const char *page)
+{
+	return page[5] & OGG_FLAG_BOS;
+}
+
+/* A packet ends with the first lacing value below 255 */
+int ogg_packets_ended(const char *page)
+{
+	const unsigned char *p = (const unsigned char *) page;
+	int n = 0;
+
+	for (int i = 0; i < p[26]; ++i)
+		n += p[OGG_HEADER_LEN + i] < 255;
+	return n;
+}
+
+unsigned ogg_vorbis_rate(const char *page, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) page;
+	size_t body = OGG_HEADER_LEN + p[26];
+
+	if (len < body + VORBIS_RATE_OFFSET + 4
+			|| memcmp(page + body, "\x01vorbis", 7))
+		return 0;
+	p += body + VORBIS_RATE_OFFSET;
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
@@ -0,0 +1,57 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OGG_PAGE_H
+#define OGG_PAGE_H
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Just enough of the Ogg page format to cut an encoded stream at page
+ * boundaries, used by the fan-out of the edge nodes (see fanout.h) and by
+ * the segmented channels (see segmented.h).
+ */
+
+#define OGG_HEADER_LEN 27
+#define OGG_FLAG_BOS 0x02
+// Identification, comment and setup
+#define VORBIS_HEADER_PACKETS 3
+
+/**
+ * Length of the page at the start of buf, 0 if it's incomplete. Sets skip
+ * to the number of bytes before the next capture pattern if the data
+ * doesn't start with one.
+ */
+size_t ogg_page_len(const char *buf, size_t len, size_t *skip);
+/** Granule position of a complete page, -1 if no packet ends on it */
+int64_t ogg_granulepos(const char *page);
+/** Whether the page starts a logical stream */
+bool ogg_bos(const char *page);
+/** Number of packets that end on a complete page */
+int ogg_packets_ended(const char *page);
+/**
+ * The sample rate from the Vorbis identification header, which is the
+ * first page of a stream. 0 if the page isn't one.
+ */
+unsigned ogg_vorbis_rate(const char *page, size_t len);
+
+#endif
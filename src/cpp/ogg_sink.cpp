@@ -20,57 +20,82 @@
 
 #include <config.h>
 #include "ogg_sink.h"
+#include "ogg_page.h"
+#include "timestamp_tagger.h"
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <fcntl.h>
 #include <gnuradio/io_signature.h>
+#include <random>
 #include <stdexcept>
+#include <sys/ioctl.h>
+#include <unistd.h>
 
 using namespace std;
 
 ogg_sink::sptr ogg_sink::make(int outfd, int n_channels,
-		unsigned int sample_rate)
+		unsigned int sample_rate, boost::shared_ptr<receiver_stats> stats)
 {
-	return boost::shared_ptr<ogg_sink>(new ogg_sink(outfd, n_channels,
-				sample_rate));
+	return boost::shared_ptr<ogg_sink>(new ogg_sink(outfd, nullptr,
+				n_channels, sample_rate, stats));
 }
 
-ogg_sink::ogg_sink(int outfd, int n_channels, unsigned int sample_rate)
+ogg_sink::sptr ogg_sink::make(struct audio_ring *ring, int notify_fd,
+		int n_channels, unsigned int sample_rate,
+		boost::shared_ptr<receiver_stats> stats)
+{
+	return boost::shared_ptr<ogg_sink>(new ogg_sink(notify_fd, ring,
+				n_channels, sample_rate, stats));
+}
+
+ogg_sink::ogg_sink(int outfd, struct audio_ring *ring, int n_channels,
+		unsigned int sample_rate,
+		boost::shared_ptr<receiver_stats> stats)
 	: gr::sync_block("ogg_sink",
-		gr::io_signature::make(1, 1, sizeof(float)),
+		gr::io_signature::make(1, 2, sizeof(float)),
 		gr::io_signature::make(0, 0, 0))
-	, fd(outfd), og({})
+	, fd(outfd), ring(ring), n_channels(n_channels), sample_rate(sample_rate)
+	, quality(0.5f), serial(std::random_device()()), granule_base(0), reconfig_pending(false)
+	, squelch(false), skip_pending(0), samples_seen(0), last_loud(0), stats(stats)
+	, recording(false), recorder_new(false), header_packets(0)
+	, samples_in(0), bytes_out(0)
+	, og({})
+{
+	// -1 if outfd isn't a pipe, in which case pages are never dropped
+	pipe_size = fcntl(fd, F_GETPIPE_SZ);
+	init_encoder();
+}
+
+/* Start a new logical Ogg stream with the current settings */
+void ogg_sink::init_encoder()
 {
 	vorbis_info_init(&vi);
-	if (vorbis_encode_init_vbr(&vi, n_channels, sample_rate, 0.5f) != 0)
+	if (vorbis_encode_init_vbr(&vi, n_channels, sample_rate, quality) != 0)
 		throw runtime_error("vorbis_encode_init_vbr failed");
 	vorbis_analysis_init(&vs, &vi);
 	vorbis_comment_init(&comm);
 	if (vorbis_analysis_headerout(&vs, &comm, &op, &op_comm, &op_code) != 0)
 		throw runtime_error("vorbis_analysis_headerout failed");
-	ogg_stream_init(&os, 0);
+	ogg_stream_init(&os, (int) serial++);
+	granule_base = samples_in;
 
 	ogg_stream_packetin(&os, &op);
 	ogg_stream_packetin(&os, &op_comm);
 	ogg_stream_packetin(&os, &op_code);
 
-	ogg_stream_flush(&os, &og);
-	print_page();
+	// The headers on pages of their own, before any audio
+	while (ogg_stream_flush(&os, &og))
+		print_page(false);
 
 	vorbis_block_init(&vs, &vb);
 }
 
-int ogg_sink::work(int noutput_items, gr_vector_const_void_star &input_items,
-			gr_vector_void_star &output_items)
+void ogg_sink::encode_blocks()
 {
-	const float *in = (const float *) input_items[0];
-	float **buf;
 	int res;
 
-	(void) output_items;
-
-	buf = vorbis_analysis_buffer(&vs, noutput_items);
-	memcpy(buf[0], in, noutput_items * sizeof(*in));
-	if (vorbis_analysis_wrote(&vs, noutput_items))
-		throw runtime_error("vorbis_analysis_wrote failed");
 	while (1) {
 		res = vorbis_analysis_blockout(&vs, &vb);
 		if (res < 0)
@@ -81,26 +106,332 @@ int ogg_sink::work(int noutput_items, gr_vector_const_void_star &input_items,
 			throw runtime_error("vorbis_analysis failed");
 		ogg_stream_packetin(&os, &op);
 		ogg_stream_pageout(&os, &og);
-		print_page();
+		print_page(true);
 	}
+}
+
+/*
+ * End the current logical stream. The players continue with the next one
+ * chained after it, which may use a different sample rate.
+ */
+void ogg_sink::finish_stream()
+{
+	if (vorbis_analysis_wrote(&vs, 0))
+		throw runtime_error("vorbis_analysis_wrote failed");
+	encode_blocks();
+	while (ogg_stream_flush(&os, &og))
+		print_page(true);
+	ogg_stream_clear(&os);
+	vorbis_block_clear(&vb);
+	vorbis_dsp_clear(&vs);
+	vorbis_comment_clear(&comm);
+	vorbis_info_clear(&vi);
+}
+
+void ogg_sink::reconfigure(float quality, unsigned int sample_rate)
+{
+	new_quality.store(quality);
+	new_sample_rate.store(sample_rate);
+	reconfig_pending.store(true, std::memory_order_release);
+}
+
+void ogg_sink::set_squelch(bool val)
+{
+	squelch.store(val, std::memory_order_relaxed);
+}
+
+void ogg_sink::skip(uint64_t samples)
+{
+	skip_pending.store(samples, std::memory_order_relaxed);
+}
+
+void ogg_sink::set_recorder(boost::shared_ptr<struct audio_writer> w)
+{
+	std::lock_guard<std::mutex> lock(recorder_mutex);
+
+	recorder = w;
+	recorder_new = true;
+	recording.store(w != nullptr, std::memory_order_relaxed);
+}
+
+/*
+ * Pass the current page to the recording, if any. The header pages are
+ * kept, so that a recording started later can begin with them.
+ */
+void ogg_sink::tee_page()
+{
+	bool header;
+
+	if (ogg_page_bos(&og)) {
+		headers.clear();
+		header_packets = 0;
+	}
+	// The pages up to the end of the last Vorbis header packet
+	header = header_packets < VORBIS_HEADER_PACKETS;
+	{
+		std::lock_guard<std::mutex> lock(recorder_mutex);
+
+		if (recorder != nullptr && recorder_new && !headers.empty())
+			audio_record_page(recorder.get(), headers.data(),
+					headers.size(), nullptr, 0, true);
+		recorder_new = false;
+		if (recorder != nullptr)
+			audio_record_page(recorder.get(),
+					(const char *) og.header, og.header_len,
+					(const char *) og.body, og.body_len,
+					header);
+	}
+	if (header) {
+		headers.append((const char *) og.header, og.header_len);
+		headers.append((const char *) og.body, og.body_len);
+		header_packets += ogg_page_packets(&og);
+	}
+}
+
+/*
+ * Power squelch on the audio. Only saves anything on AM and SSB, the FM
+ * demodulator's noise keeps it open.
+ */
+bool ogg_sink::squelch_closed(const float *in, int n)
+{
+	double sum = 0.0;
+
+	samples_seen += n;
+	if (!squelch.load(std::memory_order_relaxed))
+		return false;
+	for (int i = 0; i < n; ++i)
+		sum += in[i] * in[i];
+	if (n && sum / n >= SQUELCH_LEVEL * SQUELCH_LEVEL)
+		last_loud = samples_seen;
+	return samples_seen - last_loud
+		> (uint64_t) sample_rate * SQUELCH_HANG_MS / 1000;
+}
+
+int ogg_sink::work(int noutput_items, gr_vector_const_void_star &input_items,
+			gr_vector_void_star &output_items)
+{
+	const float *in = (const float *) input_items[0];
+	float **buf;
+	uint64_t start = thread_cpu_ns();
+	uint64_t skip;
+
+	(void) output_items;
+
+	if (reconfig_pending.exchange(false, std::memory_order_acquire)) {
+		finish_stream();
+		quality = new_quality.load();
+		sample_rate = new_sample_rate.load();
+		init_encoder();
+	}
+	// Reconnected with stereo input or back, see monitor.h
+	if ((int) input_items.size() != n_channels) {
+		finish_stream();
+		n_channels = input_items.size();
+		init_encoder();
+	}
+	if (!held.empty() && put_held())
+		notify_reader();
+	// The start-up transient of a receiver primed with history
+	skip = skip_pending.load(std::memory_order_relaxed);
+	if (skip) {
+		skip = std::min(skip, (uint64_t) noutput_items);
+		skip_pending.fetch_sub(skip, std::memory_order_relaxed);
+		return skip;
+	}
+	// The skipped audio is left out of the stream, the listener just
+	// hears the next sound sooner
+	if (squelch_closed(in, noutput_items))
+		return noutput_items;
+	// Headless and not recorded, nobody would get the pages
+	if (fd < 0 && !recording.load(std::memory_order_relaxed))
+		return noutput_items;
+
+	track_input_latency(noutput_items);
+	samples_in += noutput_items;
+
+	buf = vorbis_analysis_buffer(&vs, noutput_items);
+	for (int i = 0; i < n_channels; ++i)
+		memcpy(buf[i], input_items[i], noutput_items * sizeof(*in));
+	if (vorbis_analysis_wrote(&vs, noutput_items))
+		throw runtime_error("vorbis_analysis_wrote failed");
+	encode_blocks();
+	stats->samples_encoded.fetch_add(noutput_items,
+			std::memory_order_relaxed);
+	stats->encoder_ns.fetch_add(thread_cpu_ns() - start,
+			std::memory_order_relaxed);
 	return noutput_items;
 }
 
-void ogg_sink::print_page(void)
+/*
+ * Check whether the current page can be written to the pipe without
+ * blocking. Only this block writes to the pipe, so the free space can only
+ * grow between the check and the write.
+ */
+bool ogg_sink::page_fits(void)
+{
+	int queued;
+
+	if (ring) {
+		return sizeof(uint32_t) + og.header_len + og.body_len
+			<= AUDIO_RING_SIZE - audio_ring_used(ring);
+	}
+	if (pipe_size < 0)
+		return true;
+	if (ioctl(fd, FIONREAD, &queued) < 0)
+		return true;
+	return og.header_len + og.body_len <= pipe_size - queued;
+}
+
+/* Tell the reader of the ring about new pages */
+void ogg_sink::notify_reader()
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		throw runtime_error(string("write failed")
+				+ string(strerror(errno)));
+}
+
+/* Put the held pages into the ring in order. True if any went in. */
+bool ogg_sink::put_held()
+{
+	bool ret = false;
+
+	while (!held.empty() && audio_ring_put(ring, held.front().data(),
+				held.front().size(), nullptr, 0)) {
+		held.pop_front();
+		ret = true;
+	}
+	return ret;
+}
+
+/*
+ * Write the whole current page, waiting for a pipe reader if needed. A
+ * page for a ring that can't be dropped is held back until the reader
+ * makes room, later pages can't overtake it. Returns false if the page
+ * was dropped.
+ */
+bool ogg_sink::write_page(bool may_drop)
 {
-        long len;
-        for (len = 0; len < og.header_len;) {
-                long tmp = write(fd, og.header + len, og.header_len - len);
-                if (tmp <= 0)
+	bool moved;
+	long len;
+
+	if (ring) {
+		moved = put_held();
+		if (held.empty() && audio_ring_put(ring, og.header,
+					og.header_len, og.body, og.body_len)) {
+			notify_reader();
+			return true;
+		}
+		if (moved)
+			notify_reader();
+		// The front-end may have stopped reading for good
+		if (may_drop || held.size() >= RING_MAX_HELD)
+			return false;
+		held.push_back(string((const char *) og.header, og.header_len)
+				+ string((const char *) og.body, og.body_len));
+		return true;
+	}
+	for (len = 0; len < og.header_len;) {
+		long tmp = write(fd, og.header + len, og.header_len - len);
+		if (tmp <= 0)
 			throw runtime_error(string("write failed")
 					+ string(strerror(errno)));
-                len += tmp;
-        }
-        for (len = 0; len < og.body_len;) {
-                long tmp = write(fd, og.body + len, og.body_len - len);
-                if (tmp <= 0)
+		len += tmp;
+	}
+	for (len = 0; len < og.body_len;) {
+		long tmp = write(fd, og.body + len, og.body_len - len);
+		if (tmp <= 0)
 			throw runtime_error("write failed");
-                len += tmp;
-        }
+		len += tmp;
+	}
+	return true;
+}
+
+/*
+ * Write the current page to the output. If may_drop is set and the reader
+ * isn't keeping up, the page is dropped instead of stalling the flowgraph.
+ */
+void ogg_sink::print_page(bool may_drop)
+{
+	bool dropped;
+
+	if (og.header_len + og.body_len == 0)
+		return;
+	// Recorded even if the listener doesn't keep up
+	tee_page();
+	if (fd < 0) {
+		memset(&og, 0, sizeof(og));
+		return;
+	}
+	dropped = (may_drop && !page_fits()) || !write_page(may_drop);
+	if (dropped) {
+		stats->pages_dropped.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		bytes_out += og.header_len + og.body_len;
+		stats->pages_written.fetch_add(1, std::memory_order_relaxed);
+	}
+	track_page_latency(ogg_page_granulepos(&og) < 0 ? -1
+			: ogg_page_granulepos(&og) + (int64_t) granule_base,
+			!dropped);
         memset(&og, 0, sizeof(og));
 }
+
+/*
+ * Look for the timestamp tags added by timestamp_tagger in the input and
+ * remember them until the samples they belong to get encoded.
+ */
+void ogg_sink::track_input_latency(int noutput_items)
+{
+	std::vector<gr::tag_t> tags;
+	uint64_t start = nitems_read(0);
+	uint64_t now;
+
+	get_tags_in_range(tags, 0, start, start + noutput_items,
+			timestamp_tag_key());
+	if (tags.empty())
+		return;
+	now = monotonic_ns();
+	for (const gr::tag_t &tag : tags) {
+		struct pending_timestamp ts;
+
+		ts.source_ns = pmt::to_uint64(tag.value);
+		ts.input_ns = now;
+		ts.sample = samples_in + (tag.offset - start);
+		latency_record(&stats->dsp_latency, now - ts.source_ns);
+		if (pending.size() < MAX_PENDING_TIMESTAMPS)
+			pending.push_back(ts);
+	}
+}
+
+/*
+ * Called for every page. All the pending timestamps up to the page's
+ * granule position are now encoded. The oldest one is passed on with the
+ * page, so that the HTTP stream can measure the rest of the way.
+ */
+void ogg_sink::track_page_latency(int64_t granulepos, bool written)
+{
+	struct page_timestamp ts;
+	bool found = false;
+	uint64_t now;
+
+	if (pending.empty() || granulepos < 0
+			|| pending.front().sample > (uint64_t) granulepos)
+		return;
+	now = monotonic_ns();
+	while (!pending.empty()
+			&& pending.front().sample <= (uint64_t) granulepos) {
+		latency_record(&stats->encoder_latency,
+				now - pending.front().input_ns);
+		if (!found) {
+			ts.source_ns = pending.front().source_ns;
+			found = true;
+		}
+		pending.pop_front();
+	}
+	if (!written)
+		return;
+	ts.end_offset = bytes_out;
+	ts.page_ns = now;
+	page_written(stats.get(), ts);
+}
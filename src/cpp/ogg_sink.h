@@ -22,20 +22,103 @@
 #define OGG_SINK_H
 
 #include <config.h>
+#include "audio_record.h"
+#include "audio_ring.h"
+#include "metrics.h"
 #include <boost/shared_ptr.hpp>
 #include <gnuradio/sync_block.h>
 #include <ogg/ogg.h>
 #include <vorbis/codec.h>
 #include <vorbis/vorbisenc.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
 
+#define MAX_PENDING_TIMESTAMPS 256
+// RMS below which the squelch gate closes
+#define SQUELCH_LEVEL 0.01f
+// How long the gate stays open after the audio went quiet
+#define SQUELCH_HANG_MS 500
+// Pages that can't be dropped held back while a ring is full
+#define RING_MAX_HELD 16
+
+/*
+ * Encodes one input as mono or two as stereo. The number of connected
+ * inputs may change while the flowgraph is locked, the encoder then
+ * chains a new stream with the new channel count.
+ */
 class ogg_sink : virtual public gr::sync_block {
 public:
 	typedef boost::shared_ptr<ogg_sink> sptr;
-	static sptr make(int outfd, int n_channels, unsigned int sample_rate);
+	/**
+	 * outfd -1 passes the pages only to the recorder, and skips the
+	 * encoding while there is none.
+	 */
+	static sptr make(int outfd, int n_channels, unsigned int sample_rate,
+			boost::shared_ptr<receiver_stats> stats);
+	/**
+	 * Write the pages into a shared memory ring instead, and signal
+	 * notify_fd (an eventfd) after each one. See worker.h.
+	 */
+	static sptr make(struct audio_ring *ring, int notify_fd,
+			int n_channels, unsigned int sample_rate,
+			boost::shared_ptr<receiver_stats> stats);
 	int work(int noutpuut_items, gr_vector_const_void_star &input_items,
 			gr_vector_void_star &output_items);
+	/**
+	 * Switch the encoder to new settings. Takes effect at the start of
+	 * the next work() call, by ending the Ogg stream and chaining a new
+	 * one. Any thread.
+	 */
+	void reconfigure(float quality, unsigned int sample_rate);
+	/** Skip encoding while the input is silent. Any thread. */
+	void set_squelch(bool val);
+	/** Leave the next samples of the input out of the stream. Any thread. */
+	void skip(uint64_t samples);
+	/**
+	 * Also pass the pages to a recording, starting with the headers of
+	 * the current stream, see audio_record.h. nullptr stops. Any thread.
+	 */
+	void set_recorder(boost::shared_ptr<struct audio_writer> w);
 private:
 	int fd;
+	struct audio_ring *ring;
+	int n_channels;
+	unsigned int sample_rate;
+	float quality;
+	// Random start, so that the links of chains that are joined
+	// together, e.g. by an edge, have different serial numbers
+	uint32_t serial;
+	// Input samples consumed before the current Ogg stream started
+	uint64_t granule_base;
+	std::atomic<bool> reconfig_pending;
+	std::atomic<float> new_quality;
+	std::atomic<unsigned int> new_sample_rate;
+	std::atomic<bool> squelch;
+	std::atomic<uint64_t> skip_pending;
+	// Input samples seen, including the ones skipped by the squelch
+	uint64_t samples_seen;
+	uint64_t last_loud;
+	int pipe_size;
+	boost::shared_ptr<receiver_stats> stats;
+	struct pending_timestamp {
+		uint64_t sample;
+		uint64_t source_ns;
+		uint64_t input_ns;
+	};
+	std::deque<pending_timestamp> pending;
+	std::mutex recorder_mutex;
+	boost::shared_ptr<struct audio_writer> recorder;
+	std::atomic<bool> recording;
+	// Whether the recorder still needs the headers
+	bool recorder_new;
+	// The header pages of the current stream
+	std::string headers;
+	// Header packets in them
+	int header_packets;
+	uint64_t samples_in;
+	uint64_t bytes_out;
 	vorbis_info vi;
 	vorbis_dsp_state vs;
 	vorbis_comment comm;
@@ -43,8 +126,23 @@ private:
 	ogg_packet op, op_comm, op_code;
 	ogg_stream_state os;
 	ogg_page og;
-	ogg_sink(int outfd, int n_channels, unsigned int sample_rate);
-	void print_page(void);
+	// Pages that can't be dropped, waiting for room in the ring
+	std::deque<std::string> held;
+	ogg_sink(int outfd, struct audio_ring *ring, int n_channels,
+			unsigned int sample_rate,
+			boost::shared_ptr<receiver_stats> stats);
+	bool write_page(bool may_drop);
+	bool put_held();
+	void notify_reader();
+	void init_encoder();
+	void encode_blocks();
+	void finish_stream();
+	bool squelch_closed(const float *in, int n);
+	bool page_fits(void);
+	void print_page(bool may_drop);
+	void tee_page();
+	void track_input_latency(int noutput_items);
+	void track_page_latency(int64_t granulepos, bool written);
 };
 
 #endif
@@ -0,0 +1,229 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+#include <config.h>
+#include "overrun.h"
+#include "broadcast.h"
+#include "globals.h"
+#include "metrics.h"
+#include "source_state.h"
+#include "utils.h"
+#include "worker.h"
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+struct overrun_config overrun_config = { false };
+
+static deque<struct overrun_event> history;
+static mutex history_mutex;
+static atomic<uint64_t> last_restart_ns{0};
+static atomic<uint64_t> marks{0};
+static int stderr_pipe = -1;
+static int orig_stderr = -1;
+static thread drain_thread;
+// Marks scanner state, carried over between reads
+static int run_len;
+static bool run_ok;
+static char prev_char = '\n';
+
+static uint64_t since_restart(uint64_t now)
+{
+	uint64_t restart = last_restart_ns.load();
+
+	return restart ? now - restart : 0;
+}
+
+static void record(struct overrun_event &ev)
+{
+	lock_guard<mutex> lock(history_mutex);
+	history.push_back(ev);
+	if (history.size() > OVERRUN_HISTORY)
+		history.pop_front();
+}
+
+void overrun_detected(size_t source_ix, uint64_t lost_samples)
+{
+	uint64_t since = since_restart(monotonic_ns());
+
+	// A worker process leaves the books to the front-end
+	if (worker_forward_overrun(source_ix, lost_samples, since))
+		return;
+	overrun_account(source_ix, lost_samples, since);
+}
+
+void overrun_account(size_t source_ix, uint64_t lost_samples,
+		uint64_t since_reconfig_ns)
+{
+	boost::shared_ptr<source_stats> stats = sources_info[source_ix].stats;
+	struct overrun_event ev;
+
+	ev.time_ns = monotonic_ns();
+	ev.since_reconfig_ns = since_reconfig_ns;
+	ev.source_ix = source_ix;
+	ev.lost_samples = lost_samples;
+	ev.listeners = count_receivers_running_on(source_ix);
+	record(ev);
+	stats->overruns.fetch_add(1);
+	stats->lost_samples.fetch_add(lost_samples);
+	stats->last_overrun_ns.store(ev.time_ns);
+	cout << "Overrun on source " << source_ix << ": lost "
+		<< lost_samples * 1000.0 / get_source_state(source_ix)->sample_rate
+		<< " ms, " << ev.listeners << " listeners, "
+		<< ev.since_reconfig_ns / 1e9
+		<< " s after the flowgraph was restarted" << endl;
+	// Tell the listeners of the source
+	broadcast_changed(BROADCAST_OVERRUNS, source_ix);
+}
+
+void flowgraph_restarted()
+{
+	last_restart_ns.store(monotonic_ns());
+}
+
+static void driver_marks(int n)
+{
+	struct overrun_event ev;
+
+	marks.fetch_add(n);
+	ev.time_ns = monotonic_ns();
+	ev.since_reconfig_ns = since_restart(ev.time_ns);
+	ev.source_ix = -1;
+	ev.lost_samples = 0;
+	ev.listeners = count_receivers_running();
+	record(ev);
+}
+
+/*
+ * The drivers print a lone 'O' (or a run of them) for every overrun. A run
+ * counts if it isn't part of a word.
+ */
+static int count_marks(const char *buf, ssize_t len)
+{
+	int ret = 0;
+
+	for (ssize_t i = 0; i < len; ++i) {
+		char c = buf[i];
+
+		if (c == 'O') {
+			if (!run_len)
+				run_ok = !isalnum((unsigned char) prev_char);
+			++run_len;
+		} else {
+			if (run_len && run_ok && !isalnum((unsigned char) c))
+				ret += run_len;
+			run_len = 0;
+		}
+		prev_char = c;
+	}
+	// The marks are flushed without a newline, don't wait for one
+	if (run_len && run_ok)
+		ret += run_len;
+	run_len = 0;
+	return ret;
+}
+
+/* Until the last writer is gone */
+static void drain_stderr()
+{
+	char buf[4096];
+	ssize_t n, written;
+	int found;
+
+	while ((n = read(stderr_pipe, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		found = count_marks(buf, n);
+		if (found)
+			driver_marks(found);
+		for (ssize_t off = 0; off < n; off += written) {
+			written = write(orig_stderr, buf + off, n - off);
+			if (written <= 0)
+				break;
+		}
+	}
+}
+
+int overrun_hook_stderr()
+{
+	int fds[2];
+
+	if (!overrun_config.driver_marks)
+		return 0;
+	orig_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+	if (orig_stderr < 0) {
+		perror("fcntl");
+		return -1;
+	}
+	if (pipe2(fds, O_CLOEXEC)) {
+		perror("pipe2");
+		return -1;
+	}
+	// The worker processes inherit the write end with stderr
+	if (dup2(fds[1], STDERR_FILENO) < 0) {
+		perror("dup2");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	close(fds[1]);
+	stderr_pipe = fds[0];
+	drain_thread = thread(drain_stderr);
+	return 0;
+}
+
+/*
+ * Closing the last write end ends the thread, once the workers are gone
+ * too.
+ */
+void overrun_unhook_stderr()
+{
+	if (orig_stderr < 0)
+		return;
+	dup2(orig_stderr, STDERR_FILENO);
+	drain_thread.join();
+	close(stderr_pipe);
+	stderr_pipe = -1;
+	close(orig_stderr);
+	orig_stderr = -1;
+}
+
+uint64_t driver_overrun_marks()
+{
+	return marks.load();
+}
+
+vector<struct overrun_event> overrun_history()
+{
+	lock_guard<mutex> lock(history_mutex);
+
+	return vector<struct overrun_event>(history.begin(), history.end());
+}
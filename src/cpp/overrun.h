@@ -0,0 +1,85 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+#ifndef OVERRUN_H
+#define OVERRUN_H
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Source overruns. The timestamp tagger of each source compares the
+ * number of samples it got to the source's sample rate, lost samples show
+ * up as a lasting deficit. The 'O' marks the osmosdr drivers print to
+ * stderr are counted too, but they don't tell which source overran.
+ */
+
+// Period over which the smallest sample deficit is taken
+#define OVERRUN_WINDOW_MS 1000
+// Smallest loss reported as an overrun
+#define OVERRUN_MIN_LOST_MS 2
+// Number of recent overruns kept for the admin view
+#define OVERRUN_HISTORY 64
+
+struct overrun_config {
+	// Count the marks of the drivers, see overrun_hook_stderr()
+	bool driver_marks;
+};
+
+extern struct overrun_config overrun_config;
+
+struct overrun_event {
+	// Monotonic time of the detection
+	uint64_t time_ns;
+	// -1 for a driver mark
+	int source_ix;
+	// 0 if unknown
+	uint64_t lost_samples;
+	// Running receivers on the source, or on all sources for driver marks
+	int listeners;
+	// Time since the flowgraph was last (re)started, e.g. by
+	// topbl->lock() and unlock()
+	uint64_t since_reconfig_ns;
+};
+
+/** Called by the source's tagger when samples went missing. Any thread. */
+void overrun_detected(size_t source_ix, uint64_t lost_samples);
+/**
+ * Book an overrun detected elsewhere, e.g. by the source's worker process.
+ * Any thread.
+ */
+void overrun_account(size_t source_ix, uint64_t lost_samples,
+		uint64_t since_reconfig_ns);
+/** Called whenever the flowgraph is (re)started. Any thread. */
+void flowgraph_restarted();
+/**
+ * Count the overrun marks printed to stderr, if overrun_config says so.
+ * stderr becomes a pipe read by a thread of its own, which passes the
+ * output on to the original stderr. Writers block while it's full, like
+ * they would on a terminal.
+ */
+int overrun_hook_stderr();
+/** Give the process its original stderr back */
+void overrun_unhook_stderr();
+uint64_t driver_overrun_marks();
+std::vector<struct overrun_event> overrun_history();
+
+#endif
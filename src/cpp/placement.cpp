@@ -0,0 +1,260 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "placement.h"
+#include "globals.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+struct placement_config placement_config = { {}, {}, false, 30, 20, 10 };
+
+// CPUs not reserved for anything, used where nothing was configured
+static vector<int> free_cpus;
+static once_flag realtime_probed;
+static bool realtime_ok;
+
+static bool active()
+{
+	if (placement_config.realtime || !placement_config.service_cores.empty()
+			|| !placement_config.receiver_cores.empty())
+		return true;
+	for (const source_info_t &info : sources_info) {
+		if (!info.cores.empty())
+			return true;
+	}
+	return false;
+}
+
+static string format_cpus(const vector<int> &cpus)
+{
+	stringstream s;
+	size_t i, j;
+
+	for (i = 0; i < cpus.size(); i = j) {
+		for (j = i + 1; j < cpus.size() && cpus[j] == cpus[j - 1] + 1;)
+			++j;
+		if (i)
+			s << ",";
+		s << cpus[i];
+		if (j - i > 1)
+			s << "-" << cpus[j - 1];
+	}
+	return s.str();
+}
+
+static vector<int> cpu_list(const cpu_set_t &set)
+{
+	vector<int> ret;
+
+	for (int i = 0; i < CPU_SETSIZE; ++i) {
+		if (CPU_ISSET(i, &set))
+			ret.push_back(i);
+	}
+	return ret;
+}
+
+/* The actual placement of the calling thread */
+static string describe_self()
+{
+	cpu_set_t set;
+	struct sched_param param;
+	int policy;
+	stringstream s;
+
+	if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+		s << "CPUs " << format_cpus(cpu_list(set));
+	if (pthread_getschedparam(pthread_self(), &policy, &param) == 0) {
+		if (policy == SCHED_FIFO)
+			s << ", SCHED_FIFO " << param.sched_priority;
+		else
+			s << ", SCHED_OTHER";
+	}
+	return s.str();
+}
+
+/*
+ * SCHED_FIFO needs CAP_SYS_NICE or an RLIMIT_RTPRIO, find out once
+ * whether we have it instead of failing on every thread.
+ */
+static void probe_realtime()
+{
+	struct sched_param param, rt;
+	int policy;
+
+	if (pthread_getschedparam(pthread_self(), &policy, &param) != 0)
+		return;
+	rt.sched_priority = 1;
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &rt) != 0) {
+		cerr << "Warning: SCHED_FIFO isn't permitted, the threads "
+				"keep the normal scheduling policy." << endl;
+		return;
+	}
+	pthread_setschedparam(pthread_self(), policy, &param);
+	realtime_ok = true;
+}
+
+static bool realtime()
+{
+	if (!placement_config.realtime)
+		return false;
+	call_once(realtime_probed, probe_realtime);
+	return realtime_ok;
+}
+
+static void pin_self(const vector<int> &cores, int priority)
+{
+	cpu_set_t set;
+	struct sched_param param;
+	int ret;
+
+	if (!cores.empty()) {
+		CPU_ZERO(&set);
+		for (int c : cores)
+			CPU_SET(c, &set);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret != 0) {
+			cerr << "Failed to pin a thread to CPUs "
+				<< format_cpus(cores) << ": " << strerror(ret)
+				<< endl;
+		}
+	}
+	if (realtime()) {
+		param.sched_priority = priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret != 0) {
+			cerr << "Failed to set SCHED_FIFO priority " << priority
+				<< ": " << strerror(ret) << endl;
+		}
+	}
+}
+
+static const vector<int> &or_free(const vector<int> &cores)
+{
+	return cores.empty() ? free_cpus : cores;
+}
+
+static void place_block(gr::block_sptr b, const vector<int> &cores,
+		int priority)
+{
+	if (!cores.empty())
+		b->set_processor_affinity(cores);
+	// Block threads inherit SCHED_FIFO from the service thread that
+	// starts them, GNU Radio only sets the priority
+	if (realtime())
+		b->set_thread_priority(priority);
+}
+
+void placement_enter_source(size_t ix, const vector<int> &cores,
+		struct saved_placement *saved)
+{
+	pthread_getaffinity_np(pthread_self(), sizeof(saved->cpus),
+			&saved->cpus);
+	pthread_getschedparam(pthread_self(), &saved->policy, &saved->param);
+	if (cores.empty() && !realtime())
+		return;
+	pin_self(cores, placement_config.source_priority);
+	cout << "Source " << ix << " driver threads: " << describe_self()
+		<< endl;
+}
+
+void placement_leave_source(const struct saved_placement *saved)
+{
+	pthread_setaffinity_np(pthread_self(), sizeof(saved->cpus),
+			&saved->cpus);
+	pthread_setschedparam(pthread_self(), saved->policy, &saved->param);
+}
+
+void placement_init()
+{
+	cpu_set_t set;
+	vector<int> reserved;
+
+	if (!active())
+		return;
+	reserved = placement_config.service_cores;
+	reserved.insert(reserved.end(), placement_config.receiver_cores.begin(),
+			placement_config.receiver_cores.end());
+	for (const source_info_t &info : sources_info)
+		reserved.insert(reserved.end(), info.cores.begin(),
+				info.cores.end());
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int c : cpu_list(set)) {
+			if (find(reserved.begin(), reserved.end(), c)
+					== reserved.end())
+				free_cpus.push_back(c);
+		}
+		if (free_cpus.empty())
+			free_cpus = cpu_list(set);
+	}
+
+	for (size_t i = 0; i < osmosdr_sources.size(); ++i) {
+		const vector<int> &cores = or_free(sources_info[i].cores);
+
+		// Opened by another worker process
+		if (osmosdr_sources[i] == nullptr)
+			continue;
+		if (!cores.empty())
+			osmosdr_sources[i]->set_processor_affinity(cores);
+		place_block(sources_info[i].tagger, cores,
+				placement_config.source_priority);
+		cout << "Source " << i << " blocks: CPUs "
+			<< format_cpus(cores);
+		if (realtime())
+			cout << ", priority " << placement_config.source_priority;
+		cout << endl;
+	}
+	cout << "Receiver blocks: CPUs "
+		<< format_cpus(or_free(placement_config.receiver_cores));
+	if (realtime())
+		cout << ", priority " << placement_config.receiver_priority;
+	cout << endl;
+}
+
+void placement_apply_receiver(const vector<gr::block_sptr> &blocks)
+{
+	if (!active())
+		return;
+	for (gr::block_sptr b : blocks) {
+		place_block(b, or_free(placement_config.receiver_cores),
+				placement_config.receiver_priority);
+	}
+}
+
+void placement_pin_service_thread(int tsi)
+{
+	const vector<int> &cores = placement_config.service_cores;
+
+	if (!active())
+		return;
+	// One core per thread, round robin
+	if (cores.empty())
+		pin_self(free_cpus, placement_config.service_priority);
+	else
+		pin_self(vector<int>(1, cores[tsi % cores.size()]),
+				placement_config.service_priority);
+	cout << "Service thread " << tsi << ": " << describe_self() << endl;
+}
@@ -0,0 +1,78 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <config.h>
+#include <gnuradio/block.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cstddef>
+#include <vector>
+
+/*
+ * CPU placement of the threads. Each source's driver reader thread and its
+ * timestamp tagger can get dedicated cores, the receivers' blocks and the
+ * service threads get their own sets. With realtime enabled, the threads
+ * run under SCHED_FIFO. Nothing is changed unless configured.
+ *
+ * GNU Radio threads inherit the placement of the thread that starts the
+ * flowgraph (a service thread), so once anything is configured, every
+ * block gets an explicit set.
+ */
+
+struct placement_config {
+	std::vector<int> service_cores;
+	std::vector<int> receiver_cores;
+	bool realtime;
+	// SCHED_FIFO priorities, 1-99
+	int source_priority;
+	int service_priority;
+	int receiver_priority;
+};
+
+extern struct placement_config placement_config;
+
+struct saved_placement {
+	cpu_set_t cpus;
+	int policy;
+	struct sched_param param;
+};
+
+/**
+ * Place the calling thread like the source's driver threads for the
+ * duration of the source's creation, the drivers start their reader
+ * threads there and those inherit the placement.
+ */
+void placement_enter_source(size_t ix, const std::vector<int> &cores,
+		struct saved_placement *saved);
+void placement_leave_source(const struct saved_placement *saved);
+/**
+ * Place the sources' blocks and report the placement. After the taggers
+ * were created, before any receiver is.
+ */
+void placement_init();
+/** Called by a receiver on its new blocks. Any thread. */
+void placement_apply_receiver(const std::vector<gr::block_sptr> &blocks);
+/** Called by each service thread before it starts servicing. */
+void placement_pin_service_thread(int tsi);
+
+#endif
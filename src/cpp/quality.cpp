@@ -0,0 +1,164 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+#include <config.h>
+#include "quality.h"
+#include "admission.h"
+#include "event_loop.h"
+#include "globals.h"
+#include "overrun.h"
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+struct quality_config quality_config = { true, 0.9, 0.7 };
+
+static const struct quality_params tiers[QUALITY_TIERS] = {
+	// vorbis_quality, audio_rate, short_filters, squelch
+	{ 0.5f, 24000, false, false },
+	{ 0.1f, 24000, false, false },
+	{ 0.1f, 12000, false, false },
+	{ 0.1f, 12000, true, false },
+	{ 0.1f, 12000, true, true },
+};
+
+static int timer_fd = -1;
+// Tier of the non-privileged receivers
+static int level = QUALITY_FULL;
+static int calm_ticks;
+static uint64_t last_overruns;
+
+const struct quality_params &quality_tier_params(int tier)
+{
+	if (tier < 0 || tier >= QUALITY_TIERS)
+		tier = QUALITY_FULL;
+	return tiers[tier];
+}
+
+/* The admission budget if there's one, all CPUs otherwise */
+static double capacity()
+{
+	long cpus;
+
+	if (admission_config.cpu_budget > 0)
+		return admission_config.cpu_budget;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+static uint64_t total_overruns()
+{
+	uint64_t ret = 0;
+
+	for (const source_info_t &info : sources_info)
+		ret += info.stats->overruns.load();
+	return ret + driver_overrun_marks();
+}
+
+/* Move all receivers to the tier they should be on */
+static void apply_level()
+{
+	vector<receiver::sptr> changed;
+	// The receivers' blocks may be replaced by other threads
+	lock_guard<mutex> lock(flowgraph_mutex);
+
+	for (auto pair : receiver_map.snapshot()) {
+		receiver::sptr rec = pair.second;
+		int tier = rec->get_privileged() ? QUALITY_FULL : level;
+
+		if (rec->get_quality_tier() != tier)
+			changed.push_back(rec);
+	}
+	if (changed.empty())
+		return;
+	// One reconfiguration of the flowgraph for all of them
+	topbl->lock();
+	for (receiver::sptr rec : changed)
+		rec->set_quality_tier(rec->get_privileged() ? QUALITY_FULL : level);
+	topbl->unlock();
+	// Let the clients know their tier
+	notify_all_clients();
+}
+
+/*
+ * Step down one tier while the receivers use more than high_load of the
+ * capacity or a source overruns. Step up one tier after the load has been
+ * below low_load for QUALITY_HOLD_TICKS ticks.
+ */
+static void quality_tick()
+{
+	uint64_t expirations, overruns;
+	double load;
+	bool overrun;
+
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	load = admission_measured_load() / capacity();
+	overruns = total_overruns();
+	overrun = overruns != last_overruns;
+	last_overruns = overruns;
+
+	if (load > quality_config.high_load || overrun) {
+		calm_ticks = 0;
+		if (level < QUALITY_TIERS - 1) {
+			++level;
+			cout << "Load " << load << (overrun ? " with overruns" : "")
+				<< ", lowering quality to tier " << level
+				<< endl;
+		}
+	} else if (load < quality_config.low_load && level > QUALITY_FULL) {
+		if (++calm_ticks >= QUALITY_HOLD_TICKS) {
+			calm_ticks = 0;
+			--level;
+			cout << "Load " << load << ", raising quality to tier "
+				<< level << endl;
+		}
+	} else {
+		calm_ticks = 0;
+	}
+	// Also catches receivers whose users logged in or out
+	apply_level();
+}
+
+int quality_init()
+{
+	struct itimerspec its = {};
+
+	if (!quality_config.enabled)
+		return 0;
+	last_overruns = total_overruns();
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+	its.it_value.tv_sec = QUALITY_INTERVAL_MS / 1000;
+	its.it_value.tv_nsec = QUALITY_INTERVAL_MS % 1000 * 1000000;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(timer_fd, 0, &its, nullptr)) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	return event_loop_add_fd(timer_fd, quality_tick);
+}
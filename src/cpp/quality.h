@@ -0,0 +1,68 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include <config.h>
+
+/*
+ * Quality ladder. When the server runs out of CPU, the receivers of
+ * non-privileged users are stepped down one tier at a time, and stepped
+ * back up once the load has been low for a while.
+ */
+
+enum quality_tier {
+	QUALITY_FULL,
+	// Lower Vorbis quality
+	QUALITY_LOW_BITRATE,
+	// Lower audio rate, cheaper resampler and encoder
+	QUALITY_LOW_RATE,
+	// Shorter channel filter
+	QUALITY_SHORT_FILTERS,
+	// Nothing is encoded while the audio is silent
+	QUALITY_SQUELCH,
+	QUALITY_TIERS
+};
+
+struct quality_params {
+	float vorbis_quality;
+	int audio_rate;
+	bool short_filters;
+	bool squelch;
+};
+
+#define QUALITY_INTERVAL_MS 2000
+// Ticks of low load before stepping up again
+#define QUALITY_HOLD_TICKS 5
+
+struct quality_config {
+	bool enabled;
+	// Fractions of the CPU capacity, see README
+	double high_load;
+	double low_load;
+};
+
+extern struct quality_config quality_config;
+
+const struct quality_params &quality_tier_params(int tier);
+/** Start the controller. Before event_loop_run(). */
+int quality_init();
+
+#endif
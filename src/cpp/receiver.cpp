@@ -20,12 +20,23 @@
 
 #include <config.h>
 #include "receiver.h"
+#include "buffers.h"
 #include "fm_demod.h"
 #include "am_demod.h"
 #include "ssb_demod.h"
+#include "placement.h"
+#include "quality.h"
+#include "taps.h"
+#include "source_state.h"
 #include "utils.h"
+#include "remote.h"
 #include <algorithm>
-#include <boost/math/common_factor_rt.hpp>
+#include <boost/make_shared.hpp>
+#include <gnuradio/high_res_timer.h>
+#include <iostream>
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 
 using namespace std;
 using namespace gr;
@@ -37,30 +48,90 @@ vector<string> receiver::supported_demods = { "WBFM", "NBFM", "AM", "LSB", "USB"
 receiver::sptr receiver::make(gr::top_block_sptr top_bl,
 			int fds[2])
 {
-	return boost::shared_ptr<receiver>(new receiver(top_bl, fds));
+	return boost::shared_ptr<receiver>(new receiver(top_bl, fds, nullptr));
 }
 
-receiver::receiver(gr::top_block_sptr top_bl, int fds[2])
+receiver::sptr receiver::make(gr::top_block_sptr top_bl,
+		struct audio_ring *ring, int notify_fd)
+{
+	int fds[2] = { -1, notify_fd };
+
+	return boost::shared_ptr<receiver>(new receiver(top_bl, fds, ring));
+}
+
+receiver::sptr receiver::make_remote()
+{
+	int fds[2] = { -1, -1 };
+
+	fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fds[0] < 0) {
+		perror("eventfd");
+		return nullptr;
+	}
+	return boost::shared_ptr<receiver>(new receiver(nullptr, fds,
+				nullptr));
+}
+
+receiver::sptr receiver::make_headless(gr::top_block_sptr top_bl)
+{
+	int fds[2] = { -1, -1 };
+
+	return boost::shared_ptr<receiver>(new receiver(top_bl, fds, nullptr));
+}
+
+/* Remote receivers have no flowgraph, see make_remote() */
+receiver::receiver(gr::top_block_sptr top_bl, int fds[2],
+		struct audio_ring *ring)
 	: hier_block2("receiver", io_signature::make(1, 1, sizeof (gr_complex)),
 			io_signature::make(0, 0, 0)),
-	top_bl(top_bl), privileged(false),
-	audio_rate(24000), running(false)
+	top_bl(top_bl), stereo(false), dsp_ns_base(0), buffer_bytes(0),
+	default_buffer_bytes(0), buffer_bytes_stale(true),
+	privileged(false),
+	audio_rate(quality_tier_params(QUALITY_FULL).audio_rate),
+	quality_tier(QUALITY_FULL), running(false), remote(top_bl == nullptr),
+	remote_source_set(false), remote_freq_offset(0), remote_slot(-1),
+	reader({ nullptr, 0 }), reader_source(0), reader_slot(-1),
+	switch_pending(false)
 {
 	this->fds[0] = fds[0];
 	this->fds[1] = fds[1];
 
-	sink = ogg_sink::make(fds[1], 1, audio_rate);
+	stats = boost::make_shared<receiver_stats>();
+	if (remote)
+		return;
+	if (ring)
+		sink = ogg_sink::make(ring, fds[1], 1, audio_rate, stats);
+	else
+		sink = ogg_sink::make(fds[1], 1, audio_rate, stats);
 }
 
 receiver::~receiver()
 {
+	stop_recording();
+	if (remote) {
+		if (remote_slot >= 0)
+			remote_ops->close(source_ix, remote_slot);
+		if (reader_slot >= 0)
+			remote_ops->release_ring(reader_source, reader_slot);
+		// The pending switch never happened, let go of the new ring
+		if (switch_pending && remote_slot >= 0
+				&& (remote_slot != reader_slot
+					|| source_ix != reader_source))
+			remote_ops->release_ring(source_ix, remote_slot);
+	}
 	disconnect_all();
-	close(fds[0]);
-	close(fds[1]);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
 }
 
 void receiver::connect_blocks()
 {
+	if (!monitor.empty()) {
+		connect_monitor();
+		return;
+	}
 	connect(self(), 0, xlate, 0);
 	connect(xlate, 0, demod, 0);
 	if (low_pass != nullptr) {
@@ -70,6 +141,30 @@ void receiver::connect_blocks()
 		connect(demod, 0, resampler, 0);
 	}
 	connect(resampler, 0, sink, 0);
+	if (audio_tap != nullptr)
+		connect(resampler, 0, audio_tap, 0);
+}
+
+void receiver::connect_monitor()
+{
+	connect(self(), 0, bank, 0);
+	for (size_t i = 0; i < chains.size(); ++i) {
+		const struct monitor_chain &ch = chains[i];
+
+		connect(bank, i, ch.demod, 0);
+		if (ch.low_pass != nullptr) {
+			connect(ch.demod, 0, ch.low_pass, 0);
+			connect(ch.low_pass, 0, ch.resampler, 0);
+		} else {
+			connect(ch.demod, 0, ch.resampler, 0);
+		}
+		connect(ch.resampler, 0, mixer, i);
+	}
+	connect(mixer, 0, sink, 0);
+	if (stereo)
+		connect(mixer, 1, sink, 1);
+	if (audio_tap != nullptr)
+		connect(mixer, 0, audio_tap, 0);
 }
 
 int receiver::trim_freq_offset(int offset, int src_rate)
@@ -82,127 +177,197 @@ int receiver::trim_freq_offset(int offset, int src_rate)
 		return offset;
 }
 
-int optimal_decimation(int in_rate, int out_rate)
-{
-	// FIXME Optimize
-	int d;
-
-	if (in_rate < out_rate)
-		return 1;
-	for (d = 1; in_rate / d > out_rate; d *= 2)
-		;
-	if (in_rate / d == out_rate && in_rate % d == 0)
-		return d;
-	d /= 2;
-	for (; in_rate / d > out_rate; ++d)
-		;
-	if (in_rate / d == out_rate && in_rate % d == 0)
-		return d;
-	--d;
-	// For some reason, the AM demod doesn't work with sample rates
-	// like 25kHz, trying multiples of 4kHz
-	for (; d > 1 && (in_rate % d != 0 || (in_rate / d) % 4000 != 0); --d)
-		;
-	if (d < 1)
-		d = 1;
-	return d;
+/* The demodulator for the output of the channel filter of taps */
+gr::basic_block_sptr receiver::make_demod(const string &d,
+		channel_taps_sptr taps, vector<block_sptr> *blocks)
+{
+	if (d == "WBFM" || d == "NBFM") {
+		fm_demod::sptr fm = fm_demod::make(taps->dec_rate,
+				d == "WBFM" ? 75000 : 4000);
+		*blocks = fm->get_blocks();
+		return fm;
+	} else if (d == "AM") {
+		am_demod::sptr am = am_demod::make();
+		*blocks = am->get_blocks();
+		return am;
+	} else {
+		ssb_demod::sptr ssb = ssb_demod::make(taps->dec_rate,
+				d == "CW" ? 0.05 : 0.1);
+		*blocks = ssb->get_blocks();
+		return ssb;
+	}
 }
 
 bool receiver::change_demod(string d)
 {
 	int src_rate;
-	int dec;
-	int dec_rate;
 	int offset;
-	vector<gr_complex> taps;
+	channel_taps_sptr taps;
 
-	if (source == nullptr)
+	if (!has_source())
 		return false;
 	if (find(supported_demods.begin(), supported_demods.end(), d)
 			== supported_demods.end()) {
 		return false;
 	}
+	if (remote) {
+		cur_demod = d;
+		if (remote_slot >= 0)
+			remote_ops->set_demod(source_ix, remote_slot, d);
+		return true;
+	}
 
 	src_rate = source->get_sample_rate();
+	taps = get_channel_taps(d, src_rate, audio_rate,
+			quality_tier_params(quality_tier).short_filters);
+	if (taps == nullptr)
+		return false;
 	offset = xlate == nullptr ? 0
 			: trim_freq_offset(xlate->center_freq(), src_rate);
+	// The blocks are about to be replaced, keep the time they consumed
+	dsp_ns_base = dsp_cpu_ns();
 	disconnect_all();
-	low_pass = nullptr;
-	if (d == "WBFM") {
-		dec = optimal_decimation(src_rate, 2 * (75000 + 25000));
-		dec_rate = src_rate / dec;
-		taps = taps_f2c(firdes::low_pass(1.0, src_rate, 75000, 25000));
-		demod = fm_demod::make(dec_rate, 75000);
-
-		int div = boost::math::gcd(dec_rate, audio_rate);
-		int audio_int = audio_rate / div;
-		int audio_dec = dec_rate / div;
-		resampler = rational_resampler_base_fff::make(audio_int, audio_dec,
-				firdes::low_pass(1.0, dec_rate, audio_rate / 2, 4000));
-		low_pass = fir_filter_fff::make(1, firdes::low_pass(1.0, dec_rate, audio_rate / 2, 4000));
-	} else if (d == "NBFM") {
-		dec = optimal_decimation(src_rate, 2 * (4000 + 2000));
-		dec_rate = src_rate / dec;
-		taps = taps_f2c(firdes::low_pass(1.0, src_rate, 4000, 2000));
-		demod = fm_demod::make(dec_rate, 4000);
-
-		int div = boost::math::gcd(dec_rate, audio_rate);
-		int audio_int = audio_rate / div;
-		int audio_dec = dec_rate / div;
-		resampler = rational_resampler_base_fff::make(audio_int, audio_dec,
-				firdes::low_pass(1.0, dec_rate, 4000, 2000));
-	} else if (d == "AM") {
-		dec = optimal_decimation(src_rate, 2 * (4000 + 2000));
-		dec_rate = src_rate / dec;
-		taps = taps_f2c(firdes::low_pass(1.0, src_rate, 4000, 2000));
-		demod = am_demod::make();
-
-		int div = boost::math::gcd(dec_rate, audio_rate);
-		int audio_int = audio_rate / div;
-		int audio_dec = dec_rate / div;
-		resampler = rational_resampler_base_fff::make(audio_int, audio_dec,
-				firdes::low_pass(1.0, dec_rate, 4000, 2000));
-	} else if (d == "USB") {
-		dec = optimal_decimation(src_rate, 12000);
-		dec_rate = src_rate / dec;
-		taps = firdes::complex_band_pass(1.0, src_rate, 420, 2800, 400, firdes::WIN_KAISER, 2.0);
-		demod = ssb_demod::make(dec_rate, 0.1);
-
-		int div = boost::math::gcd(dec_rate, audio_rate);
-		int audio_int = audio_rate / div;
-		int audio_dec = dec_rate / div;
-		resampler = rational_resampler_base_fff::make(audio_int, audio_dec,
-				firdes::low_pass(1.0, dec_rate, 2500, 1000));
-	} else if (d == "LSB") {
-		dec = optimal_decimation(src_rate, 12000);
-		dec_rate = src_rate / dec;
-		taps = firdes::complex_band_pass(1.0, src_rate, -2800, -420, 400, firdes::WIN_KAISER, 2.0);
-		demod = ssb_demod::make(dec_rate, 0.1);
-
-		int div = boost::math::gcd(dec_rate, audio_rate);
-		int audio_int = audio_rate / div;
-		int audio_dec = dec_rate / div;
-		resampler = rational_resampler_base_fff::make(audio_int, audio_dec,
-				firdes::low_pass(1.0, dec_rate, 2500, 1000));
-	} else if (d == "CW") {
-		dec = optimal_decimation(src_rate, 1000);
-		dec_rate = src_rate / dec;
-		taps = firdes::complex_band_pass(1.0, src_rate, 1, 400, 400,
-				firdes::WIN_KAISER, 1.0);
-		demod = ssb_demod::make(dec_rate, 0.05);
-
-		int div = boost::math::gcd(dec_rate, audio_rate);
-		int audio_int = audio_rate / div;
-		int audio_dec = dec_rate / div;
-		resampler = rational_resampler_base_fff::make(audio_int, audio_dec,
-				firdes::low_pass(1.0, dec_rate, 500, 500));
-	}
+	monitor.clear();
+	chains.clear();
+	bank.reset();
+	mixer.reset();
+	stereo = false;
+	demod = make_demod(d, taps, &demod_blocks);
+	if (taps->low_pass.empty())
+		low_pass = nullptr;
+	else
+		low_pass = fir_filter_fff::make(1, taps->low_pass);
+	resampler = rational_resampler_base_fff::make(taps->resampler_interp,
+			taps->resampler_dec, taps->resampler);
 	cur_demod = d;
-	xlate = freq_xlating_fir_filter_ccc::make(dec, taps, offset, src_rate);
+	xlate = freq_xlating_fir_filter_ccc::make(taps->dec, taps->xlate,
+			offset, src_rate);
+	apply_buffer_policy(xlate, BUFFER_STAGE_CHANNEL, taps->dec_rate);
+	for (block_sptr b : demod_blocks)
+		apply_buffer_policy(b, BUFFER_STAGE_CHANNEL, taps->dec_rate);
+	if (low_pass != nullptr)
+		apply_buffer_policy(low_pass, BUFFER_STAGE_AUDIO, taps->dec_rate);
+	apply_buffer_policy(resampler, BUFFER_STAGE_AUDIO, audio_rate);
+	placement_apply_receiver(get_blocks());
+	buffer_bytes_stale = true;
+	connect_blocks();
+	return true;
+}
+
+bool receiver::set_monitor(const vector<struct monitor_channel> &channels)
+{
+	vector<struct monitor_channel> new_monitor = channels;
+	vector<channel_taps_sptr> taps;
+	vector<struct channel_bank::channel> bank_channels;
+	vector<float> pans;
+	bool short_filters = quality_tier_params(quality_tier).short_filters;
+	int src_rate, max_rate = 0;
+
+	if (channels.empty())
+		return monitor.empty() || change_demod(cur_demod);
+	if (remote || !has_source() || (int) channels.size()
+			> min(monitor_config.max_channels, MONITOR_MAX_CHANNELS))
+		return false;
+	src_rate = source->get_sample_rate();
+	for (struct monitor_channel &c : new_monitor) {
+		channel_taps_sptr t;
+
+		if (find(supported_demods.begin(), supported_demods.end(),
+					c.demod) == supported_demods.end())
+			return false;
+		t = get_channel_taps(c.demod, src_rate, audio_rate,
+				short_filters);
+		if (t == nullptr)
+			return false;
+		c.offset = trim_freq_offset(c.offset, src_rate);
+		taps.push_back(t);
+		bank_channels.push_back({ c.offset, t->dec, t->xlate,
+				c.squelch });
+		pans.push_back(c.pan);
+		max_rate = max(max_rate, t->dec_rate);
+	}
+	dsp_ns_base = dsp_cpu_ns();
+	disconnect_all();
+	monitor = new_monitor;
+	stereo = any_of(pans.begin(), pans.end(),
+			[](float pan) { return pan != 0.0f; });
+	bank = channel_bank::make(bank_channels, src_rate);
+	apply_buffer_policy(bank, BUFFER_STAGE_CHANNEL, max_rate);
+	chains.clear();
+	for (size_t i = 0; i < monitor.size(); ++i) {
+		const channel_taps_sptr &t = taps[i];
+		struct monitor_chain ch;
+
+		ch.demod = make_demod(monitor[i].demod, t, &ch.demod_blocks);
+		if (!t->low_pass.empty())
+			ch.low_pass = fir_filter_fff::make(1, t->low_pass);
+		ch.resampler = rational_resampler_base_fff::make(
+				t->resampler_interp, t->resampler_dec,
+				t->resampler);
+		for (block_sptr b : ch.demod_blocks)
+			apply_buffer_policy(b, BUFFER_STAGE_CHANNEL,
+					t->dec_rate);
+		if (ch.low_pass != nullptr)
+			apply_buffer_policy(ch.low_pass, BUFFER_STAGE_AUDIO,
+					t->dec_rate);
+		apply_buffer_policy(ch.resampler, BUFFER_STAGE_AUDIO,
+				audio_rate);
+		chains.push_back(ch);
+	}
+	mixer = audio_mixer::make(pans, stereo, bank, audio_rate);
+	apply_buffer_policy(mixer, BUFFER_STAGE_AUDIO, audio_rate);
+	cur_demod = monitor[0].demod;
+	placement_apply_receiver(get_blocks());
+	buffer_bytes_stale = true;
 	connect_blocks();
 	return true;
 }
 
+vector<struct monitor_channel> receiver::get_monitor()
+{
+	return monitor;
+}
+
+string receiver::get_chain_name()
+{
+	return monitor.empty() ? cur_demod : monitor_chain_name(monitor.size());
+}
+
+/* Build the current chain again, for a new source rate or quality tier */
+void receiver::rebuild()
+{
+	if (!monitor.empty())
+		set_monitor(vector<struct monitor_channel>(monitor));
+	else
+		change_demod(cur_demod);
+}
+
+void receiver::update_buffer_memory()
+{
+	buffer_bytes = 0;
+	default_buffer_bytes = 0;
+	for (block_sptr b : get_blocks()) {
+		buffer_bytes += buffer_memory(b);
+		default_buffer_bytes += default_buffer_memory(b);
+	}
+}
+
+/* Counted once the receiver runs, its outputs are connected then */
+size_t receiver::get_buffer_memory()
+{
+	if (buffer_bytes_stale && is_running()) {
+		update_buffer_memory();
+		buffer_bytes_stale = false;
+	}
+	return buffer_bytes;
+}
+
+size_t receiver::get_default_buffer_memory()
+{
+	get_buffer_memory();
+	return default_buffer_bytes;
+}
+
 string receiver::get_current_demod()
 {
 	return cur_demod;
@@ -210,15 +375,29 @@ string receiver::get_current_demod()
 
 bool receiver::set_freq_offset(int offset)
 {
+	if (remote) {
+		if (!is_ready())
+			return false;
+		remote_freq_offset = trim_freq_offset(offset,
+				get_source_state(source_ix)->sample_rate);
+		if (remote_slot >= 0)
+			remote_ops->set_freq_offset(source_ix, remote_slot,
+					remote_freq_offset);
+		return true;
+	}
+	// In monitor mode, the offset the single channel comes back to
 	if (xlate == nullptr)
 		return false;
-	offset = trim_freq_offset(offset, source->get_sample_rate());
+	offset = trim_freq_offset(offset,
+			get_source_state(source_ix)->sample_rate);
 	xlate->set_center_freq(offset);
 	return true;
 }
 
 int receiver::get_freq_offset()
 {
+	if (remote)
+		return remote_freq_offset;
 	if (xlate == nullptr)
 		return 0;
 	return xlate->center_freq();
@@ -249,37 +428,222 @@ osmosdr::source::sptr receiver::get_source()
 	return source;
 }
 
+bool receiver::has_source()
+{
+	return remote ? remote_source_set : source != nullptr;
+}
+
+bool receiver::is_remote()
+{
+	return remote;
+}
+
+double receiver::replay(double seconds)
+{
+	if (timeshift == nullptr)
+		return -1;
+	return timeshift->replay(seconds);
+}
+
 void receiver::set_source(size_t ix)
 {
 	osmosdr::source::sptr old_source = source;
+	bool was_running = running;
 
+	if (remote) {
+		set_remote_source(ix);
+		return;
+	}
 	if (ix >= osmosdr_sources.size())
 		return;
+	if (was_running) {
+		running = false;
+		disconnect_source();
+	}
 	source = osmosdr_sources[ix];
-	if (running)
-		top_bl->disconnect(old_source, 0, self(), 0);
+	this->source_ix = ix;
 	if (old_source != nullptr && cur_demod != ""
 			&& source->get_sample_rate()
 			!= old_source->get_sample_rate()) {
-		change_demod(cur_demod);
+		rebuild();
+	}
+	if (was_running) {
+		connect_source();
+		running = true;
 	}
-	if (running)
-		top_bl->connect(source, 0, self(), 0);
-	this->source_ix = ix;
+}
+
+/*
+ * Move to a slot of the new source. The slot gets the current
+ * settings, the offset is trimmed to the new sample rate like
+ * change_demod() does for local receivers.
+ */
+void receiver::set_remote_source(size_t ix)
+{
+	struct remote_slot_settings settings;
+	size_t old_ix = source_ix;
+	int slot;
+
+	if (ix >= sources_info.size())
+		return;
+	if (remote_slot >= 0)
+		remote_ops->close(source_ix, remote_slot);
+	source_ix = ix;
+	remote_source_set = true;
+	remote_freq_offset = trim_freq_offset(remote_freq_offset,
+			get_source_state(ix)->sample_rate);
+	settings.demod = cur_demod;
+	settings.freq_offset = remote_freq_offset;
+	settings.quality_tier = quality_tier;
+	settings.running = running;
+	slot = remote_ops->open(ix, fds[0], settings, stats);
+	if (slot < 0)
+		cerr << "No free slot for source " << ix << endl;
+
+	lock_guard<mutex> lock(ring_mutex);
+	// A switch that didn't happen yet is superseded
+	if (switch_pending && remote_slot >= 0
+			&& (remote_slot != reader_slot || old_ix != reader_source))
+		remote_ops->release_ring(old_ix, remote_slot);
+	remote_slot = slot;
+	switch_pending = true;
+	if (!reader.left)
+		move_reader();
+}
+
+/* Start reading the current slot's ring. Only between pages. */
+void receiver::move_reader()
+{
+	if (reader_slot >= 0)
+		remote_ops->release_ring(reader_source, reader_slot);
+	reader.ring = remote_slot < 0 ? nullptr
+		: remote_ops->ring(source_ix, remote_slot);
+	reader.left = 0;
+	reader_source = source_ix;
+	reader_slot = remote_slot;
+	switch_pending = false;
+}
+
+size_t receiver::read_audio(char *buf, size_t max)
+{
+	uint64_t val;
+	size_t n = 0, limit;
+	lock_guard<mutex> lock(ring_mutex);
+
+	// Edge-triggered, so clear the eventfd before looking at the ring
+	if (read(fds[0], &val, sizeof(val)) < 0 && errno != EAGAIN)
+		perror("read");
+	while (n < max) {
+		if (switch_pending && !reader.left)
+			move_reader();
+		if (reader.ring == nullptr)
+			break;
+		limit = max - n;
+		// The old ring is only read to the end of the current page
+		if (switch_pending)
+			limit = min(limit, (size_t) reader.left);
+		n += audio_ring_read(&reader, buf + n, limit);
+		if (!switch_pending)
+			break;
+	}
+	return n;
+}
+
+/*
+ * The receivers are fed through the source's timestamp tagger. The source
+ * is only connected to the tagger while it's in use, see source_in_use().
+ * Sources with time-shift are always connected and feed the receivers
+ * through their ring instead. Must be called while this receiver isn't
+ * marked as running.
+ */
+void receiver::connect_source()
+{
+	timestamp_tagger::sptr tagger = sources_info[source_ix].tagger;
+	double rate = source->get_sample_rate();
+
+	if (sources_info[source_ix].iq_ring) {
+		timeshift = timeshift_source::make(
+				sources_info[source_ix].iq_ring, rate);
+		apply_buffer_policy(timeshift, BUFFER_STAGE_SOURCE, rate);
+		// The audio of the history the filters settle on
+		sink->skip((uint64_t) audio_rate * timeshift_config.prime_ms
+				/ 1000);
+		top_bl->connect(timeshift, 0, self(), 0);
+		return;
+	}
+	if (!source_in_use(source_ix))
+		top_bl->connect(source, 0, tagger, 0);
+	top_bl->connect(tagger, 0, self(), 0);
+}
+
+void receiver::disconnect_source()
+{
+	timestamp_tagger::sptr tagger = sources_info[source_ix].tagger;
+
+	if (timeshift) {
+		top_bl->disconnect(timeshift, 0, self(), 0);
+		timeshift.reset();
+		return;
+	}
+	top_bl->disconnect(tagger, 0, self(), 0);
+	if (!source_in_use(source_ix))
+		top_bl->disconnect(source, 0, tagger, 0);
 }
 
 bool receiver::start()
 {
 	if (!is_ready() || is_running())
 		return false;
-	top_bl->connect(source, 0, self(), 0);
+	if (remote) {
+		running = true;
+		if (remote_slot >= 0)
+			remote_ops->set_running(source_ix, remote_slot, true);
+		return true;
+	}
+	connect_source();
 	running = true;
 	return true;
 }
 
+int receiver::get_audio_rate()
+{
+	return audio_rate;
+}
+
+void receiver::set_quality_tier(int tier)
+{
+	const struct quality_params &old_p = quality_tier_params(quality_tier);
+	const struct quality_params &p = quality_tier_params(tier);
+
+	if (tier == quality_tier)
+		return;
+	quality_tier = tier;
+	if (remote) {
+		audio_rate = p.audio_rate;
+		if (remote_slot >= 0)
+			remote_ops->set_quality(source_ix, remote_slot, tier);
+		return;
+	}
+	if (p.vorbis_quality != old_p.vorbis_quality
+			|| p.audio_rate != old_p.audio_rate)
+		sink->reconfigure(p.vorbis_quality, p.audio_rate);
+	sink->set_squelch(p.squelch);
+	audio_rate = p.audio_rate;
+	// Rebuild the chain for the new rate and filters
+	if ((p.audio_rate != old_p.audio_rate
+			|| p.short_filters != old_p.short_filters)
+			&& cur_demod != "")
+		rebuild();
+}
+
+int receiver::get_quality_tier()
+{
+	return quality_tier;
+}
+
 bool receiver::is_ready()
 {
-	return source != nullptr && cur_demod != "";
+	return has_source() && cur_demod != "";
 }
 
 bool receiver::is_running()
@@ -289,8 +653,117 @@ bool receiver::is_running()
 
 void receiver::stop()
 {
-	if (is_running()) {
-		top_bl->disconnect(source, 0, self(), 0);
-		running = false;
+	if (!is_running())
+		return;
+	running = false;
+	if (!remote)
+		disconnect_source();
+	else if (remote_slot >= 0)
+		remote_ops->set_running(source_ix, remote_slot, false);
+}
+
+bool receiver::start_recording(const string &name)
+{
+	if (remote || recorder != nullptr)
+		return false;
+	recorder = audio_record_open(name);
+	if (recorder == nullptr)
+		return false;
+	sink->set_recorder(recorder);
+	return true;
+}
+
+void receiver::stop_recording()
+{
+	if (recorder == nullptr)
+		return;
+	sink->set_recorder(nullptr);
+	audio_record_close(recorder);
+	recorder.reset();
+}
+
+boost::shared_ptr<struct audio_writer> receiver::get_recorder()
+{
+	return recorder;
+}
+
+void receiver::set_audio_tap(gr::block_sptr block)
+{
+	if (remote)
+		return;
+	audio_tap = block;
+	// Connected once there's a chain
+	if (xlate == nullptr && monitor.empty())
+		return;
+	disconnect_all();
+	placement_apply_receiver(get_blocks());
+	connect_blocks();
+}
+
+boost::shared_ptr<receiver_stats> receiver::get_stats()
+{
+	return stats;
+}
+
+std::vector<gr::block_sptr> receiver::get_blocks()
+{
+	vector<block_sptr> ret;
+
+	if (!monitor.empty()) {
+		ret.push_back(bank);
+		for (const struct monitor_chain &ch : chains) {
+			ret.insert(ret.end(), ch.demod_blocks.begin(),
+					ch.demod_blocks.end());
+			if (ch.low_pass != nullptr)
+				ret.push_back(ch.low_pass);
+			ret.push_back(ch.resampler);
+		}
+		ret.push_back(mixer);
+		ret.push_back(sink);
+		if (audio_tap != nullptr)
+			ret.push_back(audio_tap);
+		return ret;
+	}
+	if (xlate == nullptr)
+		return ret;
+	ret.push_back(xlate);
+	ret.insert(ret.end(), demod_blocks.begin(), demod_blocks.end());
+	if (low_pass != nullptr)
+		ret.push_back(low_pass);
+	ret.push_back(resampler);
+	ret.push_back(sink);
+	if (audio_tap != nullptr)
+		ret.push_back(audio_tap);
+	return ret;
+}
+
+/*
+ * CPU time spent in the DSP blocks, based on the GNU Radio performance
+ * counters. The encoder is accounted separately by the ogg_sink.
+ */
+uint64_t receiver::dsp_cpu_ns()
+{
+	double ticks = 0.0;
+
+	if (remote)
+		return stats->worker_dsp_ns.load();
+	for (block_sptr b : get_blocks()) {
+		if (b != sink)
+			ticks += b->pc_work_time_total();
+	}
+	return dsp_ns_base + (uint64_t) (ticks * 1e9 / high_res_timer_tps());
+}
+
+/** Number of encoded bytes waiting in the pipe for the HTTP stream */
+int receiver::queue_depth()
+{
+	int queued;
+
+	if (remote) {
+		lock_guard<mutex> lock(ring_mutex);
+		return reader.ring ? audio_ring_used(reader.ring) : 0;
 	}
+	if (ioctl(fds[0], FIONREAD, &queued) < 0)
+		return 0;
+	return queued;
 }
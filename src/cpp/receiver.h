@@ -22,7 +22,12 @@
 #define RECEIVER_H
 
 #include <config.h>
+#include "audio_ring.h"
+#include "metrics.h"
+#include "monitor.h"
 #include "ogg_sink.h"
+#include "taps.h"
+#include "timeshift.h"
 #include <boost/shared_ptr.hpp>
 #include <gnuradio/top_block.h>
 #include <gnuradio/filter/fir_filter_ccf.h>
@@ -32,7 +37,9 @@
 #include <gnuradio/filter/fir_filter_fff.h>
 #include <gnuradio/hier_block2.h>
 #include <osmosdr/source.h>
+#include <atomic>
 #include <cstdio>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -43,40 +50,154 @@ public:
 
 	static sptr make(gr::top_block_sptr top_bl,
 			int fds[2]);
+	/** In a worker process, writing the pages into a shared ring */
+	static sptr make(gr::top_block_sptr top_bl, struct audio_ring *ring,
+			int notify_fd);
+	/**
+	 * A stand-in for a receiver running in a worker process or on a
+	 * relay backend, see remote.h. It has no blocks, get_fd()[0] is an
+	 * eventfd signalled when there's audio for read_audio().
+	 */
+	static sptr make_remote();
+	/**
+	 * A receiver without a stream, for headless.h. The Ogg pages only
+	 * go to a recording, without one the audio isn't encoded at all.
+	 */
+	static sptr make_headless(gr::top_block_sptr top_bl);
 	bool set_freq_offset(int offset);
 	int get_freq_offset();
 	int *get_fd();
 	~receiver();
 	bool get_privileged();
 	void set_privileged(bool val);
+	/** Leaves monitor mode */
 	bool change_demod(std::string d);
+	/** The demodulation of the first channel in monitor mode */
 	std::string get_current_demod();
+	/**
+	 * Listen to all the channels at once, see monitor.h. An empty vector
+	 * goes back to a single channel. Returns false and keeps the current
+	 * chain if a channel is invalid or there are too many of them. Call
+	 * with the top block locked.
+	 */
+	bool set_monitor(const std::vector<struct monitor_channel> &channels);
+	/** Empty if not in monitor mode */
+	std::vector<struct monitor_channel> get_monitor();
+	/** The demodulation, or MONITOR and the channel count in monitor mode */
+	std::string get_chain_name();
+	int get_audio_rate();
+	/** See quality.h. Call with the top block locked. */
+	void set_quality_tier(int tier);
+	int get_quality_tier();
 	size_t get_source_ix();
 	osmosdr::source::sptr get_source();
+	bool has_source();
 	void set_source(size_t ix);
+	bool is_remote();
+	/**
+	 * Go back up to the given time and catch up, see timeshift.h.
+	 * Returns the time gone back, < 0 if the receiver doesn't read a
+	 * time-shift ring. Call with flowgraph_mutex held.
+	 */
+	double replay(double seconds);
+	/**
+	 * Record the encoded audio, see audio_record.h. Returns false if
+	 * recording is disabled or failed, or the receiver is remote.
+	 */
+	bool start_recording(const std::string &name);
+	void stop_recording();
+	/** nullptr if not recording */
+	boost::shared_ptr<struct audio_writer> get_recorder();
+	/**
+	 * Also feed the audio to block, a float sink, before it's encoded.
+	 * The left channel in stereo monitor mode. nullptr removes it. Call
+	 * with the top block locked.
+	 */
+	void set_audio_tap(gr::block_sptr block);
+	/** Copy up to max bytes of the encoded audio of a remote receiver */
+	size_t read_audio(char *buf, size_t max);
 	bool is_ready();
 	bool is_running();
 	bool start();
 	void stop();
+	boost::shared_ptr<receiver_stats> get_stats();
+	std::vector<gr::block_sptr> get_blocks();
+	uint64_t dsp_cpu_ns();
+	int queue_depth();
+	/** Call with flowgraph_mutex held */
+	size_t get_buffer_memory();
+	/**
+	 * What the buffers would take with the GNU Radio defaults. Call with
+	 * flowgraph_mutex held.
+	 */
+	size_t get_default_buffer_memory();
 
 private:
-	receiver(gr::top_block_sptr top_bl, int fds[2]);
+	receiver(gr::top_block_sptr top_bl, int fds[2],
+			struct audio_ring *ring);
 	size_t source_ix;
 	osmosdr::source::sptr source;
 	gr::top_block_sptr top_bl;
 	gr::filter::freq_xlating_fir_filter_ccc::sptr xlate;
 	gr::basic_block_sptr demod;
+	std::vector<gr::block_sptr> demod_blocks;
 	gr::filter::fir_filter_fff::sptr low_pass = nullptr;
 	gr::filter::rational_resampler_base_fff::sptr resampler;
 	ogg_sink::sptr sink;
+	// Monitor mode, the channels take the place of the blocks above
+	struct monitor_chain {
+		gr::basic_block_sptr demod;
+		std::vector<gr::block_sptr> demod_blocks;
+		gr::filter::fir_filter_fff::sptr low_pass;
+		gr::filter::rational_resampler_base_fff::sptr resampler;
+	};
+	std::vector<struct monitor_channel> monitor;
+	channel_bank::sptr bank;
+	std::vector<struct monitor_chain> chains;
+	audio_mixer::sptr mixer;
+	bool stereo;
+	gr::block_sptr audio_tap;
+	// Reads the source's time-shift ring while running, if it has one
+	timeshift_source::sptr timeshift;
+	boost::shared_ptr<struct audio_writer> recorder;
+	boost::shared_ptr<receiver_stats> stats;
+	uint64_t dsp_ns_base;
+	size_t buffer_bytes;
+	size_t default_buffer_bytes;
+	// The blocks changed since the buffers were counted
+	bool buffer_bytes_stale;
 	int fds[2];
 	bool privileged;
 	int audio_rate;
+	std::atomic<int> quality_tier;
 	bool running;
 	std::string cur_demod;
+	// Remote receivers only
+	bool remote;
+	bool remote_source_set;
+	int remote_freq_offset;
+	// Slot of source_ix, see remote.h. -1 if there was none free.
+	int remote_slot;
+	// The ring being read, which lags behind remote_slot until the
+	// reader gets to the end of a page
+	std::mutex ring_mutex;
+	struct audio_ring_reader reader;
+	size_t reader_source;
+	int reader_slot;
+	bool switch_pending;
 
+	static gr::basic_block_sptr make_demod(const std::string &d,
+			channel_taps_sptr taps,
+			std::vector<gr::block_sptr> *blocks);
 	void connect_blocks();
+	void connect_monitor();
+	void rebuild();
+	void update_buffer_memory();
+	void connect_source();
+	void disconnect_source();
 	int trim_freq_offset(int offset, int src_rate);
+	void set_remote_source(size_t ix);
+	void move_reader();
 };
 
 #endif
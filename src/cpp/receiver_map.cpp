@@ -0,0 +1,79 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "receiver_map.h"
+#include <functional>
+
+using namespace std;
+
+struct sharded_receiver_map::shard &sharded_receiver_map::shard_of(
+		const string &name)
+{
+	return shards[hash<string>()(name) % RECEIVER_MAP_SHARDS];
+}
+
+receiver::sptr sharded_receiver_map::find(const string &name)
+{
+	struct shard &s = shard_of(name);
+	lock_guard<mutex> guard(s.lock);
+
+	auto iter = s.map.find(name);
+	if (iter == s.map.end())
+		return nullptr;
+	return iter->second;
+}
+
+void sharded_receiver_map::insert(const string &name, receiver::sptr rec)
+{
+	struct shard &s = shard_of(name);
+	lock_guard<mutex> guard(s.lock);
+
+	if (s.map.insert(value_type(name, rec)).second)
+		++count;
+	else
+		s.map[name] = rec;
+}
+
+void sharded_receiver_map::erase(const string &name)
+{
+	struct shard &s = shard_of(name);
+	lock_guard<mutex> guard(s.lock);
+
+	if (s.map.erase(name))
+		--count;
+}
+
+size_t sharded_receiver_map::size()
+{
+	return count.load();
+}
+
+vector<sharded_receiver_map::value_type> sharded_receiver_map::snapshot()
+{
+	vector<value_type> ret;
+
+	ret.reserve(size());
+	for (struct shard &s : shards) {
+		lock_guard<mutex> guard(s.lock);
+		ret.insert(ret.end(), s.map.begin(), s.map.end());
+	}
+	return ret;
+}
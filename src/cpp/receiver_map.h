@@ -0,0 +1,63 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RECEIVER_MAP_H
+#define RECEIVER_MAP_H
+
+#include <config.h>
+#include "receiver.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define RECEIVER_MAP_SHARDS 16
+
+/*
+ * Map of stream names to receivers, shared by all service threads. The
+ * names are split into shards with their own locks, so lookups from
+ * different threads rarely contend. Iteration works on a snapshot.
+ */
+class sharded_receiver_map {
+public:
+	typedef std::pair<std::string, receiver::sptr> value_type;
+
+	/** Returns nullptr if there's no such receiver */
+	receiver::sptr find(const std::string &name);
+	void insert(const std::string &name, receiver::sptr rec);
+	void erase(const std::string &name);
+	size_t size();
+	std::vector<value_type> snapshot();
+
+private:
+	struct shard {
+		std::mutex lock;
+		std::unordered_map<std::string, receiver::sptr> map;
+	};
+
+	struct shard shards[RECEIVER_MAP_SHARDS];
+	std::atomic<size_t> count{0};
+
+	struct shard &shard_of(const std::string &name);
+};
+
+#endif
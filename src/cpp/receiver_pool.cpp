@@ -0,0 +1,150 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "receiver_pool.h"
+#include "remote.h"
+#include "globals.h"
+#include "quality.h"
+#include "taps.h"
+#include "utils.h"
+#include "sources.h"
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+struct receiver_pool_config receiver_pool_config = { 4, 2 };
+
+static deque<receiver::sptr> pool;
+static mutex pool_mutex;
+static condition_variable pool_cond;
+static thread pool_thread;
+static bool quitting;
+
+static receiver::sptr new_receiver()
+{
+	int pipe_fds[2];
+
+	if (pipe(pipe_fds)) {
+		perror("pipe");
+		return nullptr;
+	}
+	if (set_nonblock(pipe_fds[0])) {
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		return nullptr;
+	}
+	return receiver::make(topbl, pipe_fds);
+}
+
+/* Also for the lower quality tiers, which are needed under high load */
+static void design_all_taps()
+{
+	for (int tier = 0; tier < QUALITY_TIERS; ++tier) {
+		const struct quality_params &p = quality_tier_params(tier);
+
+		for (osmosdr::source::sptr src : osmosdr_sources) {
+			for (string d : receiver::supported_demods)
+				get_channel_taps(d, src->get_sample_rate(),
+						p.audio_rate, p.short_filters);
+		}
+	}
+}
+
+static void pool_thread_fn()
+{
+	receiver::sptr rec;
+	bool taps_designed = false;
+	unique_lock<mutex> lock(pool_mutex);
+
+	while (!quitting) {
+		if (pool.size() >= (size_t) receiver_pool_config.size) {
+			pool_cond.wait(lock);
+			continue;
+		}
+		lock.unlock();
+		rec = new_receiver();
+		if (!taps_designed) {
+			design_all_taps();
+			taps_designed = true;
+		}
+		lock.lock();
+		if (rec == nullptr) {
+			// Probably out of file descriptors, retry later
+			pool_cond.wait_for(lock, chrono::seconds(1));
+			continue;
+		}
+		pool.push_back(rec);
+	}
+	pool.clear();
+}
+
+void receiver_pool_start()
+{
+	// Remote receivers are cheap, the workers build the flowgraphs
+	if (receiver_pool_config.size <= 0 || sources_remote())
+		return;
+	quitting = false;
+	pool_thread = thread(pool_thread_fn);
+}
+
+void receiver_pool_stop()
+{
+	if (!pool_thread.joinable())
+		return;
+	{
+		lock_guard<mutex> lock(pool_mutex);
+		quitting = true;
+	}
+	pool_cond.notify_one();
+	pool_thread.join();
+}
+
+receiver::sptr receiver_pool_get()
+{
+	receiver::sptr ret;
+	lock_guard<mutex> lock(pool_mutex);
+
+	if (pool.empty())
+		return nullptr;
+	ret = pool.front();
+	pool.pop_front();
+	if (pool.size() < (size_t) receiver_pool_config.low_water)
+		pool_cond.notify_one();
+	return ret;
+}
+
+receiver::sptr receiver_pool_acquire()
+{
+	receiver::sptr rec;
+
+	if (remote_ops)
+		return receiver::make_remote();
+	rec = receiver_pool_get();
+	// The pool is empty or disabled, create the receiver here
+	if (rec == nullptr)
+		rec = new_receiver();
+	return rec;
+}
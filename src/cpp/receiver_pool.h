@@ -0,0 +1,53 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RECEIVER_POOL_H
+#define RECEIVER_POOL_H
+
+#include <config.h>
+#include "receiver.h"
+
+/*
+ * Pool of receivers created ahead of time by a background thread, so that
+ * accepting a WebSocket connection doesn't have to set up the encoder on
+ * the event loop thread. The thread also designs the filters of every
+ * demodulation for every source up front.
+ */
+
+struct receiver_pool_config {
+	// Number of receivers kept ready, 0 disables the pool
+	int size;
+	// The pool is refilled once fewer receivers than this are left
+	int low_water;
+};
+
+extern struct receiver_pool_config receiver_pool_config;
+
+void receiver_pool_start();
+void receiver_pool_stop();
+/** Returns nullptr if the pool is empty */
+receiver::sptr receiver_pool_get();
+/**
+ * A receiver from the pool, a new one if it's empty, or a remote one with
+ * remote sources. nullptr on failure.
+ */
+receiver::sptr receiver_pool_acquire();
+
+#endif
@@ -0,0 +1,491 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "relay.h"
+#include "broadcast.h"
+#include "event_loop.h"
+#include "globals.h"
+#include "metrics.h"
+#include "quality.h"
+#include "receiver_pool.h"
+#include "relay_proto.h"
+#include "remote.h"
+#include "source_state.h"
+#include "sources.h"
+#include "utils.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// An edge with more output waiting than this is too slow and dropped
+#define RELAY_MAX_QUEUE (8 * 1024 * 1024)
+
+// epoll data is the edge id in the upper half and the channel in the
+// lower half. Edge 0 are the relay's own fds.
+#define RELAY_LISTEN 0
+#define RELAY_TICK 1
+
+struct relay_config relay_config = { "127.0.0.1", 0 };
+
+struct relay_channel {
+	receiver::sptr rec;
+	// In receiver_map
+	string name;
+	int fd;
+};
+
+struct relay_edge {
+	uint64_t id;
+	struct relay_conn conn;
+	bool want_write;
+	map<uint32_t, struct relay_channel> channels;
+};
+
+// Only touched on service thread 0
+static map<uint64_t, unique_ptr<struct relay_edge>> edges;
+static uint64_t next_edge = 1;
+// The source states the edges were told about
+static vector<source_state_sptr> sent_states;
+static int epoll_fd = -1;
+static int listen_fd = -1;
+static int tick_fd = -1;
+static atomic<size_t> count_edges{0};
+static atomic<size_t> count_channels{0};
+static atomic<uint64_t> bytes_sent{0};
+
+static int watch(int fd, uint64_t edge, uint32_t channel, int op,
+		uint32_t events)
+{
+	struct epoll_event ev = {};
+
+	ev.events = events;
+	ev.data.u64 = edge << 32 | channel;
+	if (epoll_ctl(epoll_fd, op, fd, &ev)) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+static void close_channel(struct relay_edge &e, uint32_t id)
+{
+	auto it = e.channels.find(id);
+
+	if (it == e.channels.end())
+		return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+		stop_receiver(it->second.rec);
+	}
+	receiver_map.erase(it->second.name);
+	e.channels.erase(it);
+	count_channels.fetch_sub(1);
+}
+
+static void drop_edge(uint64_t id)
+{
+	auto it = edges.find(id);
+	struct relay_edge &e = *it->second;
+
+	cout << "Edge " << id << " disconnected." << endl;
+	while (!e.channels.empty())
+		close_channel(e, e.channels.begin()->first);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, e.conn.fd, nullptr);
+	relay_conn_close(&e.conn);
+	edges.erase(it);
+	count_edges.fetch_sub(1);
+	// The receivers are gone
+	broadcast_changed_all(BROADCAST_NUM_CLIENTS);
+}
+
+/* Flush the output, returns -1 if the edge has to be dropped */
+static int flush(struct relay_edge &e)
+{
+	bool write;
+
+	if (relay_conn_flush(&e.conn))
+		return -1;
+	if (relay_conn_pending(&e.conn) > RELAY_MAX_QUEUE) {
+		cerr << "Edge " << e.id << " doesn't keep up." << endl;
+		return -1;
+	}
+	write = relay_conn_pending(&e.conn) > 0;
+	if (write != e.want_write) {
+		e.want_write = write;
+		watch(e.conn.fd, e.id, 0, EPOLL_CTL_MOD,
+				write ? EPOLLIN | EPOLLOUT : EPOLLIN);
+	}
+	return 0;
+}
+
+static void put_state(struct relay_edge &e, size_t ix,
+		const struct source_state &s)
+{
+	string payload;
+
+	relay_put_u32(payload, s.hw_freq);
+	relay_put_u32(payload, s.auto_gain);
+	relay_put_u32(payload, (int32_t) (s.gain * 1000));
+	relay_put_u32(payload, s.sample_rate);
+	relay_send(&e.conn, RELAY_STATE, ix, payload.data(), payload.size());
+}
+
+/* Tell the edges about retuned sources */
+static void send_states()
+{
+	vector<uint64_t> dropped;
+
+	for (size_t i = 0; i < sources_info.size(); ++i) {
+		source_state_sptr state = get_source_state(i);
+
+		if (state->version == sent_states[i]->version)
+			continue;
+		sent_states[i] = state;
+		for (auto &pair : edges)
+			put_state(*pair.second, i, *state);
+	}
+	for (auto &pair : edges) {
+		if (flush(*pair.second))
+			dropped.push_back(pair.first);
+	}
+	for (uint64_t id : dropped)
+		drop_edge(id);
+}
+
+static void accept_edge()
+{
+	unique_ptr<struct relay_edge> e;
+	string hello;
+	int fd, one = 1;
+
+	fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN)
+			perror("accept4");
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	e.reset(new struct relay_edge);
+	e->id = next_edge++;
+	relay_conn_init(&e->conn, fd);
+	e->want_write = false;
+	if (watch(fd, e->id, 0, EPOLL_CTL_ADD, EPOLLIN)) {
+		close(fd);
+		return;
+	}
+	relay_put_u32(hello, RELAY_VERSION);
+	relay_put_u32(hello, sources_info.size());
+	relay_send(&e->conn, RELAY_HELLO, 0, hello.data(), hello.size());
+	for (size_t i = 0; i < sources_info.size(); ++i)
+		put_state(*e, i, *sent_states[i]);
+	cout << "Edge " << e->id << " connected." << endl;
+	count_edges.fetch_add(1);
+	edges[e->id] = move(e);
+}
+
+/* Tell the edge the channel couldn't be opened */
+static void refuse_channel(struct relay_edge &e, uint32_t id)
+{
+	cerr << "Couldn't open channel " << id << " of edge " << e.id << endl;
+	relay_send(&e.conn, RELAY_CLOSE, id, "", 0);
+}
+
+/* Returns -1 if the request is invalid */
+static int open_channel(struct relay_edge &e, uint32_t id,
+		const string &payload)
+{
+	const vector<string> &demods = receiver::supported_demods;
+	const char *p = payload.data();
+	struct relay_channel ch;
+	size_t ix;
+	uint32_t tier;
+	string demod;
+
+	if (payload.size() < 12 + RELAY_DEMOD_LEN)
+		return -1;
+	ix = relay_get_u32(p);
+	demod = string(p + 12, strnlen(p + 12, RELAY_DEMOD_LEN));
+	tier = relay_get_u32(p + 8);
+	if (ix >= sources_info.size() || id == 0 || tier >= QUALITY_TIERS
+			|| find(demods.begin(), demods.end(), demod)
+			== demods.end())
+		return -1;
+	close_channel(e, id);
+	ch.rec = receiver_pool_acquire();
+	if (ch.rec == nullptr) {
+		refuse_channel(e, id);
+		return 0;
+	}
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+
+		topbl->lock();
+		ch.rec->set_source(ix);
+		ch.rec->set_quality_tier(tier);
+		ch.rec->change_demod(demod);
+		topbl->unlock();
+	}
+	ch.rec->set_freq_offset((int32_t) relay_get_u32(p + 4));
+	ch.name = "relay-" + to_string(e.id) + "-" + to_string(id);
+	ch.fd = ch.rec->get_fd()[0];
+	if (watch(ch.fd, e.id, id, EPOLL_CTL_ADD, EPOLLIN)) {
+		// Gives its slot back to the worker, see receiver::~receiver
+		ch.rec.reset();
+		refuse_channel(e, id);
+		return 0;
+	}
+	receiver_map.insert(ch.name, ch.rec);
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+		start_receiver(ch.rec);
+	}
+	e.channels[id] = ch;
+	count_channels.fetch_add(1);
+	broadcast_changed_all(BROADCAST_NUM_CLIENTS);
+	return 0;
+}
+
+static void change_source(uint32_t type, size_t ix, int32_t val)
+{
+	unsigned fields = BROADCAST_GAIN;
+
+	if (ix >= sources_info.size())
+		return;
+	if (type == RELAY_HW_FREQ) {
+		source_set_hw_freq(ix, val);
+		fields = BROADCAST_HW_FREQ;
+	} else if (type == RELAY_AUTO_GAIN) {
+		source_set_gain_mode(ix, val);
+	} else {
+		source_set_gain(ix, val / 1000.0);
+	}
+	// With remote sources the state changes once it's reported
+	if (remote_ops == nullptr) {
+		broadcast_changed(fields, ix);
+		send_states();
+	}
+}
+
+/* Returns -1 if the edge has to be dropped */
+static int handle_frame(struct relay_edge &e, const struct relay_header &h,
+		const string &payload)
+{
+	switch (h.type) {
+	case RELAY_HELLO:
+		if (payload.size() < 4
+				|| relay_get_u32(payload.data()) != RELAY_VERSION) {
+			cerr << "Edge " << e.id << " runs another protocol "
+				"version." << endl;
+			return -1;
+		}
+		return 0;
+	case RELAY_OPEN:
+		return open_channel(e, h.channel, payload);
+	case RELAY_CLOSE:
+		close_channel(e, h.channel);
+		return 0;
+	case RELAY_HW_FREQ:
+	case RELAY_AUTO_GAIN:
+	case RELAY_GAIN:
+		if (payload.size() < 4)
+			return -1;
+		change_source(h.type, h.channel,
+				(int32_t) relay_get_u32(payload.data()));
+		return 0;
+	default:
+		cerr << "Unknown frame from edge " << e.id << endl;
+		return -1;
+	}
+}
+
+static int service_conn(struct relay_edge &e, uint32_t events)
+{
+	struct relay_header h;
+	string payload;
+	int ret = 0, n;
+
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		ret = relay_conn_fill(&e.conn);
+		while ((n = relay_next_frame(&e.conn, &h, payload)) > 0) {
+			if (handle_frame(e, h, payload))
+				return -1;
+		}
+		if (n < 0) {
+			cerr << "Bad frame from edge " << e.id << endl;
+			return -1;
+		}
+	}
+	if (ret)
+		return -1;
+	return flush(e);
+}
+
+/* Pass the channel's new audio on, returns -1 if the edge is dropped */
+static int service_channel(struct relay_edge &e, uint32_t id)
+{
+	auto it = e.channels.find(id);
+	char buf[16384];
+	ssize_t n;
+
+	if (it == e.channels.end())
+		return 0;
+	receiver::sptr rec = it->second.rec;
+	while (1) {
+		if (rec->is_remote()) {
+			n = rec->read_audio(buf, sizeof(buf));
+		} else {
+			n = read(it->second.fd, buf, sizeof(buf));
+			if (n < 0 && errno != EAGAIN)
+				perror("read");
+		}
+		if (n <= 0)
+			break;
+		relay_send(&e.conn, RELAY_AUDIO, id, buf, n);
+		account_bytes_sent(rec->get_stats().get(), n);
+		bytes_sent.fetch_add(n, memory_order_relaxed);
+	}
+	return flush(e);
+}
+
+static void tick()
+{
+	uint64_t expirations;
+
+	if (read(tick_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	send_states();
+}
+
+static void service_relay()
+{
+	struct epoll_event events[16];
+	uint64_t edge;
+	uint32_t channel;
+	int n, ret;
+
+	n = epoll_wait(epoll_fd, events, 16, 0);
+	for (int i = 0; i < n; ++i) {
+		edge = events[i].data.u64 >> 32;
+		channel = events[i].data.u64 & 0xffffffff;
+		if (edge == 0 && channel == RELAY_LISTEN) {
+			accept_edge();
+			continue;
+		}
+		if (edge == 0 && channel == RELAY_TICK) {
+			tick();
+			continue;
+		}
+		auto it = edges.find(edge);
+		// Dropped while handling an earlier event
+		if (it == edges.end())
+			continue;
+		if (channel == 0)
+			ret = service_conn(*it->second, events[i].events);
+		else
+			ret = service_channel(*it->second, channel);
+		if (ret)
+			drop_edge(edge);
+	}
+}
+
+int relay_init()
+{
+	struct sockaddr_in addr = {};
+	struct itimerspec its = {};
+	int one = 1;
+
+	if (relay_config.port == 0)
+		return 0;
+	for (size_t i = 0; i < sources_info.size(); ++i)
+		sent_states.push_back(get_source_state(i));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(relay_config.port);
+	if (inet_pton(AF_INET, relay_config.address.c_str(),
+				&addr.sin_addr) != 1) {
+		cerr << "Bad relay address " << relay_config.address << endl;
+		return -1;
+	}
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr))
+			|| listen(listen_fd, 16)) {
+		perror("relay");
+		return -1;
+	}
+	tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tick_fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+	its.it_interval.tv_sec = 1;
+	its.it_value.tv_sec = 1;
+	if (timerfd_settime(tick_fd, 0, &its, nullptr)) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	if (watch(listen_fd, 0, RELAY_LISTEN, EPOLL_CTL_ADD, EPOLLIN)
+			|| watch(tick_fd, 0, RELAY_TICK, EPOLL_CTL_ADD, EPOLLIN))
+		return -1;
+	cout << "Relay listening on " << relay_config.address << ":"
+		<< relay_config.port << endl;
+	return event_loop_add_fd(epoll_fd, service_relay);
+}
+
+size_t relay_edges()
+{
+	return count_edges.load();
+}
+
+size_t relay_channels()
+{
+	return count_channels.load();
+}
+
+uint64_t relay_bytes_sent()
+{
+	return bytes_sent.load();
+}
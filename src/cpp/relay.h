@@ -0,0 +1,53 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * The backend side of relay mode. Edge nodes (see edge.h) connect to the
+ * relay port and open channels, which are receivers here like those of
+ * local listeners. Their encoded audio is streamed to the edge, which fans
+ * it out. The port isn't authenticated and an edge may retune the
+ * sources, so it should only be reachable by the edges.
+ */
+
+struct relay_config {
+	// Address and port to listen on, port 0 disables the relay
+	std::string address;
+	int port;
+};
+
+extern struct relay_config relay_config;
+
+/** Start listening. Before event_loop_run(). */
+int relay_init();
+/** Connected edge nodes */
+size_t relay_edges();
+/** Channels open for the edges */
+size_t relay_channels();
+uint64_t relay_bytes_sent();
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput benchmark of the edge's fan-out tier. A sender produces a
+ * synthetic Ogg stream (Vorbis-sized pages) and the edge side splits it
+ * into pages and copies them into the rings of the listeners, which are
+ * drained like the HTTP streams would. With -l the stream goes through a
+ * relay connection over loopback TCP, framed like a backend sends it.
+ *
+ * Build with "make relay_bench" and run e.g. "./relay_bench -n 500 -l".
+ */
+
+#include <config.h>
+#include "audio_ring.h"
+#include "fanout.h"
+#include "relay_proto.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+#define PAGE_BODY 4000
+#define HEADER_PAGES 3
+
+/* A page as the encoder would write it, the CRC isn't checked */
+static string make_page(uint32_t seq, uint64_t granule)
+{
+	string page(27, '\0');
+	size_t body = PAGE_BODY;
+
+	memcpy(&page[0], "OggS", 4);
+	page[5] = seq == 0 ? 0x02 : 0;
+	for (int i = 0; i < 8; ++i)
+		page[6 + i] = (granule >> (8 * i)) & 0xff;
+	for (int i = 0; i < 4; ++i)
+		page[18 + i] = (seq >> (8 * i)) & 0xff;
+	page[26] = (body + 254) / 255;
+	for (; body >= 255; body -= 255)
+		page += (char) 255;
+	page += (char) body;
+	page.append(PAGE_BODY, 'x');
+	return page;
+}
+
+static string make_stream(size_t pages)
+{
+	string stream;
+
+	for (size_t i = 0; i < pages; ++i)
+		stream += make_page(i, i < HEADER_PAGES ? 0 : i * 1024);
+	return stream;
+}
+
+struct listener {
+	unique_ptr<struct audio_ring> ring;
+	struct audio_ring_reader reader;
+	struct fanout_sub sub;
+	struct receiver_stats stats;
+};
+
+static uint64_t drain(vector<unique_ptr<struct listener>> &listeners)
+{
+	static char buf[65536];
+	uint64_t total = 0;
+	size_t n;
+
+	for (auto &l : listeners) {
+		while ((n = audio_ring_read(&l->reader, buf, sizeof(buf))))
+			total += n;
+	}
+	return total;
+}
+
+static void send_stream(int fd, const string &stream, size_t repeat)
+{
+	struct relay_conn c;
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+
+	relay_conn_init(&c, fd);
+	for (size_t i = 0; i < repeat; ++i) {
+		// A backend sends what a pipe read returns, 16 KiB at most
+		for (size_t off = 0; off < stream.size(); off += 16384) {
+			relay_send(&c, RELAY_AUDIO, 1, stream.data() + off,
+					min((size_t) 16384, stream.size() - off));
+		}
+		while (relay_conn_pending(&c)) {
+			if (relay_conn_flush(&c))
+				return;
+			if (relay_conn_pending(&c))
+				poll(&pfd, 1, -1);
+		}
+	}
+	relay_conn_close(&c);
+}
+
+static int loopback_pair(int fds[2])
+{
+	struct sockaddr_in addr = {};
+	socklen_t len = sizeof(addr);
+	int lfd;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr))
+			|| listen(lfd, 1)
+			|| getsockname(lfd, (struct sockaddr *) &addr, &len)) {
+		perror("loopback");
+		return -1;
+	}
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[0] < 0 || connect(fds[0], (struct sockaddr *) &addr, len)) {
+		perror("connect");
+		return -1;
+	}
+	fds[1] = accept(lfd, nullptr, nullptr);
+	close(lfd);
+	return fds[1] < 0 ? -1 : 0;
+}
+
+static void usage(const char *progname)
+{
+	cout << "Usage: " << progname << " [options]" << endl << endl;
+	cout << "Options: -n <listeners>   Listeners of the channel (100)" << endl;
+	cout << "         -m <megabytes>   Size of the input stream (64)" << endl;
+	cout << "         -l               Receive over loopback TCP" << endl;
+}
+
+int main(int argc, char **argv)
+{
+	vector<unique_ptr<struct listener>> listeners;
+	struct fanout_channel channel;
+	size_t n_listeners = 100, megabytes = 64, repeat;
+	uint64_t in_bytes = 0, out_bytes = 0, pages = 0, dropped = 0;
+	bool loopback = false;
+	string stream;
+	thread sender;
+	int c, fds[2];
+
+	while ((c = getopt(argc, argv, "hn:m:l")) != -1) {
+		switch (c) {
+		case 'n':
+			n_listeners = atoi(optarg);
+			break;
+		case 'm':
+			megabytes = atoi(optarg);
+			break;
+		case 'l':
+			loopback = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	stream = make_stream(256);
+	repeat = max((size_t) 1, megabytes * 1024 * 1024 / stream.size());
+	fanout_reset(&channel);
+	for (size_t i = 0; i < n_listeners; ++i) {
+		unique_ptr<struct listener> l(new struct listener);
+
+		l->ring.reset(new struct audio_ring);
+		audio_ring_reset(l->ring.get());
+		l->reader = { l->ring.get(), 0 };
+		l->sub = { l->ring.get(), -1, &l->stats };
+		fanout_join(&channel, &l->sub);
+		listeners.push_back(move(l));
+	}
+
+	auto start = chrono::steady_clock::now();
+	if (loopback) {
+		struct relay_conn conn;
+		struct relay_header h;
+		string payload;
+
+		if (loopback_pair(fds))
+			return 1;
+		sender = thread(send_stream, fds[0], stream, repeat);
+		relay_conn_init(&conn, fds[1]);
+		while (1) {
+			struct pollfd pfd = { fds[1], POLLIN, 0 };
+
+			poll(&pfd, 1, -1);
+			if (relay_conn_fill(&conn))
+				break;
+			while (relay_next_frame(&conn, &h, payload) > 0) {
+				in_bytes += payload.size();
+				pages += fanout_feed(&channel, payload.data(),
+						payload.size());
+				out_bytes += drain(listeners);
+			}
+		}
+		sender.join();
+		relay_conn_close(&conn);
+	} else {
+		for (size_t i = 0; i < repeat; ++i) {
+			for (size_t off = 0; off < stream.size(); off += 16384) {
+				size_t len = min((size_t) 16384,
+						stream.size() - off);
+
+				in_bytes += len;
+				pages += fanout_feed(&channel,
+						stream.data() + off, len);
+				out_bytes += drain(listeners);
+			}
+		}
+	}
+	chrono::duration<double> secs = chrono::steady_clock::now() - start;
+
+	for (auto &l : listeners)
+		dropped += l->stats.pages_dropped.load();
+	cout << "Listeners:    " << n_listeners << endl;
+	cout << "Transport:    " << (loopback ? "loopback TCP" : "in memory")
+		<< endl;
+	cout << "Input:        " << in_bytes / secs.count() / 1e6 << " MB/s, "
+		<< pages / secs.count() << " pages/s" << endl;
+	cout << "Fanned out:   " << out_bytes / secs.count() / 1e6 << " MB/s"
+		<< endl;
+	cout << "Dropped:      " << dropped << " pages" << endl;
+	// A 64 kbit/s Vorbis listener needs 8 kB/s
+	cout << "Listener eq.: " << (uint64_t) (out_bytes / secs.count() / 8000)
+		<< " at 64 kbit/s" << endl;
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "relay_proto.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Bytes read per relay_conn_fill() call at most, to be fair to other fds
+#define RELAY_FILL_MAX (256 * 1024)
+
+void relay_conn_init(struct relay_conn *c, int fd)
+{
+	c->fd = fd;
+	c->in.clear();
+	c->in_used = 0;
+	c->out.clear();
+	c->out_sent = 0;
+}
+
+void relay_conn_close(struct relay_conn *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	relay_conn_init(c, -1);
+}
+
+size_t relay_conn_pending(const struct relay_conn *c)
+{
+	return c->out.size() - c->out_sent;
+}
+
+void relay_put_u32(string &out, uint32_t val)
+{
+	val = htonl(val);
+	out.append((const char *) &val, sizeof(val));
+}
+
+uint32_t relay_get_u32(const char *p)
+{
+	uint32_t val;
+
+	memcpy(&val, p, sizeof(val));
+	return ntohl(val);
+}
+
+void relay_put_header(string &out, uint32_t type, uint32_t channel,
+		uint32_t len)
+{
+	relay_put_u32(out, len);
+	relay_put_u32(out, type);
+	relay_put_u32(out, channel);
+}
+
+void relay_send(struct relay_conn *c, uint32_t type, uint32_t channel,
+		const void *payload, size_t len)
+{
+	relay_put_header(c->out, type, channel, len);
+	c->out.append((const char *) payload, len);
+}
+
+int relay_conn_flush(struct relay_conn *c)
+{
+	ssize_t n;
+
+	while (c->out_sent < c->out.size()) {
+		n = send(c->fd, c->out.data() + c->out_sent,
+				c->out.size() - c->out_sent,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n < 0) {
+			perror("send");
+			return -1;
+		}
+		c->out_sent += n;
+	}
+	// Don't let the written part pile up in front
+	if (c->out_sent == c->out.size()) {
+		c->out.clear();
+		c->out_sent = 0;
+	} else if (c->out_sent > c->out.size() / 2) {
+		c->out.erase(0, c->out_sent);
+		c->out_sent = 0;
+	}
+	return 0;
+}
+
+int relay_conn_fill(struct relay_conn *c)
+{
+	char buf[16384];
+	size_t total = 0;
+	ssize_t n;
+
+	c->in.erase(0, c->in_used);
+	c->in_used = 0;
+	while (total < RELAY_FILL_MAX) {
+		n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n < 0)
+			perror("recv");
+		if (n <= 0)
+			return -1;
+		c->in.append(buf, n);
+		total += n;
+	}
+	return 0;
+}
+
+int relay_next_frame(struct relay_conn *c, struct relay_header *h,
+		string &payload)
+{
+	const char *p = c->in.data() + c->in_used;
+	size_t avail = c->in.size() - c->in_used;
+
+	if (avail < RELAY_HEADER_LEN)
+		return 0;
+	h->len = relay_get_u32(p);
+	h->type = relay_get_u32(p + 4);
+	h->channel = relay_get_u32(p + 8);
+	if (h->len > RELAY_MAX_PAYLOAD)
+		return -1;
+	if (avail < RELAY_HEADER_LEN + h->len)
+		return 0;
+	payload.assign(p + RELAY_HEADER_LEN, h->len);
+	c->in_used += RELAY_HEADER_LEN + h->len;
+	return 1;
+}
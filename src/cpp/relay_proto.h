@@ -0,0 +1,115 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RELAY_PROTO_H
+#define RELAY_PROTO_H
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * The protocol between a relay backend (the node with the devices, see
+ * relay.h) and its edge nodes (see edge.h), over TCP. Both directions are
+ * a sequence of frames: a header with the payload length, type and
+ * channel, all big endian 32 bit integers, followed by the payload.
+ *
+ * Edge to backend:
+ *   RELAY_HELLO      u32 version
+ *   RELAY_OPEN       u32 source, i32 freq_offset, u32 quality tier,
+ *                    demodulation, NUL padded to RELAY_DEMOD_LEN
+ *   RELAY_CLOSE      -
+ *   RELAY_HW_FREQ    i32 frequency (channel is the source)
+ *   RELAY_AUTO_GAIN  u32 0 or 1 (channel is the source)
+ *   RELAY_GAIN       i32 gain in mdB (channel is the source)
+ *
+ * Backend to edge:
+ *   RELAY_HELLO      u32 version, u32 number of sources
+ *   RELAY_STATE      i32 hw_freq, u32 auto_gain, i32 gain in mdB,
+ *                    i32 sample rate (channel is the source)
+ *   RELAY_AUDIO      the channel's Ogg stream, cut anywhere
+ *   RELAY_CLOSE      - (the channel couldn't be opened)
+ *
+ * Channels are numbered by the edge. The audio of a channel starts with
+ * the Ogg headers and may be a chained stream.
+ */
+
+#define RELAY_VERSION 1
+#define RELAY_HEADER_LEN 12
+// Larger frames are a protocol error
+#define RELAY_MAX_PAYLOAD (1 << 20)
+#define RELAY_DEMOD_LEN 8
+
+enum relay_frame_type {
+	RELAY_HELLO = 1,
+	RELAY_OPEN,
+	RELAY_CLOSE,
+	RELAY_HW_FREQ,
+	RELAY_AUTO_GAIN,
+	RELAY_GAIN,
+	RELAY_STATE,
+	RELAY_AUDIO,
+};
+
+struct relay_header {
+	uint32_t len;
+	uint32_t type;
+	uint32_t channel;
+};
+
+/*
+ * A non-blocking connection with its input and output buffers. Frames are
+ * appended to out and written by relay_conn_flush().
+ */
+struct relay_conn {
+	int fd;
+	std::string in;
+	// Bytes of in already taken by relay_next_frame()
+	size_t in_used;
+	std::string out;
+	// Bytes of out already written
+	size_t out_sent;
+};
+
+void relay_conn_init(struct relay_conn *c, int fd);
+/** Close the socket and drop the buffered data */
+void relay_conn_close(struct relay_conn *c);
+/** Bytes waiting to be written */
+size_t relay_conn_pending(const struct relay_conn *c);
+void relay_put_u32(std::string &out, uint32_t val);
+uint32_t relay_get_u32(const char *p);
+void relay_put_header(std::string &out, uint32_t type, uint32_t channel,
+		uint32_t len);
+/** Append a frame with the payload to the output buffer */
+void relay_send(struct relay_conn *c, uint32_t type, uint32_t channel,
+		const void *payload, size_t len);
+/** Write what's possible. 0 if done or the socket is full, -1 on error. */
+int relay_conn_flush(struct relay_conn *c);
+/** Read what's available. 0 on success, -1 on error or end of stream. */
+int relay_conn_fill(struct relay_conn *c);
+/**
+ * Take the next complete frame off the input buffer. Returns 1 and the
+ * frame, 0 if it's incomplete, -1 if the peer breaks the protocol.
+ */
+int relay_next_frame(struct relay_conn *c, struct relay_header *h,
+		std::string &payload);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <config.h>
+#include "audio_ring.h"
+#include "metrics.h"
+#include <boost/shared_ptr.hpp>
+#include <cstddef>
+#include <string>
+
+/*
+ * Where the stand-in receivers of receiver::make_remote() get their audio
+ * from. The DSP chain runs in a slot elsewhere, in a worker process (see
+ * worker.h) or on a relay backend (see edge.h), and its Ogg pages show up
+ * in the slot's audio_ring.
+ */
+
+/* Settings of a slot, replayed when its worker or backend comes back */
+struct remote_slot_settings {
+	std::string demod;
+	int freq_offset;
+	int quality_tier;
+	bool running;
+};
+
+struct remote_ops {
+	/**
+	 * Set up a slot of the source like the receiver. notify_fd is
+	 * signalled when there are pages in the ring. Returns the slot
+	 * number, -1 if there's no free slot. Any thread.
+	 */
+	int (*open)(size_t source_ix, int notify_fd,
+			const struct remote_slot_settings &settings,
+			boost::shared_ptr<receiver_stats> stats);
+	/** The slot is reused once release_ring() was called too */
+	void (*close)(size_t source_ix, int slot);
+	struct audio_ring *(*ring)(size_t source_ix, int slot);
+	void (*release_ring)(size_t source_ix, int slot);
+	void (*set_demod)(size_t source_ix, int slot,
+			const std::string &demod);
+	void (*set_freq_offset)(size_t source_ix, int slot, int offset);
+	void (*set_quality)(size_t source_ix, int slot, int tier);
+	void (*set_running)(size_t source_ix, int slot, bool running);
+	void (*set_hw_freq)(size_t source_ix, int freq);
+	void (*set_gain_mode)(size_t source_ix, bool automatic);
+	void (*set_gain)(size_t source_ix, double gain);
+};
+
+/*
+ * Set by workers_init() or edge_init(). nullptr if the receivers run in
+ * this process's flowgraph, which is also the case in a worker.
+ */
+extern const struct remote_ops *remote_ops;
+
+#endif
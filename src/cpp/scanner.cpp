@@ -0,0 +1,431 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "scanner.h"
+#include "broadcast.h"
+#include "globals.h"
+#include "remote.h"
+#include "source_state.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <gnuradio/fft/fft.h>
+#include <gnuradio/fft/window.h>
+#include <gnuradio/io_signature.h>
+#include <gnuradio/sync_block.h>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+struct scanner_config scanner_config = {
+	1024, 10, 4, 12500, 10.0, 3.0, 300, 2000
+};
+
+// Fraction of the bandwidth scanned, the edges are filtered by the tuner
+#define USABLE_BANDWIDTH 0.9
+
+class scanner_block : virtual public gr::sync_block {
+public:
+	typedef boost::shared_ptr<scanner_block> sptr;
+	static sptr make(size_t source_ix, int sample_rate);
+	int work(int noutput_items, gr_vector_const_void_star &input_items,
+			gr_vector_void_star &output_items);
+private:
+	struct channel {
+		int offset;
+		int64_t freq;
+		int first_bin;
+		int last_bin;
+		float snr_db;
+		// Consecutive spectra above or below the thresholds
+		int above;
+		int below;
+		bool active;
+	};
+	size_t source_ix;
+	int sample_rate;
+	int fft_size;
+	gr::fft::fft_complex fft;
+	std::vector<float> window;
+	// Accumulated over the averaged FFTs, DC in the middle
+	std::vector<float> power;
+	std::vector<float> sorted;
+	int filled;
+	int ffts;
+	uint64_t skip;
+	// Absolute frequency of the middle of the grid
+	int64_t grid_center;
+	std::vector<struct channel> channels;
+	int dwell_frames;
+	int hang_frames;
+	int frames_since_publish;
+	bool listed;
+	scanner_block(size_t source_ix, int sample_rate);
+	void add_fft();
+	void process_spectrum();
+	void build_grid(int64_t center);
+	void publish();
+};
+
+struct active_channel {
+	int offset;
+	int64_t freq;
+	float snr_db;
+};
+
+struct scan_state {
+	// Subscribed clients
+	int users;
+	scanner_block::sptr block;
+	// Strongest first
+	vector<struct active_channel> active;
+	string json;
+};
+
+static mutex scan_mutex;
+static vector<struct scan_state> scans;
+static atomic<size_t> count_running{0};
+static spectrum_hook hook;
+
+scanner_block::sptr scanner_block::make(size_t source_ix, int sample_rate)
+{
+	return boost::shared_ptr<scanner_block>(new scanner_block(source_ix,
+				sample_rate));
+}
+
+scanner_block::scanner_block(size_t source_ix, int sample_rate)
+	: gr::sync_block("scanner",
+		gr::io_signature::make(1, 1, sizeof(gr_complex)),
+		gr::io_signature::make(0, 0, 0))
+	, source_ix(source_ix), sample_rate(sample_rate)
+	, fft_size(scanner_config.fft_size), fft(scanner_config.fft_size)
+	, filled(0), ffts(0), skip(0), grid_center(0)
+	, frames_since_publish(0), listed(false)
+{
+	window = gr::fft::window::blackman_harris(fft_size);
+	power.assign(fft_size, 0.0f);
+	dwell_frames = max(1, scanner_config.dwell_ms * scanner_config.rate
+			/ 1000);
+	hang_frames = max(1, scanner_config.hang_ms * scanner_config.rate
+			/ 1000);
+}
+
+/*
+ * Only the samples of the averaged FFTs are looked at, the rest of each
+ * period is skipped.
+ */
+int scanner_block::work(int noutput_items,
+		gr_vector_const_void_star &input_items,
+		gr_vector_void_star &output_items)
+{
+	const gr_complex *in = (const gr_complex *) input_items[0];
+	gr_complex *buf = fft.get_inbuf();
+	int i = 0, n;
+
+	(void) output_items;
+	while (i < noutput_items) {
+		if (skip) {
+			n = (int) min(skip, (uint64_t) (noutput_items - i));
+			skip -= n;
+			i += n;
+			continue;
+		}
+		n = min(fft_size - filled, noutput_items - i);
+		memcpy(buf + filled, in + i, n * sizeof(*in));
+		filled += n;
+		i += n;
+		if (filled == fft_size) {
+			filled = 0;
+			add_fft();
+		}
+	}
+	return noutput_items;
+}
+
+void scanner_block::add_fft()
+{
+	gr_complex *buf = fft.get_inbuf();
+	const gr_complex *out = fft.get_outbuf();
+	int64_t period = sample_rate / scanner_config.rate;
+
+	for (int i = 0; i < fft_size; ++i)
+		buf[i] *= window[i];
+	fft.execute();
+	// Swap the halves, so that the lowest frequency comes first
+	for (int i = 0; i < fft_size; ++i)
+		power[(i + fft_size / 2) % fft_size] += norm(out[i]);
+	if (++ffts < scanner_config.averages)
+		return;
+	process_spectrum();
+	power.assign(fft_size, 0.0f);
+	ffts = 0;
+	period -= (int64_t) fft_size * scanner_config.averages;
+	skip = period > 0 ? period : 0;
+}
+
+void scanner_block::build_grid(int64_t center)
+{
+	int64_t step = scanner_config.channel_hz;
+	int64_t half = (int64_t) (sample_rate * USABLE_BANDWIDTH / 2);
+	double bins_per_hz = (double) fft_size / sample_rate;
+	struct channel c = {};
+
+	grid_center = center;
+	channels.clear();
+	for (int64_t f = (center - half + step - 1) / step * step;
+			f <= center + half; f += step) {
+		c.freq = f;
+		c.offset = (int) (f - center);
+		c.first_bin = (int) ceil((c.offset - step / 2.0) * bins_per_hz)
+			+ fft_size / 2;
+		c.last_bin = (int) floor((c.offset + step / 2.0) * bins_per_hz)
+			+ fft_size / 2;
+		// Channels narrower than a bin get the nearest one
+		if (c.first_bin > c.last_bin) {
+			c.first_bin = (int) lround(c.offset * bins_per_hz)
+				+ fft_size / 2;
+			c.last_bin = c.first_bin;
+		}
+		c.first_bin = max(c.first_bin, 0);
+		c.last_bin = min(c.last_bin, fft_size - 1);
+		channels.push_back(c);
+	}
+}
+
+void scanner_block::process_spectrum()
+{
+	source_state_sptr state = get_source_state(source_ix);
+	int64_t center = (int64_t) state->hw_freq
+		- sources_info[source_ix].freq_converter_offset;
+	float open_db = scanner_config.threshold_db;
+	float close_db = open_db - scanner_config.hysteresis_db;
+	bool changed = false;
+	float floor_db;
+	double sum;
+
+	if (center != grid_center || channels.empty()) {
+		build_grid(center);
+		changed = listed;
+	}
+	sorted = power;
+	nth_element(sorted.begin(), sorted.begin() + fft_size / 2,
+			sorted.end());
+	floor_db = 10.0f * log10f(sorted[fft_size / 2] + 1e-20f);
+	if (hook)
+		hook(source_ix, power.data(), fft_size, floor_db, center,
+				sample_rate);
+	for (struct channel &c : channels) {
+		sum = 0.0;
+		for (int b = c.first_bin; b <= c.last_bin; ++b)
+			sum += power[b];
+		c.snr_db = 10.0f * log10f(sum / (c.last_bin - c.first_bin + 1)
+				+ 1e-20f) - floor_db;
+		if (!c.active) {
+			c.above = c.snr_db >= open_db ? c.above + 1 : 0;
+			if (c.above >= dwell_frames) {
+				c.active = true;
+				c.below = 0;
+				changed = true;
+			}
+		} else {
+			c.below = c.snr_db < close_db ? c.below + 1 : 0;
+			if (c.below >= hang_frames) {
+				c.active = false;
+				c.above = 0;
+				changed = true;
+			}
+		}
+	}
+	// The levels of the active channels are refreshed once a second
+	if (changed || (listed
+			&& ++frames_since_publish >= scanner_config.rate))
+		publish();
+}
+
+void scanner_block::publish()
+{
+	vector<struct active_channel> active;
+	string json = "[";
+
+	for (const struct channel &c : channels) {
+		if (c.active)
+			active.push_back({ c.offset, c.freq, c.snr_db });
+	}
+	sort(active.begin(), active.end(),
+			[](const struct active_channel &a,
+				const struct active_channel &b) {
+			return a.snr_db > b.snr_db;
+		});
+	if (active.size() > SCANNER_MAX_LISTED)
+		active.resize(SCANNER_MAX_LISTED);
+	for (const struct active_channel &a : active) {
+		char buf[96];
+
+		snprintf(buf, sizeof(buf),
+				"{\"offset\":%d,\"freq\":%lld,\"snr_db\":%.1f},",
+				a.offset, (long long) a.freq, a.snr_db);
+		json += buf;
+	}
+	if (json.size() > 1)
+		json.pop_back();
+	json += "]";
+	listed = !active.empty();
+	frames_since_publish = 0;
+	{
+		lock_guard<mutex> lock(scan_mutex);
+
+		scans[source_ix].active = move(active);
+		scans[source_ix].json = move(json);
+	}
+	broadcast_changed(BROADCAST_ACTIVITY, source_ix);
+}
+
+void scanner_init()
+{
+	lock_guard<mutex> lock(scan_mutex);
+
+	scans.resize(sources_info.size());
+	for (struct scan_state &s : scans) {
+		s.users = 0;
+		s.json = "[]";
+	}
+}
+
+void scanner_set_spectrum_hook(spectrum_hook h)
+{
+	hook = h;
+}
+
+int scanner_subscribe(size_t source_ix)
+{
+	timestamp_tagger::sptr tagger;
+	scanner_block::sptr block;
+
+	if (remote_ops != nullptr || source_ix >= scans.size())
+		return -1;
+	{
+		lock_guard<mutex> lock(scan_mutex);
+
+		if (scans[source_ix].users++ > 0)
+			return 0;
+	}
+	block = scanner_block::make(source_ix,
+			osmosdr_sources[source_ix]->get_sample_rate());
+	tagger = sources_info[source_ix].tagger;
+	topbl->lock();
+	if (!source_in_use(source_ix))
+		topbl->connect(osmosdr_sources[source_ix], 0, tagger, 0);
+	topbl->connect(tagger, 0, block, 0);
+	{
+		lock_guard<mutex> lock(scan_mutex);
+
+		scans[source_ix].block = block;
+		count_running.fetch_add(1);
+	}
+	topbl->unlock();
+	if (flowgraph_users() == 1)
+		topbl->start();
+	cout << "Scanning source " << source_ix << "." << endl;
+	return 0;
+}
+
+void scanner_unsubscribe(size_t source_ix)
+{
+	timestamp_tagger::sptr tagger = sources_info[source_ix].tagger;
+	scanner_block::sptr block;
+
+	{
+		lock_guard<mutex> lock(scan_mutex);
+
+		if (source_ix >= scans.size() || scans[source_ix].users == 0)
+			return;
+		if (--scans[source_ix].users > 0)
+			return;
+	}
+	if (flowgraph_users() == 1) {
+		topbl->stop();
+		topbl->wait();
+	}
+	topbl->lock();
+	{
+		lock_guard<mutex> lock(scan_mutex);
+
+		block = scans[source_ix].block;
+		scans[source_ix].block.reset();
+		scans[source_ix].active.clear();
+		scans[source_ix].json = "[]";
+		count_running.fetch_sub(1);
+	}
+	topbl->disconnect(tagger, 0, block, 0);
+	if (!source_in_use(source_ix))
+		topbl->disconnect(osmosdr_sources[source_ix], 0, tagger, 0);
+	topbl->unlock();
+	broadcast_changed(BROADCAST_ACTIVITY, source_ix);
+	cout << "Stopped scanning source " << source_ix << "." << endl;
+}
+
+bool scanner_active(size_t source_ix)
+{
+	lock_guard<mutex> lock(scan_mutex);
+
+	return source_ix < scans.size() && scans[source_ix].block != nullptr;
+}
+
+size_t scanners_running()
+{
+	return count_running.load();
+}
+
+string scanner_activity_json(size_t source_ix)
+{
+	lock_guard<mutex> lock(scan_mutex);
+
+	if (source_ix >= scans.size())
+		return "[]";
+	return scans[source_ix].json;
+}
+
+bool scanner_strongest(size_t source_ix, int *offset)
+{
+	lock_guard<mutex> lock(scan_mutex);
+
+	if (source_ix >= scans.size() || scans[source_ix].active.empty())
+		return false;
+	*offset = scans[source_ix].active.front().offset;
+	return true;
+}
+
+bool scanner_channel_active(size_t source_ix, int offset)
+{
+	lock_guard<mutex> lock(scan_mutex);
+
+	if (source_ix >= scans.size())
+		return false;
+	for (const struct active_channel &a : scans[source_ix].active) {
+		if (abs(a.offset - offset) <= scanner_config.channel_hz / 2)
+			return true;
+	}
+	return false;
+}
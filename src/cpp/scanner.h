@@ -0,0 +1,97 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Detection of the active channels of a source. A single block behind the
+ * source's timestamp tagger estimates the power spectrum of the whole
+ * tuner bandwidth, averaging `averages` FFTs `rate` times a second and
+ * skipping the samples in between. The bandwidth is divided into a grid of
+ * channel_hz wide channels at multiples of channel_hz, and each channel is
+ * compared to the noise floor, the median of the spectrum. A channel
+ * becomes active after it is threshold_db above the floor for dwell_ms,
+ * and inactive after it falls hysteresis_db below that for hang_ms. The
+ * cost is one FFT size's worth of work per spectrum, no matter how many
+ * channels there are.
+ *
+ * The active channels are broadcast to the clients of the source, see
+ * broadcast.h. The scanner runs while at least one client subscribed to
+ * it.
+ */
+
+// Channels broadcast at most, the strongest ones
+#define SCANNER_MAX_LISTED 24
+
+struct scanner_config {
+	int fft_size;
+	// Spectra per second
+	int rate;
+	// FFTs averaged into a spectrum
+	int averages;
+	int channel_hz;
+	double threshold_db;
+	double hysteresis_db;
+	int dwell_ms;
+	int hang_ms;
+};
+
+extern struct scanner_config scanner_config;
+
+/*
+ * Called with every spectrum from the scanner's thread. power holds
+ * fft_size linear bins, the lowest frequency first, floor_db is the noise
+ * floor and center the absolute frequency in the middle.
+ */
+typedef void (*spectrum_hook)(size_t source_ix, const float *power,
+		int fft_size, float floor_db, int64_t center, int sample_rate);
+
+/** Call after the sources are set up */
+void scanner_init();
+/** Set before the scanners start */
+void scanner_set_spectrum_hook(spectrum_hook hook);
+/**
+ * Start scanning the source for one more client. Returns -1 if the source
+ * isn't in this process. With flowgraph_mutex held.
+ */
+int scanner_subscribe(size_t source_ix);
+/** With flowgraph_mutex held */
+void scanner_unsubscribe(size_t source_ix);
+/** Whether the source is scanned. Thread safe. */
+bool scanner_active(size_t source_ix);
+/** Number of sources being scanned. Thread safe. */
+size_t scanners_running();
+/**
+ * The active channels, strongest first, e.g.
+ * [{"offset":-25000,"freq":145500000,"snr_db":21.5}]. Thread safe.
+ */
+std::string scanner_activity_json(size_t source_ix);
+/** Offset of the strongest active channel, false if there is none */
+bool scanner_strongest(size_t source_ix, int *offset);
+/** Whether the channel at the frequency offset is active */
+bool scanner_channel_active(size_t source_ix, int offset);
+
+#endif
@@ -0,0 +1,550 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "segmented.h"
+#include "broadcast.h"
+#include "event_loop.h"
+#include "globals.h"
+#include "json_writer.h"
+#include "metrics.h"
+#include "ogg_page.h"
+#include "receiver_pool.h"
+#include "utils.h"
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define LIVE_PREFIX "/live/"
+// Granule rate assumed if the identification header can't be parsed
+#define DEFAULT_GRANULE_RATE 48000
+
+struct segments_config segments_config = { 4000, 6, 4 };
+
+struct segment {
+	uint64_t seq;
+	double duration;
+	// The stream was restarted before this segment
+	bool discontinuity;
+	asset_sptr body;
+};
+
+struct segmented_channel {
+	struct segmented_info info;
+	receiver::sptr rec;
+	// In receiver_map
+	string name;
+	int fd;
+
+	// An incomplete page
+	string partial;
+	// The header pages of the current stream
+	vector<string> headers;
+	// Header packets in them
+	int header_packets;
+	unsigned rate;
+	// The pages of the segment being filled
+	string current;
+	bool current_audio;
+	int64_t start_granule;
+	int64_t last_granule;
+	bool discontinuity;
+
+	uint64_t next_seq;
+	deque<struct segment> segments;
+	asset_sptr playlist;
+};
+
+/*
+ * Guards the channels. The service thread cuts the segments, the HTTP
+ * and WebSocket callbacks look them up or change the channels.
+ */
+static mutex segments_mutex;
+static map<int, unique_ptr<struct segmented_channel>> channels;
+static asset_sptr index_json;
+static int next_id = 1;
+static int epoll_fd = -1;
+// Makes the ETags unique across restarts
+static string boot_tag;
+static string segment_cache_control;
+static string playlist_cache_control;
+static atomic<size_t> count_channels{0};
+static atomic<uint64_t> segments_cut{0};
+static atomic<uint64_t> requests{0};
+
+/*
+ * The ETag of the n-th version of a channel's playlist, segment etc.,
+ * compared with the tags listed in If-None-Match, see http.cpp.
+ */
+static struct asset *new_asset(const char *content_type, int id, char kind,
+		uint64_t n, const string &cache_control)
+{
+	struct asset *a = new struct asset;
+	char etag[48];
+
+	snprintf(etag, sizeof(etag), "%s-%08x-%c%016llx", boot_tag.c_str(),
+			id, kind, (unsigned long long) n);
+	a->content_type = content_type;
+	a->etag = etag;
+	a->cache_control = cache_control;
+	return a;
+}
+
+/* Called with segments_mutex held */
+static void update_index()
+{
+	static uint64_t version;
+	struct json_writer w;
+	struct asset *a;
+	size_t size = 1024;
+
+	a = new_asset("application/json", 0, 'i', version++, "no-cache");
+	while (1) {
+		a->body[ASSET_IDENTITY].assign(size, '\0');
+		jw_init(&w, &a->body[ASSET_IDENTITY][0], size);
+		jw_begin_array(&w);
+		for (auto &pair : channels) {
+			const struct segmented_info &info = pair.second->info;
+			string playlist = LIVE_PREFIX + to_string(info.id)
+				+ "/playlist.m3u8";
+
+			jw_begin_object(&w);
+			jw_key(&w, "id");
+			jw_int(&w, info.id);
+			jw_key(&w, "label");
+			jw_string(&w, info.label.c_str());
+			jw_key(&w, "source_ix");
+			jw_int(&w, info.source_ix);
+			jw_key(&w, "demod");
+			jw_string(&w, info.demod.c_str());
+			jw_key(&w, "freq_offset");
+			jw_int(&w, info.freq_offset);
+			jw_key(&w, "playlist");
+			jw_string(&w, playlist.c_str());
+			jw_end_object(&w);
+		}
+		jw_end_array(&w);
+		if (!jw_overflow(&w))
+			break;
+		size = w.len;
+	}
+	a->body[ASSET_IDENTITY].resize(w.len);
+	index_json = asset_sptr(a);
+}
+
+static void update_playlist(struct segmented_channel &c)
+{
+	const struct segment &last = c.segments.back();
+	unsigned target = 1;
+	struct asset *a;
+	char extinf[32];
+	string text;
+
+	for (const struct segment &s : c.segments)
+		target = max(target, (unsigned) ceil(s.duration));
+	text = "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:"
+		+ to_string(target) + "\n#EXT-X-MEDIA-SEQUENCE:"
+		+ to_string(c.segments.front().seq) + "\n";
+	for (const struct segment &s : c.segments) {
+		if (s.discontinuity)
+			text += "#EXT-X-DISCONTINUITY\n";
+		snprintf(extinf, sizeof(extinf), "#EXTINF:%.3f,\n", s.duration);
+		text += extinf + to_string(s.seq) + ".ogg\n";
+	}
+	a = new_asset("application/vnd.apple.mpegurl", c.info.id, 'p',
+			last.seq, playlist_cache_control);
+	a->body[ASSET_IDENTITY] = text;
+	c.playlist = asset_sptr(a);
+}
+
+static void finish_segment(struct segmented_channel &c)
+{
+	struct segment s;
+	struct asset *a;
+
+	s.seq = c.next_seq++;
+	s.duration = (double) (c.last_granule - c.start_granule) / c.rate;
+	s.discontinuity = c.discontinuity;
+	a = new_asset("audio/ogg", c.info.id, 's', s.seq,
+			segment_cache_control);
+	a->body[ASSET_IDENTITY].swap(c.current);
+	s.body = asset_sptr(a);
+	c.segments.push_back(s);
+	while (c.segments.size() > (size_t) segments_config.window)
+		c.segments.pop_front();
+	update_playlist(c);
+	c.current.clear();
+	c.current_audio = false;
+	c.start_granule = c.last_granule;
+	c.discontinuity = false;
+	segments_cut.fetch_add(1, memory_order_relaxed);
+}
+
+static void handle_page(struct segmented_channel &c, const char *page,
+		size_t len)
+{
+	int64_t granule = ogg_granulepos(page);
+
+	// The encoder was restarted, e.g. for another demodulation
+	if (ogg_bos(page)) {
+		if (c.current_audio)
+			finish_segment(c);
+		c.headers.clear();
+		c.header_packets = 0;
+		c.rate = ogg_vorbis_rate(page, len);
+		if (!c.rate) {
+			cerr << "Channel " << c.info.id << " isn't Vorbis."
+				<< endl;
+			c.rate = DEFAULT_GRANULE_RATE;
+		}
+		c.start_granule = 0;
+		c.last_granule = 0;
+		c.discontinuity = c.next_seq > 0;
+	}
+	// The pages up to the end of the last Vorbis header packet
+	if (c.header_packets < VORBIS_HEADER_PACKETS) {
+		c.headers.push_back(string(page, len));
+		c.header_packets += ogg_packets_ended(page);
+		return;
+	}
+	// Joined in the middle of a stream, wait for the next one
+	if (c.headers.empty())
+		return;
+	if (!c.current_audio) {
+		c.current.clear();
+		for (const string &h : c.headers)
+			c.current += h;
+		c.current_audio = true;
+	}
+	c.current.append(page, len);
+	if (granule < 0)
+		return;
+	c.last_granule = granule;
+	if ((c.last_granule - c.start_granule) * 1000
+			>= (int64_t) c.rate * segments_config.duration_ms)
+		finish_segment(c);
+}
+
+static void feed(struct segmented_channel &c, const char *data, size_t len)
+{
+	const char *buf;
+	size_t avail, n, skip;
+
+	c.partial.append(data, len);
+	buf = c.partial.data();
+	avail = c.partial.size();
+	while (1) {
+		n = ogg_page_len(buf, avail, &skip);
+		if (skip) {
+			buf += skip;
+			avail -= skip;
+			continue;
+		}
+		if (!n)
+			break;
+		handle_page(c, buf, n);
+		buf += n;
+		avail -= n;
+	}
+	c.partial.erase(0, c.partial.size() - avail);
+}
+
+/* Read the channel's new audio, without blocking the lookups meanwhile */
+static void service_channel(int id)
+{
+	receiver::sptr rec;
+	char buf[16384];
+	string data;
+	ssize_t n;
+	int fd;
+
+	{
+		lock_guard<mutex> lock(segments_mutex);
+		auto it = channels.find(id);
+
+		// Deleted while the event was pending
+		if (it == channels.end())
+			return;
+		rec = it->second->rec;
+		fd = it->second->fd;
+	}
+	while (1) {
+		if (rec->is_remote()) {
+			n = rec->read_audio(buf, sizeof(buf));
+		} else {
+			n = read(fd, buf, sizeof(buf));
+			if (n < 0 && errno != EAGAIN)
+				perror("read");
+		}
+		if (n <= 0)
+			break;
+		data.append(buf, n);
+		account_bytes_sent(rec->get_stats().get(), n);
+	}
+	if (data.empty())
+		return;
+	lock_guard<mutex> lock(segments_mutex);
+	auto it = channels.find(id);
+
+	if (it != channels.end())
+		feed(*it->second, data.data(), data.size());
+}
+
+static void service_segmented()
+{
+	struct epoll_event events[16];
+	int n;
+
+	n = epoll_wait(epoll_fd, events, 16, 0);
+	for (int i = 0; i < n; ++i)
+		service_channel(events[i].data.u32);
+}
+
+int segmented_init()
+{
+	int age;
+
+	if (segments_config.max_channels == 0)
+		return 0;
+	boot_tag = to_string((long long) time(nullptr));
+	// A segment is gone from the playlists after the window
+	age = (segments_config.duration_ms * segments_config.window + 999)
+		/ 1000;
+	segment_cache_control = "public, max-age=" + to_string(age)
+		+ ", immutable";
+	// The playlist changes once per segment
+	if (segments_config.duration_ms >= 2000)
+		playlist_cache_control = "public, max-age="
+			+ to_string(segments_config.duration_ms / 2000);
+	else
+		playlist_cache_control = "no-cache";
+	{
+		lock_guard<mutex> lock(segments_mutex);
+		update_index();
+	}
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	return event_loop_add_fd(epoll_fd, service_segmented);
+}
+
+/* A receiver that was set up for a channel which didn't come to be */
+static void discard_receiver(receiver::sptr &rec)
+{
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+		stop_receiver(rec);
+	}
+	rec.reset();
+}
+
+int segmented_create(size_t source_ix, const string &demod, int freq_offset,
+		const string &label, bool persistent)
+{
+	unique_ptr<struct segmented_channel> c;
+	struct epoll_event ev = {};
+	receiver::sptr rec;
+	string name;
+	int id;
+
+	if (epoll_fd < 0)
+		return -1;
+	{
+		lock_guard<mutex> lock(segments_mutex);
+		if (channels.size() >= (size_t) segments_config.max_channels)
+			return -1;
+	}
+	rec = receiver_pool_acquire();
+	if (rec == nullptr)
+		return -1;
+	// Keeps the full quality under load, see quality.h
+	rec->set_privileged(true);
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+
+		topbl->lock();
+		rec->set_source(source_ix);
+		rec->change_demod(demod);
+		topbl->unlock();
+	}
+	rec->set_freq_offset(freq_offset);
+
+	c.reset(new struct segmented_channel);
+	c->info = { 0, label, source_ix, demod, freq_offset, persistent };
+	c->rec = rec;
+	c->fd = rec->get_fd()[0];
+	// Nothing before the first page that starts a stream is kept
+	c->header_packets = VORBIS_HEADER_PACKETS;
+	c->rate = DEFAULT_GRANULE_RATE;
+	c->current_audio = false;
+	c->start_granule = 0;
+	c->last_granule = 0;
+	c->discontinuity = false;
+	c->next_seq = 0;
+	{
+		unique_lock<mutex> lock(segments_mutex);
+		// Another channel was created meanwhile
+		if (channels.size() >= (size_t) segments_config.max_channels) {
+			lock.unlock();
+			c.reset();
+			discard_receiver(rec);
+			return -1;
+		}
+		id = next_id++;
+		c->info.id = id;
+		c->name = "channel-" + to_string(id);
+		name = c->name;
+		receiver_map.insert(name, rec);
+		channels[id] = move(c);
+		update_index();
+		count_channels.fetch_add(1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = id;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rec->get_fd()[0], &ev)) {
+		perror("epoll_ctl");
+		// segmented_delete() refuses persistent channels
+		{
+			lock_guard<mutex> lock(segments_mutex);
+			channels.erase(id);
+			update_index();
+			count_channels.fetch_sub(1);
+		}
+		receiver_map.erase(name);
+		discard_receiver(rec);
+		return -1;
+	}
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+		start_receiver(rec);
+	}
+	cout << "Channel " << id << " created." << endl;
+	broadcast_changed_all(BROADCAST_NUM_CLIENTS);
+	return id;
+}
+
+bool segmented_delete(int id)
+{
+	unique_ptr<struct segmented_channel> c;
+
+	{
+		lock_guard<mutex> lock(segments_mutex);
+		auto it = channels.find(id);
+
+		if (it == channels.end() || it->second->info.persistent)
+			return false;
+		c = move(it->second);
+		channels.erase(it);
+		update_index();
+	}
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+		stop_receiver(c->rec);
+	}
+	receiver_map.erase(c->name);
+	cout << "Channel " << id << " deleted." << endl;
+	count_channels.fetch_sub(1);
+	broadcast_changed_all(BROADCAST_NUM_CLIENTS);
+	return true;
+}
+
+receiver::sptr segmented_receiver(int id)
+{
+	lock_guard<mutex> lock(segments_mutex);
+	auto it = channels.find(id);
+
+	return it == channels.end() ? nullptr : it->second->rec;
+}
+
+vector<struct segmented_info> segmented_list()
+{
+	lock_guard<mutex> lock(segments_mutex);
+	vector<struct segmented_info> ret;
+
+	for (auto &pair : channels)
+		ret.push_back(pair.second->info);
+	return ret;
+}
+
+asset_sptr segmented_find(const char *url)
+{
+	const char *p = url + strlen(LIVE_PREFIX);
+	unsigned long long seq;
+	char *end;
+	long id;
+
+	if (strncmp(url, LIVE_PREFIX, strlen(LIVE_PREFIX)) || epoll_fd < 0)
+		return nullptr;
+	requests.fetch_add(1, memory_order_relaxed);
+	lock_guard<mutex> lock(segments_mutex);
+	if (!strcmp(p, "index.json"))
+		return index_json;
+	id = strtol(p, &end, 10);
+	if (end == p || *end != '/')
+		return nullptr;
+	auto it = channels.find(id);
+	if (it == channels.end())
+		return nullptr;
+	struct segmented_channel &c = *it->second;
+
+	p = end + 1;
+	if (!strcmp(p, "playlist.m3u8"))
+		return c.playlist;
+	seq = strtoull(p, &end, 10);
+	if (end == p || strcmp(end, ".ogg"))
+		return nullptr;
+	for (const struct segment &s : c.segments) {
+		if (s.seq == seq)
+			return s.body;
+	}
+	return nullptr;
+}
+
+size_t segmented_channels()
+{
+	return count_channels.load();
+}
+
+uint64_t segmented_segments_cut()
+{
+	return segments_cut.load();
+}
+
+uint64_t segmented_requests()
+{
+	return requests.load();
+}
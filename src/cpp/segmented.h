@@ -0,0 +1,91 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SEGMENTED_H
+#define SEGMENTED_H
+
+#include <config.h>
+#include "asset_cache.h"
+#include "receiver.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Broadcast channels for large audiences. The audio of a channel is
+ * encoded once and cut into short segments at Ogg page boundaries. Each
+ * segment starts with the stream's header pages, so it can be decoded on
+ * its own. The segments never change once cut, so they are served from
+ * memory like the static files and can be cached by any proxy on the way.
+ * Listeners poll a playlist of the recent segments:
+ *
+ *   /live/index.json               the channels
+ *   /live/<id>/playlist.m3u8       the recent segments of a channel
+ *   /live/<id>/<seq>.ogg           a segment
+ *
+ * Privileged users create and delete the channels over the WebSocket.
+ */
+
+struct segments_config {
+	// Audio in a segment, segments are cut at the first page after it
+	int duration_ms;
+	// Segments kept per channel
+	int window;
+	// 0 disables the broadcast channels
+	int max_channels;
+};
+
+extern struct segments_config segments_config;
+
+struct segmented_info {
+	int id;
+	std::string label;
+	size_t source_ix;
+	std::string demod;
+	int freq_offset;
+	// Started from the config file, see headless.h
+	bool persistent;
+};
+
+/** Before event_loop_run(). */
+int segmented_init();
+/**
+ * Start a channel with the given tuning. Returns its id, or -1 if the
+ * channels are disabled, all are in use or no receiver is available.
+ * Thread safe.
+ */
+int segmented_create(size_t source_ix, const std::string &demod,
+		int freq_offset, const std::string &label, bool persistent);
+/**
+ * Returns false if there's no such channel or it's persistent. Thread
+ * safe.
+ */
+bool segmented_delete(int id);
+/** The receiver of a channel, nullptr if there's no such channel */
+receiver::sptr segmented_receiver(int id);
+std::vector<struct segmented_info> segmented_list();
+/** Returns nullptr if the URL isn't under /live/ or is gone. Thread safe. */
+asset_sptr segmented_find(const char *url);
+size_t segmented_channels();
+uint64_t segmented_segments_cut();
+uint64_t segmented_requests();
+
+#endif
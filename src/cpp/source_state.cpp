@@ -0,0 +1,92 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "source_state.h"
+#include "globals.h"
+#include "json_writer.h"
+#include <boost/make_shared.hpp>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+static vector<source_state_sptr> states;
+static mutex states_mutex;
+// Serializes the updates, so an older reading can't replace a newer one.
+// Readers only ever wait for states_mutex, never for the device.
+static mutex update_mutex;
+
+static void store_state(size_t source_ix, int hw_freq, bool auto_gain,
+		double gain, int sample_rate)
+{
+	boost::shared_ptr<struct source_state> state;
+	struct json_writer w;
+	char buf[128];
+
+	state = boost::make_shared<struct source_state>();
+	state->hw_freq = hw_freq;
+	state->auto_gain = auto_gain;
+	state->gain = gain;
+	state->sample_rate = sample_rate;
+	jw_init(&w, buf, sizeof(buf));
+	jw_key(&w, "hw_freq");
+	jw_int(&w, state->hw_freq);
+	state->hw_freq_json.assign(buf, w.len);
+	jw_init(&w, buf, sizeof(buf));
+	jw_key(&w, "auto_gain");
+	jw_bool(&w, state->auto_gain);
+	jw_key(&w, "gain");
+	jw_double(&w, state->gain);
+	state->gain_json.assign(buf, w.len);
+
+	lock_guard<mutex> lock(states_mutex);
+	if (states.size() < sources_info.size())
+		states.resize(sources_info.size());
+	state->version = states[source_ix] == nullptr ? 1
+		: states[source_ix]->version + 1;
+	states[source_ix] = state;
+}
+
+void update_source_state(size_t source_ix)
+{
+	osmosdr::source::sptr src = osmosdr_sources[source_ix];
+	lock_guard<mutex> update_lock(update_mutex);
+
+	store_state(source_ix, src->get_center_freq(), src->get_gain_mode(),
+			src->get_gain(), src->get_sample_rate());
+}
+
+void set_source_state(size_t source_ix, int hw_freq, bool auto_gain,
+		double gain, int sample_rate)
+{
+	lock_guard<mutex> update_lock(update_mutex);
+
+	store_state(source_ix, hw_freq, auto_gain, gain, sample_rate);
+}
+
+source_state_sptr get_source_state(size_t source_ix)
+{
+	lock_guard<mutex> lock(states_mutex);
+
+	if (source_ix >= states.size())
+		return nullptr;
+	return states[source_ix];
+}
@@ -0,0 +1,60 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SOURCE_STATE_H
+#define SOURCE_STATE_H
+
+#include <config.h>
+#include <boost/shared_ptr.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Snapshot of the hardware settings of a source. Querying the driver may
+ * take locks or talk to the device over USB, so the settings are read once
+ * after they change and the clients get the immutable snapshot.
+ */
+struct source_state {
+	// Incremented on every update, compare to tell whether anything changed
+	uint64_t version;
+	int hw_freq;
+	bool auto_gain;
+	double gain;
+	int sample_rate;
+	// Pre-serialized JSON members, e.g. "hw_freq":102000000
+	std::string hw_freq_json;
+	std::string gain_json;
+};
+
+typedef boost::shared_ptr<const struct source_state> source_state_sptr;
+
+/**
+ * Re-read the settings from the device, call after changing them. The
+ * caller serializes the calls to the device, see sources.cpp.
+ */
+void update_source_state(size_t source_ix);
+/** Settings read elsewhere, e.g. by the source's worker process */
+void set_source_state(size_t source_ix, int hw_freq, bool auto_gain,
+		double gain, int sample_rate);
+/** Any thread. Returns nullptr for an invalid index. */
+source_state_sptr get_source_state(size_t source_ix);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "sources.h"
+#include "buffers.h"
+#include "globals.h"
+#include "iq_record.h"
+#include "placement.h"
+#include "source_state.h"
+#include "timeshift.h"
+#include "edge.h"
+#include "remote.h"
+#include "worker.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+const struct remote_ops *remote_ops;
+
+/*
+ * One per source, held around every change of the device's settings and
+ * the reading of the new state. The service threads may change the same
+ * source at the same time, and the drivers aren't thread safe.
+ */
+static vector<unique_ptr<mutex>> device_mutexes;
+
+bool sources_remote()
+{
+	return worker_config.enabled || edge_config.enabled;
+}
+
+osmosdr::source::sptr open_source(size_t ix)
+{
+	const struct source_params &p = sources_info[ix].params;
+	osmosdr::source::sptr source;
+	struct saved_placement saved;
+
+	placement_enter_source(ix, sources_info[ix].cores, &saved);
+	source = osmosdr::source::make(p.osmosdr_arg);
+	placement_leave_source(&saved);
+	source->set_freq_corr(p.freq_corr);
+	source->set_sample_rate(p.sample_rate);
+	source->set_center_freq(p.initial_hw_freq);
+	if (p.auto_gain) {
+		source->set_gain_mode(true);
+	} else {
+		source->set_gain_mode(false);
+		source->set_gain(p.gain);
+	}
+	return source;
+}
+
+void setup_source(size_t ix)
+{
+	osmosdr::source::sptr src = osmosdr_sources[ix];
+
+	src->set_dc_offset_mode(0);
+	src->set_iq_balance_mode(0);
+	src->set_bandwidth(0.0);
+	sources_info[ix].tagger =
+		timestamp_tagger::make(src->get_sample_rate(), ix);
+	apply_buffer_policy(sources_info[ix].tagger,
+			BUFFER_STAGE_SOURCE, src->get_sample_rate());
+	timeshift_setup(ix);
+	// Before the service threads run
+	while (device_mutexes.size() <= ix)
+		device_mutexes.emplace_back(new mutex);
+	lock_guard<mutex> lock(*device_mutexes[ix]);
+	update_source_state(ix);
+}
+
+void source_set_hw_freq(size_t ix, int freq)
+{
+	if (remote_ops) {
+		remote_ops->set_hw_freq(ix, freq);
+		return;
+	}
+	{
+		lock_guard<mutex> lock(*device_mutexes[ix]);
+
+		osmosdr_sources[ix]->set_center_freq(freq);
+		update_source_state(ix);
+	}
+	iq_record_retuned(ix);
+}
+
+void source_set_gain_mode(size_t ix, bool automatic)
+{
+	if (remote_ops) {
+		remote_ops->set_gain_mode(ix, automatic);
+		return;
+	}
+	{
+		lock_guard<mutex> lock(*device_mutexes[ix]);
+
+		osmosdr_sources[ix]->set_gain_mode(automatic);
+		update_source_state(ix);
+	}
+	iq_record_retuned(ix);
+}
+
+void source_set_gain(size_t ix, double gain)
+{
+	if (remote_ops) {
+		remote_ops->set_gain(ix, gain);
+		return;
+	}
+	{
+		lock_guard<mutex> lock(*device_mutexes[ix]);
+
+		osmosdr_sources[ix]->set_gain_mode(false);
+		osmosdr_sources[ix]->set_gain(gain);
+		update_source_state(ix);
+	}
+	iq_record_retuned(ix);
+}
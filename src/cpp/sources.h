@@ -0,0 +1,48 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SOURCES_H
+#define SOURCES_H
+
+#include <config.h>
+#include <cstddef>
+#include <osmosdr/source.h>
+
+/**
+ * true if the devices are opened by worker processes or a relay backend
+ * rather than by this process. Known once the config was processed.
+ */
+bool sources_remote();
+/** Open the device of sources_info[ix] with its configured settings */
+osmosdr::source::sptr open_source(size_t ix);
+/**
+ * Create the source's timestamp tagger and read its state. After the top
+ * block was created.
+ */
+void setup_source(size_t ix);
+/*
+ * Retune or change the gain of a source. With remote sources the change
+ * is forwarded and the state is updated once it's reported back.
+ */
+void source_set_hw_freq(size_t ix, int freq);
+void source_set_gain_mode(size_t ix, bool automatic);
+void source_set_gain(size_t ix, double gain);
+
+#endif
@@ -21,12 +21,6 @@
 #include <config.h>
 #include "ssb_demod.h"
 #include <gnuradio/filter/firdes.h>
-#include <gnuradio/analog/agc_cc.h>
-#include <gnuradio/blocks/complex_to_mag.h>
-#include <gnuradio/analog/sig_source_c.h>
-#include <gnuradio/blocks/add_cc.h>
-#include <gnuradio/blocks/conjugate_cc.h>
-#include <gnuradio/blocks/multiply_const_ff.h>
 
 using namespace gr;
 using namespace gr::analog;
@@ -42,13 +36,6 @@ ssb_demod::ssb_demod(int in_rate, double carrier_amplitude)
 	: hier_block2("ssb_demod", io_signature::make(1, 1, sizeof(gr_complex)),
 			io_signature::make(1, 1, sizeof(float)))
 {
-	agc_cc::sptr agc;
-	sig_source_c::sptr carrier;
-	conjugate_cc::sptr conj;
-	add_cc::sptr add, add2;
-	complex_to_mag::sptr mag;
-	multiply_const_ff::sptr mult;
-
 	agc = agc_cc::make(0.01f, 0.03f);
 	carrier = sig_source_c::make(in_rate, GR_SIN_WAVE, 0, carrier_amplitude);
 	add = add_cc::make();
@@ -72,3 +59,8 @@ ssb_demod::~ssb_demod()
 {
 	disconnect_all();
 }
+
+std::vector<block_sptr> ssb_demod::get_blocks()
+{
+	return { agc, carrier, conj, add, add2, mag, mult };
+}
@@ -24,14 +24,29 @@
 #include <config.h>
 #include <boost/shared_ptr.hpp>
 #include <gnuradio/hier_block2.h>
+#include <gnuradio/analog/agc_cc.h>
+#include <gnuradio/analog/sig_source_c.h>
+#include <gnuradio/blocks/add_cc.h>
+#include <gnuradio/blocks/complex_to_mag.h>
+#include <gnuradio/blocks/conjugate_cc.h>
+#include <gnuradio/blocks/multiply_const_ff.h>
+#include <vector>
 
 class ssb_demod : public gr::hier_block2 {
 public:
 	typedef boost::shared_ptr<ssb_demod> sptr;
 	static sptr make(int in_rate, double carrier_amplitude);
 	~ssb_demod();
+	std::vector<gr::block_sptr> get_blocks();
 private:
 	ssb_demod(int in_rate, double carrier_amplitude);
+
+	gr::analog::agc_cc::sptr agc;
+	gr::analog::sig_source_c::sptr carrier;
+	gr::blocks::conjugate_cc::sptr conj;
+	gr::blocks::add_cc::sptr add, add2;
+	gr::blocks::complex_to_mag::sptr mag;
+	gr::blocks::multiply_const_ff::sptr mult;
 };
 
 #endif
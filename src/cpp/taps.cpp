@@ -0,0 +1,138 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "taps.h"
+#include "utils.h"
+#include <boost/make_shared.hpp>
+#include <boost/math/common_factor_rt.hpp>
+#include <gnuradio/filter/firdes.h>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+using namespace std;
+using namespace gr::filter;
+
+typedef tuple<string, int, int, bool> taps_key;
+
+static map<taps_key, channel_taps_sptr> cache;
+static mutex cache_mutex;
+
+int optimal_decimation(int in_rate, int out_rate)
+{
+	// FIXME Optimize
+	int d;
+
+	if (in_rate < out_rate)
+		return 1;
+	for (d = 1; in_rate / d > out_rate; d *= 2)
+		;
+	if (in_rate / d == out_rate && in_rate % d == 0)
+		return d;
+	d /= 2;
+	for (; in_rate / d > out_rate; ++d)
+		;
+	if (in_rate / d == out_rate && in_rate % d == 0)
+		return d;
+	--d;
+	// For some reason, the AM demod doesn't work with sample rates
+	// like 25kHz, trying multiples of 4kHz
+	for (; d > 1 && (in_rate % d != 0 || (in_rate / d) % 4000 != 0); --d)
+		;
+	if (d < 1)
+		d = 1;
+	return d;
+}
+
+static void set_decimation(struct channel_taps *t, int src_rate,
+		int out_rate)
+{
+	t->dec = optimal_decimation(src_rate, out_rate);
+	t->dec_rate = src_rate / t->dec;
+}
+
+static void set_resampler(struct channel_taps *t, int audio_rate,
+		double cutoff, double transition)
+{
+	int div = boost::math::gcd(t->dec_rate, audio_rate);
+
+	t->resampler_interp = audio_rate / div;
+	t->resampler_dec = t->dec_rate / div;
+	t->resampler = firdes::low_pass(1.0, t->dec_rate, cutoff, transition);
+}
+
+static channel_taps_sptr design_taps(const string &d, int src_rate,
+		int audio_rate, bool short_filters)
+{
+	boost::shared_ptr<channel_taps> t = boost::make_shared<channel_taps>();
+	// The channel filter runs at the source rate and dominates the cost,
+	// its length is inversely proportional to the transition width
+	double tw = short_filters ? SHORT_FILTER_SCALE : 1.0;
+
+	if (d == "WBFM") {
+		set_decimation(t.get(), src_rate, 2 * (75000 + 25000));
+		t->xlate = taps_f2c(firdes::low_pass(1.0, src_rate, 75000, 25000 * tw));
+		set_resampler(t.get(), audio_rate, audio_rate / 2, 4000);
+		t->low_pass = firdes::low_pass(1.0, t->dec_rate, audio_rate / 2, 4000);
+	} else if (d == "NBFM" || d == "AM") {
+		set_decimation(t.get(), src_rate, 2 * (4000 + 2000));
+		t->xlate = taps_f2c(firdes::low_pass(1.0, src_rate, 4000, 2000 * tw));
+		set_resampler(t.get(), audio_rate, 4000, 2000);
+	} else if (d == "USB") {
+		set_decimation(t.get(), src_rate, 12000);
+		t->xlate = firdes::complex_band_pass(1.0, src_rate, 420, 2800, 400 * tw, firdes::WIN_KAISER, 2.0);
+		set_resampler(t.get(), audio_rate, 2500, 1000);
+	} else if (d == "LSB") {
+		set_decimation(t.get(), src_rate, 12000);
+		t->xlate = firdes::complex_band_pass(1.0, src_rate, -2800, -420, 400 * tw, firdes::WIN_KAISER, 2.0);
+		set_resampler(t.get(), audio_rate, 2500, 1000);
+	} else if (d == "CW") {
+		set_decimation(t.get(), src_rate, 1000);
+		t->xlate = firdes::complex_band_pass(1.0, src_rate, 1, 400, 400 * tw,
+				firdes::WIN_KAISER, 1.0);
+		set_resampler(t.get(), audio_rate, 500, 500);
+	} else {
+		return nullptr;
+	}
+	return t;
+}
+
+channel_taps_sptr get_channel_taps(const string &demod, int src_rate,
+		int audio_rate, bool short_filters)
+{
+	taps_key key(demod, src_rate, audio_rate, short_filters);
+	channel_taps_sptr ret;
+
+	{
+		lock_guard<mutex> lock(cache_mutex);
+		auto iter = cache.find(key);
+		if (iter != cache.end())
+			return iter->second;
+	}
+	// Design outside of the lock, another thread may be doing the same,
+	// which is harmless
+	ret = design_taps(demod, src_rate, audio_rate, short_filters);
+	if (ret == nullptr)
+		return nullptr;
+	lock_guard<mutex> lock(cache_mutex);
+	cache[key] = ret;
+	return ret;
+}
@@ -0,0 +1,60 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TAPS_H
+#define TAPS_H
+
+#include <config.h>
+#include <boost/shared_ptr.hpp>
+#include <gnuradio/gr_complex.h>
+#include <string>
+#include <vector>
+
+/*
+ * Filters of a receiver chain for a given demodulation, source rate and
+ * audio rate. Designing them is fairly expensive (the channel filter runs
+ * at the source rate), so they are designed once and shared between all
+ * receivers with the same parameters.
+ */
+struct channel_taps {
+	// Decimation of the channel filter and the resulting rate
+	int dec;
+	int dec_rate;
+	std::vector<gr_complex> xlate;
+	// Empty if the chain has no audio low pass filter
+	std::vector<float> low_pass;
+	unsigned resampler_interp;
+	unsigned resampler_dec;
+	std::vector<float> resampler;
+};
+
+typedef boost::shared_ptr<const channel_taps> channel_taps_sptr;
+
+// Widening of the channel filter's transition band with short_filters
+#define SHORT_FILTER_SCALE 3.0
+
+/**
+ * Returns nullptr for an unsupported demodulation. short_filters trades
+ * selectivity for CPU time. Thread safe.
+ */
+channel_taps_sptr get_channel_taps(const std::string &demod, int src_rate,
+		int audio_rate, bool short_filters);
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "timeshift.h"
+#include "globals.h"
+#include "metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <gnuradio/io_signature.h>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+// Room kept between the readers and the producer
+#define GUARD_MS 250
+// How long an idle reader sleeps before work() returns without output
+#define WAIT_MS 100
+// A replay is over once it's this close to the newest sample
+#define LIVE_MS 50
+
+struct timeshift_config timeshift_config = { false, 50, 1.5 };
+
+static bool active;
+
+timeshift_sink::sptr timeshift_sink::make(boost::shared_ptr<struct iq_ring> ring)
+{
+	return boost::shared_ptr<timeshift_sink>(new timeshift_sink(ring));
+}
+
+timeshift_sink::timeshift_sink(boost::shared_ptr<struct iq_ring> ring)
+	: gr::sync_block("timeshift_sink",
+		gr::io_signature::make(1, 1, sizeof(gr_complex)),
+		gr::io_signature::make(0, 0, 0)),
+	ring(ring)
+{
+}
+
+int timeshift_sink::work(int noutput_items,
+		gr_vector_const_void_star &input_items,
+		gr_vector_void_star &output_items)
+{
+	(void) output_items;
+
+	iq_ring_write(ring.get(), (const gr_complex *) input_items[0],
+			noutput_items);
+	return noutput_items;
+}
+
+timeshift_source::sptr timeshift_source::make(
+		boost::shared_ptr<struct iq_ring> ring, double sample_rate)
+{
+	return boost::shared_ptr<timeshift_source>(
+			new timeshift_source(ring, sample_rate));
+}
+
+timeshift_source::timeshift_source(boost::shared_ptr<struct iq_ring> ring,
+		double sample_rate)
+	: gr::sync_block("timeshift_source",
+		gr::io_signature::make(0, 0, 0),
+		gr::io_signature::make(1, 1, sizeof(gr_complex))),
+	ring(ring), sample_rate(sample_rate), replay_request(-1),
+	catching_up(false), catchup_start_ns(0), catchup_items(0),
+	lag_items(0)
+{
+	uint64_t prime = sample_rate * timeshift_config.prime_ms / 1000;
+	uint64_t written = ring->written.load();
+
+	pos = max(written > prime ? written - prime : 0,
+			iq_ring_oldest(ring.get()));
+}
+
+double timeshift_source::replay(double seconds)
+{
+	uint64_t held = ring->written.load() - iq_ring_oldest(ring.get());
+	uint64_t back;
+
+	// Comes from the client, NaN fails the comparison too
+	if (!(seconds > 0))
+		seconds = 0;
+	seconds = min(seconds, held / sample_rate);
+	back = min((uint64_t) (seconds * sample_rate), held);
+	replay_request.store(back);
+	return back / sample_rate;
+}
+
+double timeshift_source::lag()
+{
+	return lag_items.load(memory_order_relaxed) / sample_rate;
+}
+
+int timeshift_source::work(int noutput_items,
+		gr_vector_const_void_star &input_items,
+		gr_vector_void_star &output_items)
+{
+	int64_t back = replay_request.exchange(-1);
+	uint64_t written, n, now;
+	double allowed;
+
+	(void) input_items;
+
+	if (back >= 0) {
+		written = ring->written.load();
+		pos = max(written - min((uint64_t) back, written),
+				iq_ring_oldest(ring.get()));
+		catching_up = true;
+		catchup_start_ns = monotonic_ns();
+		catchup_items = 0;
+	}
+	if (ring->written.load() <= pos
+			&& !iq_ring_wait(ring.get(), pos, WAIT_MS))
+		return 0;
+	written = ring->written.load();
+	// Stalled for longer than the ring holds
+	pos = max(pos, iq_ring_oldest(ring.get()));
+	n = min(written - pos, (uint64_t) noutput_items);
+	if (catching_up) {
+		now = monotonic_ns();
+		allowed = (now - catchup_start_ns) / 1e9 * sample_rate
+			* timeshift_config.catchup_speed - catchup_items;
+		if (allowed < 1) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+			return 0;
+		}
+		n = min(n, (uint64_t) allowed);
+		catchup_items += n;
+	}
+	if (!iq_ring_read(ring.get(), pos, (gr_complex *) output_items[0],
+				n)) {
+		// Overtaken while copying, go on with what is still there
+		pos = iq_ring_oldest(ring.get());
+		return 0;
+	}
+	pos += n;
+	if (catching_up && written - pos < sample_rate * LIVE_MS / 1000)
+		catching_up = false;
+	lag_items.store(written - pos, memory_order_relaxed);
+	return n;
+}
+
+static void free_ring(struct iq_ring *r)
+{
+	iq_ring_free(r);
+	delete r;
+}
+
+void timeshift_setup(size_t ix)
+{
+	source_info_t &info = sources_info[ix];
+	double rate = osmosdr_sources[ix]->get_sample_rate();
+	boost::shared_ptr<struct iq_ring> ring;
+	timeshift_sink::sptr sink;
+
+	if (info.timeshift_s <= 0)
+		return;
+	ring.reset(new struct iq_ring, free_ring);
+	ring->buf = nullptr;
+	if (iq_ring_init(ring.get(), rate * info.timeshift_s,
+				rate * GUARD_MS / 1000,
+				timeshift_config.hugepages)) {
+		cerr << "Source " << ix << " runs without time-shift." << endl;
+		return;
+	}
+	cout << "Time-shift of source " << ix << ": " << info.timeshift_s
+		<< " s, " << (ring->mapped_len >> 20) << " MiB"
+		<< (ring->hugepages ? " in hugepages" : "") << endl;
+	sink = timeshift_sink::make(ring);
+	// The tagger stays connected, see receiver::connect_source()
+	topbl->connect(osmosdr_sources[ix], 0, info.tagger, 0);
+	topbl->connect(info.tagger, 0, sink, 0);
+	info.iq_ring = ring;
+	active = true;
+}
+
+bool timeshift_active()
+{
+	return active;
+}
@@ -0,0 +1,104 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMESHIFT_H
+#define TIMESHIFT_H
+
+#include <config.h>
+#include "iq_ring.h"
+#include <boost/shared_ptr.hpp>
+#include <gnuradio/sync_block.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Time-shift of a source's IQ. Sources with "timeshift_s" set keep that
+ * many seconds of IQ in an iq_ring, fed by a timeshift_sink behind the
+ * source's timestamp tagger. The flowgraph then runs all the time. Each
+ * receiver of such a source reads the ring through its own
+ * timeshift_source:
+ *
+ * - A new receiver starts prime_ms in the past, so its filters settle on
+ *   history and the start-up transient is left out of the audio.
+ * - A listener may go back in time with a replay. The receiver then reads
+ *   at catchup_speed times real time until it is live again, and the
+ *   client plays the audio that much faster.
+ */
+
+struct timeshift_config {
+	// Back the rings with hugepages, if the system has them reserved
+	bool hugepages;
+	int prime_ms;
+	double catchup_speed;
+};
+
+extern struct timeshift_config timeshift_config;
+
+class timeshift_sink : virtual public gr::sync_block {
+public:
+	typedef boost::shared_ptr<timeshift_sink> sptr;
+	static sptr make(boost::shared_ptr<struct iq_ring> ring);
+	int work(int noutput_items, gr_vector_const_void_star &input_items,
+			gr_vector_void_star &output_items);
+private:
+	timeshift_sink(boost::shared_ptr<struct iq_ring> ring);
+	boost::shared_ptr<struct iq_ring> ring;
+};
+
+class timeshift_source : virtual public gr::sync_block {
+public:
+	typedef boost::shared_ptr<timeshift_source> sptr;
+	/** Starts prime_ms before the newest sample */
+	static sptr make(boost::shared_ptr<struct iq_ring> ring,
+			double sample_rate);
+	int work(int noutput_items, gr_vector_const_void_star &input_items,
+			gr_vector_void_star &output_items);
+	/**
+	 * Go back the given time from now and catch up. Clamped to the
+	 * history in the ring, returns the actual time. Any thread.
+	 */
+	double replay(double seconds);
+	/** How far behind the newest sample the output is, in seconds */
+	double lag();
+private:
+	timeshift_source(boost::shared_ptr<struct iq_ring> ring,
+			double sample_rate);
+	boost::shared_ptr<struct iq_ring> ring;
+	double sample_rate;
+	// Next sample to output
+	uint64_t pos;
+	// Samples to go back by, -1 if no replay was requested
+	std::atomic<int64_t> replay_request;
+	bool catching_up;
+	uint64_t catchup_start_ns;
+	uint64_t catchup_items;
+	std::atomic<uint64_t> lag_items;
+};
+
+/**
+ * Set up the ring of the source if it has "timeshift_s". Without memory
+ * for it, the source runs without one. Called by setup_source().
+ */
+void timeshift_setup(size_t ix);
+/** true if some source of this process has a ring */
+bool timeshift_active();
+
+#endif
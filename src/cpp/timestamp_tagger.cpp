@@ -0,0 +1,122 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "timestamp_tagger.h"
+#include "metrics.h"
+#include "overrun.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <gnuradio/io_signature.h>
+
+using namespace std;
+
+// Tag interval in seconds
+#define TAG_INTERVAL 0.01
+
+pmt::pmt_t timestamp_tag_key()
+{
+	static const pmt::pmt_t key = pmt::intern("grwebsdr_ts");
+	return key;
+}
+
+timestamp_tagger::sptr timestamp_tagger::make(double sample_rate,
+		size_t source_ix)
+{
+	return boost::shared_ptr<timestamp_tagger>(
+			new timestamp_tagger(sample_rate, source_ix));
+}
+
+timestamp_tagger::timestamp_tagger(double sample_rate, size_t source_ix)
+	: gr::sync_block("timestamp_tagger",
+		gr::io_signature::make(1, 1, sizeof(gr_complex)),
+		gr::io_signature::make(1, 1, sizeof(gr_complex))),
+	sample_rate(sample_rate), source_ix(source_ix), next_tag(0),
+	started_ns(0)
+{
+	interval = sample_rate * TAG_INTERVAL;
+	if (interval < 1)
+		interval = 1;
+}
+
+int timestamp_tagger::work(int noutput_items,
+		gr_vector_const_void_star &input_items,
+		gr_vector_void_star &output_items)
+{
+	uint64_t start = nitems_written(0);
+	uint64_t end = start + noutput_items;
+	uint64_t now_ns = monotonic_ns();
+	pmt::pmt_t now;
+
+	memcpy(output_items[0], input_items[0],
+			noutput_items * sizeof(gr_complex));
+	track_overruns(end, now_ns);
+
+	// The item counters start from zero when the flowgraph is restarted
+	if (next_tag < start || next_tag > start + interval)
+		next_tag = start;
+	if (next_tag >= end)
+		return noutput_items;
+	now = pmt::from_uint64(now_ns);
+	for (; next_tag < end; next_tag += interval)
+		add_item_tag(0, next_tag, timestamp_tag_key(), now);
+	return noutput_items;
+}
+
+/* Called by the scheduler whenever the flowgraph is (re)started */
+bool timestamp_tagger::start()
+{
+	started_ns = 0;
+	flowgraph_restarted();
+	return gr::sync_block::start();
+}
+
+/*
+ * The deficit is the number of samples the source should have produced
+ * by now, minus the ones that arrived. Buffering makes it vary, but its
+ * minimum over a window only grows if samples were lost.
+ */
+void timestamp_tagger::track_overruns(uint64_t items, uint64_t now)
+{
+	int64_t deficit;
+
+	if (!started_ns || items < items_base) {
+		started_ns = now;
+		items_base = items;
+		window_start_ns = now;
+		window_min = INT64_MAX;
+		has_baseline = false;
+		return;
+	}
+	deficit = (int64_t) ((now - started_ns) * sample_rate / 1e9)
+		- (int64_t) (items - items_base);
+	window_min = min(window_min, deficit);
+	if (now - window_start_ns < OVERRUN_WINDOW_MS * 1000000ULL)
+		return;
+	if (has_baseline && window_min - baseline
+			> sample_rate * OVERRUN_MIN_LOST_MS / 1000)
+		overrun_detected(source_ix, window_min - baseline);
+	// Follows the slow drift of the source's clock
+	baseline = window_min;
+	has_baseline = true;
+	window_min = INT64_MAX;
+	window_start_ns = now;
+}
@@ -0,0 +1,62 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMESTAMP_TAGGER_H
+#define TIMESTAMP_TAGGER_H
+
+#include <config.h>
+#include <boost/shared_ptr.hpp>
+#include <gnuradio/sync_block.h>
+#include <pmt/pmt.h>
+
+/*
+ * Pass-through block sitting between an osmosdr source and the receivers.
+ * It tags the IQ stream with the monotonic time (in ns) at which the
+ * samples left the source, so that the latency of each stage of the
+ * receiver chain can be measured. It also detects overruns of the source,
+ * see overrun.h.
+ */
+class timestamp_tagger : virtual public gr::sync_block {
+public:
+	typedef boost::shared_ptr<timestamp_tagger> sptr;
+	static sptr make(double sample_rate, size_t source_ix);
+	int work(int noutput_items, gr_vector_const_void_star &input_items,
+			gr_vector_void_star &output_items);
+	bool start();
+private:
+	timestamp_tagger(double sample_rate, size_t source_ix);
+	double sample_rate;
+	size_t source_ix;
+	uint64_t interval;
+	uint64_t next_tag;
+	// Sample deficit tracking, restarted with the flowgraph
+	uint64_t started_ns;
+	uint64_t items_base;
+	uint64_t window_start_ns;
+	int64_t window_min;
+	int64_t baseline;
+	bool has_baseline;
+	void track_overruns(uint64_t items, uint64_t now);
+};
+
+/** Key of the tags added by timestamp_tagger */
+pmt::pmt_t timestamp_tag_key();
+
+#endif
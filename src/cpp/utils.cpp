@@ -20,6 +20,10 @@
 
 #include <config.h>
 #include "utils.h"
+#include "iq_record.h"
+#include "scanner.h"
+#include "remote.h"
+#include "timeshift.h"
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstdio>
@@ -56,9 +60,58 @@ int count_receivers_running()
 {
 	int ret = 0;
 
-	for (auto pair : receiver_map) {
+	for (auto pair : receiver_map.snapshot()) {
 		if (pair.second->is_running())
 			++ret;
 	}
 	return ret;
 }
+
+int count_receivers_running_on(size_t source_ix)
+{
+	int ret = 0;
+
+	for (auto pair : receiver_map.snapshot()) {
+		if (pair.second->is_running()
+				&& pair.second->get_source_ix() == source_ix)
+			++ret;
+	}
+	return ret;
+}
+
+bool source_in_use(size_t source_ix)
+{
+	return count_receivers_running_on(source_ix) > 0
+		|| sources_info[source_ix].iq_ring
+		|| iq_record_active(source_ix) || scanner_active(source_ix);
+}
+
+int flowgraph_users()
+{
+	// The time-shift rings are filled all the time
+	return count_receivers_running() + iq_recordings()
+		+ scanners_running() + (timeshift_active() ? 1 : 0);
+}
+
+void start_receiver(receiver::sptr rec)
+{
+	topbl->lock();
+	rec->start();
+	topbl->unlock();
+	// The top block of remote receivers stays empty
+	if (flowgraph_users() == 1 && remote_ops == nullptr)
+		topbl->start();
+}
+
+void stop_receiver(receiver::sptr rec)
+{
+	if (!rec->is_running())
+		return;
+	if (flowgraph_users() == 1 && remote_ops == nullptr) {
+		topbl->stop();
+		topbl->wait();
+	}
+	topbl->lock();
+	rec->stop();
+	topbl->unlock();
+}
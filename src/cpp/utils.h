@@ -29,5 +29,19 @@
 std::vector<gr_complex> taps_f2c(std::vector<float> vec);
 int set_nonblock(int fd);
 int count_receivers_running();
+int count_receivers_running_on(size_t source_ix);
+/**
+ * Whether the source feeds its timestamp tagger, for running receivers, a
+ * time-shift ring or a recording
+ */
+bool source_in_use(size_t source_ix);
+/** Running receivers, recordings and time-shift keep the top block running */
+int flowgraph_users();
+/**
+ * Start or stop the receiver's stream, and the top block with the first
+ * or last one. With flowgraph_mutex held.
+ */
+void start_receiver(receiver::sptr rec);
+void stop_receiver(receiver::sptr rec);
 
 #endif
@@ -19,24 +19,39 @@
  */
 
 #include <config.h>
+#include "admission.h"
 #include "auth.h"
+#include "broadcast.h"
+#include "control_msg.h"
+#include "iq_record.h"
+#include "json_writer.h"
+#include "scanner.h"
+#include "overrun.h"
+#include "quality.h"
 #include "websocket.h"
 #include "globals.h"
 #include "utils.h"
 #include "receiver.h"
+#include "receiver_pool.h"
+#include "segmented.h"
+#include "source_state.h"
+#include "remote.h"
+#include "sources.h"
+#include "event_loop.h"
+#include <algorithm>
 #include <atomic>
+#include <gnuradio/high_res_timer.h>
+#include <map>
 #include <iostream>
 #include <cstring>
 #include <string>
 #include <sstream>
 #include <iomanip>
-#include <json-c/json_tokener.h>
 #include <cstdio>
+#include <cstdlib>
 
 using namespace std;
 
-struct json_tokener *tok;
-
 string new_stream_name()
 {
 	static atomic_int ws_id(0);
@@ -46,317 +61,929 @@ string new_stream_name()
 	return s.str();
 }
 
-void process_authentication(struct json_object *obj, receiver::sptr rec,
-		struct websocket_user_data *data)
+void process_authentication(const struct control_msg &msg,
+		receiver::sptr rec, struct websocket_user_data *data)
 {
-	struct json_object *tmp, *tmp2;
-	string user, pass;
-
-	if (json_object_object_get_ex(obj, "login", &tmp)) {
+	if (msg.fields & CONTROL_LOGIN) {
 		data->privileged_changed = true;
-		if (!json_object_object_get_ex(tmp, "user", &tmp2))
-			return;
-		if (json_object_get_type(tmp2) != json_type_string)
-			return;
-		user = json_object_get_string(tmp2);
-
-		if (!json_object_object_get_ex(tmp, "pass", &tmp2))
-			return;
-		if (json_object_get_type(tmp2) != json_type_string)
+		if (!(msg.fields & CONTROL_USER) || !(msg.fields & CONTROL_PASS))
 			return;
-		pass = json_object_get_string(tmp2);
-		if (authenticate(user, pass))
+		if (authenticate(msg.user, msg.pass))
 			rec->set_privileged(true);
-	} else if (json_object_object_get_ex(obj, "logout", &tmp)) {
+	} else if (msg.fields & CONTROL_LOGOUT) {
 		data->privileged_changed = true;
 		rec->set_privileged(false);
 	}
 }
 
-void change_freq_offset(struct json_object *obj, receiver::sptr rec,
+void change_freq_offset(const struct control_msg &msg, receiver::sptr rec,
 		struct websocket_user_data *data)
 {
-	int offset;
-	struct json_object *offset_obj;
-
-	if (!json_object_object_get_ex(obj, "freq_offset", &offset_obj)
-			|| json_object_get_type(offset_obj) != json_type_int)
+	if (!(msg.fields & CONTROL_FREQ_OFFSET))
 		return;
-	offset = json_object_get_int(offset_obj);
-	rec->set_freq_offset(offset);
+	rec->set_freq_offset(msg.freq_offset);
 	data->offset_changed = true;
 }
 
-void change_hw_freq(struct json_object *obj, receiver::sptr rec)
+void change_hw_freq(const struct control_msg &msg, receiver::sptr rec)
 {
-	bool priv;
-	struct json_object *freq_obj;
-	int freq;
-
-	if (!json_object_object_get_ex(obj, "hw_freq", &freq_obj)
-			|| json_object_get_type(freq_obj) != json_type_int)
+	if (!(msg.fields & CONTROL_HW_FREQ))
 		return;
-	freq = json_object_get_int(freq_obj);
-
-	priv = rec->get_privileged();
-	if (!priv || rec->get_source() == nullptr)
+	if (!rec->get_privileged() || !rec->has_source())
 		return;
-	rec->get_source()->set_center_freq(freq);
-	lws_callback_on_writable_all_protocol(ws_context, &protocols[1]);
+	source_set_hw_freq(rec->get_source_ix(), msg.hw_freq);
+	if (remote_ops == nullptr)
+		broadcast_changed(BROADCAST_HW_FREQ, rec->get_source_ix());
 }
 
-void change_gain(struct json_object *obj, receiver::sptr rec)
+void change_gain(const struct control_msg &msg, receiver::sptr rec)
 {
-	struct json_object *gain_obj, *auto_gain_obj;
-	double gain;
-	bool auto_gain;
 	bool gain_set = false;
 
-	if (!rec->get_privileged() || rec->get_source() == nullptr)
+	if (!rec->get_privileged() || !rec->has_source())
 		return;
 
-	if (json_object_object_get_ex(obj, "auto_gain", &auto_gain_obj)) {
-		if (json_object_get_type(auto_gain_obj) == json_type_boolean) {
-			auto_gain = json_object_get_boolean(auto_gain_obj);
-			rec->get_source()->set_gain_mode(auto_gain);
-			gain_set = true;
-		}
+	if (msg.fields & CONTROL_AUTO_GAIN) {
+		source_set_gain_mode(rec->get_source_ix(), msg.auto_gain);
+		gain_set = true;
 	}
-	if (json_object_object_get_ex(obj, "gain", &gain_obj)) {
-		if (json_object_get_type(gain_obj) == json_type_double) {
-			gain = json_object_get_double(gain_obj);
-			rec->get_source()->set_gain_mode(false);
-			rec->get_source()->set_gain(gain);
-			gain_set = true;
-		}
+	if (msg.fields & CONTROL_GAIN) {
+		source_set_gain(rec->get_source_ix(), msg.gain);
+		gain_set = true;
 	}
-	if (gain_set)
-		lws_callback_on_writable_all_protocol(ws_context, &protocols[1]);
+	// A worker reports the new state, which is broadcast then
+	if (!gain_set || remote_ops != nullptr)
+		return;
+	broadcast_changed(BROADCAST_GAIN, rec->get_source_ix());
 }
 
-void change_demod(struct json_object *obj, receiver::sptr rec,
+void change_demod(const struct control_msg &msg, receiver::sptr rec,
 		struct websocket_user_data *data)
 {
-	struct json_object *demod_obj;
-	const char *demod;
+	const vector<string> &demods = receiver::supported_demods;
 
-	if (!json_object_object_get_ex(obj, "demod", &demod_obj)
-			|| json_object_get_type(demod_obj) != json_type_string)
+	if (!(msg.fields & CONTROL_DEMOD))
+		return;
+	data->demod_changed = true;
+	if (find(demods.begin(), demods.end(), msg.demod) == demods.end())
 		return;
-	demod = json_object_get_string(demod_obj);
+	// A single channel replaces the monitor mode ones
+	if (!rec->get_monitor().empty())
+		data->monitor_changed = true;
 
+	lock_guard<mutex> lock(flowgraph_mutex);
+	// Over budget, the reply tells the client the demodulation stays
+	if (rec->has_source() && !admission_admit(rec,
+				rec->get_source_ix(), msg.demod))
+		return;
 	topbl->lock();
-	rec->change_demod(demod);
+	rec->change_demod(msg.demod);
 	topbl->unlock();
-	data->demod_changed = true;
 }
 
-void change_source(struct json_object *obj, receiver::sptr rec,
+void set_server_full(struct websocket_user_data *data, bool val)
+{
+	if (data->server_full == val)
+		return;
+	data->server_full = val;
+	data->server_full_changed = true;
+}
+
+/*
+ * Switch to the source the client asked for, if the CPU budget allows it.
+ * Otherwise the request waits until some capacity is freed.
+ */
+void admit_pending_source(receiver::sptr rec, struct websocket_user_data *data)
+{
+	size_t source_ix = (size_t) data->pending_source;
+
+	if (data->pending_source < 0)
+		return;
+	{
+		lock_guard<mutex> lock(flowgraph_mutex);
+		if (!admission_admit(rec, source_ix, rec->get_chain_name())) {
+			set_server_full(data, true);
+			return;
+		}
+		topbl->lock();
+		rec->set_source(source_ix);
+		topbl->unlock();
+		// The client scans the source it listens to
+		if (data->scan_source >= 0
+				&& (size_t) data->scan_source != source_ix) {
+			scanner_unsubscribe(data->scan_source);
+			data->scan_source = scanner_subscribe(source_ix) ? -1
+				: (int) source_ix;
+			data->scan_changed = true;
+		}
+	}
+	data->pending_source = -1;
+	set_server_full(data, false);
+	data->source_changed = true;
+	data->offset_changed = true;
+}
+
+void change_source(const struct control_msg &msg, receiver::sptr rec,
 		struct websocket_user_data *data)
 {
-	struct json_object *source_obj;
-	int tmp;
-	size_t source_ix;
+	if (!(msg.fields & CONTROL_SOURCE) || msg.source < 0)
+		return;
 
-	if (!json_object_object_get_ex(obj, "source", &source_obj)
-			|| json_object_get_type(source_obj) != json_type_int) {
+	if ((size_t) msg.source >= sources_info.size()) {
 		return;
 	}
-	tmp = json_object_get_int(source_obj);
-	if (tmp < 0)
+	data->pending_source = msg.source;
+	admit_pending_source(rec, data);
+}
+
+void request_latency(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
+{
+	if (!(msg.fields & CONTROL_GET_LATENCY))
+		return;
+	if (!rec->get_privileged())
+		return;
+	data->latency_requested = true;
+}
+
+void request_block_stats(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
+{
+	if (!(msg.fields & CONTROL_GET_BLOCK_STATS))
+		return;
+	if (!rec->get_privileged())
+		return;
+	data->block_stats_requested = true;
+}
+
+void request_overruns(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
+{
+	if (!(msg.fields & CONTROL_GET_OVERRUNS))
+		return;
+	if (!rec->get_privileged())
 		return;
-	source_ix = (size_t) tmp;
+	data->overruns_requested = true;
+}
+
+/* Go back in time, on sources with time-shift */
+void request_replay(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
+{
+	if (!(msg.fields & CONTROL_REPLAY) || msg.replay < 0)
+		return;
+	lock_guard<mutex> lock(flowgraph_mutex);
+	data->replay_lag = rec->replay(msg.replay);
+	data->replay_changed = true;
+}
+
+/* Start or stop recording the IQ of the client's source */
+void record_iq(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
+{
+	enum iq_format format;
 
-	if (source_ix >= osmosdr_sources.size()) {
+	if (!(msg.fields & CONTROL_RECORD_IQ))
 		return;
+	if (!rec->get_privileged() || !rec->has_source())
+		return;
+	data->iq_recordings_changed = true;
+	lock_guard<mutex> lock(flowgraph_mutex);
+	if (iq_format_parse(msg.iq_format, &format))
+		iq_record_start(rec->get_source_ix(), format);
+	else
+		iq_record_stop(rec->get_source_ix());
+}
+
+/* Subscribe to the active channels of the client's source */
+void change_scan(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
+{
+	if (msg.fields & CONTROL_SCAN_AUTO_TUNE) {
+		data->scan_auto_tune = msg.scan_auto_tune;
+		data->scan_changed = true;
 	}
-	topbl->lock();
-	rec->set_source(source_ix);
-	topbl->unlock();
-	data->source_changed = true;
-	data->offset_changed = true;
+	if (!(msg.fields & CONTROL_SCAN) || !rec->has_source())
+		return;
+	data->scan_changed = true;
+	lock_guard<mutex> lock(flowgraph_mutex);
+	if (data->scan_source >= 0) {
+		scanner_unsubscribe(data->scan_source);
+		data->scan_source = -1;
+	}
+	if (msg.scan && !scanner_subscribe(rec->get_source_ix()))
+		data->scan_source = rec->get_source_ix();
 }
 
-void attach_current_demod(struct json_object *obj, receiver::sptr rec)
+/*
+ * Move the receiver to the strongest active channel once the one it's on
+ * went quiet.
+ */
+void auto_tune(receiver::sptr rec, struct websocket_user_data *data)
 {
-	struct json_object *tmp;
+	int offset;
 
-	tmp = json_object_new_string(rec->get_current_demod().c_str());
-	json_object_object_add(obj, "demod", tmp);
+	if (!data->scan_auto_tune || data->scan_source < 0
+			|| !rec->has_source()
+			|| (size_t) data->scan_source != rec->get_source_ix())
+		return;
+	if (scanner_channel_active(data->scan_source, rec->get_freq_offset()))
+		return;
+	if (!scanner_strongest(data->scan_source, &offset)
+			|| offset == rec->get_freq_offset())
+		return;
+	rec->set_freq_offset(offset);
+	data->offset_changed = true;
 }
 
-void attach_hw_freq(struct json_object *obj, receiver::sptr rec)
+/*
+ * Listen to several channels at once, see monitor.h. The reservation is
+ * moved to the new chain first, and back if the receiver refused it.
+ */
+void change_monitor(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
 {
-	struct json_object *val_obj;
-	osmosdr::source::sptr src;
+	vector<struct monitor_channel> channels;
+	string chain;
+	bool ok;
+
+	if (!(msg.fields & CONTROL_MONITOR))
+		return;
+	data->monitor_changed = true;
+	// Monitor mode reports the first channel's demodulation
+	data->demod_changed = true;
+	if (!rec->get_privileged() || !rec->has_source() || rec->is_remote()
+			|| msg.n_monitor > CONTROL_MONITOR_MAX)
+		return;
+	for (int i = 0; i < msg.n_monitor; ++i) {
+		const struct control_monitor_channel &c = msg.monitor[i];
+
+		channels.push_back({ c.offset, c.demod, (float) c.pan,
+				c.squelch });
+	}
+	chain = channels.empty() ? rec->get_current_demod()
+		: monitor_chain_name(channels.size());
 
-	src = rec->get_source();
-	if (src == nullptr)
+	lock_guard<mutex> lock(flowgraph_mutex);
+	if (!admission_admit(rec, rec->get_source_ix(), chain))
 		return;
-	val_obj = json_object_new_int(src->get_center_freq());
-	json_object_object_add(obj, "hw_freq", val_obj);
+	topbl->lock();
+	ok = rec->set_monitor(channels);
+	topbl->unlock();
+	if (!ok)
+		admission_admit(rec, rec->get_source_ix(),
+				rec->get_chain_name());
 }
 
-void attach_gain(struct json_object *obj, receiver::sptr rec)
+/* Look up the band activity history of the client's source */
+void query_activity(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
 {
-	struct json_object *val_obj;
-	osmosdr::source::sptr src;
+	if (!(msg.fields & CONTROL_ACTIVITY_QUERY))
+		return;
+	if (!rec->get_privileged() || !rec->has_source())
+		return;
+	data->activity_query.from = msg.activity_from;
+	data->activity_query.to = msg.activity_to;
+	data->activity_query.lo = msg.activity_lo;
+	data->activity_query.hi = msg.activity_hi;
+	data->activity_query_pending = true;
+}
 
-	src = rec->get_source();
-	if (src == nullptr)
+/* Start or stop recording what the client hears */
+void record_audio(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
+{
+	if (!(msg.fields & CONTROL_RECORD_AUDIO))
 		return;
-	val_obj = json_object_new_boolean(src->get_gain_mode());
-	json_object_object_add(obj, "auto_gain", val_obj);
-	val_obj = json_object_new_double(src->get_gain());
-	json_object_object_add(obj, "gain", val_obj);
+	if (!rec->get_privileged() || !rec->is_ready())
+		return;
+	data->audio_recording_changed = true;
+	if (msg.record_audio)
+		rec->start_recording("source"
+				+ to_string(rec->get_source_ix()) + "-"
+				+ rec->get_current_demod());
+	else
+		rec->stop_recording();
 }
 
-void attach_freq_offset(struct json_object *obj, receiver::sptr rec)
+/* Start a broadcast channel tuned like the client's receiver */
+void create_channel(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
 {
-	struct json_object *val_obj;
+	if (!(msg.fields & CONTROL_CREATE_CHANNEL))
+		return;
+	if (!rec->get_privileged() || !rec->has_source())
+		return;
+	segmented_create(rec->get_source_ix(), rec->get_current_demod(),
+			rec->get_freq_offset(), msg.label, false);
+	data->channels_changed = true;
+}
 
-	val_obj = json_object_new_int(rec->get_freq_offset());
-	json_object_object_add(obj, "freq_offset", val_obj);
+void delete_channel(const struct control_msg &msg, receiver::sptr rec,
+		struct websocket_user_data *data)
+{
+	if (!(msg.fields & CONTROL_DELETE_CHANNEL))
+		return;
+	if (!rec->get_privileged())
+		return;
+	segmented_delete(msg.channel);
+	data->channels_changed = true;
 }
 
-void attach_source_ix(struct json_object *obj, receiver::sptr rec)
+void attach_current_demod(struct json_writer *w, receiver::sptr rec)
 {
-	struct json_object *val_obj;
-	int ix;
+	jw_key(w, "demod");
+	jw_string(w, rec->get_current_demod().c_str());
+}
 
-	ix = (int) rec->get_source_ix();
-	val_obj = json_object_new_int(ix);
-	json_object_object_add(obj, "source_ix", val_obj);
+void attach_freq_offset(struct json_writer *w, receiver::sptr rec)
+{
+	jw_key(w, "freq_offset");
+	jw_int(w, rec->get_freq_offset());
 }
 
-void attach_source_description(struct json_object *obj, receiver::sptr rec)
+void attach_source_labels(struct json_writer *w)
 {
-	struct json_object *tmp;
+	jw_key(w, "sources");
+	jw_begin_array(w);
+	for (const source_info_t &info : sources_info)
+		jw_string(w, info.label.c_str());
+	jw_end_array(w);
+}
+
+void attach_source_info(struct json_writer *w, receiver::sptr rec)
+{
+	source_state_sptr state;
 	size_t ix;
 
+	if (!rec->has_source())
+		return;
 	ix = rec->get_source_ix();
-	tmp = json_object_new_string(sources_info[ix].description.c_str());
-	json_object_object_add(obj, "description", tmp);
+	state = get_source_state(ix);
+	jw_key(w, "current_source");
+	jw_begin_object(w);
+	jw_key(w, "source_ix");
+	jw_int(w, ix);
+	jw_key(w, "description");
+	jw_string(w, sources_info[ix].description.c_str());
+	jw_members(w, state->hw_freq_json.data(), state->hw_freq_json.size());
+	jw_key(w, "sample_rate");
+	jw_int(w, state->sample_rate);
+	jw_key(w, "converter_offset");
+	jw_int(w, sources_info[ix].freq_converter_offset);
+	// Only the receivers of this process can replay
+	jw_key(w, "timeshift_s");
+	jw_int(w, sources_info[ix].iq_ring
+			? sources_info[ix].timeshift_s : 0);
+	jw_members(w, state->gain_json.data(), state->gain_json.size());
+	jw_end_object(w);
+}
+
+void attach_supported_demods(struct json_writer *w)
+{
+	jw_key(w, "supported_demods");
+	jw_begin_array(w);
+	for (const string &d : receiver::supported_demods)
+		jw_string(w, d.c_str());
+	jw_end_array(w);
 }
 
-void attach_source_labels(struct json_object *obj)
+void attach_init_data(struct json_writer *w, struct websocket_user_data *data)
 {
-	struct json_object *sources, *tmp;
+	jw_key(w, "stream_name");
+	jw_string(w, data->stream_name);
+	attach_source_labels(w);
+	attach_supported_demods(w);
+	jw_key(w, "binary_protocol");
+	jw_int(w, CONTROL_BINARY_VERSION);
+}
 
-	sources = json_object_new_array();
-	for (source_info_t info : sources_info) {
-		tmp = json_object_new_string(info.label.c_str());
-		json_object_array_add(sources, tmp);
+void attach_privileged(struct json_writer *w, receiver::sptr rec)
+{
+	jw_key(w, "privileged");
+	jw_bool(w, rec->get_privileged());
+}
+
+void attach_num_clients(struct json_writer *w,
+		struct websocket_user_data *data)
+{
+	data->num_clients = receiver_map.size();
+	jw_key(w, "num_clients");
+	jw_int(w, data->num_clients);
+}
+
+void latency_histogram_json(struct json_writer *w, const char *key,
+		struct latency_histogram *h)
+{
+	uint64_t count;
+
+	count = h->count.load();
+	jw_key(w, key);
+	jw_begin_object(w);
+	jw_key(w, "count");
+	jw_int(w, count);
+	jw_key(w, "mean_ms");
+	jw_double(w, count ? h->sum_ns.load() / 1e6 / count : 0.0);
+	jw_key(w, "buckets");
+	jw_begin_array(w);
+	for (int i = 0; i < LATENCY_BUCKETS; ++i)
+		jw_int(w, h->buckets[i].load());
+	jw_end_array(w);
+	jw_end_object(w);
+}
+
+/*
+ * Per stage latency histograms of all receivers. Bucket i counts the
+ * measurements below bounds_ms[i], the last bucket is unbounded.
+ */
+void attach_latency(struct json_writer *w)
+{
+	boost::shared_ptr<receiver_stats> stats;
+
+	jw_key(w, "latency");
+	jw_begin_object(w);
+	jw_key(w, "bounds_ms");
+	jw_begin_array(w);
+	for (int i = 0; i < LATENCY_BUCKETS - 1; ++i)
+		jw_int(w, latency_bucket_bound_ms(i));
+	jw_end_array(w);
+	jw_key(w, "receivers");
+	jw_begin_object(w);
+	for (auto pair : receiver_map.snapshot()) {
+		stats = pair.second->get_stats();
+		jw_key(w, pair.first.c_str());
+		jw_begin_object(w);
+		latency_histogram_json(w, "dsp", &stats->dsp_latency);
+		latency_histogram_json(w, "encoder", &stats->encoder_latency);
+		latency_histogram_json(w, "transport",
+				&stats->transport_latency);
+		latency_histogram_json(w, "total", &stats->total_latency);
+		jw_end_object(w);
 	}
-	json_object_object_add(obj, "sources", sources);
+	jw_end_object(w);
+	jw_end_object(w);
 }
 
-void attach_sample_rate(struct json_object *obj, receiver::sptr rec)
+struct block_counters {
+	int count;
+	double work_time;
+	double work_time_avg;
+	double nproduced_avg;
+	double input_full;
+	double output_full;
+};
+
+static double average(const vector<float> &vals)
 {
-	struct json_object *tmp;
+	double sum = 0.0;
+
+	if (vals.empty())
+		return 0.0;
+	for (float v : vals)
+		sum += v;
+	return sum / vals.size();
+}
 
-	tmp = json_object_new_int(rec->get_source()->get_sample_rate());
-	json_object_object_add(obj, "sample_rate", tmp);
+void add_block_counters(struct block_counters &c, gr::block_sptr b)
+{
+	++c.count;
+	c.work_time += b->pc_work_time_total() / gr::high_res_timer_tps();
+	c.work_time_avg += b->pc_work_time_avg() / gr::high_res_timer_tps();
+	c.nproduced_avg += b->pc_nproduced_avg();
+	c.input_full += average(b->pc_input_buffers_full_avg());
+	c.output_full += average(b->pc_output_buffers_full_avg());
 }
 
-void attach_converter_offset(struct json_object *obj, receiver::sptr rec)
+/* The members of a block's counters, the caller opens the object */
+void block_counters_json(struct json_writer *w, const struct block_counters &c)
 {
-	struct json_object *tmp;
-	source_info_t i;
+	int n = c.count ? c.count : 1;
 
-	i = sources_info[rec->get_source_ix()];
-	tmp = json_object_new_int(i.freq_converter_offset);
-	json_object_object_add(obj, "converter_offset", tmp);
+	jw_key(w, "count");
+	jw_int(w, c.count);
+	jw_key(w, "work_time_s");
+	jw_double(w, c.work_time);
+	jw_key(w, "work_time_avg_s");
+	jw_double(w, c.work_time_avg / n);
+	jw_key(w, "nproduced_avg");
+	jw_double(w, c.nproduced_avg / n);
+	jw_key(w, "input_buffers_full");
+	jw_double(w, c.input_full / n);
+	jw_key(w, "output_buffers_full");
+	jw_double(w, c.output_full / n);
 }
 
-void attach_source_info(struct json_object *obj, receiver::sptr rec)
+/*
+ * Snapshot of the GNU Radio performance counters of the blocks of all
+ * running receivers, aggregated per demodulation, and of the source
+ * taggers. Work times are totals in seconds of CPU time, buffer fullness
+ * is the average fill ratio of the block's input and output buffers.
+ */
+void attach_block_stats(struct json_writer *w)
 {
-	struct json_object *tmp;
+	struct demod_counters {
+		int receivers;
+		map<string, struct block_counters> blocks;
+	};
+	map<string, struct demod_counters> demods;
+	// The receivers' blocks may be replaced by other threads
+	lock_guard<mutex> lock(flowgraph_mutex);
 
-	if (rec->get_source() == nullptr)
-		return;
-	tmp = json_object_new_object();
-	attach_source_ix(tmp, rec);
-	attach_source_description(tmp, rec);
-	attach_hw_freq(tmp, rec);
-	attach_sample_rate(tmp, rec);
-	attach_converter_offset(tmp, rec);
-	attach_gain(tmp, rec);
-	json_object_object_add(obj, "current_source", tmp);
+	for (auto pair : receiver_map.snapshot()) {
+		receiver::sptr rec = pair.second;
+		map<string, int> seen;
+
+		if (!rec->is_running())
+			continue;
+		struct demod_counters &d = demods[rec->get_current_demod()];
+		++d.receivers;
+		for (gr::block_sptr b : rec->get_blocks()) {
+			// Tell apart multiple blocks of the same kind
+			string name = b->name();
+			int n = seen[name]++;
+			if (n)
+				name += "_" + to_string(n);
+			add_block_counters(d.blocks[name], b);
+		}
+	}
+
+	jw_key(w, "block_stats");
+	jw_begin_object(w);
+	jw_key(w, "demods");
+	jw_begin_object(w);
+	for (auto &pair : demods) {
+		jw_key(w, pair.first.c_str());
+		jw_begin_object(w);
+		jw_key(w, "receivers");
+		jw_int(w, pair.second.receivers);
+		jw_key(w, "blocks");
+		jw_begin_object(w);
+		for (auto &b : pair.second.blocks) {
+			jw_key(w, b.first.c_str());
+			jw_begin_object(w);
+			block_counters_json(w, b.second);
+			jw_end_object(w);
+		}
+		jw_end_object(w);
+		jw_end_object(w);
+	}
+	jw_end_object(w);
+
+	jw_key(w, "sources");
+	jw_begin_array(w);
+	for (size_t i = 0; i < sources_info.size(); ++i) {
+		struct block_counters c = {};
+
+		add_block_counters(c, sources_info[i].tagger);
+		jw_begin_object(w);
+		block_counters_json(w, c);
+		jw_key(w, "receivers");
+		jw_int(w, count_receivers_running_on(i));
+		jw_end_object(w);
+	}
+	jw_end_array(w);
+	jw_end_object(w);
 }
 
-void attach_supported_demods(struct json_object *obj)
+/*
+ * The recent overruns, with the number of listeners at the time and how
+ * long before the flowgraph had been restarted. Ages are in seconds.
+ */
+void attach_overruns(struct json_writer *w)
 {
-	struct json_object *demods, *tmp;
+	uint64_t now = monotonic_ns();
 
-	demods = json_object_new_array();
-	for (string d : receiver::supported_demods) {
-		tmp = json_object_new_string(d.c_str());
-		json_object_array_add(demods, tmp);
+	jw_key(w, "overruns_log");
+	jw_begin_array(w);
+	for (const struct overrun_event &ev : overrun_history()) {
+		jw_begin_object(w);
+		jw_key(w, "age_s");
+		jw_double(w, (now - ev.time_ns) / 1e9);
+		jw_key(w, "source_ix");
+		jw_int(w, ev.source_ix);
+		jw_key(w, "lost_samples");
+		jw_int(w, ev.lost_samples);
+		jw_key(w, "listeners");
+		jw_int(w, ev.listeners);
+		jw_key(w, "since_reconfig_s");
+		jw_double(w, ev.since_reconfig_ns / 1e9);
+		jw_end_object(w);
 	}
-	json_object_object_add(obj, "supported_demods", demods);
+	jw_end_array(w);
 }
 
-void attach_init_data(struct json_object *obj, struct websocket_user_data *data)
+void attach_iq_recordings(struct json_writer *w)
 {
-	struct json_object *tmp;
+	jw_key(w, "iq_recordings");
+	jw_begin_array(w);
+	for (const struct iq_record_info &info : iq_record_list()) {
+		jw_begin_object(w);
+		jw_key(w, "source_ix");
+		jw_int(w, info.source_ix);
+		jw_key(w, "name");
+		jw_string(w, info.name.c_str());
+		jw_key(w, "format");
+		jw_string(w, iq_format_name(info.format));
+		jw_key(w, "bytes_written");
+		jw_int(w, info.bytes_written);
+		jw_key(w, "dropped");
+		jw_int(w, info.dropped);
+		jw_end_object(w);
+	}
+	jw_end_array(w);
+}
 
-	tmp = json_object_new_string(data->stream_name);
-	json_object_object_add(obj, "stream_name", tmp);
+/* The monitor mode channels, empty if there are none */
+void attach_monitor(struct json_writer *w, receiver::sptr rec)
+{
+	jw_key(w, "monitor");
+	jw_begin_array(w);
+	for (const struct monitor_channel &c : rec->get_monitor()) {
+		jw_begin_object(w);
+		jw_key(w, "offset");
+		jw_int(w, c.offset);
+		jw_key(w, "demod");
+		jw_string(w, c.demod.c_str());
+		jw_key(w, "pan");
+		jw_double(w, c.pan);
+		jw_key(w, "squelch");
+		jw_bool(w, c.squelch);
+		jw_end_object(w);
+	}
+	jw_end_array(w);
+}
 
-	attach_source_labels(obj);
-	attach_supported_demods(obj);
+/* Whether the client's source is scanned, the channels come broadcast */
+void attach_scan(struct json_writer *w, struct websocket_user_data *data)
+{
+	jw_key(w, "scan");
+	jw_begin_object(w);
+	jw_key(w, "active");
+	jw_bool(w, data->scan_source >= 0);
+	jw_key(w, "auto_tune");
+	jw_bool(w, data->scan_auto_tune);
+	jw_end_object(w);
 }
 
-void attach_privileged(struct json_object *obj, receiver::sptr rec)
+/* The client's recording, false if there is none */
+void attach_audio_recording(struct json_writer *w, receiver::sptr rec)
 {
-	bool val;
-	struct json_object *val_obj;
+	boost::shared_ptr<struct audio_writer> recorder = rec->get_recorder();
+	struct audio_record_info info;
 
-	val = rec->get_privileged();
+	jw_key(w, "audio_recording");
+	if (recorder == nullptr) {
+		jw_bool(w, false);
+		return;
+	}
+	info = audio_record_get_info(recorder.get());
+	jw_begin_object(w);
+	jw_key(w, "file");
+	jw_string(w, info.file.c_str());
+	jw_key(w, "files");
+	jw_int(w, info.files);
+	jw_key(w, "bytes_written");
+	jw_int(w, info.bytes_written);
+	jw_key(w, "pages_dropped");
+	jw_int(w, info.pages_dropped);
+	jw_end_object(w);
+}
 
-	val_obj = json_object_new_boolean(val);
-	json_object_object_add(obj, "privileged", val_obj);
+/* The broadcast channels, listeners find them in /live/index.json */
+void attach_channels(struct json_writer *w)
+{
+	jw_key(w, "channels");
+	jw_begin_array(w);
+	for (const struct segmented_info &info : segmented_list()) {
+		jw_begin_object(w);
+		jw_key(w, "id");
+		jw_int(w, info.id);
+		jw_key(w, "label");
+		jw_string(w, info.label.c_str());
+		jw_key(w, "source_ix");
+		jw_int(w, info.source_ix);
+		jw_key(w, "demod");
+		jw_string(w, info.demod.c_str());
+		jw_key(w, "freq_offset");
+		jw_int(w, info.freq_offset);
+		// Can't be deleted, see headless.h
+		jw_key(w, "persistent");
+		jw_bool(w, info.persistent);
+		jw_end_object(w);
+	}
+	jw_end_array(w);
 }
 
-void attach_num_clients(struct json_object *obj)
+/*
+ * Write the pending updates of the client. Doesn't clear the flags, the
+ * reply may have to be written again into a larger buffer.
+ */
+void write_reply(struct json_writer *w, struct websocket_user_data *data,
+		receiver::sptr rec)
+{
+	jw_begin_object(w);
+	if (!data->initialized)
+		attach_init_data(w, data);
+	if (data->privileged_changed)
+		attach_privileged(w, rec);
+	if (data->demod_changed)
+		attach_current_demod(w, rec);
+	if (data->offset_changed)
+		attach_freq_offset(w, rec);
+	if (data->source_changed)
+		attach_source_info(w, rec);
+	if (data->latency_requested)
+		attach_latency(w);
+	if (data->block_stats_requested)
+		attach_block_stats(w);
+	if (data->overruns_requested)
+		attach_overruns(w);
+	if (data->channels_changed)
+		attach_channels(w);
+	if (data->iq_recordings_changed)
+		attach_iq_recordings(w);
+	if (data->audio_recording_changed)
+		attach_audio_recording(w, rec);
+	if (data->scan_changed)
+		attach_scan(w, data);
+	if (data->monitor_changed)
+		attach_monitor(w, rec);
+	if (data->activity_query_pending) {
+		// false if the source has no index
+		jw_key(w, "activity_index");
+		if (!activity_index_query(w, rec->get_source_ix(),
+					data->activity_query))
+			jw_bool(w, false);
+	}
+	if (data->replay_changed) {
+		// The client plays the audio faster until it's live again
+		jw_key(w, "replay");
+		jw_begin_object(w);
+		jw_key(w, "lag_s");
+		jw_double(w, max(data->replay_lag, 0.0));
+		jw_key(w, "speed");
+		jw_double(w, timeshift_config.catchup_speed);
+		jw_end_object(w);
+	}
+	if (data->server_full_changed) {
+		jw_key(w, "server_full");
+		jw_bool(w, data->server_full);
+	}
+	if (data->quality_changed) {
+		jw_key(w, "quality_tier");
+		jw_int(w, data->quality_tier);
+	}
+	attach_num_clients(w, data);
+	jw_end_object(w);
+}
+
+/*
+ * Send the pending updates. Replies that don't fit into the per-session
+ * buffer (e.g. the admin views) are written again into a temporary heap
+ * buffer.
+ */
+int send_reply(struct lws *wsi, struct websocket_user_data *data,
+		receiver::sptr rec)
 {
-	struct json_object *tmp;
+	struct json_writer w;
+	unsigned char *buf = (unsigned char *) data->buf;
+	broadcast_msg_sptr msg;
+	size_t size;
+	int ret;
 
-	tmp = json_object_new_int(receiver_map.size());
-	json_object_object_add(obj, "num_clients", tmp);
+	if (data->source_changed) {
+		// The source info is complete, skip the pending broadcast
+		set_client_source(wsi, (int) rec->get_source_ix());
+		msg = broadcast_get(rec->get_source_ix());
+		data->broadcast_version = msg == nullptr ? 0 : msg->version;
+	}
+	jw_init(&w, data->buf + LWS_PRE, WEBSOCKET_MAX_PAYLOAD);
+	write_reply(&w, data, rec);
+	if (jw_overflow(&w)) {
+		// Leave some room for counters growing between the passes
+		size = w.len + WEBSOCKET_MAX_PAYLOAD;
+		buf = (unsigned char *) malloc(LWS_PRE + size);
+		if (!buf) {
+			cerr << "malloc() failed" << endl;
+			return -1;
+		}
+		jw_init(&w, (char *) buf + LWS_PRE, size);
+		write_reply(&w, data, rec);
+	}
+	data->initialized = true;
+	data->privileged_changed = false;
+	data->demod_changed = false;
+	data->offset_changed = false;
+	data->source_changed = false;
+	data->latency_requested = false;
+	data->block_stats_requested = false;
+	data->overruns_requested = false;
+	data->channels_changed = false;
+	data->replay_changed = false;
+	data->iq_recordings_changed = false;
+	data->audio_recording_changed = false;
+	data->scan_changed = false;
+	data->monitor_changed = false;
+	data->activity_query_pending = false;
+	data->server_full_changed = false;
+	data->quality_changed = false;
+	if (jw_overflow(&w)) {
+		cerr << "WebSocket reply too long." << endl;
+		ret = 0;
+	} else {
+		ret = lws_write(wsi, buf + LWS_PRE, w.len, LWS_WRITE_TEXT);
+	}
+	if (buf != (unsigned char *) data->buf)
+		free(buf);
+	return ret < 0 ? -1 : 0;
 }
 
-int init_websocket()
+bool update_pending(struct websocket_user_data *data)
 {
-	tok = json_tokener_new();
-	if (!tok) {
-		cerr << "json_tokener_new() failed." << endl;
-		return -1;
+	return !data->initialized || data->privileged_changed
+		|| data->demod_changed || data->offset_changed
+		|| data->source_changed || data->latency_requested
+		|| data->block_stats_requested || data->overruns_requested
+		|| data->channels_changed || data->replay_changed
+		|| data->iq_recordings_changed
+		|| data->audio_recording_changed || data->scan_changed
+		|| data->monitor_changed
+		|| data->activity_query_pending || data->server_full_changed
+		|| data->quality_changed;
+}
+
+/*
+ * Send the latest broadcast of the client's source, if the client hasn't
+ * got it yet. Returns 1 if a message was sent.
+ */
+int send_broadcast(struct lws *wsi, struct websocket_user_data *data,
+		receiver::sptr rec)
+{
+	broadcast_msg_sptr msg;
+	const string *str;
+	size_t tsi = lws_get_tsi(wsi);
+	int ret;
+
+	// The client gets the complete state with the source info first
+	if (!data->initialized || data->source_changed
+			|| !rec->has_source())
+		return 0;
+	msg = broadcast_get(rec->get_source_ix());
+	if (msg == nullptr || msg->version == data->broadcast_version
+			|| tsi >= msg->delta.size())
+		return 0;
+	if (msg->version == data->broadcast_version + 1)
+		str = &msg->delta[tsi];
+	else
+		str = &msg->full[tsi];
+	data->broadcast_version = msg->version;
+	// Only this thread writes the header into the room of its copy
+	ret = lws_write(wsi, (unsigned char *) &(*str)[0] + LWS_PRE,
+			str->size() - LWS_PRE, LWS_WRITE_TEXT);
+	return ret < 0 ? -1 : 1;
+}
+
+/*
+ * Collect the fragments of a message, lws hands over messages larger than
+ * the rx buffer in pieces. Returns true once the message is complete.
+ */
+bool receive_fragment(struct lws *wsi, struct websocket_user_data *data,
+		const char *in, size_t len)
+{
+	if (data->rx_len + len > sizeof(data->rx_buf)) {
+		data->rx_overflow = true;
+	} else {
+		memcpy(data->rx_buf + data->rx_len, in, len);
+		data->rx_len += len;
 	}
-	return 0;
+	if (!lws_is_final_fragment(wsi) || lws_remaining_packet_payload(wsi))
+		return false;
+	if (data->rx_overflow) {
+		cerr << "WebSocket message too long." << endl;
+		data->rx_overflow = false;
+		data->rx_len = 0;
+		return false;
+	}
+	return true;
 }
 
 int create_stream(struct websocket_user_data *data)
 {
-	int pipe_fds[2];
 	string tmp;
+	receiver::sptr rec;
 
-	if (pipe(pipe_fds)) {
-		perror("pipe");
-		return -1;
-	}
-	if (set_nonblock(pipe_fds[0])) {
-		return -1;
-	}
 	tmp = new_stream_name() + string(".ogg");
 	if (tmp.size() > STREAM_NAME_LEN)
 		return -1;
+	rec = receiver_pool_acquire();
+	if (rec == nullptr)
+		return -1;
 	strncpy(data->stream_name, tmp.c_str(), tmp.size());
 	data->stream_name[tmp.size()] = '\0';
-	receiver_map[data->stream_name] = receiver::make(topbl, pipe_fds);
+	receiver_map.insert(data->stream_name, rec);
 	// Update number of clients
-	lws_callback_on_writable_all_protocol(ws_context, &protocols[1]);
+	broadcast_changed_all(BROADCAST_NUM_CLIENTS);
 	return 0;
 }
 
@@ -367,104 +994,129 @@ int websocket_cb(struct lws *wsi, enum lws_callback_reasons reason,
 	(void) wsi;
 
 	switch (reason) {
-	case LWS_CALLBACK_PROTOCOL_INIT:
-		if (init_websocket())
-			return -1;
-		break;
-
 	case LWS_CALLBACK_SERVER_WRITEABLE: {
-		struct json_object *reply;
-		char *buf = data->buf + LWS_PRE;
 		receiver::sptr rec;
+		int ret;
 
-		auto iter = receiver_map.find(data->stream_name);
-		if (iter == receiver_map.end()) {
+		rec = receiver_map.find(data->stream_name);
+		if (rec == nullptr)
 			return -1;
-		}
-		rec = iter->second;
 
-		reply = json_object_new_object();
-		if (data->initialized && !data->source_changed) {
-			attach_hw_freq(reply, rec);
-			attach_gain(reply, rec);
-		}
-		if (!data->initialized) {
-			attach_init_data(reply, data);
-			data->initialized = true;
+		// Woken up because capacity was freed, or logged in
+		admit_pending_source(rec, data);
+		// Or because the active channels changed
+		auto_tune(rec, data);
+		if (rec->get_quality_tier() != data->quality_tier) {
+			data->quality_tier = rec->get_quality_tier();
+			data->quality_changed = true;
 		}
-		if (data->privileged_changed) {
-			attach_privileged(reply, rec);
-			data->privileged_changed = false;
-		}
-		if (data->demod_changed) {
-			attach_current_demod(reply, rec);
-			data->demod_changed = false;
-		}
-		if (data->offset_changed) {
-			attach_freq_offset(reply, rec);
-			data->offset_changed = false;
-		}
-		if (data->source_changed) {
-			attach_source_info(reply, rec);
-			data->source_changed = false;
+		ret = send_broadcast(wsi, data, rec);
+		if (ret < 0)
+			return -1;
+		if (ret > 0) {
+			// One write per callback, send the rest next time
+			if (update_pending(data))
+				lws_callback_on_writable(wsi);
+			break;
 		}
-		attach_num_clients(reply);
-		strcpy(buf, json_object_get_string(reply));
-		json_object_put(reply);
-		lws_write(wsi, (unsigned char *) buf, strlen(buf), LWS_WRITE_TEXT);
+		// No broadcasts without a source, the reply has the count
+		if (!update_pending(data) && (rec->has_source()
+				|| data->num_clients == receiver_map.size()))
+			break;
+		if (send_reply(wsi, data, rec))
+			return -1;
 		break;
 	}
 	case LWS_CALLBACK_RECEIVE: {
-		struct json_object *obj;
+		struct control_msg msg;
 		receiver::sptr rec;
+		bool ok;
 
-		auto iter = receiver_map.find(data->stream_name);
-		if (iter == receiver_map.end()) {
+		rec = receiver_map.find(data->stream_name);
+		if (rec == nullptr)
 			return -1;
-		}
-		rec = iter->second;
 
-		obj = json_tokener_parse_ex(tok, (char *) in, len);
-		if (!obj) {
-			cerr << "json parsing failed." << endl;
+		if (!receive_fragment(wsi, data, (const char *) in, len))
+			break;
+		if (lws_frame_is_binary(wsi)) {
+			ok = parse_control_binary(
+					(const unsigned char *) data->rx_buf,
+					data->rx_len, &msg);
+		} else {
+			ok = parse_control_json(data->rx_buf, data->rx_len,
+					&msg);
+		}
+		data->rx_len = 0;
+		if (!ok) {
+			cerr << "Bad control message." << endl;
 			break;
 		}
-		json_tokener_reset(tok);
-
-		change_freq_offset(obj, rec, data);
-		change_hw_freq(obj, rec);
-		change_gain(obj, rec);
-		change_demod(obj, rec, data);
-		change_source(obj, rec, data);
-		process_authentication(obj, rec, data);
-		json_object_put(obj);
+
+		change_freq_offset(msg, rec, data);
+		change_hw_freq(msg, rec);
+		change_gain(msg, rec);
+		change_demod(msg, rec, data);
+		change_source(msg, rec, data);
+		process_authentication(msg, rec, data);
+		request_latency(msg, rec, data);
+		request_block_stats(msg, rec, data);
+		request_overruns(msg, rec, data);
+		request_replay(msg, rec, data);
+		record_iq(msg, rec, data);
+		record_audio(msg, rec, data);
+		change_scan(msg, rec, data);
+		change_monitor(msg, rec, data);
+		query_activity(msg, rec, data);
+		create_channel(msg, rec, data);
+		delete_channel(msg, rec, data);
 		lws_callback_on_writable(wsi);
 		break;
 	}
 	case LWS_CALLBACK_ESTABLISHED: {
+		add_client(wsi);
 		create_stream(data);
 		data->initialized = false;
+		data->channels_changed = false;
+		data->replay_changed = false;
+		data->iq_recordings_changed = false;
+		data->audio_recording_changed = false;
+		data->scan_source = -1;
+		data->scan_auto_tune = false;
+		data->scan_changed = false;
+		data->monitor_changed = false;
+		data->activity_query_pending = false;
+		data->broadcast_version = 0;
+		data->num_clients = 0;
+		data->rx_len = 0;
+		data->rx_overflow = false;
+		data->pending_source = -1;
+		data->server_full = false;
+		data->server_full_changed = false;
+		data->quality_tier = QUALITY_FULL;
+		data->quality_changed = false;
 		lws_callback_on_writable(wsi);
 		break;
 	}
 	case LWS_CALLBACK_CLOSED: {
 		receiver::sptr rec;
-		if (receiver_map.find(data->stream_name) == receiver_map.end()) {
+
+		delete_client(wsi);
+		rec = receiver_map.find(data->stream_name);
+		if (rec == nullptr)
 			break;
-		}
-		rec = receiver_map[data->stream_name];
-		if (rec->is_running()) {
-			if (count_receivers_running() == 1) {
-				topbl->stop();
-				topbl->wait();
-			}
-			topbl->lock();
-			rec->stop();
-			topbl->unlock();
+		rec->stop_recording();
+		{
+			lock_guard<mutex> lock(flowgraph_mutex);
+			if (data->scan_source >= 0)
+				scanner_unsubscribe(data->scan_source);
+			stop_receiver(rec);
 		}
 		receiver_map.erase(data->stream_name);
 		// Update number of clients
-		lws_callback_on_writable_all_protocol(ws_context, &protocols[1]);
+		broadcast_changed_all(BROADCAST_NUM_CLIENTS);
+		// Let the clients waiting for a free slot try again
+		if (admission_release(rec))
+			notify_all_clients();
 		break;
 	}
 	default:
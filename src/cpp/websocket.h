@@ -22,11 +22,14 @@
 #define WEBSOCKET_H
 
 #include <config.h>
+#include "activity_index.h"
 #include "globals.h"
 #include <string>
 #include <libwebsockets.h>
 
 #define WEBSOCKET_MAX_PAYLOAD 4096
+// Longest control message accepted from a client
+#define WEBSOCKET_MAX_RX 1024
 
 struct websocket_user_data {
 	char stream_name[STREAM_NAME_LEN + 1];
@@ -35,11 +38,44 @@ struct websocket_user_data {
 	bool source_changed;
 	bool demod_changed;
 	bool offset_changed;
+	bool latency_requested;
+	bool block_stats_requested;
+	bool overruns_requested;
+	// The broadcast channels changed, see segmented.h
+	bool channels_changed;
+	// Seconds gone back by the last replay, < 0 if it wasn't possible
+	double replay_lag;
+	bool replay_changed;
+	bool iq_recordings_changed;
+	bool audio_recording_changed;
+	// Source scanned for the client, -1 if none, see scanner.h
+	int scan_source;
+	bool scan_auto_tune;
+	bool scan_changed;
+	// Answered with the next reply, see activity_index.h
+	struct activity_query activity_query;
+	bool activity_query_pending;
+	// The monitor mode channels changed, see monitor.h
+	bool monitor_changed;
+	// Source requested while the server is full, -1 if none
+	int pending_source;
+	bool server_full;
+	bool server_full_changed;
+	// Quality tier last sent to the client, see quality.h
+	int quality_tier;
+	bool quality_changed;
+	// Version of the last broadcast message sent, see broadcast.h
+	uint64_t broadcast_version;
+	// Sent with every reply, broadcast to clients with a source
+	size_t num_clients;
+	// Fragments of the message being received
+	char rx_buf[WEBSOCKET_MAX_RX];
+	size_t rx_len;
+	bool rx_overflow;
 	char buf[LWS_PRE + WEBSOCKET_MAX_PAYLOAD];
 };
 
 int websocket_cb(struct lws *wsi, enum lws_callback_reasons reason,
 		void *user, void *in, size_t len);
-int init_websocket();
 
 #endif
@@ -0,0 +1,674 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "worker.h"
+#include "broadcast.h"
+#include "event_loop.h"
+#include "globals.h"
+#include "overrun.h"
+#include "source_state.h"
+#include "utils.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// A worker that hasn't reported for this long is killed and started again
+#define WORKER_STALL_MS 5000
+
+struct worker_config worker_config = { false, 32 };
+
+struct slot {
+	bool used;
+	// CLOSE was sent. The slot is free once the worker confirmed it and
+	// the front-end let go of the ring.
+	bool closing;
+	bool acked;
+	bool released;
+	// The receiver's eventfd, duplicated for replaying the slot
+	int notify_fd;
+	struct remote_slot_settings settings;
+	boost::shared_ptr<receiver_stats> stats;
+};
+
+struct worker {
+	size_t source_ix;
+	pid_t pid;
+	// -1 while the worker is down
+	int ctl_fd;
+	int shm_fd;
+	struct audio_ring *rings;
+	// Device settings, replayed to a new worker
+	int hw_freq;
+	bool auto_gain;
+	double gain;
+	std::vector<struct slot> slots;
+	uint64_t started_ns;
+	std::atomic<uint64_t> last_heard_ns{0};
+	std::atomic<uint64_t> restarts{0};
+	bool respawn_pending;
+	// Protects everything above but the atomics
+	std::mutex lock;
+};
+
+static vector<unique_ptr<struct worker>> workers;
+static string config_file;
+static int epoll_fd = -1;
+static int tick_fd = -1;
+
+static int watch(int fd, uint64_t data)
+{
+	struct epoll_event ev = {};
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = data;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+static bool send_msg(struct worker &w, const struct worker_msg &msg,
+		int fd = -1)
+{
+	struct msghdr mh = {};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+
+	if (w.ctl_fd < 0)
+		return false;
+	iov.iov_base = (void *) &msg;
+	iov.iov_len = sizeof(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (fd >= 0) {
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	if (sendmsg(w.ctl_fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		if (errno == EAGAIN) {
+			// Too far behind to catch up, the settings are
+			// replayed to its successor
+			cerr << "Worker of source " << w.source_ix
+				<< " doesn't keep up, killing it." << endl;
+			kill(w.pid, SIGKILL);
+		} else if (errno != EPIPE) {
+			perror("sendmsg");
+		}
+		return false;
+	}
+	return true;
+}
+
+static struct worker_msg make_msg(int type, int slot)
+{
+	struct worker_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	msg.slot = slot;
+	return msg;
+}
+
+static void send_value(struct worker &w, int type, int slot, int value)
+{
+	struct worker_msg msg = make_msg(type, slot);
+
+	msg.value = value;
+	send_msg(w, msg);
+}
+
+static void send_demod(struct worker &w, int slot, const string &demod)
+{
+	struct worker_msg msg = make_msg(WORKER_DEMOD, slot);
+
+	strncpy(msg.demod, demod.c_str(), WORKER_DEMOD_LEN - 1);
+	send_msg(w, msg);
+}
+
+static void send_gain(struct worker &w)
+{
+	struct worker_msg msg = make_msg(WORKER_GAIN, -1);
+
+	if (w.auto_gain) {
+		send_value(w, WORKER_AUTO_GAIN, -1, true);
+		return;
+	}
+	msg.gain = w.gain;
+	send_msg(w, msg);
+}
+
+/* Set the slot up in the worker, in the order a receiver needs it */
+static void send_open(struct worker &w, int slot)
+{
+	const struct remote_slot_settings &s = w.slots[slot].settings;
+
+	if (!send_msg(w, make_msg(WORKER_OPEN, slot), w.slots[slot].notify_fd))
+		return;
+	send_value(w, WORKER_QUALITY, slot, s.quality_tier);
+	if (s.demod != "")
+		send_demod(w, slot, s.demod);
+	send_value(w, WORKER_FREQ_OFFSET, slot, s.freq_offset);
+	if (s.running)
+		send_value(w, WORKER_START, slot, 0);
+}
+
+static void maybe_free(struct slot &s)
+{
+	if (!s.closing || !s.acked || !s.released)
+		return;
+	close(s.notify_fd);
+	s.notify_fd = -1;
+	s.stats = nullptr;
+	s.used = false;
+}
+
+static int spawn(struct worker &w)
+{
+	int sv[2];
+	char spec[64];
+	const char *argv[6];
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	int null_fd;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+		perror("socketpair");
+		return -1;
+	}
+	snprintf(spec, sizeof(spec), "%zu:%d:%d", w.source_ix, sv[1],
+			w.shm_fd);
+	argv[0] = "grwebsdr";
+	argv[1] = "-f";
+	argv[2] = config_file.c_str();
+	argv[3] = "-W";
+	argv[4] = spec;
+	argv[5] = nullptr;
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		// Only async-signal-safe calls from here on, the front-end
+		// has threads. Keep stdout and stderr, the latter may be
+		// the overrun marks hook.
+		null_fd = open("/dev/null", O_RDONLY);
+		if (null_fd >= 0)
+			dup2(null_fd, STDIN_FILENO);
+		for (int fd = 3; fd < max_fd; ++fd) {
+			if (fd != sv[1] && fd != w.shm_fd)
+				close(fd);
+		}
+		fcntl(sv[1], F_SETFD, 0);
+		fcntl(w.shm_fd, F_SETFD, 0);
+		execv("/proc/self/exe", (char * const *) argv);
+		_exit(127);
+	}
+	close(sv[1]);
+	if (set_nonblock(sv[0])) {
+		close(sv[0]);
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+		return -1;
+	}
+	w.ctl_fd = sv[0];
+	w.pid = pid;
+	w.started_ns = monotonic_ns();
+	w.last_heard_ns.store(w.started_ns);
+	if (watch(w.ctl_fd, w.source_ix))
+		return -1;
+	cout << "Started the worker of source " << w.source_ix << ", pid "
+		<< pid << endl;
+	return 0;
+}
+
+/* Start the worker again and hand it all the receivers it had */
+static void respawn(struct worker &w)
+{
+	lock_guard<mutex> lock(w.lock);
+
+	w.respawn_pending = false;
+	if (spawn(w))
+		return;
+	send_value(w, WORKER_HW_FREQ, -1, w.hw_freq);
+	send_gain(w);
+	for (size_t i = 0; i < w.slots.size(); ++i) {
+		if (w.slots[i].used && !w.slots[i].closing)
+			send_open(w, i);
+	}
+}
+
+static void worker_died(struct worker &w)
+{
+	int status = 0;
+	bool soon;
+
+	{
+		lock_guard<mutex> lock(w.lock);
+
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w.ctl_fd, nullptr);
+		close(w.ctl_fd);
+		w.ctl_fd = -1;
+		// It closed the socket when it exited, or was killed
+		waitpid(w.pid, &status, 0);
+		// Nobody writes into the rings of the closed slots any more
+		for (struct slot &s : w.slots) {
+			if (s.used && s.closing) {
+				s.acked = true;
+				maybe_free(s);
+			}
+		}
+		soon = monotonic_ns() - w.started_ns
+			< WORKER_RESPAWN_MS * 1000000ULL;
+		w.respawn_pending = soon;
+	}
+	w.restarts.fetch_add(1);
+	if (WIFSIGNALED(status)) {
+		cerr << "The worker of source " << w.source_ix
+			<< " was killed by signal " << WTERMSIG(status) << endl;
+	} else {
+		cerr << "The worker of source " << w.source_ix
+			<< " exited with status " << WEXITSTATUS(status)
+			<< endl;
+	}
+	// Don't spin if it can't even start, the tick retries
+	if (!soon)
+		respawn(w);
+}
+
+static void handle_msg(struct worker &w, const struct worker_msg &msg)
+{
+	size_t ix = w.source_ix;
+	bool valid = msg.slot >= 0 && (size_t) msg.slot < w.slots.size();
+
+	switch (msg.type) {
+	case WORKER_CLOSED:
+		if (!valid)
+			break;
+		{
+			lock_guard<mutex> lock(w.lock);
+			w.slots[msg.slot].acked = true;
+			maybe_free(w.slots[msg.slot]);
+		}
+		break;
+	case WORKER_STATE:
+		set_source_state(ix, msg.state.hw_freq, msg.state.auto_gain,
+				msg.state.gain, msg.state.sample_rate);
+		broadcast_changed(BROADCAST_HW_FREQ | BROADCAST_GAIN, ix);
+		break;
+	case WORKER_STATS: {
+		boost::shared_ptr<receiver_stats> stats;
+
+		// Also the heartbeat, sent with slot -1
+		if (!valid)
+			break;
+		{
+			lock_guard<mutex> lock(w.lock);
+			if (w.slots[msg.slot].used && !w.slots[msg.slot].closing)
+				stats = w.slots[msg.slot].stats;
+		}
+		if (stats == nullptr)
+			break;
+		stats->worker_dsp_ns.fetch_add(msg.stats.dsp_ns);
+		stats->encoder_ns.fetch_add(msg.stats.encoder_ns);
+		stats->samples_encoded.fetch_add(msg.stats.samples_encoded);
+		stats->pages_written.fetch_add(msg.stats.pages_written);
+		stats->pages_dropped.fetch_add(msg.stats.pages_dropped);
+		break;
+	}
+	case WORKER_OVERRUN:
+		overrun_account(ix, msg.overrun.lost_samples,
+				msg.overrun.since_reconfig_ns);
+		break;
+	default:
+		cerr << "Unknown message from the worker of source " << ix
+			<< endl;
+		break;
+	}
+}
+
+static void service_worker(struct worker &w)
+{
+	struct worker_msg msg;
+	ssize_t n;
+
+	while (1) {
+		n = recv(w.ctl_fd, &msg, sizeof(msg), MSG_DONTWAIT);
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n <= 0) {
+			worker_died(w);
+			return;
+		}
+		w.last_heard_ns.store(monotonic_ns());
+		if (n == sizeof(msg))
+			handle_msg(w, msg);
+	}
+}
+
+/* Once a second, look for stalled workers and ones to start again */
+static void tick()
+{
+	uint64_t expirations;
+	uint64_t now = monotonic_ns();
+
+	if (read(tick_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	for (auto &w : workers) {
+		if (w->respawn_pending) {
+			respawn(*w);
+		} else if (w->ctl_fd >= 0 && now - w->last_heard_ns.load()
+				> WORKER_STALL_MS * 1000000ULL) {
+			cerr << "The worker of source " << w->source_ix
+				<< " stalled, killing it." << endl;
+			kill(w->pid, SIGKILL);
+			// Its socket reports the end
+			w->last_heard_ns.store(now);
+		}
+	}
+}
+
+static void service_workers()
+{
+	struct epoll_event events[16];
+	int n;
+
+	n = epoll_wait(epoll_fd, events, 16, 0);
+	for (int i = 0; i < n; ++i) {
+		if (events[i].data.u64 == workers.size())
+			tick();
+		else
+			service_worker(*workers[events[i].data.u64]);
+	}
+}
+
+static int init_worker(size_t ix)
+{
+	unique_ptr<struct worker> w(new struct worker);
+	const struct source_params &p = sources_info[ix].params;
+	size_t size = worker_config.slots * sizeof(struct audio_ring);
+	char name[64];
+	void *mem;
+
+	w->source_ix = ix;
+	w->pid = -1;
+	w->ctl_fd = -1;
+	w->hw_freq = p.initial_hw_freq;
+	w->auto_gain = p.auto_gain;
+	w->gain = p.gain;
+	w->respawn_pending = false;
+	w->slots.resize(worker_config.slots);
+	for (struct slot &s : w->slots) {
+		s.used = false;
+		s.notify_fd = -1;
+	}
+	// The segment outlives the workers, so a new one continues the
+	// rings where the old one stopped
+	snprintf(name, sizeof(name), "/grwebsdr-%d-%zu", (int) getpid(), ix);
+	w->shm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (w->shm_fd < 0) {
+		perror("shm_open");
+		return -1;
+	}
+	shm_unlink(name);
+	if (ftruncate(w->shm_fd, size)) {
+		perror("ftruncate");
+		return -1;
+	}
+	mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			w->shm_fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	w->rings = (struct audio_ring *) mem;
+	// The clients get the configured settings until the worker reports
+	set_source_state(ix, p.initial_hw_freq, p.auto_gain, p.gain,
+			p.sample_rate);
+	workers.push_back(move(w));
+	return 0;
+}
+
+static const struct remote_ops worker_ops = {
+	worker_open,
+	worker_close,
+	worker_ring,
+	worker_release_ring,
+	worker_set_demod,
+	worker_set_freq_offset,
+	worker_set_quality,
+	worker_set_running,
+	worker_set_hw_freq,
+	worker_set_gain_mode,
+	worker_set_gain,
+};
+
+int workers_init(const char *config_path)
+{
+	struct itimerspec its = {};
+
+	if (!worker_config.enabled)
+		return 0;
+	config_file = config_path;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	for (size_t i = 0; i < sources_info.size(); ++i) {
+		if (init_worker(i))
+			return -1;
+	}
+	tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tick_fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+	its.it_interval.tv_sec = 1;
+	its.it_value.tv_sec = 1;
+	if (timerfd_settime(tick_fd, 0, &its, nullptr)) {
+		perror("timerfd_settime");
+		return -1;
+	}
+	if (watch(tick_fd, workers.size()))
+		return -1;
+	for (auto &w : workers) {
+		lock_guard<mutex> lock(w->lock);
+		if (spawn(*w))
+			return -1;
+	}
+	remote_ops = &worker_ops;
+	return event_loop_add_fd(epoll_fd, service_workers);
+}
+
+void workers_stop()
+{
+	for (auto &w : workers) {
+		lock_guard<mutex> lock(w->lock);
+
+		if (w->ctl_fd < 0)
+			continue;
+		// The worker quits when its socket closes
+		close(w->ctl_fd);
+		w->ctl_fd = -1;
+		waitpid(w->pid, nullptr, 0);
+	}
+}
+
+bool worker_up(size_t source_ix)
+{
+	if (source_ix >= workers.size())
+		return false;
+	lock_guard<mutex> lock(workers[source_ix]->lock);
+	return workers[source_ix]->ctl_fd >= 0;
+}
+
+uint64_t worker_restarts(size_t source_ix)
+{
+	if (source_ix >= workers.size())
+		return 0;
+	return workers[source_ix]->restarts.load();
+}
+
+int worker_open(size_t source_ix, int notify_fd,
+		const struct remote_slot_settings &settings,
+		boost::shared_ptr<receiver_stats> stats)
+{
+	struct worker &w = *workers[source_ix];
+	lock_guard<mutex> lock(w.lock);
+	size_t i;
+
+	for (i = 0; i < w.slots.size() && w.slots[i].used; ++i)
+		;
+	if (i == w.slots.size())
+		return -1;
+	struct slot &s = w.slots[i];
+	s.notify_fd = dup(notify_fd);
+	if (s.notify_fd < 0) {
+		perror("dup");
+		return -1;
+	}
+	s.used = true;
+	s.closing = false;
+	s.acked = false;
+	s.released = false;
+	s.settings = settings;
+	s.stats = stats;
+	// Nothing reads or writes the ring of a free slot
+	audio_ring_reset(&w.rings[i]);
+	send_open(w, i);
+	return i;
+}
+
+void worker_close(size_t source_ix, int slot)
+{
+	struct worker &w = *workers[source_ix];
+	lock_guard<mutex> lock(w.lock);
+
+	w.slots[slot].closing = true;
+	if (!send_msg(w, make_msg(WORKER_CLOSE, slot))) {
+		// A dead worker can't write any more
+		w.slots[slot].acked = w.ctl_fd < 0;
+	}
+	maybe_free(w.slots[slot]);
+}
+
+struct audio_ring *worker_ring(size_t source_ix, int slot)
+{
+	return &workers[source_ix]->rings[slot];
+}
+
+void worker_release_ring(size_t source_ix, int slot)
+{
+	struct worker &w = *workers[source_ix];
+	lock_guard<mutex> lock(w.lock);
+
+	w.slots[slot].released = true;
+	maybe_free(w.slots[slot]);
+}
+
+void worker_set_demod(size_t source_ix, int slot, const string &demod)
+{
+	struct worker &w = *workers[source_ix];
+	lock_guard<mutex> lock(w.lock);
+
+	w.slots[slot].settings.demod = demod;
+	send_demod(w, slot, demod);
+}
+
+void worker_set_freq_offset(size_t source_ix, int slot, int offset)
+{
+	struct worker &w = *workers[source_ix];
+	lock_guard<mutex> lock(w.lock);
+
+	w.slots[slot].settings.freq_offset = offset;
+	send_value(w, WORKER_FREQ_OFFSET, slot, offset);
+}
+
+void worker_set_quality(size_t source_ix, int slot, int tier)
+{
+	struct worker &w = *workers[source_ix];
+	lock_guard<mutex> lock(w.lock);
+
+	w.slots[slot].settings.quality_tier = tier;
+	send_value(w, WORKER_QUALITY, slot, tier);
+}
+
+void worker_set_running(size_t source_ix, int slot, bool running)
+{
+	struct worker &w = *workers[source_ix];
+	lock_guard<mutex> lock(w.lock);
+
+	w.slots[slot].settings.running = running;
+	send_value(w, running ? WORKER_START : WORKER_STOP, slot, 0);
+}
+
+void worker_set_hw_freq(size_t source_ix, int freq)
+{
+	struct worker &w = *workers[source_ix];
+	lock_guard<mutex> lock(w.lock);
+
+	w.hw_freq = freq;
+	send_value(w, WORKER_HW_FREQ, -1, freq);
+}
+
+void worker_set_gain_mode(size_t source_ix, bool automatic)
+{
+	struct worker &w = *workers[source_ix];
+	lock_guard<mutex> lock(w.lock);
+
+	w.auto_gain = automatic;
+	send_value(w, WORKER_AUTO_GAIN, -1, automatic);
+}
+
+void worker_set_gain(size_t source_ix, double gain)
+{
+	struct worker &w = *workers[source_ix];
+	lock_guard<mutex> lock(w.lock);
+
+	w.auto_gain = false;
+	w.gain = gain;
+	send_gain(w);
+}
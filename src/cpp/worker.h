@@ -0,0 +1,166 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <config.h>
+#include "audio_ring.h"
+#include "metrics.h"
+#include "remote.h"
+#include <boost/shared_ptr.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Worker processes. Optionally each source runs in its own process with
+ * its flowgraph and the DSP chains of its receivers, so a crash or a stall
+ * only affects the listeners of that source. The front-end process keeps
+ * the receiver_map, WebSocket control and HTTP streaming. Its receivers
+ * are stand-ins (see receiver::make_remote()) that forward their settings
+ * to a slot of the worker of their source.
+ *
+ * Each worker has a control socket to the front-end and a shared memory
+ * segment with one audio_ring per slot, which the worker's encoder fills
+ * with Ogg pages. The encoder signals the receiver's eventfd, passed over
+ * the control socket, after each page. A worker that dies is started
+ * again and its slots are set up again from the front-end's copy of their
+ * settings, the listeners hear a gap and a new chained Ogg stream.
+ *
+ * The workers are the same binary, executed with -W.
+ */
+
+// Length of the demodulation names in the messages, including the NUL
+#define WORKER_DEMOD_LEN 8
+// Interval of the CPU time reports of the workers
+#define WORKER_STATS_MS 1000
+// A worker that dies sooner after its start is started again this late
+#define WORKER_RESPAWN_MS 1000
+
+struct worker_config {
+	bool enabled;
+	// Receivers per source
+	int slots;
+};
+
+extern struct worker_config worker_config;
+
+enum worker_msg_type {
+	// Front-end -> worker, the receiver's eventfd is attached
+	WORKER_OPEN,
+	WORKER_CLOSE,
+	WORKER_START,
+	WORKER_STOP,
+	WORKER_DEMOD,
+	WORKER_FREQ_OFFSET,
+	WORKER_QUALITY,
+	WORKER_HW_FREQ,
+	WORKER_AUTO_GAIN,
+	WORKER_GAIN,
+	// Worker -> front-end
+	WORKER_CLOSED,
+	WORKER_STATE,
+	WORKER_STATS,
+	WORKER_OVERRUN,
+};
+
+struct worker_msg {
+	int32_t type;
+	// -1 for messages about the source
+	int32_t slot;
+	union {
+		// Frequency offset, quality tier, HW frequency, auto gain
+		int32_t value;
+		double gain;
+		char demod[WORKER_DEMOD_LEN];
+		struct {
+			int32_t hw_freq;
+			int32_t auto_gain;
+			double gain;
+			int32_t sample_rate;
+		} state;
+		// Increments since the last report
+		struct {
+			uint64_t dsp_ns;
+			uint64_t encoder_ns;
+			uint64_t samples_encoded;
+			uint64_t pages_written;
+			uint64_t pages_dropped;
+		} stats;
+		struct {
+			uint64_t lost_samples;
+			uint64_t since_reconfig_ns;
+		} overrun;
+	};
+};
+
+/*
+ * Front-end side
+ */
+
+/**
+ * Start the workers and watch their control sockets. Before
+ * event_loop_run(), with the stderr hook in place, so that the drivers'
+ * overrun marks are counted.
+ */
+int workers_init(const char *config_path);
+void workers_stop();
+bool worker_up(size_t source_ix);
+uint64_t worker_restarts(size_t source_ix);
+/**
+ * Set up a slot of the source's worker like the receiver. Returns the slot
+ * number, -1 if the worker has no free slot. Any thread.
+ */
+int worker_open(size_t source_ix, int notify_fd,
+		const struct remote_slot_settings &settings,
+		boost::shared_ptr<receiver_stats> stats);
+/**
+ * Tear down the slot. It's reused once the worker confirmed it and the
+ * front-end let go of the ring, see worker_release_ring().
+ */
+void worker_close(size_t source_ix, int slot);
+struct audio_ring *worker_ring(size_t source_ix, int slot);
+void worker_release_ring(size_t source_ix, int slot);
+void worker_set_demod(size_t source_ix, int slot, const std::string &demod);
+void worker_set_freq_offset(size_t source_ix, int slot, int offset);
+void worker_set_quality(size_t source_ix, int slot, int tier);
+void worker_set_running(size_t source_ix, int slot, bool running);
+void worker_set_hw_freq(size_t source_ix, int freq);
+void worker_set_gain_mode(size_t source_ix, bool automatic);
+void worker_set_gain(size_t source_ix, double gain);
+
+/*
+ * Worker side
+ */
+
+/**
+ * Run as the worker described by spec (the argument of -W). After the
+ * config file was processed, returns the exit status.
+ */
+int worker_main(const char *spec);
+/**
+ * In a worker process, pass the overrun on to the front-end and return
+ * true. Returns false in the front-end.
+ */
+bool worker_forward_overrun(size_t source_ix, uint64_t lost_samples,
+		uint64_t since_reconfig_ns);
+
+#endif
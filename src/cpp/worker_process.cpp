@@ -0,0 +1,361 @@
+/*
+ * GrWebSDR: a web SDR receiver
+ *
+ * Copyright (C) 2017 Ondřej Lysoněk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING).  If not,
+ * see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "worker.h"
+#include "globals.h"
+#include "placement.h"
+#include "source_state.h"
+#include "sources.h"
+#include "timeshift.h"
+#include "utils.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The worker process side. A single thread serves the control socket, the
+ * flowgraph runs in the GNU Radio threads as in the front-end without
+ * workers. The receivers are kept in the worker's own receiver_map, under
+ * their slot numbers, so counting the running receivers works as usual.
+ */
+
+using namespace std;
+
+struct slot_counters {
+	uint64_t dsp_ns;
+	uint64_t encoder_ns;
+	uint64_t samples_encoded;
+	uint64_t pages_written;
+	uint64_t pages_dropped;
+};
+
+static bool in_worker;
+static size_t source_ix;
+static int ctl_fd = -1;
+static struct audio_ring *rings;
+static size_t ring_count;
+static map<int, receiver::sptr> slots;
+// Counters at the last report
+static map<int, struct slot_counters> reported;
+// The overruns are sent from the tagger's thread
+static mutex send_mutex;
+
+static void send_msg(const struct worker_msg &msg)
+{
+	lock_guard<mutex> lock(send_mutex);
+
+	// The front-end is gone if this fails, the next recv() tells
+	if (send(ctl_fd, &msg, sizeof(msg), MSG_NOSIGNAL) < 0)
+		perror("send");
+}
+
+static struct worker_msg make_msg(int type, int slot)
+{
+	struct worker_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	msg.slot = slot;
+	return msg;
+}
+
+bool worker_forward_overrun(size_t source_ix, uint64_t lost_samples,
+		uint64_t since_reconfig_ns)
+{
+	struct worker_msg msg = make_msg(WORKER_OVERRUN, -1);
+
+	if (!in_worker)
+		return false;
+	(void) source_ix;
+	msg.overrun.lost_samples = lost_samples;
+	msg.overrun.since_reconfig_ns = since_reconfig_ns;
+	send_msg(msg);
+	return true;
+}
+
+static void send_state()
+{
+	struct worker_msg msg = make_msg(WORKER_STATE, -1);
+	source_state_sptr state = get_source_state(source_ix);
+
+	msg.state.hw_freq = state->hw_freq;
+	msg.state.auto_gain = state->auto_gain;
+	msg.state.gain = state->gain;
+	msg.state.sample_rate = state->sample_rate;
+	send_msg(msg);
+}
+
+/* The increments of the slots' counters, and a heartbeat */
+static void send_stats()
+{
+	for (auto &pair : slots) {
+		struct worker_msg msg = make_msg(WORKER_STATS, pair.first);
+		boost::shared_ptr<receiver_stats> stats;
+		struct slot_counters now, &last = reported[pair.first];
+
+		stats = pair.second->get_stats();
+		now.dsp_ns = pair.second->dsp_cpu_ns();
+		now.encoder_ns = stats->encoder_ns.load();
+		now.samples_encoded = stats->samples_encoded.load();
+		now.pages_written = stats->pages_written.load();
+		now.pages_dropped = stats->pages_dropped.load();
+		if (!memcmp(&now, &last, sizeof(now)))
+			continue;
+		msg.stats.dsp_ns = now.dsp_ns - last.dsp_ns;
+		msg.stats.encoder_ns = now.encoder_ns - last.encoder_ns;
+		msg.stats.samples_encoded = now.samples_encoded
+			- last.samples_encoded;
+		msg.stats.pages_written = now.pages_written
+			- last.pages_written;
+		msg.stats.pages_dropped = now.pages_dropped
+			- last.pages_dropped;
+		last = now;
+		send_msg(msg);
+	}
+	send_msg(make_msg(WORKER_STATS, -1));
+}
+
+static void close_slot(int slot)
+{
+	auto it = slots.find(slot);
+
+	if (it == slots.end())
+		return;
+	stop_receiver(it->second);
+	receiver_map.erase(to_string(slot));
+	slots.erase(it);
+	reported.erase(slot);
+}
+
+static void open_slot(int slot, int notify_fd)
+{
+	receiver::sptr rec;
+
+	close_slot(slot);
+	if (set_nonblock(notify_fd)) {
+		close(notify_fd);
+		return;
+	}
+	rec = receiver::make(topbl, &rings[slot], notify_fd);
+	topbl->lock();
+	rec->set_source(source_ix);
+	topbl->unlock();
+	receiver_map.insert(to_string(slot), rec);
+	slots[slot] = rec;
+	reported[slot] = {};
+}
+
+static void handle_source_msg(const struct worker_msg &msg)
+{
+	osmosdr::source::sptr src = osmosdr_sources[source_ix];
+
+	switch (msg.type) {
+	case WORKER_HW_FREQ:
+		src->set_center_freq(msg.value);
+		break;
+	case WORKER_AUTO_GAIN:
+		src->set_gain_mode(msg.value);
+		break;
+	case WORKER_GAIN:
+		src->set_gain_mode(false);
+		src->set_gain(msg.gain);
+		break;
+	default:
+		return;
+	}
+	update_source_state(source_ix);
+	send_state();
+}
+
+static void handle_msg(const struct worker_msg &msg, int fd)
+{
+	receiver::sptr rec;
+
+	if (msg.slot < 0) {
+		handle_source_msg(msg);
+		return;
+	}
+	if ((size_t) msg.slot >= ring_count) {
+		cerr << "Bad slot " << msg.slot << endl;
+		return;
+	}
+	if (msg.type == WORKER_OPEN) {
+		if (fd < 0)
+			cerr << "Slot " << msg.slot << " opened without an fd."
+				<< endl;
+		else
+			open_slot(msg.slot, fd);
+		return;
+	}
+	if (msg.type == WORKER_CLOSE) {
+		close_slot(msg.slot);
+		send_msg(make_msg(WORKER_CLOSED, msg.slot));
+		return;
+	}
+	auto it = slots.find(msg.slot);
+	if (it == slots.end())
+		return;
+	rec = it->second;
+	switch (msg.type) {
+	case WORKER_START:
+		if (!rec->is_ready() || rec->is_running())
+			break;
+		start_receiver(rec);
+		break;
+	case WORKER_STOP:
+		stop_receiver(rec);
+		break;
+	case WORKER_DEMOD:
+		topbl->lock();
+		rec->change_demod(string(msg.demod,
+					strnlen(msg.demod, WORKER_DEMOD_LEN)));
+		topbl->unlock();
+		break;
+	case WORKER_FREQ_OFFSET:
+		rec->set_freq_offset(msg.value);
+		break;
+	case WORKER_QUALITY:
+		topbl->lock();
+		rec->set_quality_tier(msg.value);
+		topbl->unlock();
+		break;
+	default:
+		cerr << "Unknown message from the front-end." << endl;
+		break;
+	}
+}
+
+/* Returns false once the front-end is gone */
+static bool receive()
+{
+	struct worker_msg msg;
+	struct msghdr mh = {};
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	int fd = -1;
+	ssize_t n;
+
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+	n = recvmsg(ctl_fd, &mh, MSG_CMSG_CLOEXEC);
+	if (n < 0 && errno == EINTR)
+		return true;
+	if (n <= 0)
+		return false;
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+			&& cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	if (n != sizeof(msg)) {
+		if (fd >= 0)
+			close(fd);
+		return true;
+	}
+	handle_msg(msg, fd);
+	return true;
+}
+
+static void serve()
+{
+	struct pollfd pfd;
+	uint64_t next_stats = monotonic_ns();
+	uint64_t now;
+	int n;
+
+	pfd.fd = ctl_fd;
+	pfd.events = POLLIN;
+	while (1) {
+		now = monotonic_ns();
+		if (now >= next_stats) {
+			send_stats();
+			next_stats = now + WORKER_STATS_MS * 1000000ULL;
+		}
+		n = poll(&pfd, 1, (next_stats - now) / 1000000 + 1);
+		if (n < 0 && errno != EINTR) {
+			perror("poll");
+			return;
+		}
+		if (n > 0 && !receive())
+			return;
+	}
+}
+
+int worker_main(const char *spec)
+{
+	struct stat st;
+	int shm_fd;
+	void *mem;
+
+	if (sscanf(spec, "%zu:%d:%d", &source_ix, &ctl_fd, &shm_fd) != 3
+			|| source_ix >= sources_info.size()) {
+		cerr << "Bad worker specification." << endl;
+		return 1;
+	}
+	// Don't outlive the front-end
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() == 1)
+		return 1;
+	if (fstat(shm_fd, &st)) {
+		perror("fstat");
+		return 1;
+	}
+	mem = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			shm_fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	close(shm_fd);
+	rings = (struct audio_ring *) mem;
+	ring_count = st.st_size / sizeof(struct audio_ring);
+	in_worker = true;
+
+	osmosdr_sources.resize(sources_info.size());
+	osmosdr_sources[source_ix] = open_source(source_ix);
+	topbl = gr::make_top_block("worker");
+	setup_source(source_ix);
+	placement_init();
+	if (timeshift_active())
+		topbl->start();
+	send_state();
+	serve();
+
+	for (auto &pair : slots)
+		stop_receiver(pair.second);
+	topbl->stop();
+	topbl->wait();
+	return 0;
+}
@@ -27,8 +27,13 @@ var gain_change_requested = false;
 var sample_rate = null;
 var stream_name = null;
 var audio = null;
+var replay_timer = null;
 var converter_offset = 0;
 var freq_offset = 0;
+// The channels listened to at once, see send_monitor()
+var monitor_channels = [];
+// Version of the binary control messages supported by the server, 0 if none
+var binary_protocol = 0;
 
 var ws_url;
 if (window.location.protocol == 'https:')
@@ -55,6 +60,9 @@ function setup_websocket() {
 		if (msg.hasOwnProperty('supported_demods')) {
 			update_demods(msg.supported_demods);
 		}
+		if (msg.hasOwnProperty('binary_protocol')) {
+			binary_protocol = msg.binary_protocol;
+		}
 		if (msg.hasOwnProperty('current_source')) {
 			if (audio == null)
 				init_audio(stream_name);
@@ -89,6 +97,34 @@ function setup_websocket() {
 		if (msg.hasOwnProperty('freq_offset')) {
 			update_freq_offset(msg.freq_offset);
 		}
+		if (msg.hasOwnProperty('server_full')) {
+			var elem = document.getElementById('server_full');
+			elem.style.display = msg.server_full ? 'block' : 'none';
+		}
+		if (msg.hasOwnProperty('overruns')) {
+			var elem = document.getElementById('lbl_overruns');
+			elem.innerHTML = 'Source overruns: ' + msg.overruns;
+			elem.style.display = msg.overruns > 0 ? 'block' : 'none';
+		}
+		if (msg.hasOwnProperty('quality_tier')) {
+			update_quality_tier(msg.quality_tier);
+		}
+		if (msg.hasOwnProperty('replay')) {
+			start_replay(msg.replay);
+		}
+		if (msg.hasOwnProperty('scan')) {
+			document.getElementById('scan').checked = msg.scan.active;
+			document.getElementById('scan_auto_tune').checked =
+				msg.scan.auto_tune;
+			if (!msg.scan.active)
+				update_activity([]);
+		}
+		if (msg.hasOwnProperty('activity')) {
+			update_activity(msg.activity);
+		}
+		if (msg.hasOwnProperty('monitor')) {
+			update_monitor(msg.monitor);
+		}
 		update_privileged(msg);
 		update_num_clients(msg);
 	};
@@ -119,6 +155,24 @@ function update_gain(auto, val) {
 	}
 }
 
+function update_quality_tier(tier) {
+	var names = [
+		'',
+		'lower bitrate',
+		'lower audio bandwidth',
+		'wider channel filter',
+		'audio paused during silence'
+	];
+	var elem = document.getElementById('quality_tier');
+	if (tier == 0) {
+		elem.style.display = 'none';
+		return;
+	}
+	elem.innerHTML = 'The server is busy, reduced audio quality: '
+		+ names[Math.min(tier, names.length - 1)];
+	elem.style.display = 'block';
+}
+
 function update_num_clients(msg) {
 	if (msg.hasOwnProperty('num_clients')) {
 		var elem = document.getElementById('num_clients');
@@ -234,6 +288,105 @@ function source_changed(source) {
 	if (source.hasOwnProperty('description')) {
 		update_source_description(source.description);
 	}
+	var elem = document.getElementById('div_replay');
+	elem.style.display = source.timeshift_s > 0 ? 'block' : 'none';
+}
+
+function send_replay(seconds) {
+	ws.send('{"replay": ' + seconds + '}');
+}
+
+/*
+ * The server sends the past audio faster than real time until it's live
+ * again, play it at the same speed meanwhile.
+ */
+function start_replay(replay) {
+	var label = document.getElementById('lbl_replay');
+	if (audio == null || replay.lag_s <= 0)
+		return;
+	clearTimeout(replay_timer);
+	audio.playbackRate = replay.speed;
+	label.innerHTML = 'Catching up...';
+	replay_timer = setTimeout(function () {
+		audio.playbackRate = 1.0;
+		label.innerHTML = '';
+	}, replay.lag_s / (replay.speed - 1) * 1000);
+}
+
+function send_scan() {
+	var val = document.getElementById('scan').checked;
+	ws.send('{"scan": ' + val + '}');
+}
+
+function send_scan_auto_tune() {
+	var val = document.getElementById('scan_auto_tune').checked;
+	ws.send('{"scan_auto_tune": ' + val + '}');
+}
+
+/* The active channels found by the server, strongest first */
+function update_activity(channels) {
+	var list = document.getElementById('list_activity');
+	list.innerHTML = '';
+	if (!document.getElementById('scan').checked)
+		return;
+	for (var i = 0; i < channels.length; i++) {
+		var item = document.createElement('li');
+		var offset = channels[i].offset;
+		item.innerHTML = format_freq(channels[i].freq, true) + ' ('
+			+ channels[i].snr_db.toFixed(1) + ' dB)';
+		item.style.cursor = 'pointer';
+		item.onclick = function (offset) {
+			return function () {
+				update_freq_offset(offset);
+				send_freq_offset(offset);
+			};
+		}(offset);
+		list.appendChild(item);
+	}
+}
+
+/* Add the frequency and demodulation of the receiver to the monitor */
+function add_monitor_channel() {
+	var demod = document.getElementById('select_demod').value;
+	var channels = monitor_channels.slice();
+	channels.push({ offset: freq_offset, demod: demod });
+	send_monitor(channels);
+}
+
+/* With stereo, the channels are spread from left to right */
+function send_monitor(channels) {
+	var stereo = document.getElementById('monitor_stereo').checked;
+	var msg = [];
+	for (var i = 0; i < channels.length; i++) {
+		var pan = 0;
+		if (stereo && channels.length > 1)
+			pan = -1 + 2 * i / (channels.length - 1);
+		msg.push({ offset: channels[i].offset,
+			demod: channels[i].demod, pan: pan,
+			squelch: channels[i].squelch !== false });
+	}
+	ws.send(JSON.stringify({ monitor: msg }));
+}
+
+/* Clicking a channel removes it */
+function update_monitor(channels) {
+	var list = document.getElementById('list_monitor');
+	monitor_channels = channels;
+	list.innerHTML = '';
+	for (var i = 0; i < channels.length; i++) {
+		var item = document.createElement('li');
+		item.innerHTML = format_freq(get_center_freq()
+			+ channels[i].offset, true) + ' ' + channels[i].demod;
+		item.style.cursor = 'pointer';
+		item.onclick = function (ix) {
+			return function () {
+				var rest = monitor_channels.slice();
+				rest.splice(ix, 1);
+				send_monitor(rest);
+			};
+		}(i);
+		list.appendChild(item);
+	}
 }
 
 function send_source(ix) {
@@ -351,7 +504,16 @@ function update_hw_freq(value) {
 }
 
 function send_freq_offset(offset) {
-	ws.send('{"freq_offset":' + offset + '}');
+	if (binary_protocol < 1) {
+		ws.send('{"freq_offset":' + offset + '}');
+		return;
+	}
+	// Opcode 1 followed by the offset as a little endian int32
+	var buf = new ArrayBuffer(5);
+	var view = new DataView(buf);
+	view.setUint8(0, 1);
+	view.setInt32(1, offset, true);
+	ws.send(buf);
 }
 
 function parse_freq(str) {